@@ -0,0 +1,262 @@
+/* baseline.c - the performance baseline masp_bench checks against.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include "compat.h"
+#include "baseline.h"
+
+const char *const metric_names[METRICS] = {
+  "allocs_per_line",
+  "bytes_per_line",
+  "sb_grows_per_line",
+  "peak_kb",
+  "time_ratio"
+};
+
+/* How far above the baseline each figure may go.  The counts only
+   move when the code does, and a little slack lets a change which
+   costs next to nothing through; the time moves with the machine and
+   whatever else it is doing.  */
+static const double default_tolerance[METRICS] = {
+  0.02, 0.05, 0.05, 0.10, 1.0
+};
+
+typedef struct baseline_entry {
+  char corpus[64];
+  double values[METRICS];
+  int have[METRICS];
+} baseline_entry;
+
+struct baseline {
+  char build[32];
+  double tolerance[METRICS];
+  baseline_entry *entries;
+  int nentries;
+  int entries_alloc;
+};
+
+baseline *
+baseline_new (const char *build)
+{
+  baseline *b = (baseline *) xmalloc (sizeof (baseline));
+
+  memset (b, 0, sizeof *b);
+  snprintf (b->build, sizeof b->build, "%s", *build ? build : "none");
+  memcpy (b->tolerance, default_tolerance, sizeof b->tolerance);
+  return b;
+}
+
+void
+baseline_free (baseline *b)
+{
+  if (!b)
+    return;
+  free (b->entries);
+  free (b);
+}
+
+static int
+find_metric (const char *name)
+{
+  int i;
+
+  for (i = 0; i < METRICS; i++)
+    if (strcmp (metric_names[i], name) == 0)
+      return i;
+  return -1;
+}
+
+static baseline_entry *
+find_entry (const baseline *b, const char *corpus)
+{
+  int i;
+
+  for (i = 0; i < b->nentries; i++)
+    if (strcmp (b->entries[i].corpus, corpus) == 0)
+      return &b->entries[i];
+  return NULL;
+}
+
+static baseline_entry *
+add_entry (baseline *b, const char *corpus)
+{
+  baseline_entry *e = find_entry (b, corpus);
+
+  if (e)
+    return e;
+  if (b->nentries == b->entries_alloc)
+    {
+      b->entries_alloc = b->entries_alloc ? b->entries_alloc * 2 : 16;
+      b->entries = (baseline_entry *)
+	xrealloc (b->entries, b->entries_alloc * sizeof (baseline_entry));
+    }
+  e = &b->entries[b->nentries++];
+  memset (e, 0, sizeof *e);
+  snprintf (e->corpus, sizeof e->corpus, "%s", corpus);
+  return e;
+}
+
+baseline *
+baseline_read (const char *path)
+{
+  FILE *f = fopen (path, "r");
+  baseline *b;
+  char line[256];
+  int lineno = 0;
+
+  if (!f)
+    {
+      fprintf (stderr, "masp_bench: can't read `%s'\n", path);
+      return NULL;
+    }
+  b = baseline_new ("");
+  while (fgets (line, sizeof line, f))
+    {
+      char first[64], second[64];
+      double value;
+      int n, m;
+
+      lineno++;
+      n = sscanf (line, " %63s %63s %lf", first, second, &value);
+      if (n <= 0 || first[0] == '#')
+	continue;
+      if (n == 2 && strcmp (first, "build") == 0)
+	{
+	  snprintf (b->build, sizeof b->build, "%s", second);
+	  continue;
+	}
+      m = n == 3 ? find_metric (second) : -1;
+      if (m < 0)
+	{
+	  fprintf (stderr, "masp_bench: %s:%d: can't make sense of this\n",
+		   path, lineno);
+	  fclose (f);
+	  baseline_free (b);
+	  return NULL;
+	}
+      if (strcmp (first, "tolerance") == 0)
+	b->tolerance[m] = value;
+      else
+	{
+	  baseline_entry *e = add_entry (b, first);
+
+	  e->values[m] = value;
+	  e->have[m] = 1;
+	}
+    }
+  fclose (f);
+  return b;
+}
+
+int
+baseline_write (const baseline *b, const char *path)
+{
+  FILE *f = fopen (path, "w");
+  int i, m;
+
+  if (!f)
+    {
+      fprintf (stderr, "masp_bench: can't write `%s'\n", path);
+      return 0;
+    }
+  fprintf (f, "# The figures `ctest -L perf' checks masp_bench against.\n"
+	   "# Made by `make perf-baseline'; see masp_bench --check.\n"
+	   "build %s\n", b->build);
+  for (m = 0; m < METRICS; m++)
+    fprintf (f, "tolerance %s %g\n", metric_names[m], b->tolerance[m]);
+  for (i = 0; i < b->nentries; i++)
+    for (m = 0; m < METRICS; m++)
+      if (b->entries[i].have[m])
+	fprintf (f, "%s %s %.6g\n", b->entries[i].corpus, metric_names[m],
+		 b->entries[i].values[m]);
+  return fclose (f) == 0;
+}
+
+const char *
+baseline_build (const baseline *b)
+{
+  return b->build;
+}
+
+const char *
+baseline_corpus (const baseline *b, int i)
+{
+  return i < b->nentries ? b->entries[i].corpus : NULL;
+}
+
+void
+baseline_set (baseline *b, const char *corpus, const double *values)
+{
+  baseline_entry *e = add_entry (b, corpus);
+  int m;
+
+  for (m = 0; m < METRICS; m++)
+    {
+      e->values[m] = values[m];
+      e->have[m] = 1;
+    }
+}
+
+int
+baseline_check (const baseline *b, const char *corpus,
+		const double *values, int times, FILE *file)
+{
+  const baseline_entry *e = find_entry (b, corpus);
+  int failed = 0;
+  int m;
+
+  if (!e)
+    {
+      fprintf (file, "%-28s not in the baseline\n", corpus);
+      return 0;
+    }
+  for (m = 0; m < METRICS; m++)
+    {
+      double base = e->values[m];
+      double tolerance = b->tolerance[m];
+      double change = base > 0 ? 100.0 * (values[m] - base) / base : 0.0;
+      const char *verdict;
+
+      if (!e->have[m] || (m == METRIC_TIME_RATIO && !times))
+	continue;
+      /* The baseline is written to three places; so much is noise.  */
+      if (values[m] > base * (1 + tolerance) + 0.0005)
+	{
+	  verdict = "FAIL";
+	  failed++;
+	}
+      else if (values[m] < base * (1 - tolerance) - 0.0005)
+	verdict = "improved";
+      else
+	verdict = "ok";
+      fprintf (file, "%-28s %-18s %12.3f %12.3f %+7.1f%%  %s\n", corpus,
+	       metric_names[m], base, values[m],
+	       change > -0.05 && change < 0.05 ? 0.0 : change, verdict);
+    }
+  return failed;
+}
@@ -0,0 +1,80 @@
+/* baseline.h - the performance baseline masp_bench checks against.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#ifndef BASELINE_H
+
+#define BASELINE_H
+
+#include <stdio.h>
+
+/* A baseline holds, for each corpus, figures which depend on the code
+   rather than the machine, so that it can be checked in and compared
+   against anywhere: allocations, bytes allocated and sb growth copies
+   per output line, and the most memory a run had live.  It also holds
+   the time a run took as a multiple of a fixed piece of plain work,
+   which tracks the machine's speed; that is only compared between
+   builds of the same type, and loosely.
+
+   It is kept as text, one figure to a line:
+
+     build Release
+     tolerance allocs_per_line 0.02
+     flat allocs_per_line 2.183
+
+   A figure fails the check when it is more than its tolerance, as a
+   fraction, above the baseline.  */
+
+typedef enum {
+  METRIC_ALLOCS,		/* Allocations per output line.  */
+  METRIC_BYTES,			/* Bytes allocated per output line.  */
+  METRIC_SB_GROWS,		/* sbs grown by copying, per output line.  */
+  METRIC_PEAK_KB,		/* The most memory live during a run.  */
+  METRIC_TIME_RATIO,		/* Seconds a run, over the calibration.  */
+  METRICS
+} metric;
+
+extern const char *const metric_names[METRICS];
+
+typedef struct baseline baseline;
+
+extern baseline *baseline_new (const char *build);
+/* Read the baseline in PATH, or return NULL after saying why.  */
+extern baseline *baseline_read (const char *path);
+extern void baseline_free (baseline *);
+extern int baseline_write (const baseline *, const char *path);
+
+/* The build type the times were taken in.  */
+extern const char *baseline_build (const baseline *);
+
+/* The corpora the baseline has figures for, in order; NULL past the
+   last.  */
+extern const char *baseline_corpus (const baseline *, int i);
+
+/* Set the figures of CORPUS to VALUES.  */
+extern void baseline_set (baseline *, const char *corpus,
+			  const double *values);
+
+/* Compare the VALUES of CORPUS with the baseline, saying how each
+   compares on FILE.  Times are compared only if TIMES.  Returns the
+   number which failed.  */
+extern int baseline_check (const baseline *, const char *corpus,
+			   const double *values, int times, FILE *file);
+
+#endif
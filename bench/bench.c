@@ -0,0 +1,658 @@
+/* bench.c - MASP throughput benchmarks.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+/* masp_bench preprocesses each corpus in memory through libmasp, a
+   fresh context per run, until it has spent --min-time seconds on it,
+   and prints the results as JSON:
+
+     {"bench": "masp", "version": 2, "scale": 1, "results": [
+      {"corpus": "flat", "in_lines": 50783, "in_bytes": ...,
+       "out_lines": ..., "out_bytes": ..., "iterations": 5,
+       "seconds": ..., "lines_per_sec": ..., "mb_per_sec": ...,
+       "peak_rss_kb": ..., "allocs_per_line": ..., "bytes_per_line": ...,
+       "sb_grows_per_line": ..., "peak_kb": ..., "time_ratio": ...},
+      ...
+     ]}
+
+   The rates are of output lines and bytes, since a few input lines
+   of AREPEAT can stand for any amount of work; in_lines and in_bytes
+   are the input file's own, not counting what it includes.
+   peak_rss_kb is the process's peak so far, so it never falls down
+   the list.  The names and order of the fields only change with the
+   version.
+
+   The rest do not depend on the machine.  allocs_per_line and
+   bytes_per_line count everything the second run allocated, per
+   output line, and sb_grows_per_line the sbs it grew by copying;
+   peak_kb is the most memory of the kinds compat.h follows it had
+   live at once.  time_ratio is the quickest run's time over that of a
+   fixed loop of plain C, which moves with the machine's speed, so
+   that it can be compared between machines, roughly.
+
+   With --check FILE these are compared with the baseline in FILE, see
+   baseline.h, instead of printed, and masp_bench fails if any has
+   grown past its tolerance; this is the `perf' test.  --save-baseline
+   FILE writes them to FILE as the new baseline.
+
+   With --startup it instead measures what a run costs before it
+   does any work, which is most of what a build running masp once
+   per small file pays: the time from fork to exit of masp --version,
+   which stops after reading its options, and of masp on an empty
+   file, and the time libmasp takes to make a context, preprocess
+   nothing and free it, the first time in a process and after that.
+   Each is the median of --runs goes.
+
+   The synthetic corpora come from corpus.c; the ps2gl ones are the
+   shaders in test/, preprocessed with -p -s -c ';' as the stress test
+   does.  With --write DIR the synthetic corpora are written to DIR
+   instead, for profiling the masp program on them.  */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "compat.h"
+#include "masp.h"
+#include "sb.h"
+#include "corpus.h"
+#include "baseline.h"
+
+#ifndef SRC_DIR
+#define SRC_DIR "."
+#endif
+#ifndef MASP_PATH
+#define MASP_PATH "masp"
+#endif
+
+#ifndef BUILD_TYPE
+#define BUILD_TYPE ""
+#endif
+
+#define BENCH_VERSION 2
+
+static const char *const ps2gl_files[] = {
+  "vu1Triangle.vcl",
+  "fast_pp1.vcl",
+  "general_nospec_tri_pp1.vcl",
+  NULL
+};
+
+static double
+now (void)
+{
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+  return (double) clock () / CLOCKS_PER_SEC;
+#endif
+}
+
+static long
+peak_rss_kb (void)
+{
+#if defined(__unix__) || defined(__APPLE__)
+  struct rusage ru;
+
+  if (getrusage (RUSAGE_SELF, &ru) != 0)
+    return 0;
+#ifdef __APPLE__
+  return ru.ru_maxrss / 1024;
+#else
+  return ru.ru_maxrss;
+#endif
+#else
+  return 0;
+#endif
+}
+
+/* Whether NAME was asked for by the NWANTED names in WANTED; none
+   means all.  */
+
+static int
+wanted_p (const char *name, char **wanted, int nwanted)
+{
+  int i;
+
+  for (i = 0; i < nwanted; i++)
+    if (strcmp (wanted[i], name) == 0)
+      return 1;
+  return nwanted == 0;
+}
+
+static long
+count_lines (const char *text, size_t len)
+{
+  long lines = 0;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    if (text[i] == '\n')
+      lines++;
+  return lines;
+}
+
+/* What run_corpus found.  */
+
+typedef struct result {
+  long out_lines;
+  size_t out_len;
+  int iterations;
+  double seconds;
+  double values[METRICS];
+} result;
+
+/* The best of a few goes at a fixed loop of plain C, hashing and
+   classing 4 MB, which time_ratio is measured in.  */
+
+static double
+calibrate (void)
+{
+  static unsigned char buf[65536];
+  static volatile unsigned long sink;
+  double best = 0;
+  int go, pass;
+  size_t i;
+
+  for (i = 0; i < sizeof buf; i++)
+    buf[i] = (unsigned char) (i * 7 + (i >> 8));
+  for (go = 0; go < 5; go++)
+    {
+      unsigned long h = 2166136261UL;
+      long words = 0;
+      double start = now (), seconds;
+
+      for (pass = 0; pass < 64; pass++)
+	for (i = 0; i < sizeof buf; i++)
+	  {
+	    h = (h ^ buf[i]) * 16777619UL;
+	    words += ISALNUM (buf[i]) != 0;
+	  }
+      sink = h + words;
+      seconds = now () - start;
+      if (go == 0 || seconds < best)
+	best = seconds;
+    }
+  return best;
+}
+
+/* Preprocess the LEN bytes of TEXT, called NAME, with OPTS until
+   MIN_TIME seconds have gone by, and put what was found in R.  The
+   allocations are those of the second run: the first in a process
+   also pays for what libmasp sets up once, so what it counts depends
+   on which corpora went before it, while after it each run is the
+   same.  Includes are looked for in DIR if it isn't NULL.  Returns 0
+   if a run fails.  */
+
+static int
+run_corpus (const char *name, const char *text, size_t len,
+	    const masp_options *opts, const char *dir, double min_time,
+	    double calibration, result *r)
+{
+  double start, best = 0;
+
+  memset (r, 0, sizeof *r);
+  start = now ();
+  do
+    {
+      const mem_stats *mem = mem_stats_get ();
+      mem_stats before = *mem;
+      masp_context *ctx;
+      char *out = NULL, *diag = NULL;
+      double run = now ();
+      int status;
+
+      ctx = masp_new (opts);
+      if (dir)
+	{
+	  masp_set_directory (ctx, dir);
+	  masp_add_include_path (ctx, dir);
+	}
+      status = masp_preprocess_buffer (ctx, name, text, len,
+				       &out, &r->out_len, &diag, NULL);
+      if (r->iterations == 1)
+	r->values[METRIC_PEAK_KB] =
+	  (mem->total.peak - before.total.live) / 1024.0;
+      masp_free (ctx);
+      run = now () - run;
+      if (status != 0)
+	{
+	  fprintf (stderr, "masp_bench: %s failed\n%s", name, diag);
+	  free (out);
+	  free (diag);
+	  return 0;
+	}
+      if (r->iterations == 0)
+	r->out_lines = count_lines (out, r->out_len);
+      else if (r->iterations == 1)
+	{
+	  double lines;
+
+	  lines = r->out_lines ? r->out_lines : 1;
+	  r->values[METRIC_ALLOCS] =
+	    (mem->total.allocs - before.total.allocs
+	     + mem->kind[MEM_OTHER].allocs
+	     - before.kind[MEM_OTHER].allocs) / lines;
+	  r->values[METRIC_BYTES] =
+	    (mem->total.bytes - before.total.bytes
+	     + mem->kind[MEM_OTHER].bytes
+	     - before.kind[MEM_OTHER].bytes) / lines;
+	  r->values[METRIC_SB_GROWS] =
+	    (mem->sb_grows - before.sb_grows) / lines;
+	}
+      free (out);
+      free (diag);
+      if (r->iterations == 0 || run < best)
+	best = run;
+      r->iterations++;
+      r->seconds = now () - start;
+    }
+  while (r->seconds < min_time || r->iterations < 3);
+  r->values[METRIC_TIME_RATIO] = best / calibration;
+  return 1;
+}
+
+static void
+print_result (const char *name, const char *text, size_t len,
+	      const result *r, int first)
+{
+  printf ("%s  {\"corpus\": \"%s\", \"in_lines\": %ld, \"in_bytes\": %lu, "
+	  "\"out_lines\": %ld, \"out_bytes\": %lu, "
+	  "\"iterations\": %d, \"seconds\": %.6f, "
+	  "\"lines_per_sec\": %.0f, \"mb_per_sec\": %.3f, "
+	  "\"peak_rss_kb\": %ld, \"allocs_per_line\": %.3f, "
+	  "\"bytes_per_line\": %.3f, \"sb_grows_per_line\": %.3f, "
+	  "\"peak_kb\": %.3f, \"time_ratio\": %.3f}",
+	  first ? "" : ",\n", name, count_lines (text, len),
+	  (unsigned long) len, r->out_lines, (unsigned long) r->out_len,
+	  r->iterations, r->seconds,
+	  r->out_lines * r->iterations / r->seconds,
+	  r->out_len * r->iterations / r->seconds / (1024.0 * 1024.0),
+	  peak_rss_kb (), r->values[METRIC_ALLOCS], r->values[METRIC_BYTES],
+	  r->values[METRIC_SB_GROWS], r->values[METRIC_PEAK_KB],
+	  r->values[METRIC_TIME_RATIO]);
+  fflush (stdout);
+}
+
+/* The startup benchmark.  */
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* How long masp took, from fork to exit, with the arguments in ARGV
+   and its output thrown away; -1 if it failed.  */
+
+static double
+exec_masp (char *const *argv)
+{
+#if defined(__unix__) || defined(__APPLE__)
+  double start = now ();
+  int status;
+  pid_t pid = fork ();
+
+  if (pid == 0)
+    {
+      int fd = open ("/dev/null", O_WRONLY);
+
+      if (fd >= 0)
+	{
+	  dup2 (fd, 1);
+	  dup2 (fd, 2);
+	}
+      execv (MASP_PATH, argv);
+      _exit (127);
+    }
+  if (pid < 0 || waitpid (pid, &status, 0) < 0
+      || !WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    return -1;
+  return now () - start;
+#else
+  return -1;
+#endif
+}
+
+/* A context made, given nothing and freed, in seconds.  */
+
+static double
+empty_context (void)
+{
+  double start = now ();
+  masp_context *ctx = masp_new (NULL);
+  char *out = NULL, *diag = NULL;
+  size_t len;
+
+  masp_preprocess_buffer (ctx, "empty", "", 0, &out, &len, &diag, NULL);
+  masp_free (ctx);
+  free (out);
+  free (diag);
+  return now () - start;
+}
+
+static void
+print_case (const char *name, double *times, int runs, int last)
+{
+  qsort (times, runs, sizeof (double), compare_doubles);
+  printf ("  {\"case\": \"%s\", \"median_us\": %.1f, \"min_us\": %.1f}%s\n",
+	  name, times[runs / 2] * 1e6, times[0] * 1e6, last ? "" : ",");
+}
+
+static int
+run_startup (int runs)
+{
+  char *version_argv[] = { (char *) MASP_PATH, (char *) "--version", NULL };
+  char *empty_argv[] = { (char *) MASP_PATH, (char *) "-o",
+			 (char *) "/dev/null", (char *) "/dev/null", NULL };
+  double *times = (double *) xmalloc (runs * sizeof (double));
+  double first;
+  int i;
+
+  /* Before anything else in this process has used libmasp.  */
+  first = empty_context ();
+
+  printf ("{\"bench\": \"masp_startup\", \"version\": %d, \"runs\": %d, "
+	  "\"results\": [\n", BENCH_VERSION, runs);
+  for (i = 0; i < runs; i++)
+    if ((times[i] = exec_masp (version_argv)) < 0)
+      {
+	fprintf (stderr, "masp_bench: can't run `%s'\n", MASP_PATH);
+	free (times);
+	return 0;
+      }
+  print_case ("exec_version", times, runs, 0);
+  for (i = 0; i < runs; i++)
+    if ((times[i] = exec_masp (empty_argv)) < 0)
+      {
+	fprintf (stderr, "masp_bench: `%s' failed on an empty file\n",
+		 MASP_PATH);
+	free (times);
+	return 0;
+      }
+  print_case ("exec_empty", times, runs, 0);
+  print_case ("first_context", &first, 1, 0);
+  for (i = 0; i < runs; i++)
+    times[i] = empty_context ();
+  print_case ("context", times, runs, 1);
+  printf ("]}\n");
+  free (times);
+  return 1;
+}
+
+static int
+read_file (const char *path, sb *text)
+{
+  FILE *f = fopen (path, "rb");
+  char buf[8192];
+  size_t n;
+
+  if (!f)
+    return 0;
+  while ((n = fread (buf, 1, sizeof buf, f)) > 0)
+    sb_add_buffer (text, buf, (int) n);
+  fclose (f);
+  return 1;
+}
+
+/* What main asks run_corpus for, and what it does with the answer.  */
+
+typedef struct bench {
+  double min_time;
+  double calibration;
+  baseline *check;		/* Compare with this ...  */
+  int times;			/* ... times too, if the build matches.  */
+  int failed;			/* The figures which didn't.  */
+  baseline *save;		/* Or keep the figures in this.  */
+  int first;
+} bench;
+
+static int
+bench_corpus (bench *b, const char *name, const char *text, size_t len,
+	      const masp_options *opts, const char *dir)
+{
+  result r;
+
+  if (!run_corpus (name, text, len, opts, dir, b->min_time,
+		   b->calibration, &r))
+    return 0;
+  if (b->check)
+    b->failed += baseline_check (b->check, name, r.values, b->times,
+				 stdout);
+  else
+    print_result (name, text, len, &r, b->first);
+  if (b->save)
+    baseline_set (b->save, name, r.values);
+  b->first = 0;
+  return 1;
+}
+
+static int
+write_corpora (const char *dir, int scale, char **wanted, int nwanted)
+{
+  const corpus *c;
+
+  for (c = corpus_table; c->name; c++)
+    {
+      char path[1024];
+      FILE *f;
+      sb text;
+
+      if (!wanted_p (c->name, wanted, nwanted))
+	continue;
+      snprintf (path, sizeof path, "%s/%s.s", dir, c->name);
+      f = fopen (path, "wb");
+      if (!f)
+	{
+	  fprintf (stderr, "masp_bench: can't write `%s'\n", path);
+	  return 1;
+	}
+      sb_new (&text);
+      c->generate (&text, scale);
+      fwrite (text.ptr, 1, text.len, f);
+      fclose (f);
+      sb_kill (&text);
+    }
+  return 0;
+}
+
+static int
+usage (void)
+{
+  fprintf (stderr, "\
+Usage: masp_bench [--scale n] [--min-time seconds] [--src dir]\n\
+                  [--write dir] [--check file] [--save-baseline file]\n\
+                  [corpus...]\n\
+       masp_bench --startup [--runs n]\n\
+Corpora:");
+  {
+    const corpus *c;
+    const char *const *f;
+
+    for (c = corpus_table; c->name; c++)
+      fprintf (stderr, " %s", c->name);
+    for (f = ps2gl_files; *f; f++)
+      fprintf (stderr, " %s", *f);
+  }
+  fprintf (stderr, "\n");
+  return 2;
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *src = SRC_DIR;
+  const char *write_dir = NULL;
+  const char *check_file = NULL;
+  const char *save_file = NULL;
+  double min_time = -1;
+  int scale = 1;
+  int startup = 0;
+  int runs = 200;
+  char **wanted = argv + argc;
+  int nwanted = 0;
+  masp_options synthetic, ps2gl;
+  const corpus *c;
+  const char *const *f;
+  char dir[1024];
+  bench b;
+  int ok = 1;
+  int i;
+
+  for (i = 1; i < argc; i++)
+    {
+      if (strcmp (argv[i], "--scale") == 0 && i + 1 < argc)
+	scale = atoi (argv[++i]);
+      else if (strcmp (argv[i], "--min-time") == 0 && i + 1 < argc)
+	min_time = atof (argv[++i]);
+      else if (strcmp (argv[i], "--src") == 0 && i + 1 < argc)
+	src = argv[++i];
+      else if (strcmp (argv[i], "--write") == 0 && i + 1 < argc)
+	write_dir = argv[++i];
+      else if (strcmp (argv[i], "--check") == 0 && i + 1 < argc)
+	check_file = argv[++i];
+      else if (strcmp (argv[i], "--save-baseline") == 0 && i + 1 < argc)
+	save_file = argv[++i];
+      else if (strcmp (argv[i], "--startup") == 0)
+	startup = 1;
+      else if (strcmp (argv[i], "--runs") == 0 && i + 1 < argc)
+	runs = atoi (argv[++i]);
+      else if (argv[i][0] == '-')
+	return usage ();
+      else
+	{
+	  wanted = argv + i;
+	  nwanted = argc - i;
+	  break;
+	}
+    }
+  if (scale < 1 || runs < 1)
+    return usage ();
+
+  if (startup)
+    return run_startup (runs) ? 0 : 1;
+  if (write_dir)
+    return write_corpora (write_dir, scale, wanted, nwanted);
+
+  memset (&b, 0, sizeof b);
+  /* A check runs as a test, and only needs the quickest of a few runs
+     for its times.  */
+  b.min_time = min_time >= 0 ? min_time : check_file ? 0.2 : 0.5;
+  b.first = 1;
+  if (check_file)
+    {
+      b.check = baseline_read (check_file);
+      if (!b.check)
+	return 1;
+      /* Times from another kind of build say nothing about this one.  */
+      b.times = scale == 1
+		&& strcmp (baseline_build (b.check),
+			   *BUILD_TYPE ? BUILD_TYPE : "none") == 0;
+    }
+  if (save_file)
+    b.save = baseline_new (BUILD_TYPE);
+  b.calibration = calibrate ();
+
+  /* The synthetic corpora expand far more than -u allows by default.  */
+  masp_options_init (&synthetic);
+  synthetic.comment_char = ';';
+  synthetic.unreasonable = 1;
+  masp_options_init (&ps2gl);
+  ps2gl.comment_char = ';';
+  ps2gl.copysource = 1;
+  ps2gl.print_line_number = 1;
+
+  if (b.check)
+    printf ("%-28s %-18s %12s %12s %8s\n", "corpus", "figure", "baseline",
+	    "now", "change");
+  else
+    printf ("{\"bench\": \"masp\", \"version\": %d, \"scale\": %d, "
+	    "\"results\": [\n", BENCH_VERSION, scale);
+
+  for (c = corpus_table; c->name && ok; c++)
+    {
+      sb text;
+
+      if (!wanted_p (c->name, wanted, nwanted))
+	continue;
+      sb_new (&text);
+      c->generate (&text, scale);
+      ok = bench_corpus (&b, c->name, text.ptr, text.len, &synthetic, NULL);
+      sb_kill (&text);
+    }
+
+  snprintf (dir, sizeof dir, "%s/test", src);
+  for (f = ps2gl_files; *f && ok; f++)
+    {
+      char path[1024];
+      sb text;
+
+      if (!wanted_p (*f, wanted, nwanted))
+	continue;
+      snprintf (path, sizeof path, "%s/%s", dir, *f);
+      sb_new (&text);
+      if (!read_file (path, &text))
+	{
+	  fprintf (stderr, "masp_bench: can't read `%s'\n", path);
+	  ok = 0;
+	}
+      else
+	ok = bench_corpus (&b, *f, text.ptr, text.len, &ps2gl, dir);
+      sb_kill (&text);
+    }
+
+  if (b.check)
+    {
+      if (!b.times)
+	printf ("time_ratio not checked: the baseline is of a %s build, "
+		"this is %s\n", baseline_build (b.check),
+		*BUILD_TYPE ? BUILD_TYPE : "none");
+      if (b.failed)
+	printf ("%d figures worse than the baseline allows\n", b.failed);
+      ok = ok && !b.failed;
+      baseline_free (b.check);
+    }
+  else
+    printf ("\n]}\n");
+  if (b.save)
+    {
+      ok = ok && baseline_write (b.save, save_file);
+      baseline_free (b.save);
+    }
+  return ok ? 0 : 1;
+}
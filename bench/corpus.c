@@ -0,0 +1,163 @@
+/* corpus.c - synthetic input for the MASP benchmarks.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "corpus.h"
+
+/* Deepest chain of macros calling macros; the include stack holds
+   MAX_INCLUDES levels, and the input and a few others need some.  */
+#define NEST_DEPTH 24
+
+static void
+add (sb *out, const char *format, ...)
+{
+  char line[256];
+  va_list args;
+
+  va_start (args, format);
+  vsnprintf (line, sizeof line, format, args);
+  va_end (args);
+  sb_add_string (out, line);
+}
+
+/* Plain instructions, as the bulk of a large shader is: nothing for
+   the preprocessor to do but copy lines and skip comments.  */
+
+static void
+gen_flat (sb *out, int scale)
+{
+  int i;
+
+  for (i = 0; i < 50000 * scale; i++)
+    {
+      if (i % 64 == 0)
+	add (out, "label_%d:\n", i / 64);
+      add (out, "\tmadd.xyz\tvf%02d, vf%02d, vf%02d\t; step %d\n",
+	   i % 32, (i + 1) % 32, (i + 7) % 32, i);
+    }
+  add (out, "\t.END\n");
+}
+
+/* Many small macros, each defined and then called once.  */
+
+static void
+gen_macros (sb *out, int scale)
+{
+  int n = 2000 * scale;
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      add (out, "\t.macro m%d dst, src\n", i);
+      add (out, "\tadd.xyz \\dst, \\src, vf%02d\n", i % 32);
+      add (out, "\tmul.w \\dst, \\dst, vf00\n");
+      add (out, "\t.endm\n");
+    }
+  for (i = 0; i < n; i++)
+    add (out, "\tm%d vf01, vf%02d\n", i, i % 32);
+  add (out, "\t.END\n");
+}
+
+/* A chain of macros each calling the next, called over and over.  */
+
+static void
+gen_nesting (sb *out, int scale)
+{
+  int i;
+
+  for (i = 0; i < NEST_DEPTH; i++)
+    {
+      add (out, "\t.macro n%d reg\n", i);
+      add (out, "\tsub.x \\reg, \\reg, vf%02d\n", i);
+      if (i + 1 < NEST_DEPTH)
+	add (out, "\tn%d \\reg\n", i + 1);
+      add (out, "\t.endm\n");
+    }
+  for (i = 0; i < 500 * scale; i++)
+    add (out, "\tn0 vf%02d\n", i % 32);
+  add (out, "\t.END\n");
+}
+
+/* Long AREPEAT and AWHILE loops.  */
+
+static void
+gen_unroll (sb *out, int scale)
+{
+  add (out, "\t.AREPEAT %d\n", 10000 * scale);
+  add (out, "\tiaddiu vi01, vi01, 1\n");
+  add (out, "\tlq.xyzw vf01, 0(vi01)\n");
+  add (out, "\t.AENDR\n");
+  add (out, "I\t.ASSIGNA 0\n");
+  add (out, "\t.AWHILE \\&I LT %d\n", 5000 * scale);
+  add (out, "\tsq.xyzw vf01, \\&I(vi02)\n");
+  add (out, "I\t.ASSIGNA \\&I+1\n");
+  add (out, "\t.AENDW\n");
+  add (out, "\t.END\n");
+}
+
+/* A large table of variables, each set and then used a few times.  */
+
+static void
+gen_symbols (sb *out, int scale)
+{
+  int n = 8000 * scale;
+  int i;
+
+  for (i = 0; i < n; i++)
+    add (out, "sym_%d\t.ASSIGNA %d\n", i, i * 3);
+  for (i = 0; i < n; i++)
+    add (out, "\tiaddiu vi%02d, vi00, \\&sym_%d + \\&sym_%d\n",
+	 i % 16, i, (i * 7) % n);
+  add (out, "\t.END\n");
+}
+
+/* Numbers in every prefixed base, to be converted to decimal.  */
+
+static void
+gen_numbers (sb *out, int scale)
+{
+  int i;
+
+  for (i = 0; i < 25000 * scale; i++)
+    {
+      int v = i & 0xfff;
+      int b;
+
+      add (out, "\tiaddiu vi01, vi00, 0h%x + 0q%o + 0d%d + 0b", v, v, v);
+      for (b = 11; b >= 0; b--)
+	sb_add_char (out, (v >> b) & 1 ? '1' : '0');
+      add (out, " + 0a%c\n", 'A' + i % 26);
+    }
+  add (out, "\t.END\n");
+}
+
+const corpus corpus_table[] = {
+  { "flat", gen_flat },
+  { "macros", gen_macros },
+  { "nesting", gen_nesting },
+  { "unroll", gen_unroll },
+  { "symbols", gen_symbols },
+  { "numbers", gen_numbers },
+  { NULL, NULL }
+};
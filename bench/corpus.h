@@ -0,0 +1,43 @@
+/* corpus.h - synthetic input for the MASP benchmarks.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#ifndef CORPUS_H
+
+#define CORPUS_H
+
+#include "sb.h"
+
+/* Each generator appends a whole input file to OUT, in MASP syntax
+   with '.' directives and ';' comments, ending in .END.  SCALE
+   multiplies its size; at 1 each takes of the order of a tenth of a
+   second to preprocess.  The text depends on nothing but SCALE, so
+   runs are comparable from one build to the next.  */
+
+typedef void (*corpus_generator) (sb *out, int scale);
+
+typedef struct corpus {
+  const char *name;
+  corpus_generator generate;
+} corpus;
+
+/* The generators, ending in one with a NULL name.  */
+extern const corpus corpus_table[];
+
+#endif
@@ -0,0 +1,462 @@
+/* cache.c - reusing the output of earlier runs.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+/* An entry is text headers with the raw bytes between them:
+
+     MASPCACHE 2
+     <key length>       then the key, its words ending in NULs
+     <number of files>
+     <size> <hash> <path length>   then the path, for each file
+     <number of directories>
+     <time> <nanoseconds> <path length>   then the path, for each
+                                   directory an include was missed in
+     <diagnostics length>          then the diagnostics
+     <output length>               then the output
+
+   each number ending in a newline.  A directory which isn't there has
+   the time 0.  */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+#include "compat.h"
+#include "sb.h"
+#include "cache.h"
+
+#define CACHE_MAGIC "MASPCACHE 2\n"
+
+struct run_cache {
+  char *dir;
+  sb key;
+  char **files;			/* From cache_key_file.  */
+  int nfiles;
+  char **read;			/* The files a cached run read.  */
+  int nread;
+};
+
+run_cache *
+cache_open (const char *dir)
+{
+  run_cache *c = (run_cache *) xmalloc (sizeof (run_cache));
+
+#ifdef _WIN32
+  _mkdir (dir);
+#else
+  mkdir (dir, 0777);
+#endif
+  c->dir = xstrdup (dir);
+  sb_new (&c->key);
+  c->files = NULL;
+  c->nfiles = 0;
+  c->read = NULL;
+  c->nread = 0;
+  return c;
+}
+
+void
+cache_key (run_cache *c, const char *word)
+{
+  sb_add_buffer (&c->key, word, strlen (word) + 1);
+}
+
+void
+cache_key_file (run_cache *c, const char *path)
+{
+  c->files = (char **) xrealloc (c->files,
+				 (c->nfiles + 1) * sizeof (char *));
+  c->files[c->nfiles++] = xstrdup (path);
+}
+
+void
+cache_close (run_cache *c)
+{
+  int i;
+
+  for (i = 0; i < c->nfiles; i++)
+    free (c->files[i]);
+  free (c->files);
+  for (i = 0; i < c->nread; i++)
+    free (c->read[i]);
+  free (c->read);
+  sb_kill (&c->key);
+  free (c->dir);
+  free (c);
+}
+
+/* The name of the entry for the key, in malloced memory.  */
+
+static char *
+entry_path (run_cache *c)
+{
+  unsigned long long h = 14695981039346656037ull;
+  char name[32];
+  int i;
+
+  for (i = 0; i < c->key.len; i++)
+    {
+      h ^= (unsigned char) c->key.ptr[i];
+      h *= 1099511628211ull;
+    }
+  sprintf (name, "%016llx.masp", h);
+  return resolve_path (c->dir, name);
+}
+
+/* Read all of the file at PATH into *BUF and *LEN.  Returns 0 if it
+   can't be read.  */
+
+static int
+read_whole (const char *path, char **buf, size_t *len)
+{
+  FILE *f = fopen (path, "rb");
+  size_t alloc = 8192;
+  size_t n;
+
+  if (!f)
+    return 0;
+  *buf = (char *) xmalloc (alloc);
+  *len = 0;
+  while ((n = fread (*buf + *len, 1, alloc - *len, f)) > 0)
+    {
+      *len += n;
+      if (*len == alloc)
+	{
+	  alloc *= 2;
+	  *buf = (char *) xrealloc (*buf, alloc);
+	}
+    }
+  if (ferror (f))
+    {
+      fclose (f);
+      free (*buf);
+      return 0;
+    }
+  fclose (f);
+  return 1;
+}
+
+static int
+write_whole (const char *path, const char *buf, size_t len)
+{
+  FILE *f = fopen (path, "wb");
+  int ok;
+
+  if (!f)
+    return 0;
+  ok = fwrite (buf, 1, len, f) == len;
+  if (fclose (f) != 0)
+    ok = 0;
+  return ok;
+}
+
+/* Reading an entry.  */
+
+typedef struct entry_reader {
+  const char *p;
+  const char *end;
+  int bad;
+} entry_reader;
+
+static unsigned long long
+get_number (entry_reader *r, int base)
+{
+  unsigned long long v = 0;
+
+  if (r->p >= r->end || (*r->p == '\n'))
+    r->bad = 1;
+  while (!r->bad && r->p < r->end && *r->p != '\n' && *r->p != ' ')
+    {
+      int c = *r->p++;
+      int d;
+
+      if (c >= '0' && c <= '9')
+	d = c - '0';
+      else if (c >= 'a' && c <= 'f')
+	d = c - 'a' + 10;
+      else
+	d = base;
+      if (d >= base)
+	r->bad = 1;
+      v = v * base + d;
+    }
+  if (r->p < r->end)
+    r->p++;
+  else
+    r->bad = 1;
+  return v;
+}
+
+static const char *
+get_bytes (entry_reader *r, unsigned long long n)
+{
+  const char *s = r->p;
+
+  if (r->bad || (unsigned long long) (r->end - r->p) < n)
+    {
+      r->bad = 1;
+      return NULL;
+    }
+  r->p += n;
+  return s;
+}
+
+/* Whether the file NAME has SIZE bytes hashing to HASH.  */
+
+static int
+file_unchanged (const char *name,
+		unsigned long long size, unsigned long long hash)
+{
+  unsigned long long now;
+  struct stat st;
+
+  return (stat (name, &st) == 0
+	  && (unsigned long long) st.st_size == size
+	  && file_hash (name, &now) && now == hash);
+}
+
+/* The time of the directory DIR, in *SEC and *NSEC.  */
+
+static void
+dir_time (const char *dir, unsigned long long *sec, unsigned long long *nsec)
+{
+  struct stat st;
+
+  *sec = *nsec = 0;
+  if (stat (dir, &st) == 0)
+    {
+      *sec = (unsigned long long) st.st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+      *nsec = (unsigned long long) st.st_mtim.tv_nsec;
+#endif
+    }
+}
+
+int
+cache_fetch (run_cache *c, const char *out_path, FILE *err)
+{
+  char *path = entry_path (c);
+  entry_reader r;
+  const char *key;
+  const char *diag = NULL;
+  const char *output = NULL;
+  unsigned long long n, diag_len = 0, out_len = 0, i;
+  char *buf;
+  size_t len;
+  int hit = 0;
+
+  if (!read_whole (path, &buf, &len))
+    {
+      free (path);
+      return 0;
+    }
+  r.p = buf;
+  r.end = buf + len;
+  r.bad = 0;
+
+  if (get_bytes (&r, strlen (CACHE_MAGIC)) == NULL
+      || memcmp (buf, CACHE_MAGIC, strlen (CACHE_MAGIC)) != 0)
+    r.bad = 1;
+  n = get_number (&r, 10);
+  key = get_bytes (&r, n);
+  if (!r.bad && (n != (unsigned long long) c->key.len
+		 || memcmp (key, c->key.ptr, n) != 0))
+    r.bad = 1;
+  n = get_number (&r, 10);
+  if (!r.bad && n >= (unsigned long long) c->nfiles && n < len)
+    c->read = (char **) xmalloc ((n - c->nfiles + 1) * sizeof (char *));
+  else
+    r.bad = 1;
+  for (i = 0; i < n && !r.bad; i++)
+    {
+      unsigned long long size = get_number (&r, 10);
+      unsigned long long hash = get_number (&r, 16);
+      unsigned long long path_len = get_number (&r, 10);
+      const char *name = get_bytes (&r, path_len);
+      char *copy;
+
+      if (r.bad)
+	break;
+      copy = (char *) xmalloc (path_len + 1);
+      memcpy (copy, name, path_len);
+      copy[path_len] = 0;
+      if (!file_unchanged (copy, size, hash))
+	r.bad = 1;
+      /* The files from cache_key_file come first.  */
+      if (i < (unsigned long long) c->nfiles)
+	free (copy);
+      else
+	c->read[c->nread++] = copy;
+    }
+  /* A file put in one of these would have been found instead.  */
+  n = r.bad ? 0 : get_number (&r, 10);
+  for (i = 0; i < n && !r.bad; i++)
+    {
+      unsigned long long sec = get_number (&r, 10);
+      unsigned long long nsec = get_number (&r, 10);
+      unsigned long long path_len = get_number (&r, 10);
+      const char *name = get_bytes (&r, path_len);
+      unsigned long long now_sec, now_nsec;
+      char *copy;
+
+      if (r.bad)
+	break;
+      copy = (char *) xmalloc (path_len + 1);
+      memcpy (copy, name, path_len);
+      copy[path_len] = 0;
+      dir_time (copy, &now_sec, &now_nsec);
+      if (now_sec != sec || now_nsec != nsec)
+	r.bad = 1;
+      free (copy);
+    }
+  if (!r.bad)
+    diag_len = get_number (&r, 10);
+  diag = get_bytes (&r, diag_len);
+  if (!r.bad)
+    out_len = get_number (&r, 10);
+  output = get_bytes (&r, out_len);
+
+  if (!r.bad && r.p == r.end && write_whole (out_path, output, out_len))
+    {
+      fwrite (diag, 1, diag_len, err);
+      hit = 1;
+    }
+
+  if (!hit)
+    {
+      while (c->nread > 0)
+	free (c->read[--c->nread]);
+      free (c->read);
+      c->read = NULL;
+    }
+  free (buf);
+  free (path);
+  return hit;
+}
+
+const char *const *
+cache_files (const run_cache *c, int *count)
+{
+  *count = c->nread;
+  return (const char *const *) c->read;
+}
+
+static void
+add_number (sb *buf, const char *format, unsigned long long v)
+{
+  char num[32];
+
+  sprintf (num, format, v);
+  sb_add_string (buf, num);
+}
+
+/* Add the size and hash of the file at PATH to BUF.  Returns 0 if it
+   can't be read.  */
+
+static int
+add_file (sb *buf, const char *path)
+{
+  unsigned long long hash;
+  struct stat st;
+
+  if (stat (path, &st) != 0 || !file_hash (path, &hash))
+    return 0;
+  add_number (buf, "%llu ", (unsigned long long) st.st_size);
+  add_number (buf, "%llx ", hash);
+  add_number (buf, "%llu\n", (unsigned long long) strlen (path));
+  sb_add_string (buf, path);
+  return 1;
+}
+
+/* Add the time of the directory DIR to BUF.  */
+
+static void
+add_dir (sb *buf, const char *dir)
+{
+  unsigned long long sec, nsec;
+
+  dir_time (dir, &sec, &nsec);
+  add_number (buf, "%llu ", sec);
+  add_number (buf, "%llu ", nsec);
+  add_number (buf, "%llu\n", (unsigned long long) strlen (dir));
+  sb_add_string (buf, dir);
+}
+
+void
+cache_store (run_cache *c, const char *const *files, int nfiles,
+	     const char *const *dirs, int ndirs,
+	     const char *diag, size_t diag_len, const char *out_path)
+{
+  char *path = entry_path (c);
+  char *tmp = (char *) xmalloc (strlen (path) + 32);
+  char *output;
+  size_t out_len;
+  sb buf;
+  int ok = 1;
+  int i;
+
+  if (!read_whole (out_path, &output, &out_len))
+    {
+      free (tmp);
+      free (path);
+      return;
+    }
+
+  sb_new (&buf);
+  sb_add_string (&buf, CACHE_MAGIC);
+  add_number (&buf, "%llu\n", (unsigned long long) c->key.len);
+  sb_add_buffer (&buf, c->key.ptr, c->key.len);
+  add_number (&buf, "%llu\n", (unsigned long long) (c->nfiles + nfiles));
+  for (i = 0; i < c->nfiles; i++)
+    ok &= add_file (&buf, c->files[i]);
+  for (i = 0; i < nfiles; i++)
+    ok &= add_file (&buf, files[i]);
+  add_number (&buf, "%llu\n", (unsigned long long) ndirs);
+  for (i = 0; i < ndirs; i++)
+    add_dir (&buf, dirs[i]);
+  add_number (&buf, "%llu\n", (unsigned long long) diag_len);
+  sb_add_buffer (&buf, diag, diag_len);
+  add_number (&buf, "%llu\n", (unsigned long long) out_len);
+  sb_add_buffer (&buf, output, out_len);
+
+  if (ok)
+    {
+#ifdef HAVE_UNISTD_H
+      sprintf (tmp, "%s.%ld.tmp", path, (long) getpid ());
+#else
+      sprintf (tmp, "%s.tmp", path);
+#endif
+      if (!write_whole (tmp, buf.ptr, buf.len) || rename (tmp, path) != 0)
+	remove (tmp);
+    }
+
+  sb_kill (&buf);
+  free (output);
+  free (tmp);
+  free (path);
+}
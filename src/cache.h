@@ -0,0 +1,74 @@
+/* cache.h - reusing the output of earlier runs.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#ifndef CACHE_H
+
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* With --cache-dir the output of a successful run is kept in a cache
+   directory, along with its diagnostics and the size and hash of every
+   file it read.  A later run with the same key, the words which
+   describe the options, -I, -D and input names, finds it there, and
+   if none of those files has changed its text, and no directory an
+   include was looked for in without success has changed its time,
+   takes the output and diagnostics from the cache instead of
+   preprocessing anything.
+
+   An entry is a single file named by a hash of the key, written under
+   another name and renamed into place, so that runs sharing a cache
+   never see half an entry.  The key itself is kept in the entry, so
+   two keys with the same hash only cost a miss.  */
+
+typedef struct run_cache run_cache;
+
+/* Start describing a run whose entry belongs in the directory DIR,
+   which is made if need be.  */
+extern run_cache *cache_open (const char *dir);
+
+/* Add WORD to the key.  */
+extern void cache_key (run_cache *, const char *word);
+
+/* Add the text of the file at PATH to the key, as though it had been
+   read by the run.  */
+extern void cache_key_file (run_cache *, const char *path);
+
+/* If the cache holds the run, write its output to OUT_PATH and its
+   diagnostics to ERR, and return 1.  Otherwise return 0.  */
+extern int cache_fetch (run_cache *, const char *out_path, FILE *err);
+
+/* After a hit, the files the cached run read, as masp_files_read
+   would have given them.  */
+extern const char *const *cache_files (const run_cache *, int *count);
+
+/* Save the run, which read the NFILES FILES, looked for include files
+   without success in the NDIRS directories DIRS, said DIAG and wrote
+   its output to OUT_PATH.  A run which can't be saved is simply not
+   cached.  */
+extern void cache_store (run_cache *, const char *const *files, int nfiles,
+			 const char *const *dirs, int ndirs,
+			 const char *diag, size_t diag_len,
+			 const char *out_path);
+
+extern void cache_close (run_cache *);
+
+#endif
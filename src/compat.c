@@ -1,3 +1,4 @@
+#include "config.h"
 #include "compat.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,6 +7,14 @@
 
 static const char *g_progname = NULL;
 
+#if defined(__GNUC__) || defined(__clang__)
+static __thread mem_stats g_mem;
+#elif defined(_MSC_VER)
+static __declspec(thread) mem_stats g_mem;
+#else
+static mem_stats g_mem;
+#endif
+
 static void die_oom(void) {
   if (g_progname && *g_progname) {
     fprintf(stderr, "%s: fatal: out of memory\n", g_progname);
@@ -15,22 +24,70 @@ static void die_oom(void) {
   abort();
 }
 
-void *xmalloc(size_t size) {
+const mem_stats *mem_stats_get(void) {
+  return &g_mem;
+}
+
+void mem_stats_reset_peak(void) {
+  int i;
+
+  for (i = 0; i < MEM_KINDS; i++)
+    g_mem.kind[i].peak = g_mem.kind[i].live;
+  g_mem.total.peak = g_mem.total.live;
+}
+
+void mem_note_alloc(mem_kind kind, size_t size) {
+  mem_count *c = &g_mem.kind[kind];
+
+  c->allocs++;
+  c->bytes += size;
+  if (kind == MEM_OTHER)
+    return;
+  if ((c->live += size) > c->peak)
+    c->peak = c->live;
+  g_mem.total.allocs++;
+  g_mem.total.bytes += size;
+  if ((g_mem.total.live += size) > g_mem.total.peak)
+    g_mem.total.peak = g_mem.total.live;
+}
+
+void mem_note_free(mem_kind kind, size_t size) {
+  g_mem.kind[kind].live -= size;
+  g_mem.total.live -= size;
+}
+
+void mem_note_sb_grow(size_t copied) {
+  g_mem.sb_grows++;
+  g_mem.sb_grow_bytes += copied;
+}
+
+void *xmalloc_kind(mem_kind kind, size_t size) {
   void *p = malloc(size);
   if (!p) die_oom();
+  mem_note_alloc(kind, size);
   return p;
 }
 
+void xfree_kind(mem_kind kind, void *ptr, size_t size) {
+  if (!ptr) return;
+  mem_note_free(kind, size);
+  free(ptr);
+}
+
+void *xmalloc(size_t size) {
+  return xmalloc_kind(MEM_OTHER, size);
+}
+
 void *xrealloc(void *ptr, size_t size) {
   void *p = realloc(ptr, size);
   if (!p) die_oom();
+  mem_note_alloc(MEM_OTHER, size);
   return p;
 }
 
 char *xstrdup(const char *s) {
   size_t n = strlen(s) + 1;
-  char *p = (char *)malloc(n);
-  if (!p) die_oom();
+  char *p = (char *)xmalloc(n);
   memcpy(p, s, n);
   return p;
 }
@@ -39,6 +96,89 @@ void xmalloc_set_program_name(const char *name) {
   g_progname = name;
 }
 
+static int is_absolute(const char *name) {
+#ifdef _WIN32
+  if (ISALPHA(name[0]) && name[1] == ':') return 1;
+  if (name[0] == '\\') return 1;
+#endif
+  return name[0] == '/';
+}
+
+char *resolve_path(const char *dir, const char *name) {
+  size_t dlen, nlen;
+  char *path;
+
+  if (!dir || !*dir || is_absolute(name))
+    return xstrdup(name);
+  dlen = strlen(dir);
+  nlen = strlen(name);
+  path = (char *)xmalloc(dlen + nlen + 2);
+  memcpy(path, dir, dlen);
+  path[dlen] = '/';
+  memcpy(path + dlen + 1, name, nlen + 1);
+  return path;
+}
+
+char *canonical_path(const char *name) {
+#ifdef _WIN32
+  return _fullpath(NULL, name, 0);
+#else
+  return realpath(name, NULL);
+#endif
+}
+
+int file_hash(const char *path, unsigned long long *hash) {
+  FILE *f = fopen(path, "rb");
+  unsigned char buf[8192];
+  unsigned long long h = 14695981039346656037ull;
+  size_t n, i;
+
+  if (!f) return 0;
+  while ((n = fread(buf, 1, sizeof buf, f)) > 0)
+    for (i = 0; i < n; i++) {
+      h ^= buf[i];
+      h *= 1099511628211ull;
+    }
+  fclose(f);
+  *hash = h;
+  return 1;
+}
+
+int mem_stream_open(mem_stream *m) {
+  m->buf = NULL;
+  m->len = 0;
+#ifdef HAVE_OPEN_MEMSTREAM
+  m->file = open_memstream(&m->buf, &m->len);
+#else
+  m->file = tmpfile();
+#endif
+  return m->file != NULL;
+}
+
+void mem_stream_close(mem_stream *m, char **buf, size_t *len) {
+#ifdef HAVE_OPEN_MEMSTREAM
+  fclose(m->file);
+#else
+  long size;
+
+  fflush(m->file);
+  size = ftell(m->file);
+  if (size < 0) size = 0;
+  m->len = (size_t)size;
+  m->buf = (char *)xmalloc(m->len + 1);
+  rewind(m->file);
+  m->len = fread(m->buf, 1, m->len, m->file);
+  m->buf[m->len] = 0;
+  fclose(m->file);
+#endif
+  if (buf)
+    *buf = m->buf;
+  else
+    free(m->buf);
+  if (len)
+    *len = m->len;
+}
+
 /* Minimal obstack runtime to satisfy obstack.h macros */
 
 static struct _obstack_chunk *init_chunk(struct _obstack_chunk *c, long total_size)
@@ -1,6 +1,7 @@
 #ifndef MASP_COMPAT_H
 #define MASP_COMPAT_H
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -10,6 +11,71 @@ void *xrealloc(void *ptr, size_t size);
 char *xstrdup(const char *s);
 void xmalloc_set_program_name(const char *name);
 
+/* Memory accounting.  Allocations are counted by the part of the
+   program which made them, per thread like string_count, so that what
+   a context reports is the work done on its own thread.  Blocks from
+   plain xmalloc are freed with free, untold, so only those of the
+   other kinds are followed while they live.  */
+typedef enum {
+  MEM_OTHER,			/* xmalloc, xrealloc and xstrdup.  */
+  MEM_SB,			/* The blocks of sbs.  */
+  MEM_HASH,			/* The obstacks of hash.c tables.  */
+  MEM_MACRO,			/* macro_entry and formal_entry.  */
+  MEM_KINDS
+} mem_kind;
+
+typedef struct {
+  long long allocs;
+  long long bytes;		/* Allocated, altogether.  */
+  long long live;		/* Allocated and not yet freed.  */
+  long long peak;		/* The most LIVE has been.  */
+} mem_count;
+
+typedef struct {
+  mem_count kind[MEM_KINDS];
+  mem_count total;		/* Of the kinds followed while they live.  */
+  long long sb_grows;		/* sbs moved to a larger block ... */
+  long long sb_grow_bytes;	/* ... and the bytes copied doing so.  */
+} mem_stats;
+
+/* The figures for the calling thread.  */
+const mem_stats *mem_stats_get(void);
+/* Start the peaks of the calling thread again from what is live.  */
+void mem_stats_reset_peak(void);
+
+void mem_note_alloc(mem_kind kind, size_t size);
+void mem_note_free(mem_kind kind, size_t size);
+void mem_note_sb_grow(size_t copied);
+
+/* xmalloc, and free, of SIZE bytes counted as KIND.  */
+void *xmalloc_kind(mem_kind kind, size_t size);
+void xfree_kind(mem_kind kind, void *ptr, size_t size);
+
+/* Return NAME as seen from the directory DIR, in malloced memory.
+   Absolute names are returned as they are.  */
+char *resolve_path(const char *dir, const char *name);
+
+/* The absolute name of the file NAME with links and dots resolved, in
+   malloced memory, or NULL if there is no such file.  */
+char *canonical_path(const char *name);
+
+/* 64 bit FNV-1a over the contents of the file at PATH into *HASH.
+   Returns 0 if it can't be read.  */
+int file_hash(const char *path, unsigned long long *hash);
+
+/* A stream which collects what is written to it in memory.  Where
+   there is no open_memstream a temporary file is read back instead.  */
+typedef struct {
+  FILE *file;
+  char *buf;
+  size_t len;
+} mem_stream;
+
+int mem_stream_open(mem_stream *m);
+/* Close the stream and hand its NUL terminated contents over to *BUF
+   and *LEN.  A NULL BUF drops them.  */
+void mem_stream_close(mem_stream *m, char **buf, size_t *len);
+
 /* Compiler attribute compatibility */
 #if defined(__GNUC__) || defined(__clang__)
 #define ATTRIBUTE_UNUSED __attribute__((unused))
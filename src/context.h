@@ -0,0 +1,338 @@
+/* context.h - the state of one MASP preprocessing run.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#ifndef CONTEXT_H
+
+#define CONTEXT_H
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "compat.h"
+#include "masp.h"
+#include "sb.h"
+#include "outbuf.h"
+
+#define MAX_INCLUDES 30		/* Maximum include depth.  */
+#define MAX_REASONABLE 1000	/* Maximum number of expansions.  */
+
+/* Conditional assembly uses the `ifstack'.  Each aif pushes another
+   entry onto the stack, and sets the on flag if it should.  The aelse
+   sets hadelse, and toggles on.  An aend pops a level.  We limit to
+   100 levels of nesting, not because we're facists pigs with read
+   only minds, but because more than 100 levels of nesting is probably
+   a bug in the user's macro structure.  */
+
+#define IFNESTING 100
+
+/* Hashing is done in a pretty standard way.  A hash_table has a
+   pointer to a vector of pointers to hash_entrys, and the size of the
+   vector.  A hash_entry contains a union of all the info we like to
+   store in hash table.  If there is a hash collision, hash_entries
+   with the same hash are kept in a chain.  */
+
+/* What the data in a hash_entry means.  */
+typedef enum {
+  hash_integer,			/* Name->integer mapping.  */
+  hash_string,			/* Name->string mapping.  */
+  hash_macro,			/* Name is a macro.  */
+  hash_formal			/* Name is a formal argument.  */
+} hash_type;
+
+typedef struct hs {
+  sb key;			/* Symbol name.  */
+  hash_type type;		/* Symbol meaning.  */
+  union {
+    sb s;
+    long long i;
+    struct macro_struct *m;
+    struct formal_struct *f;
+  } value;
+  struct hs *next;		/* Next hash_entry with same hash key.  */
+} hash_entry;
+
+typedef struct {
+  hash_entry **table;
+  int size;
+  int generation;		/* Bumped by each entry hash_create adds,
+				   which may hide another of its name.  */
+} hash_table;
+
+#define SYMBOL_TABLE_SIZE 101	/* Buckets in the assign and var tables.  */
+
+/* How we nest files and expand macros etc.
+
+   We keep a stack of of include_stack structs.  Each include file
+   pushes a new level onto the stack.  We keep an sb with a pushback
+   too.  unget chars are pushed onto the pushback sb, getchars first
+   checks the pushback sb before reading from the input stream.
+
+   Small things are expanded by adding the text of the item onto the
+   pushback sb.  Larger items are grown by pushing a new level which
+   reads from a list of pieces of shared text (see sb_text in sb.h).
+   Pushing an expansion links pieces onto the new level rather than
+   copying the text into it, so an AREPEAT or AWHILE body which appears
+   twice in its expansion is only stored once.  Each time
+   something like a macro is expanded, the stack index is changed.  We
+   can then perform an exitm by popping all entries off the stack with
+   the same stack index.  If we're being reasonable, we can detect
+   recusive expansion by checking the index is reasonably small.  */
+
+typedef enum {
+  include_file, include_repeat, include_while, include_macro
+} include_type;
+
+/* A piece of shared text linked into an include level.  */
+
+typedef struct text_piece {
+  struct text_piece *next;	/* Next piece to read.  */
+  sb_text *text;		/* The text, one reference held.  */
+  int pos;			/* Next char to read from text.  */
+} text_piece;
+
+struct include_stack {
+  sb pushback;			/* Current pushback stream.  */
+  int pushback_index;		/* Next char to read from stream.  */
+  text_piece *pieces;		/* Text still to read, after pushback.  */
+  text_piece **pieces_tail;	/* Where to link the next piece.  */
+  int from_piece;		/* Last char read came from pieces.  */
+  FILE *handle;			/* Open file.  */
+  struct pipe_reader *reader;	/* Or the reader thread reading it.  */
+  sb name;			/* Name of file.  */
+  int linecount;		/* Number of lines read so far.  */
+  include_type type;
+  int index;			/* Index of this layer.  */
+  const char *path;		/* The file read, as in files_read, or NULL.  */
+  int out_at;			/* Where the output was when it was pushed.  */
+};
+
+/* Include file list.  */
+
+typedef struct include_path {
+  struct include_path *next;
+  sb path;
+} include_path;
+
+/* What several contexts share; see masp_new_shared.  The include
+   file cache maps a path to the contents of the file, held as pinned
+   text so any number of threads may read it at once, together with
+   what the file looked like when it was read.  Only the map itself
+   needs the lock.
+
+   An entry or lookup which is replaced may still be in use by a run
+   which began before, so it is retired with the epoch it was replaced
+   in, and freed once every run which began by then has ended.  */
+
+typedef struct shared_entry {
+  sb_text *text;		/* The contents, pinned.  */
+  off_t size;			/* The file's size and time then.  */
+  time_t mtime;
+  long mtime_nsec;
+  struct shared_entry *retired;	/* Next replaced entry.  */
+  unsigned long epoch;		/* When it was replaced.  */
+} shared_entry;
+
+/* A directory and its time, or -1 for a directory which isn't
+   there.  */
+
+typedef struct dir_time {
+  char *dir;
+  time_t mtime;
+  long mtime_nsec;
+} dir_time;
+
+/* Where an .include found its file, kept so that later runs with the
+   same directory and include path needn't look for it again.  Putting
+   a file in one of the directories looked in without success would
+   change the answer, so those are kept with their times.  */
+
+typedef struct include_lookup {
+  char *found;			/* The name it was opened by, or NULL.  */
+  dir_time *missed;		/* Where it was looked for in vain.  */
+  int nmissed;
+  struct include_lookup *retired; /* Next replaced lookup.  */
+  unsigned long epoch;		/* When it was replaced.  */
+} include_lookup;
+
+struct masp_shared {
+#ifdef HAVE_PTHREAD
+  pthread_mutex_t lock;
+#endif
+  struct hash_control *files;	/* Path -> shared_entry.  */
+  shared_entry *retired;	/* Entries for files since changed.  */
+  struct hash_control *lookups;	/* Paths and name -> include_lookup.  */
+  include_lookup *retired_lookups;
+  unsigned long epoch;		/* Counts the replacements.  */
+  struct masp_context *users;	/* The runs using these caches.  */
+};
+
+/* The state of one preprocessing run.  masp.c and macro.c take a
+   pointer to one of these as their first argument wherever they need
+   anything beyond their arguments.  */
+
+struct masp_context {
+  /* Settings from the command line.  */
+  int unreasonable;		/* -u on command line.  */
+  int stats;			/* -d on command line.  */
+  int print_line_number;	/* -p flag on command line.  */
+  int copysource;		/* -c flag on command line.  */
+  int alternate;		/* -a on command line.  */
+  int mri;			/* -M on command line.  */
+  char comment_char;
+  char cml_prefix_char;		/* Char we got on the command line.  */
+  int line_info;		/* Include line number info in output file?  */
+  int pipeline;			/* --pipeline on command line.  */
+  int prefetch;			/* --prefetch threads, or 0.  */
+
+  /* Settings the source may change as it goes.  */
+  int radix;			/* Default radix.  */
+  char prefix_char;		/* Directive marker.  */
+  int masp_syntax;		/* Whether we are using the new MASP syntax,
+				   or the old GASP one.  */
+
+  int warnings;			/* Number of WARNINGs generated so far.  */
+  int errors;			/* Number of ERRORs generated so far.  */
+  int fatals;			/* Number of fatal ERRORs generated so far
+				   (either 0 or 1).  */
+  int had_end;			/* Seen .END.  */
+
+  masp_shared *shared;		/* Shared caches, or NULL.  */
+  struct masp_context *next_user; /* The next run using them.  */
+  unsigned long shared_epoch;	/* Their epoch when this run began.  */
+  char *directory;		/* What relative file names are in.  */
+
+  /* The files read so far, in the order they were first opened; see
+     masp_files_read.  FILES_SEEN holds the same names.  */
+  char **files_read;
+  int nfiles_read;
+  int files_read_alloc;
+  struct hash_control *files_seen;
+
+  /* The -D values given to masp_define, in order.  */
+  char **defines;
+  int ndefines;
+
+  /* After masp_record_output, what each file wrote while it was read
+     the first time, by its name in files_read, and all the output so
+     far, which OUT copies its blocks into.  */
+  struct hash_control *file_output;
+  sb recorded;
+  /* Files popped since the last line was read.  The output of a
+     file's last line comes after it is popped, so what it wrote is
+     only kept once the next line is read.  */
+  struct {
+    const char *path;
+    int out_at;
+  } ended[MAX_INCLUDES];
+  int nended;
+
+  /* The snapshot loaded by masp_use_snapshot, or NULL.  Includes of
+     the files it covers are skipped.  */
+  const masp_snapshot *snapshot;
+
+  /* The canonical names of the files masp_process_prelude read, or
+     NULL.  Includes of them are skipped too.  */
+  struct hash_control *prelude_files;
+  int reading_prelude;		/* A prelude needn't end in .END.  */
+
+  /* What this run has already found out about include files, taken
+     to hold until it ends: where each name was found (or the NO_FILE
+     marker), the text of each file from the shared cache, and the
+     time of each directory looked in.  */
+  struct hash_control *include_found;
+  struct hash_control *include_text;
+  struct hash_control *dir_times;
+  const char **dirs_missed;	/* The names in dir_times, in order.  */
+  int ndirs_missed;
+  int lookup_hits;		/* Includes found without looking, for -d.  */
+  int lookup_misses;
+  int text_hits;		/* Include files not read again, for -d.  */
+  int text_reads;
+  struct hash_control *include_guards; /* Path -> its include guard.  */
+  int guard_skips;		/* Includes left out by their guard, for -d.  */
+  int prefetched;		/* Include files read ahead, for -d.  */
+
+  /* AIF and AWHILE conditions compiled so far, by their text, and a
+     buffer for looking them up.  */
+  struct hash_control *conds;
+  int nconds;
+  sb cond_key;
+  int cond_hits;		/* Conditions run compiled, for -d.  */
+
+  /* What --profile has found so far, or NULL, and the keyword of the
+     directive just handled.  */
+  struct profile *profile;
+  hash_entry *directive;
+
+  struct trace *trace;		/* What --trace has recorded, or NULL.  */
+
+  /* The memory figures of this thread when the context was made, for
+     -d to report the difference.  */
+  mem_stats mem_start;
+
+  outbuf out;			/* The output, buffered.  */
+  FILE *errfile;		/* Where diagnostics go.  */
+
+  /* The attributes of each character are stored as a bit pattern
+     chartype, which gives us quick tests.  */
+  char chartype[256];
+
+  struct {
+    int on;			/* Is the level being output.  */
+    int hadelse;		/* Has an aelse been seen.  */
+  } ifstack[IFNESTING];
+  int ifi;
+
+  struct include_stack include_stack[MAX_INCLUDES];
+  struct include_stack *sp;
+  int include_index;		/* Last index handed out to a layer.  */
+
+  include_path *paths_head;
+  include_path *paths_tail;
+
+  sb label;			/* The label on the current line.  */
+
+  hash_table assign_hash_table;
+  hash_table *keyword_hash_table; /* Shared, see process_init.  */
+  hash_table vars;
+
+  /* The macro state, looked after by macro.c.  */
+  struct hash_control *macro_hash; /* The macro hash table.  */
+  int macro_defined;		/* Whether any macros have been defined.  */
+  int macro_alternate;		/* Whether we are in GASP alternate mode.  */
+  int macro_mri;		/* Whether we are in MRI mode.  */
+  int macro_strip_at;		/* Whether we should strip '@' characters.  */
+  /* Function to use to parse an expression.  */
+  int (*macro_expr)(masp_context *, const char *, int, const sb *, long long *);
+  int macro_number;		/* Number of macro expansions done.  */
+  int macro_loccnt;		/* Number of LOCAL labels made up.  */
+
+  /* Where a fatal error returns to.  */
+  jmp_buf fatal_return;
+  int fatal_return_set;
+};
+
+#endif
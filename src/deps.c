@@ -0,0 +1,114 @@
+/* deps.c - make dependency files.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "compat.h"
+#include "deps.h"
+
+/* Rules are wrapped before this column.  */
+#define DEPS_WIDTH 75
+
+/* Write NAME to FILE quoted for make, returning its length there.  */
+
+static int
+put_name (FILE *file, const char *name)
+{
+  int len = 0;
+
+  for (; *name; name++)
+    {
+      if (*name == ' ' || *name == '\t' || *name == '#')
+	{
+	  putc ('\\', file);
+	  len++;
+	}
+      else if (*name == '$')
+	{
+	  putc ('$', file);
+	  len++;
+	}
+      putc (*name, file);
+      len++;
+    }
+  return len;
+}
+
+int
+deps_write (FILE *file, const char *const *targets, int ntargets,
+	    const char *const *files, int nfiles)
+{
+  int column = 0;
+  int i;
+
+  for (i = 0; i < ntargets; i++)
+    {
+      if (i)
+	{
+	  putc (' ', file);
+	  column++;
+	}
+      column += put_name (file, targets[i]);
+    }
+  putc (':', file);
+  column++;
+
+  for (i = 0; i < nfiles; i++)
+    {
+      if (column + 1 + (int) strlen (files[i]) > DEPS_WIDTH && column > 1)
+	{
+	  fputs (" \\\n", file);
+	  column = 0;
+	}
+      putc (' ', file);
+      column += 1 + put_name (file, files[i]);
+    }
+  putc ('\n', file);
+
+  for (i = 1; i < nfiles; i++)
+    {
+      putc ('\n', file);
+      put_name (file, files[i]);
+      fputs (":\n", file);
+    }
+
+  return !ferror (file);
+}
+
+char *
+deps_name (const char *output, const char *suffix)
+{
+  const char *base = strrchr (output, '/');
+  const char *dot;
+  char *name;
+  size_t len;
+
+  base = base ? base + 1 : output;
+  dot = strrchr (base, '.');
+  len = dot && dot != base ? (size_t) (dot - output) : strlen (output);
+
+  name = (char *) xmalloc (len + strlen (suffix) + 1);
+  memcpy (name, output, len);
+  strcpy (name + len, suffix);
+  return name;
+}
@@ -0,0 +1,38 @@
+/* deps.h - make dependency files.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#ifndef DEPS_H
+
+#define DEPS_H
+
+#include <stdio.h>
+
+/* Write a make rule to FILE making each of the NTARGETS TARGETS
+   depend on the NFILES FILES a run read, followed by an empty rule for
+   each file but the first, the input, so that make carries on if one
+   of the include files is deleted.  Returns 0 if the writing failed.  */
+extern int deps_write (FILE *file, const char *const *targets, int ntargets,
+		       const char *const *files, int nfiles);
+
+/* The name of the dependency file for OUTPUT when none is given: OUTPUT
+   with its suffix, if any, changed to SUFFIX.  In malloced memory.  */
+extern char *deps_name (const char *output, const char *suffix);
+
+#endif
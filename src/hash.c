@@ -42,6 +42,27 @@ extern void free( void * );
 
 //#include <stdlib.h>
 
+/* The chunks of a table's obstack are counted as hash memory.  */
+
+#undef obstack_chunk_alloc
+#undef obstack_chunk_free
+#define obstack_chunk_alloc hash_chunk_alloc
+#define obstack_chunk_free hash_chunk_free
+
+static void *
+hash_chunk_alloc (long size)
+{
+  return xmalloc_kind (MEM_HASH, size);
+}
+
+static void
+hash_chunk_free (void *chunk)
+{
+  struct _obstack_chunk *c = (struct _obstack_chunk *) chunk;
+
+  xfree_kind (MEM_HASH, c, c->limit - (char *) c);
+}
+
 /* The default number of entries to use when creating a hash table.  */
 
 #define DEFAULT_SIZE (4051)
@@ -81,23 +102,20 @@ struct hash_control {
 #endif /* HASH_STATISTICS */
 };
 
-/* Create a hash table.  This return a control block.  */
+/* Create a hash table.  This return a control block.  The table
+   itself, and the obstack behind it, are only made when the first
+   entry goes in, so that the many tables which never get one (the
+   macros of a file with none, say) cost no more than the control
+   block.  Until then the table has no slots.  */
 
 struct hash_control *
 hash_new (void)
 {
-  unsigned int size;
   struct hash_control *ret;
-  unsigned int alloc;
 
-  size = DEFAULT_SIZE;
-
-  ret = (struct hash_control *) xmalloc (sizeof *ret);
-  obstack_begin (&ret->memory, chunksize);
-  alloc = size * sizeof (struct hash_entry *);
-  ret->table = (struct hash_entry **) obstack_alloc (&ret->memory, alloc);
-  memset (ret->table, 0, alloc);
-  ret->size = size;
+  ret = (struct hash_control *) xmalloc_kind (MEM_HASH, sizeof *ret);
+  ret->table = NULL;
+  ret->size = 0;
 
 #ifdef HASH_STATISTICS
   ret->lookups = 0;
@@ -111,6 +129,23 @@ hash_new (void)
   return ret;
 }
 
+/* Make the slots of TABLE, before its first entry.  */
+
+static void
+hash_make_table (struct hash_control *table)
+{
+  unsigned int size;
+  unsigned int alloc;
+
+  size = DEFAULT_SIZE;
+
+  obstack_begin (&table->memory, chunksize);
+  alloc = size * sizeof (struct hash_entry *);
+  table->table = (struct hash_entry **) obstack_alloc (&table->memory, alloc);
+  memset (table->table, 0, alloc);
+  table->size = size;
+}
+
 /* Delete a hash table, freeing all allocated memory.  */
 
 //extern void free( void * );
@@ -118,8 +153,9 @@ hash_new (void)
 void
 hash_die (struct hash_control *table)
 {
-  obstack_free (&table->memory, 0);
-  free (table);
+  if (table->table)
+    obstack_free (&table->memory, 0);
+  xfree_kind (MEM_HASH, table, sizeof *table);
 }
 
 /* Look up a string in a hash table.  This returns a pointer to the
@@ -149,6 +185,11 @@ hash_lookup (struct hash_control *table, const char *key, struct hash_entry ***p
   ++table->lookups;
 #endif
 
+  /* Nothing was ever put in; hash_insert and hash_jam make the table
+     before they look, so they always get PLIST and PHASH.  */
+  if (table->table == NULL)
+    return NULL;
+
   hash = 0;
   len = 0;
   s = (const unsigned char *) key;
@@ -216,6 +257,8 @@ hash_insert (struct hash_control *table, const char *key, void *value)
   char *key_copy;
   size_t key_len;
 
+  if (table->table == NULL)
+    hash_make_table (table);
   p = hash_lookup (table, key, &list, &hash);
   if (p != NULL)
     return "exists";
@@ -256,6 +299,8 @@ hash_jam (struct hash_control *table, const char *key, void *value)
   char *key_copy;
   size_t key_len;
 
+  if (table->table == NULL)
+    hash_make_table (table);
   p = hash_lookup (table, key, &list, &hash);
   if (p != NULL)
     {
@@ -400,6 +445,24 @@ hash_traverse (struct hash_control *table, void (*pfn)(const char *key, void *va
     }
 }
 
+/* As hash_traverse, passing ARG on to the function as well.  */
+
+void
+hash_traverse_arg (struct hash_control *table,
+		   void (*pfn)(const char *key, void *value, void *arg),
+		   void *arg)
+{
+  unsigned int i;
+
+  for (i = 0; i < table->size; ++i)
+    {
+      struct hash_entry *p;
+
+      for (p = table->table[i]; p != NULL; p = p->next)
+	(*pfn) (p->string, p->data, arg);
+    }
+}
+
 /* Print hash table statistics on the specified file.  NAME is the
    name of the hash table, used for printing a header.  */
 
@@ -434,7 +497,8 @@ hash_print_statistics (FILE *f, const char *name, struct hash_control *table)
 	}
     }
 
-  fprintf (f, "\t%g average chain length\n", (double) total / table->size);
+  fprintf (f, "\t%g average chain length\n",
+	   table->size ? (double) total / table->size : 0.0);
   fprintf (f, "\t%lu empty slots\n", empty);
 #endif
 }
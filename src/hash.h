@@ -69,6 +69,12 @@ extern void *hash_delete(struct hash_control *, const char *key);
 
 extern void hash_traverse(struct hash_control *, void (*pfn)(const char *key, void *value));
 
+/* The same, passing ARG on to the function as well.  */
+
+extern void hash_traverse_arg(struct hash_control *,
+			      void (*pfn)(const char *key, void *value, void *arg),
+			      void *arg);
+
 /* Print hash table statistics on the specified file.  NAME is the
    name of the hash table, used for printing a header.  */
 
@@ -0,0 +1,431 @@
+/* jobs.c - preprocess a batch of files side by side.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+/* A batch is a list of jobs, each an input file and the output file
+   it is preprocessed into.  Each job gets a context of its own, so
+   jobs can't see each other's macros or variables, exactly as though
+   masp had been run once for each.  A job may have -D values of its
+   own, so that one input can be run as several variants.  A pool of
+   threads takes jobs off the list in order until none are left.  */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "compat.h"
+#include "masp.h"
+#include "jobs.h"
+#include "deps.h"
+#include "asintl.h"
+
+void
+job_list_init (job_list *list)
+{
+  list->jobs = NULL;
+  list->count = 0;
+  list->alloc = 0;
+}
+
+void
+job_list_free (job_list *list)
+{
+  int i;
+
+  for (i = 0; i < list->count; i++)
+    {
+      int j;
+
+      free (list->jobs[i].input);
+      free (list->jobs[i].output);
+      free (list->jobs[i].diag);
+      for (j = 0; j < list->jobs[i].ndefines; j++)
+	free (list->jobs[i].defines[j]);
+      free (list->jobs[i].defines);
+    }
+  free (list->jobs);
+  job_list_init (list);
+}
+
+masp_job *
+job_list_add (job_list *list, const char *input, const char *output)
+{
+  masp_job *job;
+
+  if (list->count == list->alloc)
+    {
+      list->alloc = list->alloc ? list->alloc * 2 : 16;
+      list->jobs = (masp_job *) xrealloc (list->jobs,
+					  list->alloc * sizeof (masp_job));
+    }
+  job = &list->jobs[list->count++];
+  memset (job, 0, sizeof *job);
+  job->input = xstrdup (input);
+  job->output = xstrdup (output);
+  return job;
+}
+
+void
+job_define (masp_job *job, const char *define)
+{
+  job->defines = (char **) xrealloc (job->defines, (job->ndefines + 1)
+				     * sizeof (char *));
+  job->defines[job->ndefines++] = xstrdup (define);
+}
+
+int
+job_list_add_pair (job_list *list, const char *arg)
+{
+  const char *eq = strrchr (arg, '=');
+  char *input;
+
+  if (!eq || eq == arg || !eq[1])
+    return 0;
+  input = (char *) xmalloc (eq - arg + 1);
+  memcpy (input, arg, eq - arg);
+  input[eq - arg] = 0;
+  job_list_add (list, input, eq + 1);
+  free (input);
+  return 1;
+}
+
+/* Return the next whitespace separated word at *P, NUL terminating it
+   in place and leaving *P after it, or NULL at the end of the line.  */
+
+static char *
+next_word (char **p)
+{
+  char *s = *p;
+  char *word;
+
+  while (*s == ' ' || *s == '\t' || *s == '\r')
+    s++;
+  if (!*s)
+    {
+      *p = s;
+      return NULL;
+    }
+  word = s;
+  while (*s && *s != ' ' && *s != '\t' && *s != '\r')
+    s++;
+  if (*s)
+    *s++ = 0;
+  *p = s;
+  return word;
+}
+
+int
+job_list_read_manifest (job_list *list, const char *name,
+			const char *program_name, FILE *err)
+{
+  FILE *f = fopen (name, "r");
+  char *text = NULL;
+  size_t len = 0;
+  size_t alloc = 0;
+  size_t n;
+  char *line;
+  int lineno = 0;
+  int ok = 1;
+
+  if (!f)
+    {
+      fprintf (err, _("%s: Can't open manifest file `%s'.\n"),
+	       program_name, name);
+      return 0;
+    }
+  do
+    {
+      if (alloc - len < 4096)
+	{
+	  alloc = alloc ? alloc * 2 : 8192;
+	  text = (char *) xrealloc (text, alloc);
+	}
+      n = fread (text + len, 1, alloc - len - 1, f);
+      len += n;
+    }
+  while (n > 0);
+  fclose (f);
+  text[len] = 0;
+
+  for (line = text; ok && line < text + len; )
+    {
+      char *end = strchr (line, '\n');
+      char *p = line;
+      char *input;
+      char *output;
+
+      if (end)
+	*end = 0;
+      else
+	end = text + len;
+      lineno++;
+
+      input = next_word (&p);
+      if (input && *input != '#')
+	{
+	  output = next_word (&p);
+	  if (!output || next_word (&p))
+	    {
+	      fprintf (err, _("%s:%d: expected an input and an output file.\n"),
+		       name, lineno);
+	      ok = 0;
+	    }
+	  else
+	    job_list_add (list, input, output);
+	}
+      line = end + 1;
+    }
+
+  free (text);
+  return ok;
+}
+
+/* The state shared by the workers of one jobs_run.  The lock covers
+   NEXT, REPORTED, STATUS and the done flags of the jobs.  */
+
+typedef struct job_pool {
+  const jobs_setup *setup;
+  job_list *list;
+  masp_shared *shared;
+  int next;			/* Next job to start.  */
+  int reported;			/* Jobs whose diagnostics are out.  */
+  int status;
+#ifdef HAVE_PTHREAD
+  pthread_mutex_t lock;
+#endif
+} job_pool;
+
+static void
+pool_lock (job_pool *pool)
+{
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock (&pool->lock);
+#endif
+}
+
+static void
+pool_unlock (job_pool *pool)
+{
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock (&pool->lock);
+#endif
+}
+
+/* Write the dependencies of JOB, which CTX has just run, to its output
+   file name with a .d suffix.  */
+
+static void
+write_job_deps (const jobs_setup *setup, masp_context *ctx, masp_job *job,
+		FILE *errfile)
+{
+  const char *const *files;
+  const char *target = job->output;
+  char *name = deps_name (job->output, ".d");
+  char *path = resolve_path (setup->directory, name);
+  FILE *file;
+  int nfiles;
+  int ok;
+
+  files = masp_files_read (ctx, &nfiles);
+  file = fopen (path, "w");
+  ok = file && deps_write (file, &target, 1, files, nfiles);
+  if (file && fclose (file) != 0)
+    ok = 0;
+  if (!ok)
+    {
+      fprintf (errfile, _("%s: Can't write dependency file `%s'.\n"),
+	       setup->program_name, name);
+      job->status = 1;
+    }
+  free (path);
+  free (name);
+}
+
+/* Run one job, collecting its diagnostics in JOB->diag.  */
+
+static void
+run_job (job_pool *pool, masp_job *job)
+{
+  const jobs_setup *setup = pool->setup;
+  masp_context *ctx;
+  mem_stream diag;
+  FILE *errfile = setup->errfile;
+  FILE *outfile;
+  char *output;
+  int i;
+
+  if (mem_stream_open (&diag))
+    errfile = diag.file;
+
+  ctx = masp_new_shared (setup->options, pool->shared);
+  masp_set_diagnostics (ctx, errfile);
+  masp_set_directory (ctx, setup->directory);
+  if (setup->snapshot)
+    masp_use_snapshot (ctx, setup->snapshot);
+  for (i = 0; i < setup->nincludes; i++)
+    masp_add_include_path (ctx, setup->includes[i]);
+  for (i = 0; i < setup->ndefines; i++)
+    masp_define (ctx, setup->defines[i]);
+  for (i = 0; i < job->ndefines; i++)
+    masp_define (ctx, job->defines[i]);
+
+  output = resolve_path (setup->directory, job->output);
+  outfile = fopen (output, "w");
+  free (output);
+  if (!outfile)
+    {
+      fprintf (errfile, _("%s: Can't open output file `%s'.\n"),
+	       setup->program_name, job->output);
+      job->status = 1;
+    }
+  else
+    {
+      masp_set_output (ctx, outfile);
+      if (!masp_process_file (ctx, job->input))
+	{
+	  fprintf (errfile, _("%s: Can't open input file `%s'.\n"),
+		   setup->program_name, job->input);
+	  job->status = 1;
+	}
+      if (masp_finish (ctx))
+	job->status = 1;
+      if (fclose (outfile) != 0)
+	{
+	  fprintf (errfile, "Error closing output file\n");
+	  job->status = 1;
+	}
+      if (job->status == 0 && setup->deps)
+	write_job_deps (setup, ctx, job, errfile);
+    }
+  masp_free (ctx);
+
+  if (errfile != setup->errfile)
+    mem_stream_close (&diag, &job->diag, &job->diag_len);
+}
+
+/* Write out the diagnostics of each finished job which has no
+   unfinished job before it.  Called with the lock held.  */
+
+static void
+report_finished (job_pool *pool)
+{
+  job_list *list = pool->list;
+
+  while (pool->reported < list->count && list->jobs[pool->reported].done)
+    {
+      masp_job *job = &list->jobs[pool->reported++];
+
+      if (job->diag_len)
+	{
+	  fwrite (job->diag, 1, job->diag_len, pool->setup->errfile);
+	  fflush (pool->setup->errfile);
+	}
+      free (job->diag);
+      job->diag = NULL;
+      job->diag_len = 0;
+      if (job->status)
+	pool->status = 1;
+    }
+}
+
+static void *
+worker (void *arg)
+{
+  job_pool *pool = (job_pool *) arg;
+
+  for (;;)
+    {
+      masp_job *job;
+
+      pool_lock (pool);
+      if (pool->next == pool->list->count)
+	{
+	  pool_unlock (pool);
+	  break;
+	}
+      job = &pool->list->jobs[pool->next++];
+      pool_unlock (pool);
+
+      run_job (pool, job);
+
+      pool_lock (pool);
+      job->done = 1;
+      report_finished (pool);
+      pool_unlock (pool);
+    }
+  return NULL;
+}
+
+int
+jobs_run (const jobs_setup *setup, job_list *list, int nthreads)
+{
+  job_pool pool;
+
+  pool.setup = setup;
+  pool.list = list;
+  pool.shared = setup->shared ? setup->shared : masp_shared_new ();
+  pool.next = 0;
+  pool.reported = 0;
+  pool.status = 0;
+
+  if (nthreads > list->count)
+    nthreads = list->count;
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_init (&pool.lock, NULL);
+  {
+    pthread_t *threads = NULL;
+    pthread_attr_t attr;
+    int started = 0;
+
+    /* This thread is a worker too, so start one fewer.  Should a
+       thread fail to start, those that did just take more jobs.  */
+    if (nthreads > 1)
+      {
+	threads = (pthread_t *) xmalloc ((nthreads - 1) * sizeof (pthread_t));
+	pthread_attr_init (&attr);
+	pthread_attr_setstacksize (&attr, JOB_STACK_SIZE);
+	while (started < nthreads - 1
+	       && pthread_create (&threads[started], &attr, worker, &pool) == 0)
+	  started++;
+	pthread_attr_destroy (&attr);
+      }
+    worker (&pool);
+    while (started > 0)
+      pthread_join (threads[--started], NULL);
+    free (threads);
+  }
+  pthread_mutex_destroy (&pool.lock);
+#else
+  worker (&pool);
+#endif
+
+  if (pool.shared != setup->shared)
+    masp_shared_free (pool.shared);
+  return pool.status;
+}
@@ -0,0 +1,98 @@
+/* jobs.h - preprocess a batch of files side by side.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#ifndef JOBS_H
+
+#define JOBS_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "masp.h"
+
+/* The stack given to each worker thread.  Macro expansion recurses,
+   so give the workers as much as the main thread usually has rather
+   than the smaller default some systems use for threads.  */
+#define JOB_STACK_SIZE (8 * 1024 * 1024)
+
+/* One input file to be preprocessed into one output file.  */
+
+typedef struct masp_job {
+  char *input;
+  char *output;
+  char **defines;		/* -D values of its own, after the setup's.  */
+  int ndefines;
+  int status;			/* Exit status of the job.  */
+  int done;			/* Finished, though perhaps not reported.  */
+  char *diag;			/* Its diagnostics, until reported.  */
+  size_t diag_len;
+} masp_job;
+
+typedef struct job_list {
+  masp_job *jobs;
+  int count;
+  int alloc;
+} job_list;
+
+/* What every job of a batch has in common: the options, -I and -D
+   from the command line, and where relative names are and messages
+   go.  */
+
+typedef struct jobs_setup {
+  const masp_options *options;
+  char **includes;
+  int nincludes;
+  char **defines;
+  int ndefines;
+  const char *program_name;	/* For messages.  */
+  const char *directory;	/* Relative names are in here, or NULL.  */
+  FILE *errfile;		/* Where the diagnostics go.  */
+  masp_shared *shared;		/* Include cache, or NULL for a new one.  */
+  const masp_snapshot *snapshot; /* What to start each job from, or NULL.  */
+  int deps;			/* Write OUTPUT.d for each job (-MD).  */
+} jobs_setup;
+
+extern void job_list_init (job_list *);
+extern void job_list_free (job_list *);
+extern masp_job *job_list_add (job_list *, const char *input,
+			       const char *output);
+
+/* Give JOB the -D value DEFINE, on top of those every job has.  */
+extern void job_define (masp_job *job, const char *define);
+
+/* Add the job named by an INPUT=OUTPUT argument.  Returns 0 if ARG
+   has no `='.  */
+extern int job_list_add_pair (job_list *, const char *arg);
+
+/* Add the jobs listed in the manifest file NAME, one "INPUT OUTPUT"
+   pair to a line.  Blank lines and lines starting with `#' are
+   skipped.  Returns 0, after saying why on ERR, if the file can't be
+   read or a line is not a pair.  */
+extern int job_list_read_manifest (job_list *, const char *name,
+				   const char *program_name, FILE *err);
+
+/* Run every job in LIST, NTHREADS at a time, each in a context of its
+   own.  The contexts share the keyword tables and one include file
+   cache.  Diagnostics are held back and written out in the order of
+   the list, so they read the same however the jobs were
+   scheduled.  Returns 1 if any job failed, otherwise 0.  */
+extern int jobs_run (const jobs_setup *, job_list *, int nthreads);
+
+#endif
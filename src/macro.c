@@ -62,32 +62,31 @@ extern void *alloca ();
 #include "sb.h"
 #include "hash.h"
 #include "macro.h"
+#include "context.h"
 
 #include "asintl.h"
 
-extern char prefix_char; // Derictive marker
-extern int masp_syntax; // Are we using MASP or GASP syntax?
 
 /* The routines in this file handle macro definition and expansion.
    They are called by both gasp and gas.  */
 
 /* Internal functions.  */
 
-static int get_token(int, sb *, sb *);
-static int getstring(int, sb *, sb *);
-static int get_any_string(int, sb *, sb *, int, int);
-static int do_formals(macro_entry *, int, sb *);
-static int get_apost_token(int, sb *, sb *, int);
-static int sub_actual(int, sb *, sb *, struct hash_control *, int, sb *, int);
-static const char *macro_expand_body(sb *, sb *, formal_entry *, struct hash_control *, int, int);
-static const char *macro_expand(int, sb *, macro_entry *, sb *, int);
+static int get_token(masp_context *, int, sb *, sb *);
+static int getstring(masp_context *, int, sb *, sb *);
+static int get_any_string(masp_context *, int, sb *, sb *, int, int);
+static int do_formals(masp_context *, macro_entry *, int, sb *);
+static int get_apost_token(masp_context *, int, sb *, sb *, int);
+static int sub_actual(masp_context *, int, sb *, sb *, struct hash_control *, int, sb *, int);
+static const char *macro_expand_body(masp_context *, sb *, sb *, formal_entry *, struct hash_control *, int, int);
+static const char *macro_expand(masp_context *, int, sb *, macro_entry *, sb *, int);
 
 #define ISWHITE(x) ((x) == ' ' || (x) == '\t')
 
 #define ISSEP(x) \
  ((x) == ' ' || (x) == '\t' || (x) == ',' || (x) == '"' || (x) == ';' \
   || (x) == ')' || (x) == '(' \
-  || ((macro_alternate || macro_mri) && ((x) == '<' || (x) == '>')))
+  || ((ctx->macro_alternate || ctx->macro_mri) && ((x) == '<' || (x) == '>')))
 /**//*...'a'...*/
 #define ISBASE(x) \
   ((x) == 'b' || (x) == 'B' \
@@ -96,54 +95,32 @@ static const char *macro_expand(int, sb *, macro_entry *, sb *, int);
    || (x) == 'h' || (x) == 'H' \
    || (x) == 'd' || (x) == 'D')
 
-/* The macro hash table.  */
-
-static struct hash_control *macro_hash;
-
-/* Whether any macros have been defined.  */
-
-int macro_defined;
-
-/* Whether we are in GASP alternate mode.  */
-
-static int macro_alternate;
-
-/* Whether we are in MRI mode.  */
-
-static int macro_mri;
-
-/* Whether we should strip '@' characters.  */
-
-static int macro_strip_at;
-
-/* Function to use to parse an expression.  */
-
-static int (*macro_expr)(const char *, int, const sb *, int *);
-
-/* Number of macro expansions that have been done.  */
-
-static int macro_number;
+/* The macro state (the macro hash table, the modes and the count of
+   expansions) is kept in the masp_context; see context.h.  */
 
 /* Initialize macro processing.  */
 
 void
-macro_init (int alternate, int mri, int strip_at, int (*expr)(const char *, int, const sb *, int *))
+macro_init (masp_context *ctx, int alternate, int mri, int strip_at, int (*expr)(masp_context *, const char *, int, const sb *, long long *))
 {
-  macro_hash = hash_new ();
-  macro_defined = 0;
-  macro_alternate = alternate;
-  macro_mri = mri;
-  macro_strip_at = strip_at;
-  macro_expr = expr;
+  /* Starting again (as .ALTERNATE does) forgets the old macros.  */
+  macro_cleanup (ctx);
+  ctx->macro_hash = hash_new ();
+  ctx->macro_defined = 0;
+  ctx->macro_alternate = alternate;
+  ctx->macro_mri = mri;
+  ctx->macro_strip_at = strip_at;
+  ctx->macro_expr = expr;
 }
 
 /* Switch in and out of MRI mode on the fly.  */
 
 void
-macro_mri_mode (mri)
+macro_mri_mode (ctx, mri)
+     masp_context *ctx;
      int mri;
 {
-  macro_mri = mri;
+  ctx->macro_mri = mri;
 }
 
 /* Read input lines till we get to a TO string.
@@ -153,25 +130,26 @@ macro_mri_mode (mri)
    Return 1 on success, 0 on unexpected EOF.  */
 
 int
-buffer_and_nest (from, to, ptr, get_line)
+buffer_and_nest (ctx, from, to, ptr, get_line)
+     masp_context *ctx;
      const char *from;
      const char *to;
      sb *ptr;
-     int (*get_line) (sb *);
+     int (*get_line) (masp_context *, sb *);
 {
   int from_len = strlen (from);
   int to_len = strlen (to);
   int depth = 1;
   int line_start = ptr->len;
 
-  int more = get_line (ptr);
+  int more = get_line (ctx, ptr);
 
   while (more)
     {
       /* Try and find the first pseudo op on the line.  */
       int i = line_start;
 
-      if (! macro_alternate && ! macro_mri)
+      if (! ctx->macro_alternate && ! ctx->macro_mri)
 	{
 	  /* With normal syntax we can suck what we want till we get
 	     to the dot.  With the alternate, labels have to start in
@@ -199,11 +177,11 @@ buffer_and_nest (from, to, ptr, get_line)
       while (i < ptr->len && ISWHITE (ptr->ptr[i]))
 	i++;
 
-      if (i < ptr->len && (ptr->ptr[i] == prefix_char
-			   || macro_alternate
-			   || macro_mri))
+      if (i < ptr->len && (ptr->ptr[i] == ctx->prefix_char
+			   || ctx->macro_alternate
+			   || ctx->macro_mri))
 	{
-	  if (ptr->ptr[i] == prefix_char )
+	  if (ptr->ptr[i] == ctx->prefix_char )
 	    i++;
 	  if (strncasecmp (ptr->ptr + i, from, from_len) == 0
 	      && (ptr->len == (i + from_len)
@@ -226,7 +204,7 @@ buffer_and_nest (from, to, ptr, get_line)
       /* Add a CR to the end and keep running.  */
       sb_add_char (ptr, '\n');
       line_start = ptr->len;
-      more = get_line (ptr);
+      more = get_line (ctx, ptr);
     }
 
   /* Return 1 on success, 0 on unexpected EOF.  */
@@ -236,7 +214,8 @@ buffer_and_nest (from, to, ptr, get_line)
 /* Pick up a token.  */
 
 static int
-get_token (idx, in, name)
+get_token (ctx, idx, in, name)
+     masp_context *ctx;
      int idx;
      sb *in;
      sb *name;
@@ -246,17 +225,16 @@ get_token (idx, in, name)
 	  || in->ptr[idx] == '_'
 	  || in->ptr[idx] == '$'))
     {
-      sb_add_char (name, in->ptr[idx++]);
+      int start = idx++;
       while (idx < in->len
 	     && (ISALNUM (in->ptr[idx])
 		 || in->ptr[idx] == '_'
 		 || in->ptr[idx] == '$'))
-	{
-	  sb_add_char (name, in->ptr[idx++]);
-	}
+	idx++;
+      sb_add_buffer (name, in->ptr + start, idx - start);
     }
   /* Ignore trailing &.  */
-  if (macro_alternate && idx < in->len && in->ptr[idx] == '&')
+  if (ctx->macro_alternate && idx < in->len && in->ptr[idx] == '&')
     idx++;
   return idx;
 }
@@ -264,7 +242,8 @@ get_token (idx, in, name)
 /* Pick up a string.  */
 
 static int
-getstring (idx, in, acc)
+getstring (ctx, idx, in, acc)
+     masp_context *ctx;
      int idx;
      sb *in;
      sb *acc;
@@ -273,8 +252,8 @@ getstring (idx, in, acc)
 
   while (idx < in->len
 	 && (in->ptr[idx] == '"'
-	     || (in->ptr[idx] == '<' && (macro_alternate || macro_mri))
-	     || (in->ptr[idx] == '\'' && macro_alternate)))
+	     || (in->ptr[idx] == '<' && (ctx->macro_alternate || ctx->macro_mri))
+	     || (in->ptr[idx] == '\'' && ctx->macro_alternate)))
     {
       if (in->ptr[idx] == '<')
 	{
@@ -313,7 +292,7 @@ getstring (idx, in, acc)
 	      else
 		escaped = 0;
 
-	      if (macro_alternate && in->ptr[idx] == '!')
+	      if (ctx->macro_alternate && in->ptr[idx] == '!')
 		{
 		  idx ++;
 
@@ -348,9 +327,8 @@ getstring (idx, in, acc)
 
 // Gets a string, ignoring whitespace, until comma ',' is found.
 
-static int get_until_comma( int idx, sb *in, sb *out )
+static int get_until_comma( masp_context *ctx, int idx, sb *in, sb *out )
 {
-	extern char comment_char;
   int ws;
   sb_reset (out);
   idx = sb_skip_white (idx, in);
@@ -366,7 +344,7 @@ static int get_until_comma( int idx, sb *in, sb *out )
 	}
       else
 	{
-	  if ( in->ptr[ idx ] == comment_char )
+	  if ( in->ptr[ idx ] == ctx->comment_char )
 	    break;
 	  if ( in->ptr[ idx ] == ',' )
 	    break;
@@ -411,7 +389,8 @@ static int get_until_comma( int idx, sb *in, sb *out )
 */
 
 static int
-get_any_string (idx, in, out, expand, pretend_quoted)
+get_any_string (ctx, idx, in, out, expand, pretend_quoted)
+     masp_context *ctx;
      int idx;
      sb *in;
      sb *out;
@@ -429,37 +408,38 @@ get_any_string (idx, in, out, expand, pretend_quoted)
 	    sb_add_char (out, in->ptr[idx++]);
 	}
       else if (in->ptr[idx] == '%'
-	       && macro_alternate
+	       && ctx->macro_alternate
 	       && expand)
 	{
-	  int val;
-	  char buf[20];
+	  long long val;
+	  char buf[30];
 	  /* Turns the next expression into a string.  */
 	  /* xgettext: no-c-format */
-	  idx = (*macro_expr) (_("% operator needs absolute expression"),
-			       idx + 1,
-			       in,
-			       &val);
-	  snprintf (buf, sizeof buf, "%d", val);
+	  idx = (*ctx->macro_expr) (ctx,
+				    _("% operator needs absolute expression"),
+				    idx + 1,
+				    in,
+				    &val);
+	  snprintf (buf, sizeof buf, "%lld", val);
 	  sb_add_string (out, buf);
 	}
       else if (in->ptr[idx] == '"'
-	       || (in->ptr[idx] == '<' && (macro_alternate || macro_mri))
-	       || (macro_alternate && in->ptr[idx] == '\''))
+	       || (in->ptr[idx] == '<' && (ctx->macro_alternate || ctx->macro_mri))
+	       || (ctx->macro_alternate && in->ptr[idx] == '\''))
 	{
-	  if (macro_alternate
-	      && ! macro_strip_at
+	  if (ctx->macro_alternate
+	      && ! ctx->macro_strip_at
 	      && expand)
 	    {
 	      /* Keep the quotes.  */
 	      sb_add_char (out, '\"');
 
-	      idx = getstring (idx, in, out);
+	      idx = getstring (ctx, idx, in, out);
 	      sb_add_char (out, '\"');
 	    }
 	  else
 	    {
-	      idx = getstring (idx, in, out);
+	      idx = getstring (ctx, idx, in, out);
 	    }
 	}
       else
@@ -472,7 +452,7 @@ get_any_string (idx, in, out, expand, pretend_quoted)
 			 && in->ptr[idx] != '\t'
 			 && in->ptr[idx] != ','
 			 && (in->ptr[idx] != '<'
-			     || (! macro_alternate && ! macro_mri)))))
+			     || (! ctx->macro_alternate && ! ctx->macro_mri)))))
 	    {
 	      if (in->ptr[idx] == '"'
 		  || in->ptr[idx] == '\'')
@@ -496,7 +476,8 @@ get_any_string (idx, in, out, expand, pretend_quoted)
 /* Pick up the formal parameters of a macro definition.  */
 
 static int
-do_formals2 (macro, idx, in)
+do_formals2 (ctx, macro, idx, in)
+     masp_context *ctx;
      macro_entry *macro;
      int idx;
      sb *in;
@@ -509,14 +490,15 @@ do_formals2 (macro, idx, in)
     {
       formal_entry *formal;
 
-      formal = (formal_entry *) xmalloc (sizeof (formal_entry));
+      formal = (formal_entry *) xmalloc_kind (MEM_MACRO,
+					      sizeof (formal_entry));
 
       sb_new (&formal->name);
       sb_new (&formal->def);
       sb_new (&formal->actual);
 
       idx = sb_skip_white (idx, in);
-      idx = get_token (idx, in, &formal->name);
+      idx = get_token (ctx, idx, in, &formal->name);
       if (formal->name.len == 0)
 	break;
       idx = sb_skip_white (idx, in);
@@ -527,7 +509,7 @@ do_formals2 (macro, idx, in)
 	    {
 	      /* Got a default.  */
 	      //idx = get_any_string (idx + 1, in, &formal->def, 1, 0);
-	      idx = get_until_comma( idx + 1, in, &formal->def );
+	      idx = get_until_comma( ctx, idx + 1, in, &formal->def );
 	    }
 	}
       idx = sb_skip_white( idx, in );
@@ -550,7 +532,8 @@ do_formals2 (macro, idx, in)
 
 
 static int
-do_formals (macro, idx, in)
+do_formals (ctx, macro, idx, in)
+     masp_context *ctx;
      macro_entry *macro;
      int idx;
      sb *in;
@@ -563,14 +546,15 @@ do_formals (macro, idx, in)
     {
       formal_entry *formal;
 
-      formal = (formal_entry *) xmalloc (sizeof (formal_entry));
+      formal = (formal_entry *) xmalloc_kind (MEM_MACRO,
+					      sizeof (formal_entry));
 
       sb_new (&formal->name);
       sb_new (&formal->def);
       sb_new (&formal->actual);
 
       idx = sb_skip_white (idx, in);
-      idx = get_token (idx, in, &formal->name);
+      idx = get_token (ctx, idx, in, &formal->name);
       if (formal->name.len == 0)
 	break;
       idx = sb_skip_white (idx, in);
@@ -580,7 +564,7 @@ do_formals (macro, idx, in)
 	  if (idx < in->len && in->ptr[idx] == '=')
 	    {
 	      /* Got a default.  */
-	      idx = get_any_string (idx + 1, in, &formal->def, 1, 0);
+	      idx = get_any_string (ctx, idx + 1, in, &formal->def, 1, 0);
 	    }
 	}
 
@@ -595,14 +579,15 @@ do_formals (macro, idx, in)
       *p = NULL;
     }
 
-  if (macro_mri)
+  if (ctx->macro_mri)
     {
       formal_entry *formal;
       const char *name;
 
       /* Add a special NARG formal, which macro_expand will set to the
          number of arguments.  */
-      formal = (formal_entry *) xmalloc (sizeof (formal_entry));
+      formal = (formal_entry *) xmalloc_kind (MEM_MACRO,
+					      sizeof (formal_entry));
 
       sb_new (&formal->name);
       sb_new (&formal->def);
@@ -610,7 +595,7 @@ do_formals (macro, idx, in)
 
       /* The same MRI assemblers which treat '@' characters also use
          the name $NARG.  At least until we find an exception.  */
-      if (macro_strip_at)
+      if (ctx->macro_strip_at)
 	name = "$NARG";
       else
 	name = "NARG";
@@ -633,18 +618,19 @@ do_formals (macro, idx, in)
    the macro which was defined.  */
 
 const char *
-define_macro (idx, in, label, get_line, namep)
+define_macro (ctx, idx, in, label, get_line, namep)
+     masp_context *ctx;
      int idx;
      sb *in;
      sb *label;
-     int (*get_line) (sb *);
+     int (*get_line) (masp_context *, sb *);
      const char **namep;
 {
   macro_entry *macro;
   sb name;
   const char *namestr;
 
-  macro = (macro_entry *) xmalloc (sizeof (macro_entry));
+  macro = (macro_entry *) xmalloc_kind (MEM_MACRO, sizeof (macro_entry));
   sb_new (&macro->sub);
   sb_new (&name);
 
@@ -652,7 +638,7 @@ define_macro (idx, in, label, get_line, namep)
   macro->formals = 0;
 
   idx = sb_skip_white (idx, in);
-  if (! buffer_and_nest ("MACRO", "ENDM", &macro->sub, get_line))
+  if (! buffer_and_nest (ctx, "MACRO", "ENDM", &macro->sub, get_line))
     return _("unexpected end of file in macro definition");
   if (label != NULL && label->len != 0)
     {
@@ -660,27 +646,27 @@ define_macro (idx, in, label, get_line, namep)
       if (idx < in->len && in->ptr[idx] == '(')
 	{
 	  /* It's the label: MACRO (formals,...)  sort  */
-	  idx = do_formals (macro, idx + 1, in);
+	  idx = do_formals (ctx, macro, idx + 1, in);
 	  if (in->ptr[idx] != ')')
 	    return _("missing ) after formals");
 	}
       else
 	{
 	  /* It's the label: MACRO formals,...  sort  */
-	  if ( masp_syntax )
-	    idx = do_formals2 (macro, idx, in);
+	  if ( ctx->masp_syntax )
+	    idx = do_formals2 (ctx, macro, idx, in);
 	  else
-	    idx = do_formals (macro, idx, in);
+	    idx = do_formals (ctx, macro, idx, in);
 	}
     }
   else
     {
-      idx = get_token (idx, in, &name);
+      idx = get_token (ctx, idx, in, &name);
       idx = sb_skip_comma (idx, in);
-      if ( masp_syntax )
-	idx = do_formals2 (macro, idx, in);
+      if ( ctx->masp_syntax )
+	idx = do_formals2 (ctx, macro, idx, in);
       else
-	idx = do_formals( macro, idx, in );
+	idx = do_formals(ctx,  macro, idx, in );
     }
 
   /* And stick it in the macro hash table.  */
@@ -689,9 +675,9 @@ define_macro (idx, in, label, get_line, namep)
   /* Get the null-terminated string from the sb.  hash_jam will copy it
      to its obstack, so we can free the sb afterward.  */
   namestr = sb_terminate (&name);
-  hash_jam (macro_hash, namestr, (void *) macro);
+  hash_jam (ctx->macro_hash, namestr, (void *) macro);
 
-  macro_defined = 1;
+  ctx->macro_defined = 1;
 
   /* Return the name if requested.  Note: this returns a pointer to the
      sb's internal buffer which will become invalid after sb_kill.
@@ -707,13 +693,13 @@ define_macro (idx, in, label, get_line, namep)
 /* Scan a token, and then skip KIND.  */
 
 static int
-get_apost_token (int idx, sb *in, sb *name, int kind)
+get_apost_token (masp_context *ctx, int idx, sb *in, sb *name, int kind)
 {
-  idx = get_token (idx, in, name);
+  idx = get_token (ctx, idx, in, name);
   if (idx < in->len
       && in->ptr[idx] == kind
-      && (! macro_mri || macro_strip_at)
-      && (! macro_strip_at || kind == '@'))
+      && (! ctx->macro_mri || ctx->macro_strip_at)
+      && (! ctx->macro_strip_at || kind == '@'))
     idx++;
   return idx;
 }
@@ -721,15 +707,15 @@ get_apost_token (int idx, sb *in, sb *name, int kind)
 /* Substitute the actual value for a formal parameter.  */
 
 static int
-sub_actual (int start, sb *in, sb *t, struct hash_control *formal_hash, int kind, sb *out, int copyifnotthere)
+sub_actual (masp_context *ctx, int start, sb *in, sb *t, struct hash_control *formal_hash, int kind, sb *out, int copyifnotthere)
 {
   int src;
   formal_entry *ptr;
 
-  src = get_apost_token (start, in, t, kind);
+  src = get_apost_token (ctx, start, in, t, kind);
   /* See if it's in the macro's hash table, unless this is
      macro_strip_at and kind is '@' and the token did not end in '@'.  */
-  if (macro_strip_at
+  if (ctx->macro_strip_at
       && kind == '@'
       && (src == start || in->ptr[src - 1] != '@'))
     ptr = NULL;
@@ -766,24 +752,43 @@ sub_actual (int start, sb *in, sb *t, struct hash_control *formal_hash, int kind
 /* Expand the body of a macro.  */
 
 static const char *
-macro_expand_body (sb *in, sb *out, formal_entry *formals, struct hash_control *formal_hash, int comment_char, int locals)
+macro_expand_body (masp_context *ctx, sb *in, sb *out, formal_entry *formals, struct hash_control *formal_hash, int comment_char, int locals)
 {
   sb t;
   int src = 0;
   int inquote = 0;
   formal_entry *loclist = NULL;
+  char stops[8];
+  int nstops = 0;
 
   sb_new (&t);
 
+  /* The characters which can start something other than plain text.
+     Runs of anything else are copied through in one go.  In alternate
+     and MRI mode every name may be a formal, so no runs are taken.  */
+  stops[nstops++] = '&';
+  stops[nstops++] = '\\';
+  stops[nstops++] = '"';
+  if (comment_char != '\0')
+    stops[nstops++] = comment_char;
+  if (ctx->macro_strip_at)
+    stops[nstops++] = '@';
+  if (ctx->macro_mri)
+    {
+      stops[nstops++] = '\'';
+      stops[nstops++] = '=';
+    }
+  stops[nstops] = '\0';
+
   while (src < in->len)
     {
       if (in->ptr[src] == '&')
 	{
 	  sb_reset (&t);
-	  if (macro_mri)
+	  if (ctx->macro_mri)
 	    {
 	      if (src + 1 < in->len && in->ptr[src + 1] == '&')
-		src = sub_actual (src + 2, in, &t, formal_hash, '\'', out, 1);
+		src = sub_actual (ctx, src + 2, in, &t, formal_hash, '\'', out, 1);
 	      else
 		sb_add_char (out, in->ptr[src++]);
 	    }
@@ -794,7 +799,7 @@ macro_expand_body (sb *in, sb *out, formal_entry *formals, struct hash_control *
 		 behaviour); the '&' character itself does not survive into
 		 the output.  Keep until ps2gl shaders show a need to change
 		 it.  */
-	      src = sub_actual (src + 1, in, &t, formal_hash, '&', out, 0);
+	      src = sub_actual (ctx, src + 1, in, &t, formal_hash, '&', out, 0);
 	    }
 	}
       else if (in->ptr[src] == '\\')
@@ -810,11 +815,7 @@ macro_expand_body (sb *in, sb *out, formal_entry *formals, struct hash_control *
 	  else if (in->ptr[src] == '(')
 	    {
 	      /* Sub in till the next ')' literally.  */
-	      src++;
-	      while (src < in->len && in->ptr[src] != ')')
-		{
-		  sb_add_char (out, in->ptr[src++]);
-		}
+	      src = sb_add_until (out, src + 1, in, ')');
 	      if (in->ptr[src] == ')')
 		src++;
 	      else
@@ -826,7 +827,7 @@ macro_expand_body (sb *in, sb *out, formal_entry *formals, struct hash_control *
 
 	      char buffer[10];
 	      src++;
-	      snprintf (buffer, sizeof buffer, "%d", macro_number);
+	      snprintf (buffer, sizeof buffer, "%d", ctx->macro_number);
 	      sb_add_string (out, buffer);
 	    }
 	  else if (in->ptr[src] == '&')
@@ -837,7 +838,7 @@ macro_expand_body (sb *in, sb *out, formal_entry *formals, struct hash_control *
 	      sb_add_char (out, '&');
 	      src++;
 	    }
-	  else if (macro_mri && ISALNUM (in->ptr[src]))
+	  else if (ctx->macro_mri && ISALNUM (in->ptr[src]))
 	    {
 	      int ind;
 	      formal_entry *f;
@@ -864,15 +865,15 @@ macro_expand_body (sb *in, sb *out, formal_entry *formals, struct hash_control *
 	  else
 	    {
 	      sb_reset (&t);
-	      src = sub_actual (src, in, &t, formal_hash, '\'', out, 0);
+	      src = sub_actual (ctx, src, in, &t, formal_hash, '\'', out, 0);
 	    }
 	}
-      else if ((macro_alternate || macro_mri)
+      else if ((ctx->macro_alternate || ctx->macro_mri)
 	       && (ISALPHA (in->ptr[src])
 		   || in->ptr[src] == '_'
 		   || in->ptr[src] == '$')
 	       && (! inquote
-		   || ! macro_strip_at
+		   || ! ctx->macro_strip_at
 		   || (src > 0 && in->ptr[src - 1] == '@')))
 	{
 	  if (! locals
@@ -881,8 +882,8 @@ macro_expand_body (sb *in, sb *out, formal_entry *formals, struct hash_control *
 	      || ! ISWHITE (in->ptr[src + 5]))
 	    {
 	      sb_reset (&t);
-	      src = sub_actual (src, in, &t, formal_hash,
-				(macro_strip_at && inquote) ? '@' : '\'',
+	      src = sub_actual (ctx, src, in, &t, formal_hash,
+				(ctx->macro_strip_at && inquote) ? '@' : '\'',
 				out, 1);
 	    }
 	  else
@@ -892,11 +893,11 @@ macro_expand_body (sb *in, sb *out, formal_entry *formals, struct hash_control *
 	      src = sb_skip_white (src + 5, in);
 	      while (in->ptr[src] != '\n' && in->ptr[src] != comment_char)
 		{
-		  static int loccnt;
 		  char buf[20];
 		  const char *err;
 
-		  f = (formal_entry *) xmalloc (sizeof (formal_entry));
+		  f = (formal_entry *) xmalloc_kind (MEM_MACRO,
+						     sizeof (formal_entry));
 		  sb_new (&f->name);
 		  sb_new (&f->def);
 		  sb_new (&f->actual);
@@ -904,9 +905,9 @@ macro_expand_body (sb *in, sb *out, formal_entry *formals, struct hash_control *
 		  f->next = loclist;
 		  loclist = f;
 
-		  src = get_token (src, in, &f->name);
-		  ++loccnt;
-		  snprintf (buf, sizeof buf, "LL%04x", loccnt);
+		  src = get_token (ctx, src, in, &f->name);
+		  ++ctx->macro_loccnt;
+		  snprintf (buf, sizeof buf, "LL%04x", ctx->macro_loccnt);
 		  sb_add_string (&f->actual, buf);
 
 		  err = hash_jam (formal_hash, sb_terminate (&f->name), f);
@@ -929,12 +930,12 @@ macro_expand_body (sb *in, sb *out, formal_entry *formals, struct hash_control *
 	    src++;
 	}
       else if (in->ptr[src] == '"'
-	       || (macro_mri && in->ptr[src] == '\''))
+	       || (ctx->macro_mri && in->ptr[src] == '\''))
 	{
 	  inquote = !inquote;
 	  sb_add_char (out, in->ptr[src++]);
 	}
-      else if (in->ptr[src] == '@' && macro_strip_at)
+      else if (in->ptr[src] == '@' && ctx->macro_strip_at)
 	{
 	  ++src;
 	  if (src < in->len
@@ -944,7 +945,7 @@ macro_expand_body (sb *in, sb *out, formal_entry *formals, struct hash_control *
 	      ++src;
 	    }
 	}
-      else if (macro_mri
+      else if (ctx->macro_mri
 	       && in->ptr[src] == '='
 	       && src + 1 < in->len
 	       && in->ptr[src + 1] == '=')
@@ -952,7 +953,7 @@ macro_expand_body (sb *in, sb *out, formal_entry *formals, struct hash_control *
 	  formal_entry *ptr;
 
 	  sb_reset (&t);
-	  src = get_token (src + 2, in, &t);
+	  src = get_token (ctx, src + 2, in, &t);
 	  ptr = (formal_entry *) hash_find (formal_hash, sb_terminate (&t));
 	  if (ptr == NULL)
 	    {
@@ -980,7 +981,9 @@ macro_expand_body (sb *in, sb *out, formal_entry *formals, struct hash_control *
 	}
       else
 	{
-	  sb_add_char (out, in->ptr[src++]);
+	  sb_add_char_fast (out, in->ptr[src++]);
+	  if (! ctx->macro_alternate && ! ctx->macro_mri)
+	    src = sb_add_until_any (out, src, in, stops);
 	}
     }
 
@@ -997,7 +1000,7 @@ macro_expand_body (sb *in, sb *out, formal_entry *formals, struct hash_control *
       sb_kill (&loclist->name);
       sb_kill (&loclist->def);
       sb_kill (&loclist->actual);
-      free (loclist);
+      xfree_kind (MEM_MACRO, loclist, sizeof (formal_entry));
       loclist = f;
     }
 
@@ -1008,7 +1011,7 @@ macro_expand_body (sb *in, sb *out, formal_entry *formals, struct hash_control *
    body.  */
 
 static const char *
-macro_expand (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
+macro_expand (masp_context *ctx, int idx, sb *in, macro_entry *m, sb *out, int comment_char)
 {
   sb t;
   formal_entry *ptr;
@@ -1027,7 +1030,7 @@ macro_expand (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
   while (f != NULL && f->index < 0)
     f = f->next;
 
-  if (macro_mri)
+  if (ctx->macro_mri)
     {
       /* The macro may be called with an optional qualifier, which may
          be referred to in the macro body as \0.  */
@@ -1042,7 +1045,8 @@ macro_expand (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
 	    {
 	      formal_entry *n;
 
-	      n = (formal_entry *) xmalloc (sizeof (formal_entry));
+	      n = (formal_entry *) xmalloc_kind (MEM_MACRO,
+						 sizeof (formal_entry));
 	      sb_new (&n->name);
 	      sb_new (&n->def);
 	      sb_new (&n->actual);
@@ -1051,7 +1055,7 @@ macro_expand (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
 	      n->next = m->formals;
 	      m->formals = n;
 
-	      idx = get_any_string (idx, in, &n->actual, 1, 0);
+	      idx = get_any_string (ctx, idx, in, &n->actual, 1, 0);
 	    }
 	}
     } // if ( macro_mri )
@@ -1066,10 +1070,10 @@ macro_expand (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
       scan = idx;
       while (scan < in->len
 	     && !ISSEP (in->ptr[scan])
-	     && !(macro_mri && in->ptr[scan] == '\'')
-	     && (!macro_alternate && in->ptr[scan] != '='))
+	     && !(ctx->macro_mri && in->ptr[scan] == '\'')
+	     && (!ctx->macro_alternate && in->ptr[scan] != '='))
 	scan++;
-      if (scan < in->len && !macro_alternate && in->ptr[scan] == '=')
+      if (scan < in->len && !ctx->macro_alternate && in->ptr[scan] == '=')
 	{
 	  is_keyword = 1;
 
@@ -1078,7 +1082,7 @@ macro_expand (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
 	  /* This is a keyword arg, fetch the formal name and
 	     then the actual stuff.  */
 	  sb_reset (&t);
-	  idx = get_token (idx, in, &t);
+	  idx = get_token (ctx, idx, in, &t);
 	  if (in->ptr[idx] != '=')
 	    return _("confusion in formal parameters");
 
@@ -1090,7 +1094,7 @@ macro_expand (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
 	    {
 	      /* Insert this value into the right place.  */
 	      sb_reset (&ptr->actual);
-	      idx = get_any_string (idx + 1, in, &ptr->actual, 0, 0);
+	      idx = get_any_string (ctx, idx + 1, in, &ptr->actual, 0, 0);
 	      if (ptr->actual.len > 0)
 		++narg;
 	    }
@@ -1107,10 +1111,11 @@ macro_expand (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
 	      formal_entry **pf;
 	      int c;
 
-	      if (!macro_mri)
+	      if (!ctx->macro_mri)
 		return _("too many positional arguments");
 
-	      f = (formal_entry *) xmalloc (sizeof (formal_entry));
+	      f = (formal_entry *) xmalloc_kind (MEM_MACRO,
+						 sizeof (formal_entry));
 	      sb_new (&f->name);
 	      sb_new (&f->def);
 	      sb_new (&f->actual);
@@ -1127,7 +1132,7 @@ macro_expand (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
 	    }
 
 	  sb_reset (&f->actual);
-	  idx = get_any_string (idx, in, &f->actual, 1, 0);
+	  idx = get_any_string (ctx, idx, in, &f->actual, 1, 0);
 	  if (f->actual.len > 0)
 	    ++narg;
 	  do
@@ -1137,7 +1142,7 @@ macro_expand (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
 	  while (f != NULL && f->index < 0);
 	}
 
-      if (! macro_mri)
+      if (! ctx->macro_mri)
 	idx = sb_skip_comma (idx, in);
       else
 	{
@@ -1148,25 +1153,25 @@ macro_expand (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
 	}
     }
 
-  if (macro_mri)
+  if (ctx->macro_mri)
     {
       char buffer[20];
 
       sb_reset (&t);
-      sb_add_string (&t, macro_strip_at ? "$NARG" : "NARG");
+      sb_add_string (&t, ctx->macro_strip_at ? "$NARG" : "NARG");
       ptr = (formal_entry *) hash_find (m->formal_hash, sb_terminate (&t));
       sb_reset (&ptr->actual);
       snprintf (buffer, sizeof buffer, "%d", narg);
       sb_add_string (&ptr->actual, buffer);
     }
 
-  err = macro_expand_body (&m->sub, out, m->formals, m->formal_hash,
+  err = macro_expand_body (ctx, &m->sub, out, m->formals, m->formal_hash,
 			   comment_char, 1);
   if (err != NULL)
     return err;
 
   /* Discard any unnamed formal arguments.  */
-  if (macro_mri)
+  if (ctx->macro_mri)
     {
       formal_entry **pf;
 
@@ -1181,21 +1186,21 @@ macro_expand (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
 	      sb_kill (&(*pf)->def);
 	      sb_kill (&(*pf)->actual);
 	      f = (*pf)->next;
-	      free (*pf);
+	      xfree_kind (MEM_MACRO, *pf, sizeof (formal_entry));
 	      *pf = f;
 	    }
 	}
     }
 
   sb_kill (&t);
-  macro_number++;
+  ctx->macro_number++;
 
   return NULL;
 }
 
 
 static const char *
-macro_expand2 (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
+macro_expand2 (masp_context *ctx, int idx, sb *in, macro_entry *m, sb *out, int comment_char)
 {
   sb t;
   formal_entry *ptr;
@@ -1224,12 +1229,12 @@ macro_expand2 (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
       scan = idx;
       while (scan < in->len
 	     && !ISSEP (in->ptr[scan])
-	     && !(macro_mri && in->ptr[scan] == '\'')
-	     && (!macro_alternate && in->ptr[scan] != '=')
+	     && !(ctx->macro_mri && in->ptr[scan] == '\'')
+	     && (!ctx->macro_alternate && in->ptr[scan] != '=')
 	     && (in->ptr[scan] != comment_char))
 	scan++;
 
-      if (scan < in->len && !macro_alternate && in->ptr[scan] == '=')
+      if (scan < in->len && !ctx->macro_alternate && in->ptr[scan] == '=')
 	{
 	  is_keyword = 1;
 
@@ -1239,7 +1244,7 @@ macro_expand2 (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
 	  /* This is a keyword arg, fetch the formal name and
 	     then the actual stuff.  */
 	  sb_reset (&t);
-	  idx = get_token (idx, in, &t);
+	  idx = get_token (ctx, idx, in, &t);
 	  if (in->ptr[idx] != '=')
 	    return _("confusion in formal parameters");
 
@@ -1253,7 +1258,7 @@ macro_expand2 (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
 	      sb_reset (&ptr->actual);
 	      //idx = get_any_string (idx + 1, in, &ptr->actual, 0, 0);
 	      //printf( "before get_until_comma" );
-	      idx = get_until_comma (idx + 1, in, &ptr->actual );
+	      idx = get_until_comma (ctx, idx + 1, in, &ptr->actual );
 	      //printf( "right after calling get_until_comma" );
 	      if (ptr->actual.len > 0)
 		++narg;
@@ -1272,10 +1277,11 @@ macro_expand2 (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
 	      formal_entry **pf;
 	      int c;
 
-	      if (!macro_mri)
+	      if (!ctx->macro_mri)
 		return _("too many positional arguments");
 
-	      f = (formal_entry *) xmalloc (sizeof (formal_entry));
+	      f = (formal_entry *) xmalloc_kind (MEM_MACRO,
+						 sizeof (formal_entry));
 	      sb_new (&f->name);
 	      sb_new (&f->def);
 	      sb_new (&f->actual);
@@ -1294,7 +1300,7 @@ macro_expand2 (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
 	  sb_reset (&f->actual);
 	  //printf( "just before get_until_comma\n" );
 	  //idx = get_any_string (idx, in, &f->actual, 1, 0);
-	  idx = get_until_comma (idx , in, &f->actual );
+	  idx = get_until_comma (ctx, idx , in, &f->actual );
 	  //printf( "%s", sb_name( &f->actual ) );
 	  //printf( "right after get_until_comma\n" );
 	  if (f->actual.len > 0)
@@ -1306,7 +1312,7 @@ macro_expand2 (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
 	  while (f != NULL && f->index < 0);
 	}
 
-      if (! macro_mri)
+      if (! ctx->macro_mri)
 	idx = sb_skip_comma (idx, in);
       else
 	{
@@ -1317,25 +1323,25 @@ macro_expand2 (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
 	}
     }
 
-  if (macro_mri)
+  if (ctx->macro_mri)
     {
       char buffer[20];
 
       sb_reset (&t);
-      sb_add_string (&t, macro_strip_at ? "$NARG" : "NARG");
+      sb_add_string (&t, ctx->macro_strip_at ? "$NARG" : "NARG");
       ptr = (formal_entry *) hash_find (m->formal_hash, sb_terminate (&t));
       sb_reset (&ptr->actual);
       snprintf (buffer, sizeof buffer, "%d", narg);
       sb_add_string (&ptr->actual, buffer);
     }
 
-  err = macro_expand_body (&m->sub, out, m->formals, m->formal_hash,
+  err = macro_expand_body (ctx, &m->sub, out, m->formals, m->formal_hash,
 			   comment_char, 1);
   if (err != NULL)
     return err;
 
   /* Discard any unnamed formal arguments.  */
-  if (macro_mri)
+  if (ctx->macro_mri)
     {
       formal_entry **pf;
 
@@ -1350,14 +1356,14 @@ macro_expand2 (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
 	      sb_kill (&(*pf)->def);
 	      sb_kill (&(*pf)->actual);
 	      f = (*pf)->next;
-	      free (*pf);
+	      xfree_kind (MEM_MACRO, *pf, sizeof (formal_entry));
 	      *pf = f;
 	    }
 	}
     }
 
   sb_kill (&t);
-  macro_number++;
+  ctx->macro_number++;
 
   return NULL;
 }
@@ -1366,7 +1372,7 @@ macro_expand2 (int idx, sb *in, macro_entry *m, sb *out, int comment_char)
    gasp.  Return 1 if a macro is found, 0 otherwise.  */
 
 int
-check_macro (const char *line, sb *expand, int comment_char, const char **error, macro_entry **info)
+check_macro (masp_context *ctx, const char *line, sb *expand, int comment_char, const char **error, macro_entry **info)
 {
   const char *s;
   char *copy, *cs;
@@ -1376,7 +1382,7 @@ check_macro (const char *line, sb *expand, int comment_char, const char **error,
   if (! ISALPHA (*line)
       && *line != '_'
       && *line != '$'
-      && (! macro_mri || *line != '.'))
+      && (! ctx->macro_mri || *line != '.'))
     return 0;
 
   s = line + 1;
@@ -1391,21 +1397,20 @@ check_macro (const char *line, sb *expand, int comment_char, const char **error,
   for (cs = copy; *cs != '\0'; cs++)
     *cs = TOLOWER (*cs);
 
-  macro = (macro_entry *) hash_find (macro_hash, copy);
+  macro = (macro_entry *) hash_find (ctx->macro_hash, copy);
 
   if (macro == NULL)
     return 0;
 
   /* Wrap the line up in an sb.  */
   sb_new (&line_sb);
-  while (*s != '\0' && *s != '\n' && *s != '\r')
-    sb_add_char (&line_sb, *s++);
+  sb_add_buffer (&line_sb, s, strcspn (s, "\n\r"));
 
   sb_new (expand);
-  if ( masp_syntax )
-    *error = macro_expand2 (0, &line_sb, macro, expand, comment_char);
+  if ( ctx->masp_syntax )
+    *error = macro_expand2 (ctx, 0, &line_sb, macro, expand, comment_char);
   else
-    *error = macro_expand(0, &line_sb, macro, expand, comment_char);
+    *error = macro_expand(ctx, 0, &line_sb, macro, expand, comment_char);
 
   sb_kill (&line_sb);
 
@@ -1419,9 +1424,9 @@ check_macro (const char *line, sb *expand, int comment_char, const char **error,
 /* Delete a macro.  */
 
 void
-delete_macro (const char *name)
+delete_macro (masp_context *ctx, const char *name)
 {
-  hash_delete (macro_hash, name);
+  hash_delete (ctx->macro_hash, name);
 }
 
 /* Handle the MRI IRP and IRPC pseudo-ops.  These are handled as a
@@ -1429,7 +1434,7 @@ delete_macro (const char *name)
    success, or an error message otherwise.  */
 
 const char *
-expand_irp (int irpc, int idx, sb *in, sb *out, int (*get_line)(sb *), int comment_char)
+expand_irp (masp_context *ctx, int irpc, int idx, sb *in, sb *out, int (*get_line)(masp_context *, sb *), int comment_char)
 {
   const char *mn;
   sb sub;
@@ -1445,14 +1450,14 @@ expand_irp (int irpc, int idx, sb *in, sb *out, int (*get_line)(sb *), int comme
   idx = sb_skip_white (idx, in);
 
   sb_new (&sub);
-  if (! buffer_and_nest (mn, "ENDR", &sub, get_line))
+  if (! buffer_and_nest (ctx, mn, "ENDR", &sub, get_line))
     return _("unexpected end of file in irp or irpc");
 
   sb_new (&f.name);
   sb_new (&f.def);
   sb_new (&f.actual);
 
-  idx = get_token (idx, in, &f.name);
+  idx = get_token (ctx, idx, in, &f.name);
   if (f.name.len == 0)
     return _("missing model parameter");
 
@@ -1470,7 +1475,7 @@ expand_irp (int irpc, int idx, sb *in, sb *out, int (*get_line)(sb *), int comme
   if (idx >= in->len || in->ptr[idx] == comment_char)
     {
       /* Expand once with a null string.  */
-      err = macro_expand_body (&sub, out, &f, h, comment_char, 0);
+      err = macro_expand_body (ctx, &sub, out, &f, h, comment_char, 0);
       if (err != NULL)
 	return err;
     }
@@ -1481,7 +1486,7 @@ expand_irp (int irpc, int idx, sb *in, sb *out, int (*get_line)(sb *), int comme
       while (idx < in->len && in->ptr[idx] != comment_char)
 	{
 	  if (!irpc)
-	    idx = get_any_string (idx, in, &f.actual, 1, 0);
+	    idx = get_any_string (ctx, idx, in, &f.actual, 1, 0);
 	  else
 	    {
 	      if (in->ptr[idx] == '"')
@@ -1499,7 +1504,7 @@ expand_irp (int irpc, int idx, sb *in, sb *out, int (*get_line)(sb *), int comme
 	      sb_add_char (&f.actual, in->ptr[idx]);
 	      ++idx;
 	    }
-	  err = macro_expand_body (&sub, out, &f, h, comment_char, 0);
+	  err = macro_expand_body (ctx, &sub, out, &f, h, comment_char, 0);
 	  if (err != NULL)
 	    return err;
 	  if (!irpc)
@@ -1533,7 +1538,7 @@ free_macro_entry (const char *key, void *value)
       sb_kill (&formal->name);
       sb_kill (&formal->def);
       sb_kill (&formal->actual);
-      free (formal);
+      xfree_kind (MEM_MACRO, formal, sizeof (formal_entry));
     }
 
   /* Free the formal hash table.  */
@@ -1544,19 +1549,19 @@ free_macro_entry (const char *key, void *value)
   sb_kill (&macro->sub);
 
   /* Free the macro entry itself.  */
-  free (macro);
+  xfree_kind (MEM_MACRO, macro, sizeof (macro_entry));
 }
 
 /* Cleanup all macro data structures.  */
 
 void
-macro_cleanup (void)
+macro_cleanup (masp_context *ctx)
 {
-  if (macro_hash != NULL)
+  if (ctx->macro_hash != NULL)
     {
-      hash_traverse (macro_hash, free_macro_entry);
-      hash_die (macro_hash);
-      macro_hash = NULL;
+      hash_traverse (ctx->macro_hash, free_macro_entry);
+      hash_die (ctx->macro_hash);
+      ctx->macro_hash = NULL;
     }
-  macro_defined = 0;
+  ctx->macro_defined = 0;
 }
@@ -30,6 +30,7 @@
 
 #define MACRO_H
 
+#include "masp.h"
 #include "sb.h"
 
 /* Structures used to store macros.
@@ -64,23 +65,18 @@ typedef struct macro_struct {
   struct hash_control *formal_hash; /* hash table of formals.  */
 } macro_entry;
 
-/* Whether any macros have been defined.  */
-
-extern int macro_defined;
-
-/* The macro nesting level.  */
-
-extern int macro_nest;
-
-extern int buffer_and_nest(const char *, const char *, sb *, int (*)(sb *));
-extern void macro_init(int alternate, int mri, int strip_at,
-	   int (*)(const char *, int, const sb *, int *));
-extern void macro_mri_mode(int);
-extern const char *define_macro(int idx, sb *in, sb *label, int (*get_line)(sb *),
-	   const char **namep);
-extern int check_macro(const char *, sb *, int, const char **, macro_entry **);
-extern void delete_macro(const char *);
-extern void macro_cleanup(void);
-extern const char *expand_irp(int, int, sb *, sb *, int (*)(sb *), int);
+extern int buffer_and_nest(masp_context *, const char *, const char *, sb *,
+	   int (*)(masp_context *, sb *));
+extern void macro_init(masp_context *, int alternate, int mri, int strip_at,
+	   int (*)(masp_context *, const char *, int, const sb *, long long *));
+extern void macro_mri_mode(masp_context *, int);
+extern const char *define_macro(masp_context *, int idx, sb *in, sb *label,
+	   int (*get_line)(masp_context *, sb *), const char **namep);
+extern int check_macro(masp_context *, const char *, sb *, int, const char **,
+	   macro_entry **);
+extern void delete_macro(masp_context *, const char *);
+extern void macro_cleanup(masp_context *);
+extern const char *expand_irp(masp_context *, int, int, sb *, sb *,
+	   int (*)(masp_context *, sb *), int);
 
 #endif
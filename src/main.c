@@ -0,0 +1,1170 @@
+/* main.c - MASP command line driver.
+   Copyright 1994, 1995, 1996, 1997, 1998, 1999, 2000, 2001, 2002
+   Free Software Foundation, Inc.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+/* The masp program is a thin layer over the library in masp.c: it
+   turns the command line into masp_options and feeds each input file
+   through one context.  With --jobs or --manifest it runs a batch of
+   separate jobs instead (jobs.c), and with --server it runs the jobs
+   other masp processes send it (server.c); --fork-server runs each in
+   a process forked from one which has read a prelude.  */
+
+#include "config.h"
+#include "bin-bugs.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "compat.h"
+#include "masp.h"
+#include "jobs.h"
+#include "server.h"
+#include "cache.h"
+#include "deps.h"
+#include "asintl.h"
+
+static char *program_version = PACKAGE_VERSION;
+
+static int show_usage(FILE *file, int status);
+static int show_help(FILE *file);
+
+static char *program_name;
+
+/* Long options without a short form.  */
+#define OPTION_MANIFEST 150
+#define OPTION_SERVER 151
+#define OPTION_CLIENT 152
+#define OPTION_PIPELINE 153
+#define OPTION_EMIT_SNAPSHOT 154
+#define OPTION_USE_SNAPSHOT 155
+#define OPTION_CACHE_DIR 156
+#define OPTION_PREFETCH 157
+#define OPTION_PROFILE 158
+#define OPTION_TRACE 159
+#define OPTION_MEMORY_REPORT 160
+#define OPTION_FORK_SERVER 161
+#define OPTION_PRELUDE 162
+#define OPTION_VARIANT 163
+
+/* The threads --prefetch reads on when it isn't told how many.  */
+#define PREFETCH_THREADS 2
+
+/* The list of long options.  */
+static struct option long_options[] =
+{
+  { "alternate", no_argument, 0, 'a' },
+  { "include", required_argument, 0, 'I' },
+  { "commentchar", required_argument, 0, 'c' },
+  { "prefixchar", required_argument, 0, 'P' },
+  { "line-numbers", no_argument, 0, 'l' },
+  { "copysource", no_argument, 0, 's' },
+  { "debug", no_argument, 0, 'd' },
+  { "help", no_argument, 0, 'h' },
+  { "mri", no_argument, 0, 'M' },
+  { "output", required_argument, 0, 'o' },
+  { "print", no_argument, 0, 'p' },
+  { "unreasonable", no_argument, 0, 'u' },
+  { "version", no_argument, 0, 'v' },
+  { "define", required_argument, 0, 'd' },
+  { "jobs", required_argument, 0, 'j' },
+  { "manifest", required_argument, 0, OPTION_MANIFEST },
+  { "server", required_argument, 0, OPTION_SERVER },
+  { "client", required_argument, 0, OPTION_CLIENT },
+  { "fork-server", required_argument, 0, OPTION_FORK_SERVER },
+  { "prelude", required_argument, 0, OPTION_PRELUDE },
+  { "variant", required_argument, 0, OPTION_VARIANT },
+  { "pipeline", no_argument, 0, OPTION_PIPELINE },
+  { "prefetch", optional_argument, 0, OPTION_PREFETCH },
+  { "profile", no_argument, 0, OPTION_PROFILE },
+  { "trace", required_argument, 0, OPTION_TRACE },
+  { "memory-report", required_argument, 0, OPTION_MEMORY_REPORT },
+  { "emit-snapshot", required_argument, 0, OPTION_EMIT_SNAPSHOT },
+  { "use-snapshot", required_argument, 0, OPTION_USE_SNAPSHOT },
+  { "cache-dir", required_argument, 0, OPTION_CACHE_DIR },
+  { NULL, no_argument, 0, 0 }
+};
+
+/* Everything the command line asks for.  */
+
+typedef struct masp_args {
+  masp_options opts;
+  char **defines;		/* -D, after any from the environment.  */
+  int ndefines;
+  char **includes;		/* -I.  */
+  int nincludes;
+  char *out_name;		/* -o.  */
+  int nthreads;			/* --jobs, or 0.  */
+  char *manifest;		/* --manifest.  */
+  char **variants;		/* --variant NAME:DEFINES.  */
+  int nvariants;
+  char *server;			/* --server socket.  */
+  char *fork_server;		/* --fork-server socket.  */
+  char *prelude;		/* --prelude.  */
+  char *emit_snapshot;		/* --emit-snapshot.  */
+  char *use_snapshot;		/* --use-snapshot.  */
+  char *cache_dir;		/* --cache-dir.  */
+  char *trace;			/* --trace.  */
+  char *memory_report;		/* --memory-report.  */
+  int deps;			/* -MD: write the dependencies as well.  */
+  int deps_only;		/* -MM: write only the dependencies.  */
+  char *deps_file;		/* -MF.  */
+  char **deps_targets;		/* -MT.  */
+  int ndeps_targets;
+  char **files;			/* The rest of the command line.  */
+  int nfiles;
+} masp_args;
+
+/* Show a usage message, returning STATUS to exit with.  */
+static int
+show_usage (FILE *file, int status)
+{
+  // Removed references of alternate and mri mode
+  //   [-a]      [--alternate]         enter alternate macro mode
+  //   [-M]      [--mri]               enter MRI compatibility mode
+   fprintf (file,
+"Usage: %s \n"
+"   [-c char] [--commentchar char]  change the comment character from !\n"
+"   [-d]      [--debug]             print some debugging info\n"
+"   [-h]      [--help]              print this message\n"
+"   [-o out]  [--output out]        set the output file\n"
+"   [-p]      [--print]             print line numbers\n"
+"   [-s]      [--copysource]        copy source through as comments \n"
+"   [-u]      [--unreasonable]      allow unreasonable nesting\n"
+"   [-v]      [--version]           print the program version\n"
+"   [-Dname=value]                  create preprocessor variable called name,\n"
+"                                   with value\n"
+"   [-Ipath]                        add to include path list\n"
+"   [-P char] [--prefixchar char]   use char to prefix MASP directives\n"
+"                                   the default is '.'\n"
+"   [-l]      [--line-numbers]      include line number info in output\n"
+"   [--pipeline]                    read and write on threads of their own\n"
+"   [--prefetch[=n]]                read include files ahead on n threads\n"
+"   [--profile]                     report the time each directive and\n"
+"                                   macro took\n"
+"   [--trace file]                  write include, macro and conditional\n"
+"                                   spans for a trace viewer\n"
+"   [--memory-report file]          write the memory used, by subsystem,\n"
+"                                   as JSON\n"
+"   [--emit-snapshot file]          save macros and variables at the end\n"
+"   [--use-snapshot file]           start from a saved snapshot, skipping\n"
+"                                   includes of the files it was made from\n"
+"   [--cache-dir dir]               reuse the -o output of an earlier run\n"
+"                                   if nothing it read has changed\n"
+"   [-MD]                           write make dependencies to out-file.d\n"
+"   [-MM]                           only follow includes, and write the\n"
+"                                   dependencies instead of the output\n"
+"   [-MF file]                      write the dependencies to file\n"
+"   [-MT target]                    make the rule for target, not out-file\n"
+"   [-j n]    [--jobs n]            preprocess in=out pairs, n at a time\n"
+"   [--manifest file]               read in out pairs from file, one a line\n"
+"   [--variant name:-Dn=v,...]      run in-file with these -D values too,\n"
+"                                   into out-file with .name before its\n"
+"                                   suffix, once for each --variant\n"
+"   [--server socket]               serve jobs from --client on socket\n"
+"   [--client socket]               have the server on socket do the job,\n"
+"                                   or do it here if there is none\n"
+"   [--fork-server socket]          as --server, but read --prelude first\n"
+"                                   and fork a copy of the result per job\n"
+"   [--prelude file]                the file --fork-server starts from\n"
+"   [in-file] or [in-file=out-file] with --jobs or --manifest\n"
+"MASP_DEFINES in the environment holds more name=value pairs for -D.\n",
+	    program_name);
+  if (status == 0)
+    fprintf (file, _("Report bugs to %s\n"), REPORT_BUGS_TO);
+  return status;
+}
+
+/* Display a help message.  */
+
+static int
+show_help (FILE *file)
+{
+  fprintf (file, _("%s: MASP, the Assembly Preprocessor\n"), program_name);
+  return show_usage (file, 0);
+}
+
+static void
+args_init (masp_args *a, int argc, int nenv)
+{
+  memset (a, 0, sizeof *a);
+  masp_options_init (&a->opts);
+  a->defines = (char **) xmalloc ((argc + nenv + 1) * sizeof (char *));
+  a->includes = (char **) xmalloc ((argc + 1) * sizeof (char *));
+  a->deps_targets = (char **) xmalloc ((argc + 1) * sizeof (char *));
+  a->variants = (char **) xmalloc ((argc + 1) * sizeof (char *));
+}
+
+static void
+args_free (masp_args *a)
+{
+  free (a->defines);
+  free (a->includes);
+  free (a->deps_targets);
+  free (a->variants);
+}
+
+/* getopt keeps its state in globals, so only one thread at a time may
+   parse a command line.  */
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t parse_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Take the dependency options out of the ARGC arguments in ARGV and
+   into A, returning how many arguments are left, or -1 after
+   complaining on ERR.  They are spelt as cc spells them, which getopt
+   would read as -M followed by -D and the rest.  */
+
+static int
+take_deps_options (int argc, char **argv, masp_args *a, FILE *err)
+{
+  int i, j;
+
+  for (i = 1; i < argc && strcmp (argv[i], "--") != 0; i++)
+    {
+      char *arg = argv[i];
+      char **value = NULL;
+      int n = 1;
+
+      if (strcmp (arg, "-MD") == 0)
+	a->deps = 1;
+      else if (strcmp (arg, "-MM") == 0)
+	a->deps_only = 1;
+      else if (strncmp (arg, "-MF", 3) == 0)
+	value = &a->deps_file;
+      else if (strncmp (arg, "-MT", 3) == 0)
+	value = &a->deps_targets[a->ndeps_targets++];
+      else
+	continue;
+
+      if (value && arg[3])
+	*value = arg + 3;
+      else if (value && i + 1 < argc)
+	{
+	  *value = argv[i + 1];
+	  n = 2;
+	}
+      else if (value)
+	{
+	  fprintf (err, _("%s: %.3s needs an argument.\n"), program_name, arg);
+	  return -1;
+	}
+
+      for (j = i; j + n <= argc; j++)
+	argv[j] = argv[j + n];
+      argc -= n;
+      i--;
+    }
+  return argc;
+}
+
+/* Parse ARGC arguments in ARGV into A, which args_init has readied.
+   Help and version go to OUT, complaints to ERR.  Returns -1 to go on,
+   or else the status to exit with.  */
+
+static int
+parse_args (int argc, char **argv, masp_args *a, FILE *out, FILE *err)
+{
+  int opt;
+  int status = -1;
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock (&parse_lock);
+#endif
+  /* Start afresh, in case a line was parsed before.  */
+  optind = 0;
+  opterr = err == stderr;
+  argc = take_deps_options (argc, argv, a, err);
+  if (argc < 0)
+    {
+      argc = 0;
+      status = 1;
+    }
+  /* Naming the file or the target asks for the dependencies.  */
+  if (a->deps_file || a->ndeps_targets)
+    a->deps = 1;
+
+  while (status < 0
+	 && (opt = getopt_long (argc, argv, "I:sdhavc:upo:D:MP:lj:",
+				long_options, (int *) NULL)) != EOF)
+    {
+      switch (opt)
+	{
+	case 'o':
+	  a->out_name = optarg;
+	  break;
+	case 'u':
+	  a->opts.unreasonable = 1;
+	  break;
+	case 'I':
+	  a->includes[a->nincludes++] = optarg;
+	  break;
+	case 'p':
+	  a->opts.print_line_number = 1;
+	  break;
+	case 'c':
+	  a->opts.comment_char = optarg[0];
+	  break;
+	case 'a':
+	  a->opts.alternate = 1;
+	  break;
+	case 's':
+	  a->opts.copysource = 1;
+	  break;
+	case 'l':
+	  a->opts.line_info = 1;
+	  break;
+	case 'd':
+	  a->opts.stats = 1;
+	  break;
+	case 'D':
+	  a->defines[a->ndefines++] = optarg;
+	  break;
+	case 'M':
+	  a->opts.mri = 1;
+	  a->opts.comment_char = ';';
+	  break;
+	case 'h':
+	  status = show_help (out);
+	  break;
+	case 'v':
+	  /* This output is intended to follow the GNU standards document.  */
+	  fprintf (out, _("MASP, the Assembly Preprocessor %s\n"), program_version);
+	  fprintf (out, _("Copyright 2003 Johann Gunnar Oskarsson"
+			  " <myrkraverk@users.sourcefore.net>\n\n"));
+	  fprintf (out, _("\
+This program is free software; you may redistribute it under the terms of\n\
+the GNU General Public License.  This program has absolutely no warranty.\n"));
+	  status = 0;
+	  break;
+	case 'P':
+	  a->opts.prefix_char = optarg[0];
+	  break;
+	case 'j':
+	  a->nthreads = atoi (optarg);
+	  if (a->nthreads < 1)
+	    {
+	      fprintf (err, _("%s: --jobs needs a positive number.\n"),
+		       program_name);
+	      status = 1;
+	    }
+	  break;
+	case OPTION_MANIFEST:
+	  a->manifest = optarg;
+	  break;
+	case OPTION_VARIANT:
+	  if (optarg[0] == ':' || !strchr (optarg, ':'))
+	    {
+	      fprintf (err, _("%s: --variant wants name:-Dname=value,...\n"),
+		       program_name);
+	      status = 1;
+	    }
+	  a->variants[a->nvariants++] = optarg;
+	  break;
+	case OPTION_SERVER:
+	  a->server = optarg;
+	  break;
+	case OPTION_FORK_SERVER:
+	  a->fork_server = optarg;
+	  break;
+	case OPTION_PRELUDE:
+	  a->prelude = optarg;
+	  break;
+	case OPTION_PIPELINE:
+	  a->opts.pipeline = 1;
+	  break;
+	case OPTION_PREFETCH:
+	  a->opts.prefetch = optarg ? atoi (optarg) : PREFETCH_THREADS;
+	  if (a->opts.prefetch < 1)
+	    {
+	      fprintf (err, _("%s: --prefetch needs a positive number.\n"),
+		       program_name);
+	      status = 1;
+	    }
+	  break;
+	case OPTION_PROFILE:
+	  a->opts.profile = 1;
+	  break;
+	case OPTION_TRACE:
+	  a->opts.trace = 1;
+	  a->trace = optarg;
+	  break;
+	case OPTION_MEMORY_REPORT:
+	  a->memory_report = optarg;
+	  break;
+	case OPTION_EMIT_SNAPSHOT:
+	  a->emit_snapshot = optarg;
+	  break;
+	case OPTION_USE_SNAPSHOT:
+	  a->use_snapshot = optarg;
+	  break;
+	case OPTION_CACHE_DIR:
+	  a->cache_dir = optarg;
+	  break;
+	case OPTION_CLIENT:
+	  /* Only means anything before the arguments are sent.  */
+	  break;
+	case 0:
+	  break;
+	default:
+	  status = show_usage (err, 1);
+	  break;
+	}
+    }
+  a->files = argv + optind;
+  a->nfiles = argc - optind;
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock (&parse_lock);
+#endif
+  return status;
+}
+
+/* Add the -D values in the MASP_DEFINES environment variable to A.
+   They come before those on the command line, which can override
+   them.  COPY is where the words are kept, freed by the caller.  */
+
+static void
+env_defines (masp_args *a, char **copy)
+{
+  const char *env = getenv ("MASP_DEFINES");
+  char *p;
+
+  *copy = NULL;
+  if (!env)
+    return;
+  *copy = p = xstrdup (env);
+  for (;;)
+    {
+      while (*p == ' ' || *p == '\t')
+	p++;
+      if (!*p)
+	break;
+      a->defines[a->ndefines++] = p;
+      while (*p && *p != ' ' && *p != '\t')
+	p++;
+      if (*p)
+	*p++ = 0;
+    }
+}
+
+/* The number of words in MASP_DEFINES, at most.  */
+
+static int
+count_env_defines (void)
+{
+  const char *env = getenv ("MASP_DEFINES");
+  return env ? (int) strlen (env) / 2 + 1 : 0;
+}
+
+/* Describe the run A asks for to CACHE: everything besides the text
+   of the files it reads which could change its output.  */
+
+static void
+cache_describe (run_cache *cache, const masp_args *a, const char *dir)
+{
+  const masp_options *o = &a->opts;
+  char word[64];
+  char *cwd;
+  int i;
+
+  cache_key (cache, program_version);
+  sprintf (word, "%d %d %d %d %d %d %d %d", o->alternate, o->mri,
+	   o->copysource, o->print_line_number, o->unreasonable,
+	   o->line_info, (unsigned char) o->comment_char,
+	   (unsigned char) o->prefix_char);
+  cache_key (cache, word);
+
+  /* Relative names are found from here.  */
+  cwd = canonical_path (dir ? dir : ".");
+  cache_key (cache, cwd ? cwd : "");
+  free (cwd);
+
+  for (i = 0; i < a->nincludes; i++)
+    {
+      cache_key (cache, "-I");
+      cache_key (cache, a->includes[i]);
+    }
+  for (i = 0; i < a->ndefines; i++)
+    {
+      cache_key (cache, "-D");
+      cache_key (cache, a->defines[i]);
+    }
+  if (a->use_snapshot)
+    {
+      char *path = resolve_path (dir, a->use_snapshot);
+      cache_key (cache, "--use-snapshot");
+      cache_key (cache, path);
+      cache_key_file (cache, path);
+      free (path);
+    }
+  for (i = 0; i < a->nfiles; i++)
+    {
+      cache_key (cache, "--");
+      cache_key (cache, a->files[i]);
+    }
+}
+
+/* Preprocess the input files of A in CTX into OUTFILE, closing it
+   afterwards if OWNED, with messages on ERRFILE.  Returns the exit
+   status.  */
+
+static int
+run_files (masp_context *ctx, const masp_args *a, const char *dir,
+	   FILE *outfile, int owned, FILE *errfile)
+{
+  int exitcode;
+  int i;
+
+  masp_set_output (ctx, outfile);
+
+  /* Process all the input files.  */
+
+  exitcode = 0;
+  for (i = 0; i < a->nfiles && !masp_fatal_p (ctx); i++)
+    {
+      if (!masp_process_file (ctx, a->files[i]))
+	{
+	  fprintf (errfile, _("%s: Can't open input file `%s'.\n"),
+		   program_name, a->files[i]);
+	  exitcode = -1;
+	  break;
+	}
+    }
+
+  if (exitcode == 0 && a->emit_snapshot && !masp_fatal_p (ctx))
+    {
+      char *path = resolve_path (dir, a->emit_snapshot);
+      if (!masp_save_snapshot (ctx, path))
+	exitcode = -1;
+      free (path);
+    }
+
+  if (exitcode == 0)
+    exitcode = masp_finish (ctx);
+  else
+    exitcode = 1;
+
+  /* A run which failed is as worth looking at as one which didn't.  */
+  if (a->memory_report)
+    {
+      char *path = resolve_path (dir, a->memory_report);
+      if (!masp_write_memory (ctx, path))
+	exitcode = 1;
+      free (path);
+    }
+  if (a->trace)
+    {
+      char *path = resolve_path (dir, a->trace);
+      if (!masp_write_trace (ctx, path))
+	exitcode = 1;
+      free (path);
+    }
+
+  /* Flush and close output file to ensure all data is written.
+     This fixes race conditions when multiple masp processes run in parallel. */
+  if (fflush (outfile) != 0)
+    {
+      fprintf (errfile, "Error flushing output file\n");
+      exitcode = 1;
+    }
+  if (owned && fclose (outfile) != 0)
+    {
+      fprintf (errfile, "Error closing output file\n");
+      exitcode = 1;
+    }
+
+  return exitcode;
+}
+
+/* The target of the dependencies of the run A, if -MT gives none: the
+   -o file, or without one the input with a .s suffix, in malloced
+   memory.  */
+
+static char *
+deps_target (const masp_args *a)
+{
+  const char *input = a->nfiles ? a->files[0] : "masp";
+
+  return a->out_name ? xstrdup (a->out_name) : deps_name (input, ".s");
+}
+
+/* Write the dependencies of the run A asks for, which read the NFILES
+   FILES, to the file -MF names or else the -o file with a .d suffix,
+   or with -MM to OUT.  The rule is for the -MT targets or else the
+   deps_target.  Returns 0 after saying why on ERR if they can't be
+   written.  */
+
+static int
+write_deps (const masp_args *a, const char *dir, FILE *out, FILE *err,
+	    const char *const *files, int nfiles)
+{
+  char *target = deps_target (a);
+  const char *const *targets = (const char *const *) a->deps_targets;
+  int ntargets = a->ndeps_targets;
+  char *path = NULL;
+  FILE *file = out;
+  int ok;
+
+  if (!ntargets)
+    {
+      targets = (const char *const *) &target;
+      ntargets = 1;
+    }
+  if (a->deps_file)
+    path = resolve_path (dir, a->deps_file);
+  else if (!a->deps_only)
+    {
+      char *name = deps_name (target, ".d");
+      path = resolve_path (dir, name);
+      free (name);
+    }
+  if (path)
+    file = fopen (path, "w");
+
+  ok = file && deps_write (file, targets, ntargets, files, nfiles);
+  if (file && file != out && fclose (file) != 0)
+    ok = 0;
+  if (!ok)
+    fprintf (err, _("%s: Can't write dependency file `%s'.\n"),
+	     program_name, path ? path : "-");
+
+  free (path);
+  free (target);
+  return ok;
+}
+
+/* The name of the output of the variant NAME, of LEN characters, of a
+   run into OUT: OUT with .NAME before its suffix, if it has one.  */
+
+static char *
+variant_output (const char *out, const char *name, size_t len)
+{
+  /* deps_name with no suffix leaves what goes before OUT's.  */
+  char *path = deps_name (out, "");
+  size_t stem = strlen (path);
+
+  path = (char *) xrealloc (path, strlen (out) + len + 2);
+  path[stem] = '.';
+  memcpy (path + stem + 1, name, len);
+  strcpy (path + stem + 1 + len, out + stem);
+  return path;
+}
+
+/* Add to LIST the job for the --variant SPEC of the run A: its input,
+   with the -D values in SPEC, a `-D' before each being optional, on
+   top of A's own.  */
+
+static void
+add_variant (job_list *list, const masp_args *a, const char *spec)
+{
+  const char *colon = strchr (spec, ':');
+  char *output = variant_output (a->out_name, spec, colon - spec);
+  masp_job *job = job_list_add (list, a->files[0], output);
+  char *copy = xstrdup (colon + 1);
+  char *p = copy;
+
+  while (*p)
+    {
+      char *word = p;
+
+      p += strcspn (p, ",");
+      if (*p)
+	*p++ = 0;
+      if (strncmp (word, "-D", 2) == 0)
+	word += 2;
+      if (*word)
+	job_define (job, word);
+    }
+  free (copy);
+  free (output);
+}
+
+/* Do what A asks, with relative names in DIR if it isn't NULL and
+   using the include cache SHARED if that isn't.  OUT and ERR stand for
+   stdout and stderr.  If PRELUDE isn't NULL the run goes on in it,
+   rather than in a new context, and leaves it to the caller to free.
+   Returns the exit status.  */
+
+static int
+run_args (masp_args *a, FILE *out, FILE *err, const char *dir,
+	  masp_shared *shared, masp_context *prelude)
+{
+  masp_context *ctx;
+  masp_shared *own_shared = NULL;
+  masp_snapshot *snapshot = NULL;
+  run_cache *cache = NULL;
+  char *out_path = NULL;
+  mem_stream diag;
+  FILE *errfile = err;
+  FILE *outfile;
+  int exitcode;
+  int i;
+
+  if (a->nvariants && (a->manifest || a->nfiles != 1 || !a->out_name))
+    {
+      fprintf (err, _("%s: --variant needs -o and a single input file.\n"),
+	       program_name);
+      return 1;
+    }
+  if (a->nthreads || a->manifest || a->nvariants)
+    {
+      /* These name a single output, or what goes with one.  The
+	 outputs of variants are named after -o.  */
+      const char *single = (a->out_name && !a->nvariants ? "-o"
+			    : a->emit_snapshot ? "--emit-snapshot"
+			    : a->trace ? "--trace"
+			    : a->memory_report ? "--memory-report"
+			    : a->cache_dir ? "--cache-dir"
+			    : a->deps_only ? "-MM"
+			    : a->deps_file ? "-MF"
+			    : a->ndeps_targets ? "-MT"
+			    /* A snapshot is only for the -D values it was
+			       made with, and a variant adds its own.  */
+			    : a->nvariants && a->use_snapshot ? "--use-snapshot"
+			    : NULL);
+      if (single && a->nvariants)
+	{
+	  fprintf (err, _("%s: %s can't be used with --variant.\n"),
+		   program_name, single);
+	  return 1;
+	}
+      if (single)
+	{
+	  fprintf (err, _("%s: %s can't be used with --jobs or --manifest.\n"),
+		   program_name, single);
+	  return 1;
+	}
+    }
+  if ((a->deps || a->deps_only) && !a->ndeps_targets && !a->nthreads
+      && !a->manifest && !a->out_name)
+    {
+      /* An input named like the output would be its own target.  */
+      char *target = deps_target (a);
+      int self = a->nfiles && strcmp (target, a->files[0]) == 0;
+
+      free (target);
+      if (self)
+	{
+	  fprintf (err, _("%s: %s needs -o or -MT, or `%s' would depend on itself.\n"),
+		   program_name, a->deps_only ? "-MM" : "-MD", a->files[0]);
+	  return 1;
+	}
+    }
+  if (a->out_name)
+    out_path = resolve_path (dir, a->out_name);
+
+  /* Only a run whose whole result is its output file and diagnostics
+     is cached; -d, --profile, --trace and --memory-report look at
+     this very run.  The diagnostics are collected, to be kept along
+     with the output.  */
+  if (a->cache_dir && out_path && !a->emit_snapshot && !a->opts.stats
+      && !a->opts.profile && !a->trace && !a->memory_report
+      && !a->deps_only)
+    {
+      char *path = resolve_path (dir, a->cache_dir);
+      cache = cache_open (path);
+      free (path);
+      cache_describe (cache, a, dir);
+      if (cache_fetch (cache, out_path, err))
+	{
+	  const char *const *files;
+	  int nfiles;
+
+	  files = cache_files (cache, &nfiles);
+	  exitcode = 0;
+	  if (a->deps && !write_deps (a, dir, out, err, files, nfiles))
+	    exitcode = 1;
+	  cache_close (cache);
+	  free (out_path);
+	  return exitcode;
+	}
+      if (mem_stream_open (&diag))
+	errfile = diag.file;
+      else
+	{
+	  cache_close (cache);
+	  cache = NULL;
+	}
+    }
+
+  /* A snapshot which can't be used is only a missed saving.  */
+  if (a->use_snapshot)
+    {
+      char *path = resolve_path (dir, a->use_snapshot);
+      snapshot = masp_snapshot_open (path, &a->opts,
+				     (const char *const *) a->defines,
+				     a->ndefines, err);
+      free (path);
+    }
+
+  if (a->nthreads || a->manifest || a->nvariants)
+    {
+      jobs_setup setup;
+      job_list list;
+
+      job_list_init (&list);
+      for (i = 0; i < a->nvariants; i++)
+	add_variant (&list, a, a->variants[i]);
+      if (a->manifest)
+	{
+	  char *manifest = resolve_path (dir, a->manifest);
+	  int ok = job_list_read_manifest (&list, manifest, program_name, err);
+	  free (manifest);
+	  if (!ok)
+	    {
+	      job_list_free (&list);
+	      masp_snapshot_close (snapshot);
+	      return 1;
+	    }
+	}
+      for (i = 0; !a->nvariants && i < a->nfiles; i++)
+	if (!job_list_add_pair (&list, a->files[i]))
+	  {
+	    fprintf (err, _("%s: `%s' is not an in-file=out-file pair.\n"),
+		     program_name, a->files[i]);
+	    job_list_free (&list);
+	    masp_snapshot_close (snapshot);
+	    return 1;
+	  }
+
+      setup.options = &a->opts;
+      setup.includes = a->includes;
+      setup.nincludes = a->nincludes;
+      setup.defines = a->defines;
+      setup.ndefines = a->ndefines;
+      setup.program_name = program_name;
+      setup.directory = dir;
+      setup.errfile = err;
+      setup.shared = shared;
+      setup.snapshot = snapshot;
+      setup.deps = a->deps;
+      exitcode = jobs_run (&setup, &list, a->nthreads ? a->nthreads : 1);
+
+      job_list_free (&list);
+      masp_snapshot_close (snapshot);
+      return exitcode;
+    }
+
+  /* A run of its own still reads each include file only once.  */
+  if (!shared)
+    shared = own_shared = masp_shared_new ();
+  ctx = prelude ? prelude : masp_new_shared (&a->opts, shared);
+  masp_set_diagnostics (ctx, errfile);
+  masp_set_directory (ctx, dir);
+  if (snapshot)
+    masp_use_snapshot (ctx, snapshot);
+  if (a->emit_snapshot)
+    masp_record_output (ctx);
+  for (i = 0; i < a->nincludes; i++)
+    masp_add_include_path (ctx, a->includes[i]);
+  for (i = 0; i < a->ndefines; i++)
+    masp_define (ctx, a->defines[i]);
+
+  if (a->deps_only)
+    {
+      /* Nothing is written but the dependencies.  */
+      exitcode = 0;
+      for (i = 0; i < a->nfiles && !masp_fatal_p (ctx); i++)
+	if (!masp_scan_file (ctx, a->files[i]))
+	  {
+	    fprintf (errfile, _("%s: Can't open input file `%s'.\n"),
+		     program_name, a->files[i]);
+	    exitcode = 1;
+	    break;
+	  }
+      if (exitcode == 0)
+	exitcode = masp_finish (ctx);
+    }
+  else
+    {
+      outfile = out_path ? fopen (out_path, "w") : out;
+      if (!outfile)
+	{
+	  fprintf (errfile, _("%s: Can't open output file `%s'.\n"),
+		   program_name, a->out_name);
+	  exitcode = 1;
+	}
+      else
+	exitcode = run_files (ctx, a, dir, outfile, outfile != out, errfile);
+    }
+
+  if (exitcode == 0 && (a->deps || a->deps_only))
+    {
+      const char *const *files;
+      int nfiles;
+
+      files = masp_files_read (ctx, &nfiles);
+      if (!write_deps (a, dir, out, errfile, files, nfiles))
+	exitcode = 1;
+    }
+
+  if (cache)
+    {
+      const char *const *files;
+      const char *const *dirs;
+      char *text;
+      size_t len;
+      int nfiles;
+      int ndirs;
+
+      mem_stream_close (&diag, &text, &len);
+      fwrite (text, 1, len, err);
+      files = masp_files_read (ctx, &nfiles);
+      dirs = masp_dirs_missed (ctx, &ndirs);
+      if (exitcode == 0)
+	cache_store (cache, files, nfiles, dirs, ndirs, text, len,
+		     out_path);
+      free (text);
+      cache_close (cache);
+    }
+
+  if (!prelude)
+    masp_free (ctx);
+  masp_shared_free (own_shared);
+  masp_snapshot_close (snapshot);
+  free (out_path);
+  return exitcode;
+}
+
+/* The context --fork-server read its prelude into.  Each job gets a
+   copy of it in the process forked for it.  */
+static masp_context *prelude_ctx;
+
+/* Run a job sent by a client, going on from PRELUDE, when it isn't
+   NULL, if the job can.  It can if the prelude was read with the same
+   syntax options and -D values and none of its files has changed, and
+   unless it runs several jobs or variants of its own, or uses a
+   snapshot or cache, which know nothing of the prelude; otherwise it
+   is run afresh.  */
+
+static int
+run_request (const server_request *req, FILE *out, FILE *err,
+	     masp_shared *shared, masp_context *prelude)
+{
+  char **argv = (char **) xmalloc ((req->argc + 2) * sizeof (char *));
+  masp_args a;
+  int status;
+  int i;
+
+  /* getopt wants the program name in front.  */
+  argv[0] = program_name;
+  for (i = 0; i < req->argc; i++)
+    argv[i + 1] = req->argv[i];
+  argv[req->argc + 1] = NULL;
+
+  args_init (&a, req->argc + 1, req->ndefines);
+  for (i = 0; i < req->ndefines; i++)
+    a.defines[a.ndefines++] = req->defines[i];
+  status = parse_args (req->argc + 1, argv, &a, out, err);
+  if (status < 0 && (a.server || a.fork_server))
+    {
+      fprintf (err, _("%s: a job can't start another server.\n"),
+	       program_name);
+      status = 1;
+    }
+  if (status < 0)
+    {
+      if (prelude
+	  && (a.nthreads || a.manifest || a.nvariants || a.use_snapshot
+	      || a.emit_snapshot || a.cache_dir
+	      || !masp_prelude_options (prelude, &a.opts,
+					(const char *const *) a.defines,
+					a.ndefines, err)))
+	prelude = NULL;
+      status = run_args (&a, out, err, req->cwd, shared, prelude);
+    }
+
+  args_free (&a);
+  free (argv);
+  return status;
+}
+
+/* Run a job sent by a client; see server.h.  */
+
+static int
+serve_job (const server_request *req, FILE *out, FILE *err,
+	   masp_shared *shared)
+{
+  return run_request (req, out, err, shared, NULL);
+}
+
+/* Run a job sent to --fork-server, in the process forked for it.  */
+
+static int
+serve_prelude_job (const server_request *req, FILE *out, FILE *err,
+		   masp_shared *shared)
+{
+  return run_request (req, out, err, shared, prelude_ctx);
+}
+
+/* Read the prelude A names, with its -I and -D values, and serve
+   jobs forked from the result.  The prelude's output is thrown away.
+   Returns the exit status if it can't be read or the server can't
+   start.  */
+
+static int
+fork_server_start (masp_args *a)
+{
+  mem_stream out;
+  char *text;
+  size_t len;
+  int status;
+  int i;
+
+  if (!mem_stream_open (&out))
+    {
+      fprintf (stderr, _("%s: out of memory\n"), program_name);
+      return 1;
+    }
+  prelude_ctx = masp_new_shared (&a->opts, masp_shared_new ());
+  masp_set_output (prelude_ctx, out.file);
+  for (i = 0; i < a->nincludes; i++)
+    masp_add_include_path (prelude_ctx, a->includes[i]);
+  for (i = 0; i < a->ndefines; i++)
+    masp_define (prelude_ctx, a->defines[i]);
+
+  if (!masp_process_prelude (prelude_ctx, a->prelude))
+    {
+      fprintf (stderr, _("%s: Can't open input file `%s'.\n"),
+	       program_name, a->prelude);
+      status = 1;
+    }
+  else if (masp_fatal_p (prelude_ctx) || masp_finish (prelude_ctx) != 0)
+    {
+      fprintf (stderr, _("%s: the prelude `%s' has errors.\n"),
+	       program_name, a->prelude);
+      status = 1;
+    }
+  else
+    status = -1;
+  mem_stream_close (&out, &text, &len);
+  free (text);
+  masp_set_output (prelude_ctx, stdout);
+
+  if (status < 0)
+    status = fork_server_run (a->fork_server, serve_prelude_job,
+			      program_name);
+  return status;
+}
+
+/* Find the socket named by --client in ARGV, if there is one, and
+   take the option out of ARGV so the rest can be sent on.  */
+
+static char *
+take_client_option (int *argc, char **argv)
+{
+  char *path = NULL;
+  int i, j;
+
+  for (i = 1; i < *argc && strcmp (argv[i], "--") != 0; i++)
+    {
+      int n = 0;
+      if (strcmp (argv[i], "--client") == 0 && i + 1 < *argc)
+	{
+	  path = argv[i + 1];
+	  n = 2;
+	}
+      else if (strncmp (argv[i], "--client=", 9) == 0)
+	{
+	  path = argv[i] + 9;
+	  n = 1;
+	}
+      if (n)
+	{
+	  for (j = i; j + n <= *argc; j++)
+	    argv[j] = argv[j + n];
+	  *argc -= n;
+	  i--;
+	}
+    }
+  return path;
+}
+
+int
+main (int argc, char *argv[])
+{
+  masp_args a;
+  char *client;
+  char *env_copy;
+  int status;
+
+  /* Messages are only looked up in a catalogue when NLS is built
+     in; without it, reading the locale for them is time thrown away
+     on every run.  The character classes still follow LC_CTYPE.  */
+#ifdef ENABLE_NLS
+#if defined (HAVE_SETLOCALE) && defined (HAVE_LC_MESSAGES) && defined (LC_MESSAGES)
+  setlocale (LC_MESSAGES, "");
+#endif
+  bindtextdomain (PACKAGE, LOCALEDIR);
+  textdomain (PACKAGE);
+#endif
+#if defined (HAVE_SETLOCALE) && defined (LC_CTYPE)
+  setlocale (LC_CTYPE, "");
+#endif
+
+  program_name = argv[0];
+  xmalloc_set_program_name (program_name);
+
+  /* A client sends its arguments to the server as they are.  If no
+     server answers it does the job itself, just as it would have done
+     without --client.  */
+  client = take_client_option (&argc, argv);
+  args_init (&a, argc, count_env_defines ());
+  env_defines (&a, &env_copy);
+  if (client)
+    {
+      status = client_run (client, argc - 1, argv + 1,
+			   a.defines, a.ndefines);
+      if (status >= 0)
+	{
+	  args_free (&a);
+	  free (env_copy);
+	  return status;
+	}
+    }
+
+  status = parse_args (argc, argv, &a, stdout, stderr);
+  if (status < 0 && !a.fork_server != !a.prelude)
+    {
+      fprintf (stderr, _("%s: --fork-server and --prelude go together.\n"),
+	       program_name);
+      status = 1;
+    }
+  if (status < 0 && a.server)
+    status = server_run (a.server, serve_job, program_name);
+  if (status < 0 && a.fork_server)
+    status = fork_server_start (&a);
+  if (status < 0)
+    status = run_args (&a, stdout, stderr, NULL, NULL, NULL);
+
+  args_free (&a);
+  free (env_copy);
+  return status;
+}
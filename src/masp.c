@@ -57,7 +57,6 @@ suitable for gas to consume.
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
-#include <getopt.h>
 
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
@@ -69,12 +68,21 @@ extern char *malloc ();
 
 #include "compat.h"
 #include "sb.h"
+#include "masp.h"
+#include "context.h"
 #include "macro.h"
+#include "hash.h"
+#include "pipeline.h"
+#include "prefetch.h"
+#include "outbuf.h"
+#include "snapshot.h"
+#include "profile.h"
+#include "trace.h"
+#include "symhash.h"
 #include "asintl.h"
+#include <sys/stat.h>
 #include <regex.h>
 
-char *program_version = PACKAGE_VERSION;
-
 /* This is normally declared in as.h, but we don't include that.  We
    need the function because other files linked with masp.c might call
    it.  */
@@ -85,26 +93,6 @@ extern void as_abort(const char *, int, const char *);
    is used by the hash table code used by macro.c.  */
 int chunksize = 0;
 
-#define MAX_INCLUDES 30		/* Maximum include depth.  */
-#define MAX_REASONABLE 1000	/* Maximum number of expansions.  */
-
-int unreasonable;		/* -u on command line.  */
-int stats;			/* -d on command line.  */
-int print_line_number;		/* -p flag on command line.  */
-int copysource;			/* -c flag on command line.  */
-int warnings;			/* Number of WARNINGs generated so far.  */
-int errors;			/* Number of ERRORs generated so far.  */
-int fatals;			/* Number of fatal ERRORs generated so far (either 0 or 1).  */
-int alternate = 0;              /* -a on command line.  */
-int mri = 0;			/* -M on command line.  */
-char comment_char = '!';
-int radix = 10;			/* Default radix.  */
-
-int had_end; /* Seen .END.  */
-
-/* The output stream.  */
-FILE *outfile;
-
 /* The attributes of each character are stored as a bit pattern
    chartype, which gives us quick tests.  */
 
@@ -114,28 +102,16 @@ FILE *outfile;
 #define WHITEBIT 8
 #define COMMENTBIT 16
 #define BASEBIT  32
-#define ISCOMMENTCHAR(x) (chartype[(unsigned char)(x)] & COMMENTBIT)
-#define ISFIRSTCHAR(x)  (chartype[(unsigned char)(x)] & FIRSTBIT)
-#define ISNEXTCHAR(x)   (chartype[(unsigned char)(x)] & NEXTBIT)
-#define ISSEP(x)        (chartype[(unsigned char)(x)] & SEPBIT)
-#define ISWHITE(x)      (chartype[(unsigned char)(x)] & WHITEBIT)
-#define ISBASE(x)       (chartype[(unsigned char)(x)] & BASEBIT)
-static char chartype[256];
-
-/* Conditional assembly uses the `ifstack'.  Each aif pushes another
-   entry onto the stack, and sets the on flag if it should.  The aelse
-   sets hadelse, and toggles on.  An aend pops a level.  We limit to
-   100 levels of nesting, not because we're facists pigs with read
-   only minds, but because more than 100 levels of nesting is probably
-   a bug in the user's macro structure.  */
-
-#define IFNESTING 100
-struct {
-  int on;			/* Is the level being output.  */
-  int hadelse;			/* Has an aelse been seen.  */
-} ifstack[IFNESTING];
-
-int ifi;
+#define LABELBIT 64
+#define ISCOMMENTCHAR(x) (ctx->chartype[(unsigned char)(x)] & COMMENTBIT)
+#define ISFIRSTCHAR(x)  (ctx->chartype[(unsigned char)(x)] & FIRSTBIT)
+#define ISNEXTCHAR(x)   (ctx->chartype[(unsigned char)(x)] & NEXTBIT)
+#define ISSEP(x)        (ctx->chartype[(unsigned char)(x)] & SEPBIT)
+#define ISWHITE(x)      (ctx->chartype[(unsigned char)(x)] & WHITEBIT)
+#define ISBASE(x)       (ctx->chartype[(unsigned char)(x)] & BASEBIT)
+
+/* The depth of the include stack.  */
+#define isp (ctx->sp - ctx->include_stack)
 
 /* What to do with all the keywords.  */
 #define PROCESS 	0x1000  /* Run substitution over the line.  */
@@ -221,7 +197,7 @@ typedef enum {
 } exp_t_type;
 
 typedef struct {
-  int value;			/* Constant part.  */
+  long long value;		/* Constant part.  */
   float f_value;
   double d_value;
   exp_t_type type;
@@ -229,253 +205,143 @@ typedef struct {
   symbol sub_symbol;		/* Name part.  */
 } exp_t;
 
-/* Hashing is done in a pretty standard way.  A hash_table has a
-   pointer to a vector of pointers to hash_entrys, and the size of the
-   vector.  A hash_entry contains a union of all the info we like to
-   store in hash table.  If there is a hash collision, hash_entries
-   with the same hash are kept in a chain.  */
-
-/* What the data in a hash_entry means.  */
-typedef enum {
-  hash_integer,			/* Name->integer mapping.  */
-  hash_string,			/* Name->string mapping.  */
-  hash_macro,			/* Name is a macro.  */
-  hash_formal			/* Name is a formal argument.  */
-} hash_type;
-
-typedef struct hs {
-  sb key;			/* Symbol name.  */
-  hash_type type;		/* Symbol meaning.  */
-  union {
-    sb s;
-    int i;
-    struct macro_struct *m;
-    struct formal_struct *f;
-  } value;
-  struct hs *next;		/* Next hash_entry with same hash key.  */
-} hash_entry;
-
-typedef struct {
-  hash_entry **table;
-  int size;
-} hash_table;
-
-/* How we nest files and expand macros etc.
-
-   We keep a stack of of include_stack structs.  Each include file
-   pushes a new level onto the stack.  We keep an sb with a pushback
-   too.  unget chars are pushed onto the pushback sb, getchars first
-   checks the pushback sb before reading from the input stream.
 
-   Small things are expanded by adding the text of the item onto the
-   pushback sb.  Larger items are grown by pushing a new level and
-   allocating the entire pushback buf for the item.  Each time
-   something like a macro is expanded, the stack index is changed.  We
-   can then perform an exitm by popping all entries off the stack with
-   the same stack index.  If we're being reasonable, we can detect
-   recusive expansion by checking the index is reasonably small.  */
-
-typedef enum {
-  include_file, include_repeat, include_while, include_macro
-} include_type;
-
-struct include_stack {
-  sb pushback;			/* Current pushback stream.  */
-  int pushback_index;		/* Next char to read from stream.  */
-  FILE *handle;			/* Open file.  */
-  sb name;			/* Name of file.  */
-  int linecount;		/* Number of lines read so far.  */
-  include_type type;
-  int index;			/* Index of this layer.  */
-} include_stack[MAX_INCLUDES];
-
-struct include_stack *sp;
-#define isp (sp - include_stack)
-
-/* Include file list.  */
-
-typedef struct include_path {
-  struct include_path *next;
-  sb path;
-} include_path;
-
-include_path *paths_head;
-include_path *paths_tail;
-
-char cml_prefix_char; // Char we cot on the command line
-char prefix_char; // Directive marker
-int masp_syntax; // whether we are using the new MASP syntax, or the
-		 // old GASP one
-int line_info;  // Include line number info in output file?
-
-static void quit(void);
+static void quit(masp_context *ctx) ATTRIBUTE_NORETURN;
 static void hash_new_table(int size, hash_table *ptr);
 static int hash(const sb *key);
 static hash_entry *hash_create(hash_table *tab, const sb *key);
-static void hash_add_to_string_table(hash_table *tab, const sb *key, const sb *name, int again);
-static void hash_add_to_int_table(hash_table *tab, const sb *key, int name);
+static void hash_add_to_string_table(masp_context *ctx, hash_table *tab, const sb *key, const sb *name, int again);
 static hash_entry *hash_lookup(hash_table *tab, const sb *key);
-static void checkconst(int op, exp_t *term);
+static void hash_free_table(hash_table *tab);
+static void checkconst(masp_context *ctx, int op, exp_t *term);
 static int is_flonum(int idx, const sb *in);
 static int chew_flonum(int idx, const sb *in, sb *out);
-static int sb_strtol(int idx, const sb *in, int base, int *ptr);
-static int level_0(int idx, const sb *in, exp_t *term);
-static int level_1(int idx, const sb *in, exp_t *term);
-static int level_2(int idx, const sb *in, exp_t *term);
-static int level_3(int idx, const sb *in, exp_t *term);
-static int level_4(int idx, const sb *in, exp_t *term);
-static int level_5(int idx, const sb *in, exp_t *term);
-static int exp_parse(int idx, const sb *in, exp_t *term);
+static int sb_strtol(int idx, const sb *in, int base, long long *ptr);
+static int level_0(masp_context *ctx, int idx, const sb *in, exp_t *term);
+static int level_1(masp_context *ctx, int idx, const sb *in, exp_t *term);
+static int level_2(masp_context *ctx, int idx, const sb *in, exp_t *term);
+static int level_3(masp_context *ctx, int idx, const sb *in, exp_t *term);
+static int level_4(masp_context *ctx, int idx, const sb *in, exp_t *term);
+static int level_5(masp_context *ctx, int idx, const sb *in, exp_t *term);
+static int exp_parse(masp_context *ctx, int idx, const sb *in, exp_t *term);
 static void exp_string(exp_t *term, sb *out);
-static int exp_get_abs(const char *name, int len, const sb *in, int *val);
+static int exp_get_abs(masp_context *ctx, const char *name, int len, const sb *in, long long *val);
 #if 0
 static void strip_comments(sb *);
 #endif
-static void unget(int ch);
-static void include_buf(sb *name, sb *ptr, include_type type, int index);
-static void include_print_where_line(FILE *file);
-static void include_print_line(FILE *file);
-static int get_line(sb *in);
-static int grab_label(sb *in, sb *out);
-static void change_base(int idx, sb *in, sb *out);
-static void do_end(sb *in);
-static void do_assign(int again, int idx, sb *in);
-static void do_radix(sb *ptr);
-static int get_opsize(int idx, sb *in, int *size);
-static int eol(int idx, sb *line);
-static void do_data(int idx, sb *in, int size);
-static void do_datab(int idx, sb *in);
-static void do_align(int idx, sb *in);
-static void do_res(int idx, sb *in, int type);
-static void do_export(sb *in);
-static void do_print(int idx, sb *in);
-static void do_heading(int idx, sb *in);
-static void do_page(void);
-static void do_form(int idx, sb *in);
-static int get_any_string(int idx, sb *in, sb *out, int expand, int pretend_quoted);
-static int skip_openp(int idx, sb *in);
-static int skip_closep(int idx, sb *in);
-static int dolen(int idx, sb *in, sb *out);
-static int doinstr(int idx, sb *in, sb *out);
-static int dosubstr(int idx, sb *in, sb *out);
-static void process_assigns(int idx, sb *in, sb *buf);
-static int get_and_process(int idx, sb *in, sb *out);
-static void process_file(void);
+static void unget(masp_context *ctx, int ch);
+static void include_buf(masp_context *ctx, sb *name, include_type type, int index);
+static void include_link(masp_context *ctx, sb_text *text);
+static void include_link_string(masp_context *ctx, const char *s);
+static void include_print_where_line(masp_context *ctx, FILE *file);
+static void include_print_line(masp_context *ctx);
+static int get_line(masp_context *ctx, sb *in);
+static void end_file_output(masp_context *ctx);
+static int grab_label(masp_context *ctx, sb *in, sb *out);
+static void change_base(masp_context *ctx, int idx, sb *in, sb *out);
+static void do_end(masp_context *ctx, sb *in);
+static void do_assign(masp_context *ctx, int again, int idx, sb *in);
+static void do_radix(masp_context *ctx, sb *ptr);
+static int get_opsize(masp_context *ctx, int idx, sb *in, int *size);
+static int eol(masp_context *ctx, int idx, sb *line);
+static void do_data(masp_context *ctx, int idx, sb *in, int size);
+static void do_datab(masp_context *ctx, int idx, sb *in);
+static void do_align(masp_context *ctx, int idx, sb *in);
+static void do_res(masp_context *ctx, int idx, sb *in, int type);
+static void do_export(masp_context *ctx, sb *in);
+static void do_print(masp_context *ctx, int idx, sb *in);
+static void do_heading(masp_context *ctx, int idx, sb *in);
+static void do_page(masp_context *ctx);
+static void do_form(masp_context *ctx, int idx, sb *in);
+static int get_any_string(masp_context *ctx, int idx, sb *in, sb *out, int expand, int pretend_quoted);
+static int skip_openp(masp_context *ctx, int idx, sb *in);
+static int skip_closep(masp_context *ctx, int idx, sb *in);
+static int dolen(masp_context *ctx, int idx, sb *in, sb *out);
+static int doinstr(masp_context *ctx, int idx, sb *in, sb *out);
+static int dosubstr(masp_context *ctx, int idx, sb *in, sb *out);
+static void process_assigns(masp_context *ctx, int idx, sb *in, sb *buf);
+static int get_and_process(masp_context *ctx, int idx, sb *in, sb *out);
+static void process_file(masp_context *ctx);
+static void scan_file(masp_context *ctx);
 static void free_old_entry(hash_entry *ptr);
-static void do_assigna(int idx, sb *in);
-static void do_assignc(int idx, sb *in);
-static void do_reg(int idx, sb *in);
-static int condass_lookup_name(sb *inbuf, int idx, sb *out, int warn);
-static int whatcond(int idx, sb *in, int *val);
-static int istrue(int idx, sb *in);
-static void do_aif(int idx, sb *in);
-static void do_aelse(void);
-static void do_aendi(void);
-static int condass_on(void);
-static void do_if(int idx, sb *in, int cond);
-static int get_mri_string(int idx, sb *in, sb *val, int terminator);
-static void do_ifc(int idx, sb *in, int ifnc);
-static void do_aendr(void);
-static void do_awhile(int idx, sb *in);
-static void do_aendw(void);
-static void do_exitm(void);
-static void do_arepeat(int idx, sb *in);
-static void do_endm(void);
-static void do_irp(int idx, sb *in, int irpc);
-static void do_local(int idx, sb *in);
-static void do_macro(int idx, sb *in);
-static int macro_op(int idx, sb *in);
-static int getstring(int idx, const sb *in, sb *acc);
-static void do_sdata(int idx, sb *in, int type);
-static void do_sdatab(int idx, sb *in);
-static int new_file(const char *name);
-static void do_include(int idx, sb *in);
-static void include_pop(void);
-static int get(void);
-static int linecount(void);
-static int include_next_index(void);
-static void chartype_init(void);
-static int process_pseudo_op(int idx, sb *line, sb *acc);
-static int process_pseudo_op2(int idx, sb *line, sb *acc);
-static void add_keyword(const char *name, int code);
-static void process_init(void);
-static void do_define(const char *string);
-static void show_usage(FILE *file, int status);
-static void show_help(void);
-
-#define FATAL(x)				\
-  do						\
-    {						\
-      include_print_where_line (stderr);	\
-      fprintf x;				\
-      fatals++;					\
-      quit ();					\
-    }						\
+static void do_assigna(masp_context *ctx, int idx, sb *in);
+static void do_assignc(masp_context *ctx, int idx, sb *in);
+static void do_reg(masp_context *ctx, int idx, sb *in);
+static int condass_lookup_name(masp_context *ctx, sb *inbuf, int idx, sb *out, int warn);
+static int whatcond(masp_context *ctx, int idx, sb *in, int *val);
+static int istrue(masp_context *ctx, int idx, sb *in);
+static void do_aif(masp_context *ctx, int idx, sb *in);
+static void do_aelse(masp_context *ctx);
+static void do_aendi(masp_context *ctx);
+static int condass_on(masp_context *ctx);
+static void do_if(masp_context *ctx, int idx, sb *in, int cond);
+static int get_mri_string(masp_context *ctx, int idx, sb *in, sb *val, int terminator);
+static void do_ifc(masp_context *ctx, int idx, sb *in, int ifnc);
+static void do_aendr(masp_context *ctx);
+static void do_awhile(masp_context *ctx, int idx, sb *in);
+static void do_aendw(masp_context *ctx);
+static void do_exitm(masp_context *ctx);
+static void do_arepeat(masp_context *ctx, int idx, sb *in);
+static void do_endm(masp_context *ctx);
+static void do_irp(masp_context *ctx, int idx, sb *in, int irpc);
+static void do_local(masp_context *ctx, int idx, sb *in);
+static void do_macro(masp_context *ctx, int idx, sb *in);
+static int macro_op(masp_context *ctx, int idx, sb *in);
+static int getstring(masp_context *ctx, int idx, const sb *in, sb *acc);
+static void do_sdata(masp_context *ctx, int idx, sb *in, int type);
+static void do_sdatab(masp_context *ctx, int idx, sb *in);
+static int new_file(masp_context *ctx, const char *name);
+static void new_buffer(masp_context *ctx, const char *name, const char *text, size_t len);
+static void do_include(masp_context *ctx, int idx, sb *in);
+static void include_pop(masp_context *ctx);
+static int get(masp_context *ctx);
+static int linecount(masp_context *ctx);
+static int include_next_index(masp_context *ctx);
+static void chartype_init(masp_context *ctx);
+static int process_pseudo_op(masp_context *ctx, int idx, sb *line, sb *acc);
+static int process_pseudo_op2(masp_context *ctx, int idx, sb *line, sb *acc);
+static void process_init(masp_context *ctx);
+static void do_gasp(masp_context *ctx);
+static void do_masp(masp_context *ctx);
+
+#define FATAL(x)					\
+  do							\
+    {							\
+      include_print_where_line (ctx, ctx->errfile);	\
+      fprintf x;					\
+      ctx->fatals++;					\
+      quit (ctx);					\
+    }							\
   while (0)
 
-#define ERROR(x)				\
-  do						\
-    {						\
-      include_print_where_line (stderr);	\
-      fprintf x;				\
-      errors++;					\
-    }						\
+#define ERROR(x)					\
+  do							\
+    {							\
+      include_print_where_line (ctx, ctx->errfile);	\
+      fprintf x;					\
+      ctx->errors++;					\
+    }							\
   while (0)
 
-#define WARNING(x)				\
-  do						\
-    {						\
-      include_print_where_line (stderr);	\
-      fprintf x;				\
-      warnings++;				\
-    }						\
+#define WARNING(x)					\
+  do							\
+    {							\
+      include_print_where_line (ctx, ctx->errfile);	\
+      fprintf x;					\
+      ctx->warnings++;					\
+    }							\
   while (0)
 
-/* Exit the program and return the right ERROR code.  */
+/* Abandon the run after a fatal error.  Control goes back to the
+   library entry point which started the run, which tidies up the
+   include stack and returns.  */
 
 static void
-quit (void)
+quit (masp_context *ctx)
 {
-  int exitcode;
-  if (fatals + errors)
-    exitcode = 1;
-  else
-    exitcode = 0;
-
-  if (stats)
-    {
-      int i;
-      for (i = 0; i < sb_max_power_two; i++)
-	{
-	  fprintf (stderr, "strings size %8d : %d\n",
-		   1 << i, string_count[i]);
-	}
-    }
-
-  /* Flush and close output file to ensure all data is written.
-     This fixes race conditions when multiple masp processes run in parallel. */
-  if (outfile)
-    {
-      if (fflush (outfile) != 0)
-	{
-	  fprintf (stderr, "Error flushing output file\n");
-	  exitcode = 1;
-	}
-      if (outfile != stdout)
-	{
-	  if (fclose (outfile) != 0)
-	    {
-	      fprintf (stderr, "Error closing output file\n");
-	      exitcode = 1;
-	    }
-	  outfile = NULL;
-	}
-    }
-
-  /* Clean up macro data structures.  */
-  macro_cleanup ();
-
-  exit (exitcode);
+  if (ctx->fatal_return_set)
+    longjmp (ctx->fatal_return, 1);
+  exit (1);
 }
 
 /* Hash table maintenance.  */
@@ -488,6 +354,7 @@ hash_new_table (int size, hash_table *ptr)
 {
   int i;
   ptr->size = size;
+  ptr->generation = 0;
   ptr->table = (hash_entry **) xmalloc (size * (sizeof (hash_entry *)));
   /* Fill with null-pointer, not zero-bit-pattern.  */
   for (i = 0; i < size; i++)
@@ -499,14 +366,7 @@ hash_new_table (int size, hash_table *ptr)
 static int
 hash(const sb *key)
 {
-  unsigned int k = 0x1234u;
-  int i;
-  const unsigned char *p = (const unsigned char *)key->ptr;
-  for (i = 0; i < key->len; i++)
-    {
-      k ^= (k << 2) ^ p[i];
-    }
-  return (int)(k & 0xf0fffu);
+  return symbol_hash (key->ptr, key->len);
 }
 
 /* Look up key in hash_table tab.  If present, then return it,
@@ -531,6 +391,7 @@ hash_create (hash_table *tab, const sb *key)
 	  sb_add_sb (&n->key, key);
 	  table[k] = n;
 	  n->type = hash_integer;
+	  tab->generation++;
 	  return n;
 	}
       if (strncmp (table[k]->key.ptr, key->ptr, key->len) == 0)
@@ -545,7 +406,7 @@ hash_create (hash_table *tab, const sb *key)
    If replacing old value and again, then ERROR.  */
 
 static void
-hash_add_to_string_table (hash_table *tab, const sb *key, const sb *name, int again)
+hash_add_to_string_table (masp_context *ctx, hash_table *tab, const sb *key, const sb *name, int again)
 {
   hash_entry *ptr = hash_create (tab, key);
   if (ptr->type == hash_integer)
@@ -555,7 +416,7 @@ hash_add_to_string_table (hash_table *tab, const sb *key, const sb *name, int ag
   if (ptr->value.s.len)
     {
       if (!again)
-	ERROR ((stderr, _("redefinition not allowed\n")));
+	ERROR ((ctx->errfile, _("redefinition not allowed\n")));
     }
 
   ptr->type = hash_string;
@@ -564,15 +425,6 @@ hash_add_to_string_table (hash_table *tab, const sb *key, const sb *name, int ag
   sb_add_sb (&ptr->value.s, name);
 }
 
-/* Add integer name to hash_table tab with sb key.  */
-
-static void
-hash_add_to_int_table (hash_table *tab, const sb *key, int name)
-{
-  hash_entry *ptr = hash_create (tab, key);
-  ptr->value.i = name;
-}
-
 /* Look up sb key in hash_table tab.
    If found, return hash_entry result, else 0.  */
 
@@ -592,6 +444,29 @@ hash_lookup (hash_table *tab, const sb *key)
   return 0;
 }
 
+/* Free everything in hash_table tab.  */
+
+static void
+hash_free_table (hash_table *tab)
+{
+  int i;
+  for (i = 0; i < tab->size; i++)
+    {
+      hash_entry *p = tab->table[i];
+      while (p)
+	{
+	  hash_entry *next = p->next;
+	  free_old_entry (p);
+	  sb_kill (&p->key);
+	  free (p);
+	  p = next;
+	}
+    }
+  free (tab->table);
+  tab->table = NULL;
+  tab->size = 0;
+}
+
 /* expressions
 
    are handled in a really simple recursive decent way. each bit of
@@ -612,20 +487,20 @@ hash_lookup (hash_table *tab, const sb *key)
    If not the give the op ERROR.  */
 
 static void
-checkconst (int op, exp_t *term)
+checkconst (masp_context *ctx, int op, exp_t *term)
 {
   if (term->add_symbol.len
       || term->sub_symbol.len)
     {
-      ERROR ((stderr, _("the %c operator cannot take non-absolute arguments.\n"), op));
+      ERROR ((ctx->errfile, _("the %c operator cannot take non-absolute arguments.\n"), op));
     }
 }
 
-/* Chew the flonum from the string starting at idx.  Adjust idx to
-   point to the next character after the flonum.  */
+/* Return the index of the first character after the flonum in string
+   starting at idx, or idx if there is none.  */
 
 static int
-chew_flonum (int idx, const sb *string, sb *out)
+flonum_end (int idx, const sb *string)
 {
   /* Manually parse a floating-point literal:
      [0-9]* '.' [0-9]+ ( [eE] [+-]? [0-9]+ )?
@@ -658,6 +533,17 @@ chew_flonum (int idx, const sb *string, sb *out)
 	}
       /* If no digits after 'e' part, ignore the exponent */
     }
+  return i;
+}
+
+/* Chew the flonum from the string starting at idx.  Adjust idx to
+   point to the next character after the flonum.  */
+
+static int
+chew_flonum (int idx, const sb *string, sb *out)
+{
+  int i = flonum_end (idx, string);
+
   sb_add_buffer (out, &string->ptr[idx], i - idx);
   return i;
 }
@@ -683,9 +569,9 @@ is_flonum (int idx, const sb *string)
    ptr, and return the index of the first character not in the number.  */
 
 static int
-sb_strtol (int idx, const sb *string, int base, int *ptr)
+sb_strtol (int idx, const sb *string, int base, long long *ptr)
 {
-  int value = 0;
+  unsigned long long value = 0;
   idx = sb_skip_white (idx, string);
 
   while (idx < string->len)
@@ -716,12 +602,12 @@ sb_strtol (int idx, const sb *string, int base, int *ptr)
       value = value * base + dig;
       idx++;
     }
-  *ptr = value;
+  *ptr = (long long) value;
   return idx;
 }
 
 static int
-level_0 (int idx, const sb *string, exp_t *lhs)
+level_0 (masp_context *ctx, int idx, const sb *string, exp_t *lhs)
 {
   lhs->add_symbol.len = 0;
   lhs->add_symbol.name = 0;
@@ -736,23 +622,21 @@ level_0 (int idx, const sb *string, exp_t *lhs)
 
   if ( is_flonum( idx, string ) ) // myrkraverk
     {
-      sb buf;
-      double d;
-      sb_new (&buf);
-      sb_add_sb (&buf, string);
-      sb_add_char (&buf, '\0');
-      //  if (regexec (&reg, &buf.ptr[idx], 1, &match, 0) != 0)
-
-      //      printf("flonum!!!\n");
-      d = atof( &buf.ptr[idx] );
-      lhs->d_value = d;
-      
+      /* atof wants the flonum on its own; a copy on the stack does for
+	 all but absurdly long ones.  */
+      char buf[64];
+      char *copy = buf;
+      int len = flonum_end (idx, string) - idx;
+
+      if (len >= (int) sizeof buf)
+	copy = (char *) xmalloc (len + 1);
+      memcpy (copy, string->ptr + idx, len);
+      copy[len] = '\0';
+      lhs->d_value = atof (copy);
       lhs->type = exp_t_double;
-      //      printf( "%f\n", d );
-      idx = chew_flonum( idx, string, &buf );
-      //      while ( string->ptr[idx] == 
-
-      sb_kill(&buf);
+      if (copy != buf)
+	free (copy);
+      idx += len;
     }
   else if (ISDIGIT (string->ptr[idx]))
     {
@@ -773,37 +657,37 @@ level_0 (int idx, const sb *string, exp_t *lhs)
     {
       sb acc;
       sb_new (&acc);
-      ERROR ((stderr, _("string where expression expected.\n")));
-      idx = getstring (idx, string, &acc);
+      ERROR ((ctx->errfile, _("string where expression expected.\n")));
+      idx = getstring (ctx, idx, string, &acc);
       sb_kill (&acc);
     }
   else
     {
-      ERROR ((stderr, _("can't find primary in expression.\n")));
+      ERROR ((ctx->errfile, _("can't find primary in expression.\n")));
       idx++;
     }
   return sb_skip_white (idx, string);
 }
 
 static int
-level_1 (int idx, const sb *string, exp_t *lhs)
+level_1 (masp_context *ctx, int idx, const sb *string, exp_t *lhs)
 {
   idx = sb_skip_white (idx, string);
 
   switch (string->ptr[idx])
     {
     case '+':
-      idx = level_1 (idx + 1, string, lhs);
+      idx = level_1 (ctx, idx + 1, string, lhs);
       break;
     case '~':
-      idx = level_1 (idx + 1, string, lhs);
-      checkconst ('~', lhs);
+      idx = level_1 (ctx, idx + 1, string, lhs);
+      checkconst (ctx, '~', lhs);
       lhs->value = ~lhs->value;
       break;
     case '-':
       {
 	symbol t;
-	idx = level_1 (idx + 1, string, lhs);
+	idx = level_1 (ctx, idx + 1, string, lhs);
 	switch ( lhs->type )
 	  {
 	  case exp_t_int:
@@ -823,36 +707,36 @@ level_1 (int idx, const sb *string, exp_t *lhs)
       }
     case '(':
       idx++;
-      idx = level_5 (sb_skip_white (idx, string), string, lhs);
+      idx = level_5 (ctx, sb_skip_white (idx, string), string, lhs);
       if (string->ptr[idx] != ')')
-	ERROR ((stderr, _("misplaced closing parens.\n")));
+	ERROR ((ctx->errfile, _("misplaced closing parens.\n")));
       else
 	idx++;
       break;
     default:
-      idx = level_0 (idx, string, lhs);
+      idx = level_0 (ctx, idx, string, lhs);
       break;
     }
   return sb_skip_white (idx, string);
 }
 
 static int
-level_2 (int idx, const sb *string, exp_t *lhs)
+level_2 (masp_context *ctx, int idx, const sb *string, exp_t *lhs)
 {
   exp_t rhs;
 
-  idx = level_1 (idx, string, lhs);
+  idx = level_1 (ctx, idx, string, lhs);
 
   while (idx < string->len && (string->ptr[idx] == '*'
 			       || string->ptr[idx] == '/'))
     {
       char op = string->ptr[idx++];
-      idx = level_1 (idx, string, &rhs);
+      idx = level_1 (ctx, idx, string, &rhs);
       switch (op)
 	{
 	case '*':
-	  checkconst ('*', lhs);
-	  checkconst ('*', &rhs);
+	  checkconst (ctx, '*', lhs);
+	  checkconst (ctx, '*', &rhs);
 	  switch ( lhs->type )
 	    {
 	    case exp_t_int:
@@ -868,10 +752,10 @@ level_2 (int idx, const sb *string, exp_t *lhs)
 	  break;
 	case '/':
 	  //printf("division\n"); // myrk
-	  checkconst ('/', lhs);
-	  checkconst ('/', &rhs);
+	  checkconst (ctx, '/', lhs);
+	  checkconst (ctx, '/', &rhs);
 	  if ( rhs.type == exp_t_int && rhs.value == 0)
-	    ERROR ((stderr, _("attempt to divide by zero.\n")));
+	    ERROR ((ctx->errfile, _("attempt to divide by zero.\n")));
 	  else
 	    switch( lhs->type )
 	      {
@@ -893,25 +777,25 @@ level_2 (int idx, const sb *string, exp_t *lhs)
 }
 
 static int
-level_3 (int idx, const sb *string, exp_t *lhs)
+level_3 (masp_context *ctx, int idx, const sb *string, exp_t *lhs)
 {
   exp_t rhs;
 
-  idx = level_2 (idx, string, lhs);
+  idx = level_2 (ctx, idx, string, lhs);
 
   while (idx < string->len
 	 && (string->ptr[idx] == '+'
 	     || string->ptr[idx] == '-'))
     {
       char op = string->ptr[idx++];
-      idx = level_2 (idx, string, &rhs);
+      idx = level_2 (ctx, idx, string, &rhs);
       switch (op)
 	{
 	case '+':
 	  lhs->value += rhs.value;
 	  if (lhs->add_symbol.name && rhs.add_symbol.name)
 	    {
-	      ERROR ((stderr, _("can't add two relocatable expressions\n")));
+	      ERROR ((ctx->errfile, _("can't add two relocatable expressions\n")));
 	    }
 	  /* Change nn+symbol to symbol + nn.  */
 	  if (rhs.add_symbol.name)
@@ -929,22 +813,22 @@ level_3 (int idx, const sb *string, exp_t *lhs)
 }
 
 static int
-level_4 (int idx, const sb *string, exp_t *lhs)
+level_4 (masp_context *ctx, int idx, const sb *string, exp_t *lhs)
 {
   exp_t rhs;
 
-  idx = level_3 (idx, string, lhs);
+  idx = level_3 (ctx, idx, string, lhs);
 
   while (idx < string->len &&
 	 string->ptr[idx] == '&')
     {
       char op = string->ptr[idx++];
-      idx = level_3 (idx, string, &rhs);
+      idx = level_3 (ctx, idx, string, &rhs);
       switch (op)
 	{
 	case '&':
-	  checkconst ('&', lhs);
-	  checkconst ('&', &rhs);
+	  checkconst (ctx, '&', lhs);
+	  checkconst (ctx, '&', &rhs);
 	  lhs->value &= rhs.value;
 	  break;
 	}
@@ -953,27 +837,27 @@ level_4 (int idx, const sb *string, exp_t *lhs)
 }
 
 static int
-level_5 (int idx, const sb *string, exp_t *lhs)
+level_5 (masp_context *ctx, int idx, const sb *string, exp_t *lhs)
 {
   exp_t rhs;
 
-  idx = level_4 (idx, string, lhs);
+  idx = level_4 (ctx, idx, string, lhs);
 
   while (idx < string->len
 	 && (string->ptr[idx] == '|' || string->ptr[idx] == '~'))
     {
       char op = string->ptr[idx++];
-      idx = level_4 (idx, string, &rhs);
+      idx = level_4 (ctx, idx, string, &rhs);
       switch (op)
 	{
 	case '|':
-	  checkconst ('|', lhs);
-	  checkconst ('|', &rhs);
+	  checkconst (ctx, '|', lhs);
+	  checkconst (ctx, '|', &rhs);
 	  lhs->value |= rhs.value;
 	  break;
 	case '~':
-	  checkconst ('~', lhs);
-	  checkconst ('~', &rhs);
+	  checkconst (ctx, '~', lhs);
+	  checkconst (ctx, '~', &rhs);
 	  lhs->value ^= rhs.value;
 	  break;
 	}
@@ -986,9 +870,9 @@ level_5 (int idx, const sb *string, exp_t *lhs)
    expression.  */
 
 static int
-exp_parse (int idx, const sb *string, exp_t *res)
+exp_parse (masp_context *ctx, int idx, const sb *string, exp_t *res)
 {
-  return level_5 (sb_skip_white (idx, string), string, res);
+  return level_5 (ctx, sb_skip_white (idx, string), string, res);
 }
 
 /* Turn the expression at exp into text and glue it onto the end of
@@ -1009,10 +893,10 @@ exp_string (exp_t *exp, sb *string)
     }
   if (exp->value)
     {
-      char buf[20];
+      char buf[32];
       if (np)
 	sb_add_char (string, '+');
-      snprintf (buf, sizeof buf, "%d", exp->value);
+      snprintf (buf, sizeof buf, "%lld", exp->value);
       sb_add_string (string, buf);
       np = 1;
       ad = 1;
@@ -1034,28 +918,17 @@ exp_string (exp_t *exp, sb *string)
    the index of the first character past the end of the expression.  */
 
 static int
-exp_get_abs (const char *emsg, int idx, const sb *in, int *val)
+exp_get_abs (masp_context *ctx, const char *emsg, int idx, const sb *in,
+	     long long *val)
 {
   exp_t res;
-  idx = exp_parse (idx, in, &res);
+  idx = exp_parse (ctx, idx, in, &res);
   if (res.add_symbol.len || res.sub_symbol.len)
-    ERROR ((stderr, "%s", emsg));
+    ERROR ((ctx->errfile, "%s", emsg));
   *val = res.value;
   return idx;
 }
 
-/* Current label parsed from line.  */
-sb label;
-
-/* Hash table for all assigned variables.  */
-hash_table assign_hash_table;
-
-/* Hash table for keyword.  */
-hash_table keyword_hash_table;
-
-/* Hash table for eq variables.  */
-hash_table vars;
-
 #define in_comment '#'
 
 #if 0
@@ -1079,105 +952,216 @@ strip_comments (out)
 /* Push back character ch so that it can be read again.  */
 
 static void
-unget (int ch)
+unget (masp_context *ctx, int ch)
 {
   if (ch == '\n')
     {
-      sp->linecount--;
+      ctx->sp->linecount--;
+    }
+  if (ctx->sp->pushback_index)
+    ctx->sp->pushback_index--;
+  else if (ctx->sp->from_piece && ctx->sp->pieces->pos > 0)
+    ctx->sp->pieces->pos--;
+  else
+    sb_add_char (&ctx->sp->pushback, ch);
+}
+
+/* Begin a --trace span on LANE called NAME, of LEN characters, after
+   LABEL if that isn't NULL.  It is placed at the line being read from
+   the innermost file on the include stack.  */
+
+static void
+trace_span (masp_context *ctx, trace_lane lane, const char *cat,
+	    const char *label, const char *name, int len)
+{
+  struct include_stack *p = ctx->sp;
+  char buf[64];
+
+  if (label)
+    {
+      while (len > 0 && ISWHITE (*name))
+	name++, len--;
+      len = snprintf (buf, sizeof buf, "%s %.*s", label, len, name);
+      if (len >= (int) sizeof buf)
+	len = sizeof buf - 1;
+      name = buf;
     }
-  if (sp->pushback_index)
-    sp->pushback_index--;
+  while (p > ctx->include_stack && p->type != include_file)
+    p--;
+  if (p > ctx->include_stack)
+    trace_begin (ctx->trace, lane, cat, name, len,
+		 sb_terminate (&p->name), p->linecount - 1);
   else
-    sb_add_char (&sp->pushback, ch);
+    trace_begin (ctx->trace, lane, cat, name, len, NULL, 0);
+}
+
+/* Push a new level with the given name, type and index onto the
+   include stack.  Its text is linked on afterwards with include_link.  */
+
+static void
+include_buf (masp_context *ctx, sb *name, include_type type, int index)
+{
+  /* A macro expansion is named after the macro by macro_op.  */
+  if (ctx->trace)
+    switch (type)
+      {
+      case include_file:
+	trace_span (ctx, TRACE_INCLUDES, "file", NULL, name->ptr, name->len);
+	break;
+      case include_repeat:
+	trace_span (ctx, TRACE_INCLUDES, "repeat", "AREPEAT",
+		    name->ptr, name->len);
+	break;
+      case include_while:
+	trace_span (ctx, TRACE_INCLUDES, "while", "AWHILE",
+		    name->ptr, name->len);
+	break;
+      default:
+	break;
+      }
+  ctx->sp++;
+  if (ctx->sp - ctx->include_stack >= MAX_INCLUDES)
+    FATAL ((ctx->errfile, _("unreasonable nesting.\n")));
+  if (ctx->profile)
+    profile_depth (ctx->profile, isp);
+  sb_new (&ctx->sp->name);
+  sb_add_sb (&ctx->sp->name, name);
+  ctx->sp->handle = 0;
+  ctx->sp->reader = NULL;
+  ctx->sp->linecount = 1;
+  ctx->sp->pushback_index = 0;
+  ctx->sp->pieces = NULL;
+  ctx->sp->pieces_tail = &ctx->sp->pieces;
+  ctx->sp->from_piece = 0;
+  ctx->sp->type = type;
+  ctx->sp->index = index;
+  ctx->sp->path = NULL;
+  sb_new (&ctx->sp->pushback);
+}
+
+/* Link another reference to text onto the end of the top level.  */
+
+static void
+include_link (masp_context *ctx, sb_text *text)
+{
+  text_piece *p;
+
+  if (text->len == 0)
+    return;
+  p = (text_piece *) xmalloc (sizeof (text_piece));
+  p->next = NULL;
+  p->text = sb_text_ref (text);
+  p->pos = 0;
+  *ctx->sp->pieces_tail = p;
+  ctx->sp->pieces_tail = &p->next;
+}
+
+/* Link a copy of the null terminated string s onto the top level.  */
+
+static void
+include_link_string (masp_context *ctx, const char *s)
+{
+  sb_text *text = sb_text_string (s);
+  include_link (ctx, text);
+  sb_text_unref (text);
 }
 
-/* Push the sb ptr onto the include stack, with the given name, type
-   and index.  */
+/* Free the pieces still linked into the include level at p.  */
 
 static void
-include_buf (sb *name, sb *ptr, include_type type, int index)
-{
-  sp++;
-  if (sp - include_stack >= MAX_INCLUDES)
-    FATAL ((stderr, _("unreasonable nesting.\n")));
-  sb_new (&sp->name);
-  sb_add_sb (&sp->name, name);
-  sp->handle = 0;
-  sp->linecount = 1;
-  sp->pushback_index = 0;
-  sp->type = type;
-  sp->index = index;
-  sb_new (&sp->pushback);
-  sb_add_sb (&sp->pushback, ptr);
+include_free_pieces (struct include_stack *p)
+{
+  while (p->pieces)
+    {
+      text_piece *next = p->pieces->next;
+      sb_text_unref (p->pieces->text);
+      free (p->pieces);
+      p->pieces = next;
+    }
+  p->pieces_tail = &p->pieces;
 }
 
 /* Used in ERROR messages, print info on where the include stack is
    onto file.  */
 
 static void
-include_print_where_line (FILE *file)
+include_print_where_line (masp_context *ctx, FILE *file)
 {
-  struct include_stack *p = include_stack + 1;
+  struct include_stack *p = ctx->include_stack + 1;
 
-  while (p <= sp)
+  while (p <= ctx->sp)
     {
-      fprintf (file, "%s:%d ", sb_name (&p->name), p->linecount - 1);
+      fprintf (file, "%s:%d ", sb_terminate (&p->name), p->linecount - 1);
       p++;
     }
 }
 
-/* Used in listings, print the line number onto file.  */
+/* Used in listings, print the line number to the output.  */
 
 static void
-include_print_line (FILE *file)
+include_print_line (masp_context *ctx)
 {
   int n;
-  struct include_stack *p = include_stack + 1;
+  struct include_stack *p = ctx->include_stack + 1;
 
-  n = fprintf (file, "%4d", p->linecount);
+  n = out_add_int (&ctx->out, p->linecount, 4);
   p++;
-  while (p <= sp)
+  while (p <= ctx->sp)
     {
-      n += fprintf (file, ".%d", p->linecount);
+      out_add_char (&ctx->out, '.');
+      n += 1 + out_add_int (&ctx->out, p->linecount, 0);
       p++;
     }
   while (n < 8 * 3)
     {
-      fprintf (file, " ");
+      out_add_char (&ctx->out, ' ');
       n++;
     }
 }
 
+/* Write a `# LINE "file"' marker for the file on top of the include
+   stack, for -l.  */
+
+static void
+line_marker (masp_context *ctx, int line)
+{
+  out_add_string (&ctx->out, "# ");
+  out_add_int (&ctx->out, line, 0);
+  out_add_string (&ctx->out, " \"");
+  out_add_sb (&ctx->out, &ctx->sp->name);
+  out_add_string (&ctx->out, "\"\n");
+}
+
 /* Read a line from the top of the include stack into sb in.  */
 
 static int
-get_line (sb *in)
+get_line_1 (masp_context *ctx, sb *in)
 {
   int online = 0;
   int more = 1;
 
-  if (copysource)
+  if (ctx->copysource)
     {
-      putc (comment_char, outfile);
-      if (print_line_number)
-	include_print_line (outfile);
+      out_add_char (&ctx->out, ctx->comment_char);
+      if (ctx->print_line_number)
+	include_print_line (ctx);
     }
 
   while (1)
     {
-      int ch = get ();
+      int ch = get (ctx);
 
       while (ch == '\r')
-	ch = get ();
+	ch = get (ctx);
 
       if (ch == EOF)
 	{
 	  //printf( "# %d", include_stack->linecount );
 	  if (online)
 	    {
-	      WARNING ((stderr, _("End of file not at start of line.\n")));
-	      if (copysource)
-		putc ('\n', outfile);
+	      WARNING ((ctx->errfile, _("End of file not at start of line.\n")));
+	      if (ctx->copysource)
+		out_add_char (&ctx->out, '\n');
 	      ch = '\n';
 	    }
 	  else
@@ -1188,35 +1172,35 @@ get_line (sb *in)
 	  break;
 	}
 
-      if (copysource)
+      if (ctx->copysource)
 	{
-	  putc (ch, outfile);
+	  out_add_char (&ctx->out, ch);
 	}
 
       if (ch == '\n')
 	{
-	  ch = get ();
+	  ch = get (ctx);
 	  online = 0;
 	  if (ch == '+')
 	    {
 	      /* Continued line.  */
-	      if (copysource)
+	      if (ctx->copysource)
 		{
-		  putc (comment_char, outfile);
-		  putc ('+', outfile);
+		  out_add_char (&ctx->out, ctx->comment_char);
+		  out_add_char (&ctx->out, '+');
 		}
-	      ch = get ();
+	      ch = get (ctx);
 	    }
 	  else
 	    {
 	      if (ch != EOF)
-		unget (ch);
+		unget (ctx, ch);
 	      break;
 	    }
 	}
       else
 	{
-	  sb_add_char (in, ch);
+	  sb_add_char_fast (in, ch);
 	}
       online++;
     }
@@ -1224,10 +1208,26 @@ get_line (sb *in)
   return more;
 }
 
+static int
+get_line (masp_context *ctx, sb *in)
+{
+  double start;
+  int more;
+
+  if (ctx->nended)
+    end_file_output (ctx);
+  if (!ctx->profile)
+    return get_line_1 (ctx, in);
+  start = profile_clock ();
+  more = get_line_1 (ctx, in);
+  profile_phase_done (ctx->profile, PROFILE_GET_LINE, start);
+  return more;
+}
+
 /* Find a label from sb in and put it in out.  */
 
 static int
-grab_label (sb *in, sb *out)
+grab_label (masp_context *ctx, sb *in, sb *out)
 {
   int i = 0;
   sb_reset (out);
@@ -1235,14 +1235,7 @@ grab_label (sb *in, sb *out)
     {
       sb_add_char (out, in->ptr[i]);
       i++;
-      while ((ISNEXTCHAR (in->ptr[i])
-	      || in->ptr[i] == '\\'
-	      || in->ptr[i] == '&')
-	     && i < in->len)
-	{
-	  sb_add_char (out, in->ptr[i]);
-	  i++;
-	}
+      i = sb_add_class_run (out, i, in, ctx->chartype, LABELBIT);
     }
   return i;
 }
@@ -1251,9 +1244,9 @@ grab_label (sb *in, sb *out)
    find all the other numbers and convert them from the default radix.  */
 
 static void
-change_base (int idx, sb *in, sb *out)
+change_base (masp_context *ctx, int idx, sb *in, sb *out)
 {
-  char buffer[20];
+  char buffer[32];
 
   while (idx < in->len)
     {
@@ -1261,20 +1254,14 @@ change_base (int idx, sb *in, sb *out)
 	  && idx + 1 < in->len
 	  && in->ptr[idx + 1] == '(')
 	{
-	  idx += 2;
-	  while (idx < in->len
-		 && in->ptr[idx] != ')')
-	    {
-	      sb_add_char (out, in->ptr[idx]);
-	      idx++;
-	    }
+	  idx = sb_add_until (out, idx + 2, in, ')');
 	  if (idx < in->len)
 	    idx++;
 	}
-      else if (idx < in->len - 1 && in->ptr[idx + 1] == '\'' && ! mri)
+      else if (idx < in->len - 1 && in->ptr[idx + 1] == '\'' && ! ctx->mri)
 	{
 	  int base;
-	  int value;
+	  long long value;
 	  switch (in->ptr[idx])
 	    {
 	    case 'b':
@@ -1299,25 +1286,20 @@ change_base (int idx, sb *in, sb *out)
 	      base = 256;
 	      break;
 	    default:
-	      ERROR ((stderr, _("Illegal base character %c.\n"), in->ptr[idx]));
+	      ERROR ((ctx->errfile, _("Illegal base character %c.\n"), in->ptr[idx]));
 	      base = 10;
 	      break;
 	    }
 
 	  idx = sb_strtol (idx + 2, in, base, &value);
-	  snprintf (buffer, sizeof buffer, "%d", value);
+	  snprintf (buffer, sizeof buffer, "%lld", value);
 	  sb_add_string (out, buffer);
 	}
       else if (ISFIRSTCHAR (in->ptr[idx]))
 	{
 	  /* Copy entire names through quickly.  */
 	  sb_add_char (out, in->ptr[idx]);
-	  idx++;
-	  while (idx < in->len && ISNEXTCHAR (in->ptr[idx]))
-	    {
-	      sb_add_char (out, in->ptr[idx]);
-	      idx++;
-	    }
+	  idx = sb_add_class_run (out, idx + 1, in, ctx->chartype, NEXTBIT);
 	}
       else if (is_flonum (idx, in))
 	{
@@ -1325,36 +1307,27 @@ change_base (int idx, sb *in, sb *out)
 	}
       else if (ISDIGIT (in->ptr[idx]))
 	{
-	  int value;
+	  long long value;
 	  /* All numbers must start with a digit, let's chew it and
 	     spit out decimal.  */
-	  idx = sb_strtol (idx, in, radix, &value);
-	  snprintf (buffer, sizeof buffer, "%d", value);
+	  idx = sb_strtol (idx, in, ctx->radix, &value);
+	  snprintf (buffer, sizeof buffer, "%lld", value);
 	  sb_add_string (out, buffer);
 
 	  /* Skip all undigsested letters.  */
-	  while (idx < in->len && ISNEXTCHAR (in->ptr[idx]))
-	    {
-	      sb_add_char (out, in->ptr[idx]);
-	      idx++;
-	    }
+	  idx = sb_add_class_run (out, idx, in, ctx->chartype, NEXTBIT);
 	}
       else if (in->ptr[idx] == '"' || in->ptr[idx] == '\'')
 	{
 	  char tchar = in->ptr[idx];
 	  /* Copy entire names through quickly.  */
 	  sb_add_char (out, in->ptr[idx]);
-	  idx++;
-	  while (idx < in->len && in->ptr[idx] != tchar)
-	    {
-	      sb_add_char (out, in->ptr[idx]);
-	      idx++;
-	    }
+	  idx = sb_add_until (out, idx + 1, in, tchar);
 	}
       else
 	{
 	  /* Nothing special, just pass it through.  */
-	  sb_add_char (out, in->ptr[idx]);
+	  sb_add_char_fast (out, in->ptr[idx]);
 	  idx++;
 	}
     }
@@ -1391,31 +1364,22 @@ static int is_base( char a )
 
 
 static void
-change_base2 (int idx, sb *in, sb *out)
+change_base2_1 (masp_context *ctx, int idx, sb *in, sb *out)
 {
-  char buffer[20];
+  char buffer[32];
 
   while (idx < in->len)
     { 
       if ( ISCOMMENTCHAR( in->ptr[ idx ] ) ) // Don't do anything in comments
 	{
-	  while( idx < in->len )
-	    {
-	      sb_add_char (out, in->ptr[idx]);
-	      idx++;
-	    }
+	  sb_add_buffer (out, in->ptr + idx, in->len - idx);
+	  idx = in->len;
 	}
       else if (in->ptr[idx] == '\\'
 	       && idx + 1 < in->len
 	       && in->ptr[idx + 1] == '(')
 	{
-	  idx += 2;
-	  while (idx < in->len
-		 && in->ptr[idx] != ')')
-	    {
-	      sb_add_char (out, in->ptr[idx]);
-	      idx++;
-	    }
+	  idx = sb_add_until (out, idx + 2, in, ')');
 	  if (idx < in->len)
 	    idx++;
 	}
@@ -1423,7 +1387,7 @@ change_base2 (int idx, sb *in, sb *out)
 	       is_base( in->ptr[idx + 1] ) )
 	{
 	  int base;
-	  int value;
+	  long long value;
 	  base = is_base( in->ptr[idx + 1 ] );
 /**//*
 	  if ( base == 1 ) // An ascii char
@@ -1450,10 +1414,10 @@ change_base2 (int idx, sb *in, sb *out)
 		   ( in->ptr[ idx ] != '\t' &&
 		     in->ptr[ idx ] != ' ' &&
 		     in->ptr[ idx ] != ',' &&
-		     in->ptr[ idx ] != comment_char ) )
+		     in->ptr[ idx ] != ctx->comment_char ) )
 		{ // This really is a number, we think
 		  idx = sb_strtol (idx, in, base, &value);
-		  snprintf (buffer, sizeof buffer, "%d", value);
+		  snprintf (buffer, sizeof buffer, "%lld", value);
 		  sb_add_string (out, buffer);
 		}
 	      else // We write out the radix code, it may be something
@@ -1467,12 +1431,7 @@ change_base2 (int idx, sb *in, sb *out)
 	{
 	  /* Copy entire names through quickly.  */
 	  sb_add_char (out, in->ptr[idx]);
-	  idx++;
-	  while (idx < in->len && ISNEXTCHAR (in->ptr[idx]))
-	    {
-	      sb_add_char (out, in->ptr[idx]);
-	      idx++;
-	    }
+	  idx = sb_add_class_run (out, idx + 1, in, ctx->chartype, NEXTBIT);
 	}
       else if (is_flonum (idx, in))
 	{
@@ -1480,42 +1439,48 @@ change_base2 (int idx, sb *in, sb *out)
 	}
       else if (ISDIGIT (in->ptr[idx]))
 	{
-	  int value;
+	  long long value;
 	  /* All numbers must start with a digit, let's chew it and
 	     spit out decimal.  */
-	  idx = sb_strtol (idx, in, radix, &value);
-	  snprintf (buffer, sizeof buffer, "%d", value);
+	  idx = sb_strtol (idx, in, ctx->radix, &value);
+	  snprintf (buffer, sizeof buffer, "%lld", value);
 	  sb_add_string (out, buffer);
 
 	  /* Skip all undigsested letters.  */
-	  while (idx < in->len && ISNEXTCHAR (in->ptr[idx]))
-	    {
-	      sb_add_char (out, in->ptr[idx]);
-	      idx++;
-	    }
+	  idx = sb_add_class_run (out, idx, in, ctx->chartype, NEXTBIT);
 	}
       else if (in->ptr[idx] == '"' || in->ptr[idx] == '\'')
 	{
 	  char tchar = in->ptr[idx];
 	  /* Copy entire names through quickly.  */
 	  sb_add_char (out, in->ptr[idx]);
-	  idx++;
-	  while (idx < in->len && in->ptr[idx] != tchar)
-	    {
-	      sb_add_char (out, in->ptr[idx]);
-	      idx++;
-	    }
+	  idx = sb_add_until (out, idx + 1, in, tchar);
 	}
       else
 	{
 	  /* Nothing special, just pass it through.  */
-	  sb_add_char (out, in->ptr[idx]);
+	  sb_add_char_fast (out, in->ptr[idx]);
 	  idx++;
 	}
     }
 
 }
 
+static void
+change_base2 (masp_context *ctx, int idx, sb *in, sb *out)
+{
+  double start;
+
+  if (!ctx->profile)
+    {
+      change_base2_1 (ctx, idx, in, out);
+      return;
+    }
+  start = profile_clock ();
+  change_base2_1 (ctx, idx, in, out);
+  profile_phase_done (ctx->profile, PROFILE_CHANGE_BASE, start);
+}
+
 
 /* static void */
 /* change_base2 (idx, in, out) */
@@ -1566,7 +1531,7 @@ change_base2 (int idx, sb *in, sb *out)
 /* 	      base = 10; */
 /* 	      break; */
 /* 	    default: */
-/* 	      //ERROR ((stderr, _("Illegal base character %c.\n"), in->ptr[idx])); */
+/* 	      //ERROR ((ctx->errfile, _("Illegal base character %c.\n"), in->ptr[idx])); */
 /* 	      //goto foo; */
 /* 	      base = 10; */
 /* 	      break; */
@@ -1632,50 +1597,52 @@ change_base2 (int idx, sb *in, sb *out)
 /* } */
 /* .end  */
 
-static void do_ifmode( int idx,  sb *in )
+static void do_ifmode(masp_context *ctx,  int idx,  sb *in )
 {
-   if (ifi >= IFNESTING)
+   if (ctx->ifi >= IFNESTING)
      {
-       FATAL ((stderr, _("IFMODE nesting unreasonable.\n")));
+       FATAL ((ctx->errfile, _("IFMODE nesting unreasonable.\n")));
      }
-  ifi++;
-  if (ifstack[ifi - 1].on )
+  if (ctx->trace)
+    trace_span (ctx, TRACE_CONDITIONALS, "conditional", NULL, "IFMODE", 6);
+  ctx->ifi++;
+  if (ctx->ifstack[ctx->ifi - 1].on )
     {
       idx = sb_skip_white( idx, in );
       if ( idx + 3 < in->len )
 	{
 	  if ( strncasecmp ( in->ptr + idx , "GASP", 4) == 0 )
 	    {
-	      ifstack[ifi].on = masp_syntax ? 0 : 1;
+	      ctx->ifstack[ctx->ifi].on = ctx->masp_syntax ? 0 : 1;
 	    }
 	  else     if ( strncasecmp (in->ptr + idx, "MASP", 4) == 0)
-		ifstack[ifi].on = masp_syntax;
+		ctx->ifstack[ctx->ifi].on = ctx->masp_syntax;
 	  else
 	    {
-	       FATAL ((stderr, _("UUU3.\n")));
+	       FATAL ((ctx->errfile, _("UUU3.\n")));
 	    }
 	}
       else
 	{
-	         FATAL ((stderr, _("UUU2.\n")));
+	         FATAL ((ctx->errfile, _("UUU2.\n")));
 	}
     }
   else
     {
-       FATAL ((stderr, _("UUU1.\n")));
+       FATAL ((ctx->errfile, _("UUU1.\n")));
     }
-  ifstack[ifi].hadelse = 0;
+  ctx->ifstack[ctx->ifi].hadelse = 0;
   return;
 }
 
-static int do_expr( int idx, sb *in, sb *out )
+static int do_expr(masp_context *ctx,  int idx, sb *in, sb *out )
 {
   exp_t res;
   char a[256];
   int l;
   if ( in->ptr[idx] == '(' )
     idx++;
-  idx = exp_parse (idx, in, &res);
+  idx = exp_parse (ctx, idx, in, &res);
 
   if ( res.type == exp_t_double )
     {
@@ -1690,7 +1657,7 @@ static int do_expr( int idx, sb *in, sb *out )
   //if ( res.type == exp_t_double )
   //    printf("%f\n", res.d_value );
   //  if (res.add_symbol.len || res.sub_symbol.len)
-  //    ERROR ((stderr, "%s", emsg));
+  //    ERROR ((ctx->errfile, "%s", emsg));
   //  *val = res.value;
   //  return idx;
 
@@ -1699,81 +1666,88 @@ static int do_expr( int idx, sb *in, sb *out )
 }
 
 
-static void do_elseifmode( int idx, sb *in )
+static void do_elseifmode(masp_context *ctx,  int idx, sb *in )
 {
-  ifstack[ifi].on = ifstack[ifi - 1].on ? !ifstack[ifi].on : 0;
-  if (ifstack[ifi].hadelse)
+  ctx->ifstack[ctx->ifi].on = ctx->ifstack[ctx->ifi - 1].on ? !ctx->ifstack[ctx->ifi].on : 0;
+  if (ctx->ifstack[ctx->ifi].hadelse)
     {
-      ERROR ((stderr, _("Multiple ELSEs in IFMODE.\n")));
+      ERROR ((ctx->errfile, _("Multiple ELSEs in IFMODE.\n")));
     }
-  ifstack[ifi].hadelse = 1;
+  ctx->ifstack[ctx->ifi].hadelse = 1;
   return;
 }
 
-static void do_endifmode( int idx, sb *in )
+static void do_endifmode(masp_context *ctx,  int idx, sb *in )
 {
-  if ( ifi )
-    ifi--;
+  if ( ctx->ifi )
+    {
+      ctx->ifi--;
+      if (ctx->trace)
+	trace_end (ctx->trace, TRACE_CONDITIONALS);
+    }
   return;
 }
 
 static void
-do_end (sb *in)
+do_end (masp_context *ctx, sb *in)
 {
-  had_end = 1;
-  if (mri)
-    fprintf (outfile, "%s\n", sb_name (in));
+  ctx->had_end = 1;
+  if (ctx->mri)
+    {
+      out_add_sb (&ctx->out, in);
+      out_add_char (&ctx->out, '\n');
+    }
 }
 
 /* .assign  */
 
 static void
-do_assign (int again, int idx, sb *in)
+do_assign (masp_context *ctx, int again, int idx, sb *in)
 {
   /* Stick label in symbol table with following value.  */
   exp_t e;
   sb acc;
 
   sb_new (&acc);
-  idx = exp_parse (idx, in, &e);
+  idx = exp_parse (ctx, idx, in, &e);
   exp_string (&e, &acc);
-  hash_add_to_string_table (&assign_hash_table, &label, &acc, again);
+  hash_add_to_string_table (ctx, &ctx->assign_hash_table, &ctx->label, &acc, again);
   sb_kill (&acc);
 }
 
 /* .radix [b|q|d|h]  */
 
 static void
-do_radix (sb *ptr)
+do_radix (masp_context *ctx, sb *ptr)
 {
   int idx = sb_skip_white (0, ptr);
   switch (ptr->ptr[idx])
     {
     case 'B':
     case 'b':
-      radix = 2;
+      ctx->radix = 2;
       break;
     case 'q':
     case 'Q':
-      radix = 8;
+      ctx->radix = 8;
       break;
     case 'd':
     case 'D':
-      radix = 10;
+      ctx->radix = 10;
       break;
     case 'h':
     case 'H':
-      radix = 16;
+      ctx->radix = 16;
       break;
     default:
-      ERROR ((stderr, _("radix is %c must be one of b, q, d or h"), radix));
+      ERROR ((ctx->errfile, _("radix is %c must be one of b, q, d or h"), ctx->radix));
     }
 }
 
 /* Parse off a .b, .w or .l.  */
 
 static int
-get_opsize (int idx, sb *in, int *size)
+get_opsize (masp_context *ctx, int idx, sb *in, int *size)
 {
   *size = 4;
   if (in->ptr[idx] == '.')
@@ -1798,7 +1772,7 @@ get_opsize (int idx, sb *in, int *size)
     case '\t':
       break;
     default:
-      ERROR ((stderr, _("size must be one of b, w or l, is %c.\n"), in->ptr[idx]));
+      ERROR ((ctx->errfile, _("size must be one of b, w or l, is %c.\n"), in->ptr[idx]));
       break;
     }
   idx++;
@@ -1807,7 +1781,7 @@ get_opsize (int idx, sb *in, int *size)
 }
 
 static int
-eol (int idx, sb *line)
+eol (masp_context *ctx, int idx, sb *line)
 {
   idx = sb_skip_white (idx, line);
   if (idx < line->len
@@ -1822,7 +1796,7 @@ eol (int idx, sb *line)
     or d[bwl] <data>*  */
 
 static void
-do_data (int idx, sb *in, int size)
+do_data (masp_context *ctx, int idx, sb *in, int size)
 {
   int opsize = 4;
   char *opname = ".yikes!";
@@ -1831,7 +1805,7 @@ do_data (int idx, sb *in, int size)
 
   if (!size)
     {
-      idx = get_opsize (idx, in, &opsize);
+      idx = get_opsize (ctx, idx, in, &opsize);
     }
   else
     {
@@ -1850,134 +1824,149 @@ do_data (int idx, sb *in, int size)
       break;
     }
 
-  fprintf (outfile, "%s\t", opname);
+  out_add_string (&ctx->out, opname);
+  out_add_char (&ctx->out, '\t');
 
   idx = sb_skip_white (idx, in);
 
-  if (alternate
+  if (ctx->alternate
       && idx < in->len
       && in->ptr[idx] == '"')
     {
       int i;
-      idx = getstring (idx, in, &acc);
+      idx = getstring (ctx, idx, in, &acc);
       for (i = 0; i < acc.len; i++)
 	{
 	  if (i)
-	    fprintf (outfile, ",");
-	  fprintf (outfile, "%d", acc.ptr[i]);
+	    out_add_char (&ctx->out, ',');
+	  out_add_int (&ctx->out, acc.ptr[i], 0);
 	}
     }
   else
     {
-      while (!eol (idx, in))
+      while (!eol (ctx, idx, in))
 	{
 	  exp_t e;
-	  idx = exp_parse (idx, in, &e);
+	  idx = exp_parse (ctx, idx, in, &e);
 	  exp_string (&e, &acc);
-	  sb_add_char (&acc, 0);
-	  fprintf (outfile, "%s", acc.ptr);
+	  out_add_sb (&ctx->out, &acc);
 	  if (idx < in->len && in->ptr[idx] == ',')
 	    {
-	      fprintf (outfile, ",");
+	      out_add_char (&ctx->out, ',');
 	      idx++;
 	    }
 	}
     }
   sb_kill (&acc);
-  sb_print_at (outfile, idx, in);
-  fprintf (outfile, "\n");
+  out_add_sb_at (&ctx->out, idx, in);
+  out_add_char (&ctx->out, '\n');
 }
 
 /* .datab [.b|.w|.l] <repeat>,<fill>  */
 
 static void
-do_datab (int idx, sb *in)
+do_datab (masp_context *ctx, int idx, sb *in)
 {
   int opsize;
-  int repeat;
-  int fill;
+  long long repeat;
+  long long fill;
 
-  idx = get_opsize (idx, in, &opsize);
+  idx = get_opsize (ctx, idx, in, &opsize);
 
-  idx = exp_get_abs (_("datab repeat must be constant.\n"), idx, in, &repeat);
+  idx = exp_get_abs (ctx, _("datab repeat must be constant.\n"), idx, in, &repeat);
   idx = sb_skip_comma (idx, in);
-  idx = exp_get_abs (_("datab data must be absolute.\n"), idx, in, &fill);
-
-  fprintf (outfile, ".fill\t%d,%d,%d\n", repeat, opsize, fill);
+  idx = exp_get_abs (ctx, _("datab data must be absolute.\n"), idx, in, &fill);
+
+  out_add_string (&ctx->out, ".fill\t");
+  out_add_int (&ctx->out, repeat, 0);
+  out_add_char (&ctx->out, ',');
+  out_add_int (&ctx->out, opsize, 0);
+  out_add_char (&ctx->out, ',');
+  out_add_int (&ctx->out, fill, 0);
+  out_add_char (&ctx->out, '\n');
 }
 
 /* .align <size>  */
 
 static void
-do_align (int idx, sb *in)
+do_align (masp_context *ctx, int idx, sb *in)
 {
-  int al, have_fill, fill;
+  long long al, fill;
+  int have_fill;
 
-  idx = exp_get_abs (_("align needs absolute expression.\n"), idx, in, &al);
+  idx = exp_get_abs (ctx, _("align needs absolute expression.\n"), idx, in, &al);
   idx = sb_skip_white (idx, in);
   have_fill = 0;
   fill = 0;
-  if (! eol (idx, in))
+  if (! eol (ctx, idx, in))
     {
       idx = sb_skip_comma (idx, in);
-      idx = exp_get_abs (_(".align needs absolute fill value.\n"), idx, in,
+      idx = exp_get_abs (ctx, _(".align needs absolute fill value.\n"), idx, in,
 			 &fill);
       have_fill = 1;
     }
 
-  fprintf (outfile, ".align	%d", al);
+  out_add_string (&ctx->out, ".align\t");
+  out_add_int (&ctx->out, al, 0);
   if (have_fill)
-    fprintf (outfile, ",%d", fill);
-  fprintf (outfile, "\n");
+    {
+      out_add_char (&ctx->out, ',');
+      out_add_int (&ctx->out, fill, 0);
+    }
+  out_add_char (&ctx->out, '\n');
 }
 
 /* .res[.b|.w|.l] <size>  */
 
 static void
-do_res (int idx, sb *in, int type)
+do_res (masp_context *ctx, int idx, sb *in, int type)
 {
   int size = 4;
-  int count = 0;
+  long long count = 0;
 
-  idx = get_opsize (idx, in, &size);
-  while (!eol (idx, in))
+  idx = get_opsize (ctx, idx, in, &size);
+  while (!eol (ctx, idx, in))
     {
       idx = sb_skip_white (idx, in);
       if (in->ptr[idx] == ',')
 	idx++;
-      idx = exp_get_abs (_("res needs absolute expression for fill count.\n"), idx, in, &count);
+      idx = exp_get_abs (ctx, _("res needs absolute expression for fill count.\n"), idx, in, &count);
 
       if (type == 'c' || type == 'z')
 	count++;
 
-      fprintf (outfile, ".space	%d\n", count * size);
+      out_add_string (&ctx->out, ".space\t");
+      out_add_int (&ctx->out, count * size, 0);
+      out_add_char (&ctx->out, '\n');
     }
 }
 
 /* .export  */
 
 static void
-do_export (sb *in)
+do_export (masp_context *ctx, sb *in)
 {
-  fprintf (outfile, ".global	%s\n", sb_name (in));
+  out_add_string (&ctx->out, ".global\t");
+  out_add_sb (&ctx->out, in);
+  out_add_char (&ctx->out, '\n');
 }
 
 /* .print [list] [nolist]  */
 
 static void
-do_print (int idx, sb *in)
+do_print (masp_context *ctx, int idx, sb *in)
 {
   idx = sb_skip_white (idx, in);
   while (idx < in->len)
     {
       if (strncasecmp (in->ptr + idx, "LIST", 4) == 0)
 	{
-	  fprintf (outfile, ".list\n");
+	  out_add_string (&ctx->out, ".list\n");
 	  idx += 4;
 	}
       else if (strncasecmp (in->ptr + idx, "NOLIST", 6) == 0)
 	{
-	  fprintf (outfile, ".nolist\n");
+	  out_add_string (&ctx->out, ".nolist\n");
 	  idx += 6;
 	}
       idx++;
@@ -1987,30 +1976,32 @@ do_print (int idx, sb *in)
 /* .head  */
 
 static void
-do_heading (int idx, sb *in)
+do_heading (masp_context *ctx, int idx, sb *in)
 {
   sb head;
   sb_new (&head);
-  idx = getstring (idx, in, &head);
-  fprintf (outfile, ".title	\"%s\"\n", sb_name (&head));
+  idx = getstring (ctx, idx, in, &head);
+  out_add_string (&ctx->out, ".title\t\"");
+  out_add_sb (&ctx->out, &head);
+  out_add_string (&ctx->out, "\"\n");
   sb_kill (&head);
 }
 
 /* .page  */
 
 static void
-do_page (void)
+do_page (masp_context *ctx)
 {
-  fprintf (outfile, ".eject\n");
+  out_add_string (&ctx->out, ".eject\n");
 }
 
 /* .form [lin=<value>] [col=<value>]  */
 
 static void
-do_form (int idx, sb *in)
+do_form (masp_context *ctx, int idx, sb *in)
 {
-  int lines = 60;
-  int columns = 132;
+  long long lines = 60;
+  long long columns = 132;
   idx = sb_skip_white (idx, in);
 
   while (idx < in->len)
@@ -2019,18 +2010,22 @@ do_form (int idx, sb *in)
       if (strncasecmp (in->ptr + idx, "LIN=", 4) == 0)
 	{
 	  idx += 4;
-	  idx = exp_get_abs (_("form LIN= needs absolute expresssion.\n"), idx, in, &lines);
+	  idx = exp_get_abs (ctx, _("form LIN= needs absolute expresssion.\n"), idx, in, &lines);
 	}
 
       if (strncasecmp (in->ptr + idx, _("COL="), 4) == 0)
 	{
 	  idx += 4;
-	  idx = exp_get_abs (_("form COL= needs absolute expresssion.\n"), idx, in, &columns);
+	  idx = exp_get_abs (ctx, _("form COL= needs absolute expresssion.\n"), idx, in, &columns);
 	}
 
       idx++;
     }
-  fprintf (outfile, ".psize %d,%d\n", lines, columns);
+  out_add_string (&ctx->out, ".psize ");
+  out_add_int (&ctx->out, lines, 0);
+  out_add_char (&ctx->out, ',');
+  out_add_int (&ctx->out, columns, 0);
+  out_add_char (&ctx->out, '\n');
 
 }
 
@@ -2043,7 +2038,7 @@ do_form (int idx, sb *in)
 */
 
 static int
-get_any_string (int idx, sb *in, sb *out, int expand, int pretend_quoted)
+get_any_string (masp_context *ctx, int idx, sb *in, sb *out, int expand, int pretend_quoted)
 {
   sb_reset (out);
   idx = sb_skip_white (idx, in);
@@ -2056,36 +2051,36 @@ get_any_string (int idx, sb *in, sb *out, int expand, int pretend_quoted)
 	    sb_add_char (out, in->ptr[idx++]);
 	}
       else if (in->ptr[idx] == '%'
-	       && alternate
+	       && ctx->alternate
 	       && expand)
 	{
-	  int val;
-	  char buf[20];
+	  long long val;
+	  char buf[30];
 	  /* Turns the next expression into a string.  */
 	  /* xgettext: no-c-format */
-	  idx = exp_get_abs (_("% operator needs absolute expression"),
+	  idx = exp_get_abs (ctx, _("% operator needs absolute expression"),
 			     idx + 1,
 			     in,
 			     &val);
-	  snprintf (buf, sizeof buf, "%d", val);
+	  snprintf (buf, sizeof buf, "%lld", val);
 	  sb_add_string (out, buf);
 	}
       else if (in->ptr[idx] == '"'
 	       || in->ptr[idx] == '<'
-	       || (alternate && in->ptr[idx] == '\''))
+	       || (ctx->alternate && in->ptr[idx] == '\''))
 	{
-	  if (alternate && expand)
+	  if (ctx->alternate && expand)
 	    {
 	      /* Keep the quotes.  */
 	      sb_add_char (out, '\"');
 
-	      idx = getstring (idx, in, out);
+	      idx = getstring (ctx, idx, in, out);
 	      sb_add_char (out, '\"');
 
 	    }
 	  else
 	    {
-	      idx = getstring (idx, in, out);
+	      idx = getstring (ctx, idx, in, out);
 	    }
 	}
       else
@@ -2101,9 +2096,7 @@ get_any_string (int idx, sb *in, sb *out, int expand, int pretend_quoted)
 		{
 		  char tchar = in->ptr[idx];
 		  sb_add_char (out, in->ptr[idx++]);
-		  while (idx < in->len
-			 && in->ptr[idx] != tchar)
-		    sb_add_char (out, in->ptr[idx++]);
+		  idx = sb_add_until (out, idx, in, tchar);
 		  if (idx == in->len)
 		    return idx;
 		}
@@ -2119,11 +2112,11 @@ get_any_string (int idx, sb *in, sb *out, int expand, int pretend_quoted)
    whitespace.  Return the idx of the next char.  */
 
 static int
-skip_openp (int idx, sb *in)
+skip_openp (masp_context *ctx, int idx, sb *in)
 {
   idx = sb_skip_white (idx, in);
   if (in->ptr[idx] != '(')
-    ERROR ((stderr, _("misplaced ( .\n")));
+    ERROR ((ctx->errfile, _("misplaced ( .\n")));
   idx = sb_skip_white (idx + 1, in);
   return idx;
 }
@@ -2132,11 +2125,11 @@ skip_openp (int idx, sb *in)
    whitespace.  Return the idx of the next char.  */
 
 static int
-skip_closep (int idx, sb *in)
+skip_closep (masp_context *ctx, int idx, sb *in)
 {
   idx = sb_skip_white (idx, in);
   if (in->ptr[idx] != ')')
-    ERROR ((stderr, _("misplaced ).\n")));
+    ERROR ((ctx->errfile, _("misplaced ).\n")));
   idx = sb_skip_white (idx + 1, in);
   return idx;
 }
@@ -2144,16 +2137,16 @@ skip_closep (int idx, sb *in)
 /* .len  */
 
 static int
-dolen (int idx, sb *in, sb *out)
+dolen (masp_context *ctx, int idx, sb *in, sb *out)
 {
 
   sb stringout;
   char buffer[10];
 
   sb_new (&stringout);
-  idx = skip_openp (idx, in);
-  idx = get_and_process (idx, in, &stringout);
-  idx = skip_closep (idx, in);
+  idx = skip_openp (ctx, idx, in);
+  idx = get_and_process (ctx, idx, in, &stringout);
+  idx = skip_closep (ctx, idx, in);
   snprintf (buffer, sizeof buffer, "%d", stringout.len);
   sb_add_string (out, buffer);
 
@@ -2164,37 +2157,37 @@ dolen (int idx, sb *in, sb *out)
 /* .instr  */
 
 static int
-doinstr (int idx, sb *in, sb *out)
+doinstr (masp_context *ctx, int idx, sb *in, sb *out)
 {
   sb string;
   sb search;
-  int i;
-  int start;
+  long long i;
+  long long start;
   int res;
   char buffer[10];
 
   sb_new (&string);
   sb_new (&search);
-  idx = skip_openp (idx, in);
-  idx = get_and_process (idx, in, &string);
+  idx = skip_openp (ctx, idx, in);
+  idx = get_and_process (ctx, idx, in, &string);
   idx = sb_skip_comma (idx, in);
-  idx = get_and_process (idx, in, &search);
+  idx = get_and_process (ctx, idx, in, &search);
   idx = sb_skip_comma (idx, in);
   if (ISDIGIT (in->ptr[idx]))
     {
-      idx = exp_get_abs (_(".instr needs absolute expresson.\n"), idx, in, &start);
+      idx = exp_get_abs (ctx, _(".instr needs absolute expresson.\n"), idx, in, &start);
     }
   else
     {
       start = 0;
     }
-  idx = skip_closep (idx, in);
+  idx = skip_closep (ctx, idx, in);
   res = -1;
   for (i = start; i < string.len; i++)
     {
       if (strncmp (string.ptr + i, search.ptr, search.len) == 0)
 	{
-	  res = i;
+	  res = (int) i;
 	  break;
 	}
     }
@@ -2206,20 +2199,20 @@ doinstr (int idx, sb *in, sb *out)
 }
 
 static int
-dosubstr (int idx, sb *in, sb *out)
+dosubstr (masp_context *ctx, int idx, sb *in, sb *out)
 {
   sb string;
-  int pos;
-  int len;
+  long long pos;
+  long long len;
   sb_new (&string);
 
-  idx = skip_openp (idx, in);
-  idx = get_and_process (idx, in, &string);
+  idx = skip_openp (ctx, idx, in);
+  idx = get_and_process (ctx, idx, in, &string);
   idx = sb_skip_comma (idx, in);
-  idx = exp_get_abs (_("need absolute position.\n"), idx, in, &pos);
+  idx = exp_get_abs (ctx, _("need absolute position.\n"), idx, in, &pos);
   idx = sb_skip_comma (idx, in);
-  idx = exp_get_abs (_("need absolute length.\n"), idx, in, &len);
-  idx = skip_closep (idx, in);
+  idx = exp_get_abs (ctx, _("need absolute length.\n"), idx, in, &len);
+  idx = skip_closep (ctx, idx, in);
 
   if (len < 0 || pos < 0 ||
       pos > string.len
@@ -2244,45 +2237,40 @@ dosubstr (int idx, sb *in, sb *out)
 /* Scan line, change tokens in the hash table to their replacements.  */
 
 static void
-process_assigns (int idx, sb *in, sb *buf)
+process_assigns_1 (masp_context *ctx, int idx, sb *in, sb *buf)
 {
   while (idx < in->len)
     {
       hash_entry *ptr;
       if ( ISCOMMENTCHAR( in->ptr[ idx ] ) ) // Do nothing with comments
 	{
-	  while ( idx < in->len )
-	    {
-	      sb_add_char( buf, in->ptr[ idx++ ] );
-	    }
+	  sb_add_buffer (buf, in->ptr + idx, in->len - idx);
+	  idx = in->len;
 	}
       else if (in->ptr[idx] == '\\'
 	  && idx + 1 < in->len
 	  && in->ptr[idx + 1] == '(')
 	{
-	  do
-	    {
-	      sb_add_char (buf, in->ptr[idx]);
-	      idx++;
-	    }
-	  while (idx < in->len && in->ptr[idx - 1] != ')');
+	  /* Copy \( ... ) through untouched, closing paren included.  */
+	  idx = sb_add_until (buf, idx, in, ')');
+	  if (idx < in->len)
+	    sb_add_char (buf, in->ptr[idx++]);
 	}
       else if (in->ptr[idx] == '\\'
 	  && idx + 1 < in->len
 	  && in->ptr[idx + 1] == '&')
 	{
-	  idx = condass_lookup_name (in, idx + 2, buf, 1);
+	  idx = condass_lookup_name (ctx, in, idx + 2, buf, 1);
 	}
       else if (in->ptr[idx] == '\\'
 	       && idx + 1 < in->len
 	       && in->ptr[idx + 1] == '$')
 	{
-	  idx = condass_lookup_name (in, idx + 2, buf, 0);
+	  idx = condass_lookup_name (ctx, in, idx + 2, buf, 0);
 	}
       else if (in->ptr[idx] == '\\' ) // myrk: keyword ?
 	{
 	  sb acc;
-	  char *e;
 	  hash_entry *ptr;
 	  
 /* typedef enum { */
@@ -2311,18 +2299,8 @@ process_assigns (int idx, sb *in, sb *buf)
 
 	  idx++;
 
-	  //	  in = line->ptr + idx;
-	  //	  s = in;
-	  e = in->ptr + idx;
-	  //	  sb_reset (acc);
-
-	  while (idx < in->len && *e && ISFIRSTCHAR (*e))
-	    {
-	      sb_add_char (&acc, *e);
-	      e++;
-	      idx++;
-	    }
-	  ptr = hash_lookup (&keyword_hash_table, &acc);
+	  idx = sb_add_class_run (&acc, idx, in, ctx->chartype, FIRSTBIT);
+	  ptr = hash_lookup (ctx->keyword_hash_table, &acc);
 	  if (!ptr)
 	    {
 	      /* Unknown backslash keyword: leave as-is */
@@ -2334,7 +2312,7 @@ process_assigns (int idx, sb *in, sb *buf)
 	      switch (ptr->value.i)
 		{
 		case K_EXPR:
-		  idx = do_expr (idx, in, buf);
+		  idx = do_expr (ctx, idx, in, buf);
 		  break;
 		default:
 		  /* Unhandled known keyword: copy back */
@@ -2350,7 +2328,7 @@ process_assigns (int idx, sb *in, sb *buf)
 	       && TOUPPER (in->ptr[idx + 1]) == 'L'
 	       && TOUPPER (in->ptr[idx + 2]) == 'E'
 	       && TOUPPER (in->ptr[idx + 3]) == 'N')
-	idx = dolen (idx + 4, in, buf);
+	idx = dolen (ctx, idx + 4, in, buf);
       else if (idx + 6 < in->len
 	       && in->ptr[idx] == '.'
 	       && TOUPPER (in->ptr[idx + 1]) == 'I'
@@ -2358,7 +2336,7 @@ process_assigns (int idx, sb *in, sb *buf)
 	       && TOUPPER (in->ptr[idx + 3]) == 'S'
 	       && TOUPPER (in->ptr[idx + 4]) == 'T'
 	       && TOUPPER (in->ptr[idx + 5]) == 'R')
-	idx = doinstr (idx + 6, in, buf);
+	idx = doinstr (ctx, idx + 6, in, buf);
       else if (idx + 7 < in->len
 	       && in->ptr[idx] == '.'
 	       && TOUPPER (in->ptr[idx + 1]) == 'S'
@@ -2367,7 +2345,7 @@ process_assigns (int idx, sb *in, sb *buf)
 	       && TOUPPER (in->ptr[idx + 4]) == 'S'
 	       && TOUPPER (in->ptr[idx + 5]) == 'T'
 	       && TOUPPER (in->ptr[idx + 6]) == 'R')
-	idx = dosubstr (idx + 7, in, buf);
+	idx = dosubstr (ctx, idx + 7, in, buf);
       else if (ISFIRSTCHAR (in->ptr[idx]))
 	{
 	  /* May be a simple name subsitution, see if we have a word.  */
@@ -2379,7 +2357,7 @@ process_assigns (int idx, sb *in, sb *buf)
 
 	  sb_new (&acc);
 	  sb_add_buffer (&acc, in->ptr + idx, cur - idx);
-	  ptr = hash_lookup (&assign_hash_table, &acc);
+	  ptr = hash_lookup (&ctx->assign_hash_table, &acc);
 	  if (ptr)
 	    {
 	      /* Found a definition for it.  */
@@ -2395,24 +2373,39 @@ process_assigns (int idx, sb *in, sb *buf)
 	}
       else
 	{
-	  sb_add_char (buf, in->ptr[idx++]);
+	  sb_add_char_fast (buf, in->ptr[idx++]);
 	}
     }
 }
 
+static void
+process_assigns (masp_context *ctx, int idx, sb *in, sb *buf)
+{
+  double start;
+
+  if (!ctx->profile)
+    {
+      process_assigns_1 (ctx, idx, in, buf);
+      return;
+    }
+  start = profile_clock ();
+  process_assigns_1 (ctx, idx, in, buf);
+  profile_phase_done (ctx->profile, PROFILE_ASSIGNS, start);
+}
+
 static int
-get_and_process (int idx, sb *in, sb *out)
+get_and_process (masp_context *ctx, int idx, sb *in, sb *out)
 {
   sb t;
   sb_new (&t);
-  idx = get_any_string (idx, in, &t, 1, 0);
-  process_assigns (0, &t, out);
+  idx = get_any_string (ctx, idx, in, &t, 1, 0);
+  process_assigns (ctx, 0, &t, out);
   sb_kill (&t);
   return idx;
 }
 
 static void
-process_file (void)
+process_file (masp_context *ctx)
 {
   sb line;
   sb t1, t2;
@@ -2426,9 +2419,9 @@ process_file (void)
   sb_new (&acc);
   sb_new (&label_in);
   sb_reset (&line);
-  more = get_line (&line);
-  if ( line_info )
-    fprintf( outfile, "# %d \"%s\"\n", sp->linecount - 1, sb_name( &sp->name ) ); // myrkraverk 
+  more = get_line (ctx, &line);
+  if ( ctx->line_info )
+    line_marker (ctx, ctx->sp->linecount - 1); // myrkraverk
   while (more)
     {
       //printf( "$ %s %d\n", sb_name( &sp->name ), sp->linecount );
@@ -2436,20 +2429,20 @@ process_file (void)
       int l;
       if (line.len == 0)
 	{
-	  if (condass_on ())
-	    fprintf (outfile, "\n");
+	  if (condass_on (ctx))
+	    out_add_char (&ctx->out, '\n');
 	}
-      else if (mri
+      else if (ctx->mri
 	       && (line.ptr[0] == '*'
 		   || line.ptr[0] == '!'))
 	{
 	  /* MRI line comment.  */
-	  fprintf (outfile, "%s", sb_name (&line));
+	  out_add_sb (&ctx->out, &line);
 	}
       else
 	{
-	  l = grab_label (&line, &label_in);
-	  sb_reset (&label);
+	  l = grab_label (ctx, &line, &label_in);
+	  sb_reset (&ctx->label);
 
 	  if (line.ptr[l] == ':')
 	    l++;
@@ -2463,7 +2456,7 @@ process_file (void)
 	      /* Munge the label, unless this is EQU or ASSIGN.  */
 	      do_assigns = 1;
 	      if (l < line.len
-		  && (line.ptr[l] == '.' || alternate || mri))
+		  && (line.ptr[l] == '.' || ctx->alternate || ctx->mri))
 		{
 		  int lx = l;
 
@@ -2484,38 +2477,45 @@ process_file (void)
 		       printf( "blah" );
 
 	      if (do_assigns)
-		process_assigns (0, &label_in, &label);
+		process_assigns (ctx, 0, &label_in, &ctx->label);
 	      else
-		sb_add_sb (&label, &label_in);
+		sb_add_sb (&ctx->label, &label_in);
 	    }
 
 	  if (l < line.len)
 	    {
-	      if (( masp_syntax && process_pseudo_op2 (l, &line, &acc)) ||
-		  ( !masp_syntax && process_pseudo_op (l, &line, &acc)))
-		{
+	      double start = ctx->profile ? profile_clock () : 0;
 
+	      ctx->directive = NULL;
+	      if (( ctx->masp_syntax && process_pseudo_op2 (ctx, l, &line, &acc)) ||
+		  ( !ctx->masp_syntax && process_pseudo_op (ctx, l, &line, &acc)))
+		{
+		  if (ctx->profile && ctx->directive)
+		    profile_directive (ctx->profile, ctx->directive->value.i,
+				       ctx->directive->key.ptr,
+				       ctx->directive->key.len, start);
 		}
-	      else if (condass_on ())
+	      else if (condass_on (ctx))
 		{
-		  if (macro_op (l, &line))
+		  if (macro_op (ctx, l, &line))
 		    {
 
 		    }
 		  else
 		    {
 		      {
-			if (label.len)
+			if (ctx->label.len)
 			  {
-			    fprintf (outfile, "%s:\t", sb_name (&label));
+			    out_add_sb (&ctx->out, &ctx->label);
+			    out_add_char (&ctx->out, ':');
 			  }
-			else
-			  fprintf (outfile, "\t");
+			out_add_char (&ctx->out, '\t');
 			sb_reset (&t1);
-			process_assigns (l, &line, &t1);
+			process_assigns (ctx, l, &line, &t1);
 			sb_reset (&t2);
-			change_base2 (0, &t1, &t2);
-			fprintf (outfile, "%s\n", sb_name (&t2));
+			change_base2 (ctx, 0, &t1, &t2);
+			out_add_sb (&ctx->out, &t2);
+			out_add_char (&ctx->out, '\n');
 		      }
 		    }
 		}
@@ -2523,21 +2523,22 @@ process_file (void)
 	  else
 	    {
 	      /* Only a label on this line.  */
-	      if (label.len && condass_on ())
+	      if (ctx->label.len && condass_on (ctx))
 		{
-		  fprintf (outfile, "%s:\n", sb_name (&label));
+		  out_add_sb (&ctx->out, &ctx->label);
+		  out_add_string (&ctx->out, ":\n");
 		}
 	    }
 	}
 
-      if (had_end)
+      if (ctx->had_end)
 	break;
       sb_reset (&line);
-      more = get_line (&line);
+      more = get_line (ctx, &line);
     }
 
-  if (!had_end && !mri)
-    WARNING ((stderr, _("END missing from end of file.\n")));
+  if (!ctx->had_end && !ctx->mri && !ctx->reading_prelude)
+    WARNING ((ctx->errfile, _("END missing from end of file.\n")));
 
   /* Release temporary string buffers to avoid leaks under sanitizers. */
   sb_kill (&label_in);
@@ -2547,6 +2548,67 @@ process_file (void)
   sb_kill (&line);
 }
 
+/* Read the file on top of the include stack for its includes alone,
+   following each .include and doing nothing else.  Includes in macro
+   definitions and under false conditions count as well, which for
+   finding what a file may depend on errs on the safe side.  */
+
+static void
+scan_file (masp_context *ctx)
+{
+  sb line;
+  sb label;
+  sb acc;
+  int more;
+
+  sb_new (&line);
+  sb_new (&label);
+  sb_new (&acc);
+  more = get_line (ctx, &line);
+  while (more)
+    {
+      int l = grab_label (ctx, &line, &label);
+      hash_entry *ptr = NULL;
+
+      if (l < line.len && line.ptr[l] == ':')
+	l++;
+      while (l < line.len && ISWHITE (line.ptr[l]))
+	l++;
+      if (l < line.len
+	  && (line.ptr[l] == ctx->prefix_char || ctx->alternate || ctx->mri))
+	{
+	  if (line.ptr[l] == ctx->prefix_char)
+	    l++;
+	  sb_reset (&acc);
+	  l = sb_add_class_run (&acc, l, &line, ctx->chartype, FIRSTBIT);
+	  ptr = hash_lookup (ctx->keyword_hash_table, &acc);
+	}
+      if (ptr && ptr->value.i == K_INCLUDE)
+	{
+	  /* The name may use -D values.  */
+	  sb_reset (&acc);
+	  process_assigns (ctx, l, &line, &acc);
+	  sb_reset (&line);
+	  if (ctx->masp_syntax)
+	    change_base2 (ctx, 0, &acc, &line);
+	  else
+	    change_base (ctx, 0, &acc, &line);
+	  do_include (ctx, 0, &line);
+	}
+      else if (ptr && ptr->value.i == K_MASP)
+	do_masp (ctx);
+      else if (ptr && ptr->value.i == K_GASP)
+	do_gasp (ctx);
+
+      sb_reset (&line);
+      more = get_line (ctx, &line);
+    }
+
+  sb_kill (&acc);
+  sb_kill (&label);
+  sb_kill (&line);
+}
+
 static void
 free_old_entry (hash_entry *ptr)
 {
@@ -2560,22 +2622,22 @@ free_old_entry (hash_entry *ptr)
 /* name: .ASSIGNA <value>  */
 
 static void
-do_assigna (int idx, sb *in)
+do_assigna (masp_context *ctx, int idx, sb *in)
 {
   sb tmp;
-  int val;
+  long long val;
   sb_new (&tmp);
 
-  process_assigns (idx, in, &tmp);
-  idx = exp_get_abs (_(".ASSIGNA needs constant expression argument.\n"), 0, &tmp, &val);
+  process_assigns (ctx, idx, in, &tmp);
+  idx = exp_get_abs (ctx, _(".ASSIGNA needs constant expression argument.\n"), 0, &tmp, &val);
 
-  if (!label.len)
+  if (!ctx->label.len)
     {
-      ERROR ((stderr, _(".ASSIGNA without label.\n")));
+      ERROR ((ctx->errfile, _(".ASSIGNA without label.\n")));
     }
   else
     {
-      hash_entry *ptr = hash_create (&vars, &label);
+      hash_entry *ptr = hash_create (&ctx->vars, &ctx->label);
       free_old_entry (ptr);
       ptr->type = hash_integer;
       ptr->value.i = val;
@@ -2586,19 +2648,19 @@ do_assigna (int idx, sb *in)
 /* name: .ASSIGNC <string>  */
 
 static void
-do_assignc (int idx, sb *in)
+do_assignc (masp_context *ctx, int idx, sb *in)
 {
   sb acc;
   sb_new (&acc);
-  idx = getstring (idx, in, &acc);
+  idx = getstring (ctx, idx, in, &acc);
 
-  if (!label.len)
+  if (!ctx->label.len)
     {
-      ERROR ((stderr, _(".ASSIGNS without label.\n")));
+      ERROR ((ctx->errfile, _(".ASSIGNS without label.\n")));
     }
   else
     {
-      hash_entry *ptr = hash_create (&vars, &label);
+      hash_entry *ptr = hash_create (&ctx->vars, &ctx->label);
       free_old_entry (ptr);
       ptr->type = hash_string;
       sb_new (&ptr->value.s);
@@ -2610,49 +2672,45 @@ do_assignc (int idx, sb *in)
 /* name: .REG (reg)  */
 
 static void
-do_reg (int idx, sb *in)
+do_reg (masp_context *ctx, int idx, sb *in)
 {
   /* Remove reg stuff from inside parens.  */
   sb what;
-  if (!mri)
-    idx = skip_openp (idx, in);
+  if (!ctx->mri)
+    idx = skip_openp (ctx, idx, in);
   else
     idx = sb_skip_white (idx, in);
   sb_new (&what);
-  while (idx < in->len
-	 && (mri
-	     ? ! eol (idx, in)
-	     : in->ptr[idx] != ')'))
-    {
-      sb_add_char (&what, in->ptr[idx]);
-      idx++;
-    }
-  hash_add_to_string_table (&assign_hash_table, &label, &what, 1);
+  if (!ctx->mri)
+    idx = sb_add_until (&what, idx, in, ')');
+  else
+    while (idx < in->len && ! eol (ctx, idx, in))
+      {
+	sb_add_char (&what, in->ptr[idx]);
+	idx++;
+      }
+  hash_add_to_string_table (ctx, &ctx->assign_hash_table, &ctx->label, &what, 1);
   sb_kill (&what);
 }
 
 static int
-condass_lookup_name (sb *inbuf, int idx, sb *out, int warn)
+condass_lookup_name (masp_context *ctx, sb *inbuf, int idx, sb *out, int warn)
 {
   hash_entry *ptr;
   sb condass_acc;
   sb_new (&condass_acc);
 
-  while (idx < inbuf->len
-	 && ISNEXTCHAR (inbuf->ptr[idx]))
-    {
-      sb_add_char (&condass_acc, inbuf->ptr[idx++]);
-    }
+  idx = sb_add_class_run (&condass_acc, idx, inbuf, ctx->chartype, NEXTBIT);
 
   if (inbuf->ptr[idx] == '\'')
     idx++;
-  ptr = hash_lookup (&vars, &condass_acc);
+  ptr = hash_lookup (&ctx->vars, &condass_acc);
 
   if (!ptr)
     {
       if (warn)
 	{
-	  WARNING ((stderr, _("Can't find preprocessor variable %s.\n"), sb_name (&condass_acc)));
+	  WARNING ((ctx->errfile, _("Can't find preprocessor variable %s.\n"), sb_name (&condass_acc)));
 	}
       else
 	{
@@ -2664,7 +2722,7 @@ condass_lookup_name (sb *inbuf, int idx, sb *out, int warn)
       if (ptr->type == hash_integer)
 	{
 	  char buffer[30];
-	  snprintf (buffer, sizeof buffer, "%d", ptr->value.i);
+	  snprintf (buffer, sizeof buffer, "%lld", ptr->value.i);
 	  sb_add_string (out, buffer);
 	}
       else
@@ -2685,7 +2743,7 @@ condass_lookup_name (sb *inbuf, int idx, sb *out, int warn)
 #define NEVER 7
 
 static int
-whatcond (int idx, sb *in, int *val)
+whatcond (masp_context *ctx, int idx, sb *in, int *val)
 {
   int cond;
 
@@ -2714,7 +2772,7 @@ whatcond (int idx, sb *in, int *val)
     }
   if (cond == NEVER)
     {
-      ERROR ((stderr, _("Comparison operator must be one of EQ, NE, LT, LE, GT or GE.\n")));
+      ERROR ((ctx->errfile, _("Comparison operator must be one of EQ, NE, LT, LE, GT or GE.\n")));
       cond = NEVER;
     }
   idx = sb_skip_white (idx + 2, in);
@@ -2722,32 +2780,108 @@ whatcond (int idx, sb *in, int *val)
   return idx;
 }
 
+/* If there is a single plain "..." string at IDX in IN, which
+   getstring would copy as it stands but for "" standing for ", set
+   *START and *END around what is between the quotes and return the
+   index past it.  Otherwise return -1.  */
+
+static int
+plain_string (masp_context *ctx, int idx, const sb *in, int *start, int *end)
+{
+  idx = sb_skip_white (idx, in);
+  if (ctx->alternate || idx >= in->len || in->ptr[idx] != '"')
+    return -1;
+  *start = ++idx;
+  while (idx < in->len)
+    {
+      if (in->ptr[idx] == '"')
+	{
+	  if (idx + 1 >= in->len || in->ptr[idx + 1] != '"')
+	    break;
+	  idx++;
+	}
+      idx++;
+    }
+  *end = idx;
+  if (idx < in->len)
+    idx++;
+  /* getstring would carry on with a character code.  */
+  if (idx < in->len && in->ptr[idx] == '<')
+    return -1;
+  return idx;
+}
+
+/* Whether the ALEN characters at A and the BLEN at B make the same
+   string.  Each is plain_string text, where "" is one ", if its PLAIN
+   flag is set, and getstring's copy otherwise.  */
+
+static int
+string_same (const char *a, int alen, int a_plain,
+	     const char *b, int blen, int b_plain)
+{
+  while (alen > 0 && blen > 0)
+    {
+      int as = a_plain && *a == '"' ? 2 : 1;
+      int bs = b_plain && *b == '"' ? 2 : 1;
+
+      if (*a != *b)
+	return 0;
+      a += as;
+      alen -= as;
+      b += bs;
+      blen -= bs;
+    }
+  return alen <= 0 && blen <= 0;
+}
+
 static int
-istrue (int idx, sb *in)
+istrue (masp_context *ctx, int idx, sb *in)
 {
   int res;
-  sb acc_a;
-  sb cond;
-  sb acc_b;
-  sb_new (&acc_a);
-  sb_new (&cond);
-  sb_new (&acc_b);
   idx = sb_skip_white (idx, in);
 
   if (in->ptr[idx] == '"')
     {
       int cond;
       int same;
-      /* This is a string comparision.  */
-      idx = getstring (idx, in, &acc_a);
-      idx = whatcond (idx, in, &cond);
-      idx = getstring (idx, in, &acc_b);
-      same = acc_a.len == acc_b.len
-	&& (strncmp (acc_a.ptr, acc_b.ptr, acc_a.len) == 0);
-
-      if (cond != EQ && cond != NE)
+      sb acc_a;
+      sb acc_b;
+      int a_start, a_end, b_start, b_end;
+      int a_plain, b_plain;
+      int next;
+      /* This is a string comparision.  Plain strings are compared
+	 where they stand, others copied out by getstring.  */
+      next = plain_string (ctx, idx, in, &a_start, &a_end);
+      a_plain = next >= 0;
+      if (a_plain)
+	idx = next;
+      else
+	{
+	  sb_new (&acc_a);
+	  idx = getstring (ctx, idx, in, &acc_a);
+	}
+      idx = whatcond (ctx, idx, in, &cond);
+      next = plain_string (ctx, idx, in, &b_start, &b_end);
+      b_plain = next >= 0;
+      if (b_plain)
+	idx = next;
+      else
+	{
+	  sb_new (&acc_b);
+	  idx = getstring (ctx, idx, in, &acc_b);
+	}
+      same = string_same (a_plain ? in->ptr + a_start : acc_a.ptr,
+			  a_plain ? a_end - a_start : acc_a.len, a_plain,
+			  b_plain ? in->ptr + b_start : acc_b.ptr,
+			  b_plain ? b_end - b_start : acc_b.len, b_plain);
+      if (!a_plain)
+	sb_kill (&acc_a);
+      if (!b_plain)
+	sb_kill (&acc_b);
+
+      if (cond != EQ && cond != NE)
 	{
-	  ERROR ((stderr, _("Comparison operator for strings must be EQ or NE\n")));
+	  ERROR ((ctx->errfile, _("Comparison operator for strings must be EQ or NE\n")));
 	  res = 0;
 	}
       else
@@ -2756,20 +2890,20 @@ istrue (int idx, sb *in)
   else
     /* This is a numeric expression.  */
     {
-      int vala;
-      int valb;
+      long long vala;
+      long long valb;
       int cond;
-      idx = exp_get_abs (_("Conditional operator must have absolute operands.\n"), idx, in, &vala);
-      idx = whatcond (idx, in, &cond);
+      idx = exp_get_abs (ctx, _("Conditional operator must have absolute operands.\n"), idx, in, &vala);
+      idx = whatcond (ctx, idx, in, &cond);
       idx = sb_skip_white (idx, in);
       if (in->ptr[idx] == '"')
 	{
-	  WARNING ((stderr, _("String compared against expression.\n")));
+	  WARNING ((ctx->errfile, _("String compared against expression.\n")));
 	  res = 0;
 	}
       else
 	{
-	  idx = exp_get_abs (_("Conditional operator must have absolute operands.\n"), idx, in, &valb);
+	  idx = exp_get_abs (ctx, _("Conditional operator must have absolute operands.\n"), idx, in, &valb);
 	  switch (cond)
 	    {
 	    default:
@@ -2800,74 +2934,556 @@ istrue (int idx, sb *in)
 	}
     }
 
-  sb_kill (&acc_a);
-  sb_kill (&cond);
-  sb_kill (&acc_b);
   return res;
 }
 
+/* Compiled conditions.
+
+   Inside an AWHILE, or a macro called again and again, the same AIF
+   or AWHILE condition comes round many times.  Each time
+   process_assigns copies the line with its \& variables put in, and
+   istrue parses the copy.  A numeric condition made of nothing but
+   decimal numbers, \& variables, the operators and one comparison is
+   instead compiled the first time it is met into a program for a
+   little stack machine, kept in ctx->conds by its text, and run
+   against the variables as they stand.  Each variable is bound to its
+   entry in ctx->vars until hash_create adds another entry there.
+
+   Whatever the compiler isn't sure of goes the usual way, and so does
+   a condition on a variable which isn't set or holds a string, or one
+   which would give a message, such as for a division by zero, so that
+   the results and the messages are just what they were.  */
+
+#define COND_STACK 32		/* The deepest a program may go.  */
+#define COND_MAX 1024		/* The most conditions kept.  */
+
+typedef enum {
+  COND_NUMBER,			/* Push VALUE.  */
+  COND_VARIABLE,		/* Push variable number VALUE.  */
+  COND_NEG, COND_NOT,
+  COND_MUL, COND_DIV, COND_ADD, COND_SUB, COND_AND, COND_OR, COND_XOR
+} cond_opcode;
+
+typedef struct cond_op {
+  cond_opcode code;
+  long long value;
+} cond_op;
+
+typedef struct cond_var {
+  sb name;
+  int start;			/* Where \&name lies in the text.  */
+  int end;
+  hash_entry *entry;		/* Its entry in ctx->vars, or NULL.  */
+  int generation;		/* The table's generation when looked up.  */
+} cond_var;
+
+typedef struct cond_code {
+  sb text;			/* The condition as written.  */
+  int ok;			/* Whether it could be compiled.  */
+  cond_op *ops;
+  int nops;
+  int cond;			/* EQ, NE and so on.  */
+  int cond_at;			/* Where the comparison is in the text.  */
+  int comment;			/* Whether the text ends in a comment.  */
+  cond_var *vars;		/* In the order they appear.  */
+  int nvars;
+} cond_code;
+
+typedef struct cond_compiler {
+  masp_context *ctx;
+  cond_code *code;
+  int idx;
+  int depth;			/* Of the stack, when the program runs.  */
+  int nesting;
+  int bad;
+} cond_compiler;
+
+/* The character OFF past the one being compiled, or 0 past the end.  */
+
+static int
+cond_char (const cond_compiler *cc, int off)
+{
+  const sb *text = &cc->code->text;
+
+  return cc->idx + off < text->len ? text->ptr[cc->idx + off] : 0;
+}
+
+static void
+cond_emit (cond_compiler *cc, cond_opcode op, long long value)
+{
+  cond_code *code = cc->code;
+
+  code->ops = (cond_op *) xrealloc (code->ops,
+				    (code->nops + 1) * sizeof (cond_op));
+  code->ops[code->nops].code = op;
+  code->ops[code->nops].value = value;
+  code->nops++;
+  if (op == COND_NUMBER || op == COND_VARIABLE)
+    {
+      if (++cc->depth > COND_STACK)
+	cc->bad = 1;
+    }
+  else if (op != COND_NEG && op != COND_NOT)
+    cc->depth--;
+}
+
+/* As level_0, for a number or a variable.  */
+
+static void
+cond_primary (cond_compiler *cc)
+{
+  masp_context *ctx = cc->ctx;
+  cond_code *code = cc->code;
+  sb *text = &code->text;
+  int c;
+
+  cc->idx = sb_skip_white (cc->idx, text);
+  c = cond_char (cc, 0);
+  if (ISDIGIT (c) && !is_flonum (cc->idx, text))
+    {
+      long long value;
+
+      cc->idx = sb_strtol (cc->idx, text, 10, &value);
+      cond_emit (cc, COND_NUMBER, value);
+    }
+  else if (c == '\\' && cond_char (cc, 1) == '&')
+    {
+      int start = cc->idx;
+      int end = start + 2;
+      cond_var *v;
+
+      while (end < text->len && ISNEXTCHAR (text->ptr[end]))
+	end++;
+      if (end == start + 2)
+	{
+	  cc->bad = 1;
+	  return;
+	}
+      code->vars = (cond_var *) xrealloc (code->vars,
+					  (code->nvars + 1)
+					  * sizeof (cond_var));
+      v = &code->vars[code->nvars];
+      sb_new (&v->name);
+      sb_add_buffer (&v->name, text->ptr + start + 2, end - start - 2);
+      if (end < text->len && text->ptr[end] == '\'')
+	end++;
+      v->start = start;
+      v->end = end;
+      v->entry = NULL;
+      v->generation = 0;
+      cond_emit (cc, COND_VARIABLE, code->nvars++);
+      cc->idx = end;
+    }
+  else
+    {
+      cc->bad = 1;
+      return;
+    }
+
+  /* Nothing may run on from the number, as another digit or name
+     would once the variable is put in.  */
+  c = cond_char (cc, 0);
+  if (ISNEXTCHAR (c) || c == '.' || c == '\'' || c == '\\')
+    cc->bad = 1;
+}
+
+static void cond_level (cond_compiler *cc, int level);
+
+/* As level_1.  */
+
+static void
+cond_unary (cond_compiler *cc)
+{
+  if (cc->bad || ++cc->nesting > COND_STACK)
+    {
+      cc->bad = 1;
+      return;
+    }
+  cc->idx = sb_skip_white (cc->idx, &cc->code->text);
+  switch (cond_char (cc, 0))
+    {
+    case '+':
+      cc->idx++;
+      cond_unary (cc);
+      break;
+    case '~':
+      cc->idx++;
+      cond_unary (cc);
+      cond_emit (cc, COND_NOT, 0);
+      break;
+    case '-':
+      cc->idx++;
+      cond_unary (cc);
+      cond_emit (cc, COND_NEG, 0);
+      break;
+    case '(':
+      cc->idx++;
+      cond_level (cc, 3);
+      if (cond_char (cc, 0) != ')')
+	cc->bad = 1;
+      else
+	cc->idx++;
+      break;
+    default:
+      cond_primary (cc);
+      break;
+    }
+  cc->nesting--;
+  cc->idx = sb_skip_white (cc->idx, &cc->code->text);
+}
+
+/* As level_2 to level_5, for LEVEL 0 to 3.  */
+
+static void
+cond_level (cond_compiler *cc, int level)
+{
+  static const char ops[4][3] = { "*/", "+-", "&", "|~" };
+  static const cond_opcode codes[4][2] = {
+    { COND_MUL, COND_DIV },
+    { COND_ADD, COND_SUB },
+    { COND_AND, COND_AND },
+    { COND_OR, COND_XOR }
+  };
+  const char *op;
+  int c;
+
+  if (level == 0)
+    cond_unary (cc);
+  else
+    cond_level (cc, level - 1);
+  while (!cc->bad && (c = cond_char (cc, 0)) != 0
+	 && (op = strchr (ops[level], c)) != NULL)
+    {
+      cc->idx++;
+      if (level == 0)
+	cond_unary (cc);
+      else
+	cond_level (cc, level - 1);
+      cond_emit (cc, codes[level][op - ops[level]], 0);
+    }
+}
+
+/* Compile CODE's text, as istrue would take it for a numeric
+   comparison, setting CODE->ok if it can be run compiled.  */
+
+static void
+cond_compile (masp_context *ctx, cond_code *code)
+{
+  sb *text = &code->text;
+  cond_compiler cc;
+  int i;
+
+  cc.ctx = ctx;
+  cc.code = code;
+  cc.idx = 0;
+  cc.depth = 0;
+  cc.nesting = 0;
+  cc.bad = 0;
+
+  cond_level (&cc, 3);
+
+  /* As whatcond.  */
+  cc.idx = sb_skip_white (cc.idx, text);
+  code->cond_at = cc.idx;
+  code->cond = NEVER;
+  if (cc.idx + 1 < text->len)
+    {
+      char a = TOUPPER (cond_char (&cc, 0));
+      char b = TOUPPER (cond_char (&cc, 1));
+
+      if (a == 'E' && b == 'Q')
+	code->cond = EQ;
+      else if (a == 'N' && b == 'E')
+	code->cond = NE;
+      else if (a == 'L' && b == 'T')
+	code->cond = LT;
+      else if (a == 'L' && b == 'E')
+	code->cond = LE;
+      else if (a == 'G' && b == 'T')
+	code->cond = GT;
+      else if (a == 'G' && b == 'E')
+	code->cond = GE;
+    }
+  if (code->cond == NEVER || ISNEXTCHAR (cond_char (&cc, 2)))
+    cc.bad = 1;
+  cc.idx += 2;
+
+  cond_level (&cc, 3);
+
+  cc.idx = sb_skip_white (cc.idx, text);
+  code->comment = cc.idx < text->len && ISCOMMENTCHAR (text->ptr[cc.idx]);
+  if (cc.idx < text->len && !code->comment)
+    cc.bad = 1;
+  /* process_assigns leaves whatever follows a comment character
+     alone, operators and variables too.  */
+  for (i = 0; i < cc.idx && !cc.bad; i++)
+    if (ISCOMMENTCHAR (text->ptr[i]))
+      cc.bad = 1;
+  code->ok = !cc.bad;
+}
+
+static void
+free_cond (const char *text ATTRIBUTE_UNUSED, void *c)
+{
+  cond_code *code = (cond_code *) c;
+  int i;
+
+  for (i = 0; i < code->nvars; i++)
+    sb_kill (&code->vars[i].name);
+  free (code->vars);
+  free (code->ops);
+  sb_kill (&code->text);
+  free (code);
+}
+
+/* The compiled condition for the LEN bytes of TEXT, compiling it if
+   need be, or NULL if there are too many.  */
+
+static cond_code *
+cond_find (masp_context *ctx, const char *text, int len)
+{
+  cond_code *code;
+
+  if (!ctx->conds)
+    ctx->conds = hash_new ();
+  sb_reset (&ctx->cond_key);
+  sb_add_buffer (&ctx->cond_key, text, len);
+  code = (cond_code *) hash_find (ctx->conds, sb_terminate (&ctx->cond_key));
+  if (code)
+    {
+      /* A NUL in the text cuts the key short.  */
+      if (code->text.len != len || memcmp (code->text.ptr, text, len) != 0)
+	return NULL;
+      return code;
+    }
+  if (ctx->nconds >= COND_MAX)
+    return NULL;
+
+  code = (cond_code *) xmalloc (sizeof (cond_code));
+  sb_new (&code->text);
+  sb_add_buffer (&code->text, text, len);
+  code->ops = NULL;
+  code->nops = 0;
+  code->vars = NULL;
+  code->nvars = 0;
+  cond_compile (ctx, code);
+  hash_insert (ctx->conds, ctx->cond_key.ptr, code);
+  ctx->nconds++;
+  return code;
+}
+
+/* Work out the condition at IDX in IN, the line as written, without
+   process_assigns and istrue if it can be done; AIF is set for an
+   AIF, which the line goes through change_base for as well.  Returns
+   0 if it can't.  Otherwise, unless RUN is 0 and the variables are
+   only checked, sets *RESULT, and if it is true and NAME is not NULL,
+   adds the text process_assigns would have made to NAME.  */
+
+static int
+cond_run (masp_context *ctx, int idx, sb *in, int aif, int run,
+	  int *result, sb *name)
+{
+  long long stack[COND_STACK];
+  cond_code *code;
+  int sp = 0;
+  int i;
+
+  if (ctx->mri || ctx->alternate || (aif && ctx->radix != 10))
+    return 0;
+  code = cond_find (ctx, in->ptr + idx, in->len - idx);
+  /* The GASP change_base doesn't leave comments alone.  */
+  if (!code || !code->ok || (aif && code->comment && !ctx->masp_syntax))
+    return 0;
+
+  for (i = 0; i < code->nvars; i++)
+    {
+      cond_var *v = &code->vars[i];
+
+      if (!v->entry || v->generation != ctx->vars.generation)
+	{
+	  v->entry = hash_lookup (&ctx->vars, &v->name);
+	  v->generation = ctx->vars.generation;
+	}
+      if (!v->entry || v->entry->type != hash_integer)
+	return 0;
+    }
+  if (ctx->assign_hash_table.generation)
+    {
+      /* The comparison is a word process_assigns would look up.  */
+      sb word;
+
+      word.ptr = code->text.ptr + code->cond_at;
+      word.len = 2;
+      if (hash_lookup (&ctx->assign_hash_table, &word))
+	return 0;
+    }
+  if (!run)
+    {
+      ctx->cond_hits++;
+      return 1;
+    }
+
+  for (i = 0; i < code->nops; i++)
+    {
+      const cond_op *op = &code->ops[i];
+
+      switch (op->code)
+	{
+	case COND_NUMBER:
+	  stack[sp++] = op->value;
+	  break;
+	case COND_VARIABLE:
+	  stack[sp++] = code->vars[op->value].entry->value.i;
+	  break;
+	case COND_NEG:
+	  stack[sp - 1] = -stack[sp - 1];
+	  break;
+	case COND_NOT:
+	  stack[sp - 1] = ~stack[sp - 1];
+	  break;
+	case COND_DIV:
+	  if (stack[sp - 1] == 0)
+	    return 0;
+	  sp--;
+	  stack[sp - 1] /= stack[sp];
+	  break;
+	default:
+	  sp--;
+	  switch (op->code)
+	    {
+	    case COND_MUL: stack[sp - 1] *= stack[sp]; break;
+	    case COND_ADD: stack[sp - 1] += stack[sp]; break;
+	    case COND_SUB: stack[sp - 1] -= stack[sp]; break;
+	    case COND_AND: stack[sp - 1] &= stack[sp]; break;
+	    case COND_OR: stack[sp - 1] |= stack[sp]; break;
+	    default: stack[sp - 1] ^= stack[sp]; break;
+	    }
+	  break;
+	}
+    }
+
+  switch (code->cond)
+    {
+    case EQ: *result = stack[0] == stack[1]; break;
+    case NE: *result = stack[0] != stack[1]; break;
+    case LT: *result = stack[0] < stack[1]; break;
+    case LE: *result = stack[0] <= stack[1]; break;
+    case GT: *result = stack[0] > stack[1]; break;
+    default: *result = stack[0] >= stack[1]; break;
+    }
+
+  if (*result && name)
+    {
+      int at = 0;
+
+      for (i = 0; i < code->nvars; i++)
+	{
+	  const cond_var *v = &code->vars[i];
+	  char buffer[30];
+
+	  sb_add_buffer (name, code->text.ptr + at, v->start - at);
+	  snprintf (buffer, sizeof buffer, "%lld", v->entry->value.i);
+	  sb_add_string (name, buffer);
+	  at = v->end;
+	}
+      sb_add_buffer (name, code->text.ptr + at, code->text.len - at);
+    }
+  ctx->cond_hits++;
+  return 1;
+}
+
+/* .AIF, when its condition can be run compiled.  LINE is as written,
+   before process_assigns.  Returns 0 if the AIF must be done as
+   usual.  */
+
+static int
+do_aif_compiled (masp_context *ctx, int idx, sb *line)
+{
+  int on = ctx->ifstack[ctx->ifi].on;
+  int res = 0;
+
+  if (ctx->ifi >= IFNESTING
+      || !cond_run (ctx, idx, line, 1, on, &res, NULL))
+    return 0;
+  if (ctx->trace)
+    trace_span (ctx, TRACE_CONDITIONALS, "conditional", NULL, "AIF", 3);
+  ctx->ifi++;
+  ctx->ifstack[ctx->ifi].on = on ? res : 0;
+  ctx->ifstack[ctx->ifi].hadelse = 0;
+  return 1;
+}
+
 /* .AIF  */
 
 static void
-do_aif (int idx, sb *in)
+do_aif (masp_context *ctx, int idx, sb *in)
 {
-  if (ifi >= IFNESTING)
+  if (ctx->ifi >= IFNESTING)
     {
-      FATAL ((stderr, _("AIF nesting unreasonable.\n")));
+      FATAL ((ctx->errfile, _("AIF nesting unreasonable.\n")));
     }
-  ifi++;
-  ifstack[ifi].on = ifstack[ifi - 1].on ? istrue (idx, in) : 0;
-  ifstack[ifi].hadelse = 0;
+  if (ctx->trace)
+    trace_span (ctx, TRACE_CONDITIONALS, "conditional", NULL, "AIF", 3);
+  ctx->ifi++;
+  ctx->ifstack[ctx->ifi].on = ctx->ifstack[ctx->ifi - 1].on ? istrue (ctx, idx, in) : 0;
+  ctx->ifstack[ctx->ifi].hadelse = 0;
 }
 
 /* .AELSE  */
 
 static void
-do_aelse (void)
+do_aelse (masp_context *ctx)
 {
-  ifstack[ifi].on = ifstack[ifi - 1].on ? !ifstack[ifi].on : 0;
-  if (ifstack[ifi].hadelse)
+  ctx->ifstack[ctx->ifi].on = ctx->ifstack[ctx->ifi - 1].on ? !ctx->ifstack[ctx->ifi].on : 0;
+  if (ctx->ifstack[ctx->ifi].hadelse)
+    {
+      ERROR ((ctx->errfile, _("Multiple AELSEs in AIF.\n")));
+    }
+  ctx->ifstack[ctx->ifi].hadelse = 1;
+  if (ctx->trace && ctx->ifi)
     {
-      ERROR ((stderr, _("Multiple AELSEs in AIF.\n")));
+      trace_end (ctx->trace, TRACE_CONDITIONALS);
+      trace_span (ctx, TRACE_CONDITIONALS, "conditional", NULL, "AELSE", 5);
     }
-  ifstack[ifi].hadelse = 1;
 }
 
 /* .AENDI  */
 
 static void
-do_aendi (void)
+do_aendi (masp_context *ctx)
 {
-  if (ifi != 0)
+  if (ctx->ifi != 0)
     {
-      ifi--;
+      ctx->ifi--;
+      if (ctx->trace)
+	trace_end (ctx->trace, TRACE_CONDITIONALS);
     }
   else
     {
-      ERROR ((stderr, _("AENDI without AIF.\n")));
+      ERROR ((ctx->errfile, _("AENDI without AIF.\n")));
     }
 }
 
 static int
-condass_on (void)
+condass_on (masp_context *ctx)
 {
-  return ifstack[ifi].on;
+  return ctx->ifstack[ctx->ifi].on;
 }
 
 /* MRI IFEQ, IFNE, IFLT, IFLE, IFGE, IFGT.  */
 
 static void
-do_if (int idx, sb *in, int cond)
+do_if (masp_context *ctx, int idx, sb *in, int cond)
 {
-  int val;
+  long long val;
   int res;
 
-  if (ifi >= IFNESTING)
+  if (ctx->ifi >= IFNESTING)
     {
-      FATAL ((stderr, _("IF nesting unreasonable.\n")));
+      FATAL ((ctx->errfile, _("IF nesting unreasonable.\n")));
     }
 
-  idx = exp_get_abs (_("Conditional operator must have absolute operands.\n"),
+  idx = exp_get_abs (ctx, _("Conditional operator must have absolute operands.\n"),
 		     idx, in, &val);
   switch (cond)
     {
@@ -2880,15 +3496,17 @@ do_if (int idx, sb *in, int cond)
     case GT: res = val >  0; break;
     }
 
-  ifi++;
-  ifstack[ifi].on = ifstack[ifi - 1].on ? res : 0;
-  ifstack[ifi].hadelse = 0;
+  if (ctx->trace)
+    trace_span (ctx, TRACE_CONDITIONALS, "conditional", NULL, "IF", 2);
+  ctx->ifi++;
+  ctx->ifstack[ctx->ifi].on = ctx->ifstack[ctx->ifi - 1].on ? res : 0;
+  ctx->ifstack[ctx->ifi].hadelse = 0;
 }
 
 /* Get a string for the MRI IFC or IFNC pseudo-ops.  */
 
 static int
-get_mri_string (int idx, sb *in, sb *val, int terminator)
+get_mri_string (masp_context *ctx, int idx, sb *in, sb *val, int terminator)
 {
   idx = sb_skip_white (idx, in);
 
@@ -2931,56 +3549,59 @@ get_mri_string (int idx, sb *in, sb *val, int terminator)
 /* MRI IFC, IFNC  */
 
 static void
-do_ifc (int idx, sb *in, int ifnc)
+do_ifc (masp_context *ctx, int idx, sb *in, int ifnc)
 {
   sb first;
   sb second;
   int res;
 
-  if (ifi >= IFNESTING)
+  if (ctx->ifi >= IFNESTING)
     {
-      FATAL ((stderr, _("IF nesting unreasonable.\n")));
+      FATAL ((ctx->errfile, _("IF nesting unreasonable.\n")));
     }
 
   sb_new (&first);
   sb_new (&second);
 
-  idx = get_mri_string (idx, in, &first, ',');
+  idx = get_mri_string (ctx, idx, in, &first, ',');
 
   if (idx >= in->len || in->ptr[idx] != ',')
     {
-      ERROR ((stderr, _("Bad format for IF or IFNC.\n")));
+      ERROR ((ctx->errfile, _("Bad format for IF or IFNC.\n")));
       return;
     }
 
-  idx = get_mri_string (idx + 1, in, &second, ';');
+  idx = get_mri_string (ctx, idx + 1, in, &second, ';');
 
   res = (first.len == second.len
 	 && strncmp (first.ptr, second.ptr, first.len) == 0);
   res ^= ifnc;
 
-  ifi++;
-  ifstack[ifi].on = ifstack[ifi - 1].on ? res : 0;
-  ifstack[ifi].hadelse = 0;
+  if (ctx->trace)
+    trace_span (ctx, TRACE_CONDITIONALS, "conditional", NULL,
+		ifnc ? "IFNC" : "IFC", ifnc ? 4 : 3);
+  ctx->ifi++;
+  ctx->ifstack[ctx->ifi].on = ctx->ifstack[ctx->ifi - 1].on ? res : 0;
+  ctx->ifstack[ctx->ifi].hadelse = 0;
 }
 
 /* .ENDR  */
 
 static void
-do_aendr (void)
+do_aendr (masp_context *ctx)
 {
-  if (!mri)
-    ERROR ((stderr, _("AENDR without a AREPEAT.\n")));
+  if (!ctx->mri)
+    ERROR ((ctx->errfile, _("AENDR without a AREPEAT.\n")));
   else
-    ERROR ((stderr, _("ENDR without a REPT.\n")));
+    ERROR ((ctx->errfile, _("ENDR without a REPT.\n")));
 }
 
 /* .AWHILE  */
 
 static void
-do_awhile (int idx, sb *in)
+do_awhile (masp_context *ctx, int idx, sb *in)
 {
-  int line = linecount ();
+  int line = linecount (ctx);
   sb exp;
   sb sub;
   int doit;
@@ -2988,11 +3609,14 @@ do_awhile (int idx, sb *in)
   sb_new (&sub);
   sb_new (&exp);
 
-  process_assigns (idx, in, &exp);
-  doit = istrue (0, &exp);
+  if (!cond_run (ctx, idx, in, 0, 1, &doit, &exp))
+    {
+      process_assigns (ctx, idx, in, &exp);
+      doit = istrue (ctx, 0, &exp);
+    }
 
-  if (! buffer_and_nest ("AWHILE", "AENDW", &sub, get_line))
-    FATAL ((stderr, _("AWHILE without a AENDW at %d.\n"), line - 1));
+  if (! buffer_and_nest (ctx, "AWHILE", "AENDW", &sub, get_line))
+    FATAL ((ctx->errfile, _("AWHILE without a AENDW at %d.\n"), line - 1));
 
   /* Turn
      	.AWHILE exp
@@ -3007,29 +3631,37 @@ do_awhile (int idx, sb *in)
 
   if (doit)
     {
-      int index = include_next_index ();
-
+      int index = include_next_index (ctx);
+      sb_text *body;
+      sb_text *cond;
       sb copy;
+
       sb_new (&copy);
-      sb_add_sb (&copy, &sub);
       sb_add_sb (&copy, in);
       sb_add_string (&copy, "\n");
-      sb_add_sb (&copy, &sub);
-      sb_add_string (&copy, "\t.AENDW\n");
-      /* Push another WHILE.  */
-      include_buf (&exp, &copy, include_while, index);
-      sb_kill (&copy);
+      cond = sb_text_adopt (&copy);
+      body = sb_text_adopt (&sub);
+
+      /* Push another WHILE, linking the body in twice.  */
+      include_buf (ctx, &exp, include_while, index);
+      include_link (ctx, body);
+      include_link (ctx, cond);
+      include_link (ctx, body);
+      include_link_string (ctx, "\t.AENDW\n");
+      sb_text_unref (cond);
+      sb_text_unref (body);
     }
+  else
+    sb_kill (&sub);
   sb_kill (&exp);
-  sb_kill (&sub);
 }
 
 /* .AENDW  */
 
 static void
-do_aendw (void)
+do_aendw (masp_context *ctx)
 {
-  ERROR ((stderr, _("AENDW without a AENDW.\n")));
+  ERROR ((ctx->errfile, _("AENDW without a AENDW.\n")));
 }
 
 /* .EXITM
@@ -3037,19 +3669,19 @@ do_aendw (void)
    Pop things off the include stack until the type and index changes.  */
 
 static void
-do_exitm (void)
+do_exitm (masp_context *ctx)
 {
-  include_type type = sp->type;
+  include_type type = ctx->sp->type;
   if (type == include_repeat
       || type == include_while
       || type == include_macro)
     {
-      int index = sp->index;
-      include_pop ();
-      while (sp->index == index
-	     && sp->type == type)
+      int index = ctx->sp->index;
+      include_pop (ctx);
+      while (ctx->sp->index == index
+	     && ctx->sp->type == type)
 	{
-	  include_pop ();
+	  include_pop (ctx);
 	}
     }
 }
@@ -3057,27 +3689,25 @@ do_exitm (void)
 /* .AREPEAT  */
 
 static void
-do_arepeat (int idx, sb *in)
+do_arepeat (masp_context *ctx, int idx, sb *in)
 {
-  int line = linecount ();
+  int line = linecount (ctx);
   sb exp;			/* Buffer with expression in it.  */
-  sb copy;			/* Expanded repeat block.  */
   sb sub;			/* Contents of AREPEAT.  */
-  int rc;
+  long long rc;
   int ret;
-  char buffer[30];
+  char buffer[40];
 
   sb_new (&exp);
-  sb_new (&copy);
   sb_new (&sub);
-  process_assigns (idx, in, &exp);
-  idx = exp_get_abs (_("AREPEAT must have absolute operand.\n"), 0, &exp, &rc);
-  if (!mri)
-    ret = buffer_and_nest ("AREPEAT", "AENDR", &sub, get_line);
+  process_assigns (ctx, idx, in, &exp);
+  idx = exp_get_abs (ctx, _("AREPEAT must have absolute operand.\n"), 0, &exp, &rc);
+  if (!ctx->mri)
+    ret = buffer_and_nest (ctx, "AREPEAT", "AENDR", &sub, get_line);
   else
-    ret = buffer_and_nest ("REPT", "ENDR", &sub, get_line);
+    ret = buffer_and_nest (ctx, "REPT", "ENDR", &sub, get_line);
   if (! ret)
-    FATAL ((stderr, _("AREPEAT without a AENDR at %d.\n"), line - 1));
+    FATAL ((ctx->errfile, _("AREPEAT without a AENDR at %d.\n"), line - 1));
   if (rc > 0)
     {
       /* Push back the text following the repeat, and another repeat block
@@ -3091,52 +3721,54 @@ do_arepeat (int idx, sb *in)
 	 foo
 	 .AENDR
       */
-      int index = include_next_index ();
-      sb_add_sb (&copy, &sub);
+      int index = include_next_index (ctx);
+      sb_text *body = sb_text_adopt (&sub);
+
+      include_buf (ctx, &exp, include_repeat, index);
+      include_link (ctx, body);
       if (rc > 1)
 	{
-	  if (!mri)
-	    snprintf (buffer, sizeof buffer, "\t.AREPEAT\t%d\n", rc - 1);
+	  if (!ctx->mri)
+	    snprintf (buffer, sizeof buffer, "\t.AREPEAT\t%lld\n", rc - 1);
 	  else
-	    snprintf (buffer, sizeof buffer, "\tREPT\t%d\n", rc - 1);
-	  sb_add_string (&copy, buffer);
-	  sb_add_sb (&copy, &sub);
-	  if (!mri)
-	    sb_add_string (&copy, "	.AENDR\n");
+	    snprintf (buffer, sizeof buffer, "\tREPT\t%lld\n", rc - 1);
+	  include_link_string (ctx, buffer);
+	  include_link (ctx, body);
+	  if (!ctx->mri)
+	    include_link_string (ctx, "	.AENDR\n");
 	  else
-	    sb_add_string (&copy, "	ENDR\n");
+	    include_link_string (ctx, "	ENDR\n");
 	}
-
-      include_buf (&exp, &copy, include_repeat, index);
+      sb_text_unref (body);
     }
+  else
+    sb_kill (&sub);
   sb_kill (&exp);
-  sb_kill (&sub);
-  sb_kill (&copy);
 }
 
 /* .ENDM  */
 
 static void
-do_endm (void)
+do_endm (masp_context *ctx)
 {
-  ERROR ((stderr, _(".ENDM without a matching .MACRO.\n")));
+  ERROR ((ctx->errfile, _(".ENDM without a matching .MACRO.\n")));
 }
 
 /* MRI IRP pseudo-op.  */
 
 static void
-do_irp (int idx, sb *in, int irpc)
+do_irp (masp_context *ctx, int idx, sb *in, int irpc)
 {
   const char *err;
   sb out;
 
   sb_new (&out);
 
-  err = expand_irp (irpc, idx, in, &out, get_line, comment_char);
+  err = expand_irp (ctx, irpc, idx, in, &out, get_line, ctx->comment_char);
   if (err != NULL)
-    ERROR ((stderr, "%s\n", err));
+    ERROR ((ctx->errfile, "%s\n", err));
 
-  fprintf (outfile, "%s", sb_terminate (&out));
+  out_add_sb (&ctx->out, &out);
 
   sb_kill (&out);
 }
@@ -3146,46 +3778,67 @@ do_irp (int idx, sb *in, int irpc)
 /* Parse off LOCAL n1, n2,... Invent a label name for it.  */
 
 static void
-do_local (int idx, sb *line)
+do_local (masp_context *ctx, int idx, sb *line)
 {
-  ERROR ((stderr, _("LOCAL outside of MACRO")));
+  ERROR ((ctx->errfile, _("LOCAL outside of MACRO")));
 }
 
 static void
-do_macro (int idx, sb *in)
+do_macro (masp_context *ctx, int idx, sb *in)
 {
   const char *err;
-  int line = linecount ();
+  int line = linecount (ctx);
 
-  err = define_macro (idx, in, &label, get_line, (const char **) NULL);
+  err = define_macro (ctx, idx, in, &ctx->label, get_line, (const char **) NULL);
   if (err != NULL)
-    ERROR ((stderr, _("macro at line %d: %s\n"), line - 1, err));
+    ERROR ((ctx->errfile, _("macro at line %d: %s\n"), line - 1, err));
 }
 
 static int
-macro_op (int idx, sb *in)
+macro_op (masp_context *ctx, int idx, sb *in)
 {
   const char *err;
   sb out;
   sb name;
+  sb_text *text;
+  double start;
 
-  if (! macro_defined)
+  if (! ctx->macro_defined)
     return 0;
 
   sb_terminate (in);
-  if (! check_macro (in->ptr + idx, &out, comment_char, &err, NULL))
+  start = ctx->profile ? profile_clock () : 0;
+  if (! check_macro (ctx, in->ptr + idx, &out, ctx->comment_char, &err, NULL))
     return 0;
 
+  if (ctx->profile || ctx->trace)
+    {
+      /* The name as check_macro found it.  */
+      int end = idx + 1;
+      while (ISALNUM (in->ptr[end]) || in->ptr[end] == '_'
+	     || in->ptr[end] == '$')
+	end++;
+      if (ctx->profile)
+	profile_macro (ctx->profile, in->ptr + idx, end - idx, out.len,
+		       start);
+      if (ctx->trace)
+	trace_span (ctx, TRACE_INCLUDES, "macro", NULL,
+		    in->ptr + idx, end - idx);
+    }
+
   if (err != NULL)
-    ERROR ((stderr, "%s\n", err));
+    ERROR ((ctx->errfile, "%s\n", err));
 
   sb_new (&name);
   sb_add_string (&name, _("macro expansion"));
 
-  include_buf (&name, &out, include_macro, include_next_index ());
+  /* The expansion is linked into the new level as it stands.  */
+  text = sb_text_adopt (&out);
+  include_buf (ctx, &name, include_macro, include_next_index (ctx));
+  include_link (ctx, text);
+  sb_text_unref (text);
 
   sb_kill (&name);
-  sb_kill (&out);
 
   return 1;
 }
@@ -3193,18 +3846,18 @@ macro_op (int idx, sb *in)
 /* String handling.  */
 
 static int
-getstring (int idx, const sb *in, sb *acc)
+getstring (masp_context *ctx, int idx, const sb *in, sb *acc)
 {
   idx = sb_skip_white (idx, in);
 
   while (idx < in->len
 	 && (in->ptr[idx] == '"'
 	     || in->ptr[idx] == '<'
-	     || (in->ptr[idx] == '\'' && alternate)))
+	     || (in->ptr[idx] == '\'' && ctx->alternate)))
     {
       if (in->ptr[idx] == '<')
 	{
-	  if (alternate || mri)
+	  if (ctx->alternate || ctx->mri)
 	    {
 	      int nest = 0;
 	      idx++;
@@ -3229,24 +3882,32 @@ getstring (int idx, const sb *in, sb *acc)
 	    }
 	  else
 	    {
-	      int code;
+	      long long code;
 	      idx++;
-	      idx = exp_get_abs (_("Character code in string must be absolute expression.\n"),
+	      idx = exp_get_abs (ctx, _("Character code in string must be absolute expression.\n"),
 				 idx, in, &code);
 	      sb_add_char (acc, code);
 
 	      if (in->ptr[idx] != '>')
-		ERROR ((stderr, _("Missing > for character code.\n")));
+		ERROR ((ctx->errfile, _("Missing > for character code.\n")));
 	      idx++;
 	    }
 	}
       else if (in->ptr[idx] == '"' || in->ptr[idx] == '\'')
 	{
 	  char tchar = in->ptr[idx];
+	  char stops[3];
+
+	  stops[0] = tchar;
+	  stops[1] = ctx->alternate ? '!' : '\0';
+	  stops[2] = '\0';
 	  idx++;
 	  while (idx < in->len)
 	    {
-	      if (alternate && in->ptr[idx] == '!')
+	      idx = sb_add_until_any (acc, idx, in, stops);
+	      if (idx >= in->len)
+		break;
+	      if (ctx->alternate && in->ptr[idx] == '!')
 		{
 		  idx++;
 		  sb_add_char (acc, in->ptr[idx++]);
@@ -3272,384 +3933,1292 @@ getstring (int idx, const sb *in, sb *acc)
 /* .SDATA[C|Z] <string>  */
 
 static void
-do_sdata (int idx, sb *in, int type)
+do_sdata (masp_context *ctx, int idx, sb *in, int type)
 {
   int nc = 0;
   int pidx = -1;
   sb acc;
   sb_new (&acc);
-  fprintf (outfile, ".byte\t");
+  out_add_string (&ctx->out, ".byte\t");
 
-  while (!eol (idx, in))
+  while (!eol (ctx, idx, in))
     {
       int i;
       sb_reset (&acc);
       idx = sb_skip_white (idx, in);
-      while (!eol (idx, in))
+      while (!eol (ctx, idx, in))
 	{
-	  pidx = idx = get_any_string (idx, in, &acc, 0, 1);
+	  pidx = idx = get_any_string (ctx, idx, in, &acc, 0, 1);
 	  if (type == 'c')
 	    {
 	      if (acc.len > 255)
 		{
-		  ERROR ((stderr, _("string for SDATAC longer than 255 characters (%d).\n"), acc.len));
+		  ERROR ((ctx->errfile, _("string for SDATAC longer than 255 characters (%d).\n"), acc.len));
 		}
-	      fprintf (outfile, "%d", acc.len);
+	      out_add_int (&ctx->out, acc.len, 0);
 	      nc = 1;
 	    }
 
 	  for (i = 0; i < acc.len; i++)
 	    {
 	      if (nc)
-		{
-		  fprintf (outfile, ",");
-		}
-	      fprintf (outfile, "%d", acc.ptr[i]);
+		out_add_char (&ctx->out, ',');
+	      out_add_int (&ctx->out, acc.ptr[i], 0);
 	      nc = 1;
 	    }
 
 	  if (type == 'z')
 	    {
 	      if (nc)
-		fprintf (outfile, ",");
-	      fprintf (outfile, "0");
+		out_add_char (&ctx->out, ',');
+	      out_add_char (&ctx->out, '0');
 	    }
 	  idx = sb_skip_comma (idx, in);
 	  if (idx == pidx)
 	    break;
 	}
-      if (!alternate && in->ptr[idx] != ',' && idx != in->len)
+      if (!ctx->alternate && in->ptr[idx] != ',' && idx != in->len)
 	{
-	  fprintf (outfile, "\n");
-	  ERROR ((stderr, _("illegal character in SDATA line (0x%x).\n"),
+	  out_add_char (&ctx->out, '\n');
+	  ERROR ((ctx->errfile, _("illegal character in SDATA line (0x%x).\n"),
 		  in->ptr[idx]));
 	  break;
 	}
       idx++;
     }
   sb_kill (&acc);
-  fprintf (outfile, "\n");
+  out_add_char (&ctx->out, '\n');
 }
 
 /* .SDATAB <count> <string>  */
 
 static void
-do_sdatab (int idx, sb *in)
+do_sdatab (masp_context *ctx, int idx, sb *in)
 {
-  int repeat;
-  int i;
+  long long repeat;
+  long long i;
   sb acc;
   sb_new (&acc);
 
-  idx = exp_get_abs (_("Must have absolute SDATAB repeat count.\n"), idx, in, &repeat);
+  idx = exp_get_abs (ctx, _("Must have absolute SDATAB repeat count.\n"), idx, in, &repeat);
   if (repeat <= 0)
     {
-      ERROR ((stderr, _("Must have positive SDATAB repeat count (%d).\n"), repeat));
+      ERROR ((ctx->errfile, _("Must have positive SDATAB repeat count (%lld).\n"), repeat));
       repeat = 1;
     }
 
   idx = sb_skip_comma (idx, in);
-  idx = getstring (idx, in, &acc);
+  idx = getstring (ctx, idx, in, &acc);
 
   for (i = 0; i < repeat; i++)
     {
       if (i)
-	fprintf (outfile, "\t");
-      fprintf (outfile, ".byte\t");
-      sb_print (outfile, &acc);
-      fprintf (outfile, "\n");
+	out_add_char (&ctx->out, '\t');
+      out_add_string (&ctx->out, ".byte\t");
+      out_add_bytes (&ctx->out, &acc);
+      out_add_char (&ctx->out, '\n');
     }
   sb_kill (&acc);
 
 }
 
-static int
-new_file (const char *name)
+/* Return the path to open for the file NAME, which is relative to the
+   context's directory if it has one.  The result is NAME itself or
+   else malloced.  */
+
+static char *
+context_path (masp_context *ctx, const char *name)
 {
-  FILE *newone = fopen (name, "r");
-  if (!newone)
-    return 0;
+  if (!ctx->directory)
+    return (char *) name;
+  return resolve_path (ctx->directory, name);
+}
 
-  if (isp == MAX_INCLUDES)
-    FATAL ((stderr, _("Unreasonable include depth (%ld).\n"), (long) isp));
+/* Note that the file at PATH has been read, unless it already has
+   been.  Returns its name as kept in files_read.  */
 
-  sp++;
-  sp->handle = newone;
+static const char *
+record_file (masp_context *ctx, const char *path)
+{
+  char *copy;
 
-  sb_new (&sp->name);
-  sb_add_string (&sp->name, name);
+  if (!ctx->files_seen)
+    ctx->files_seen = hash_new ();
+  else if ((copy = (char *) hash_find (ctx->files_seen, path)) != NULL)
+    return copy;
 
-  sp->linecount = 1;
-  sp->pushback_index = 0;
-  sp->type = include_file;
-  sp->index = 0;
-  sb_new (&sp->pushback);
-  if ( line_info )
-    fprintf( outfile, "# %d \"%s\"\n", sp->linecount, sb_name( &sp->name ) ); // myrkraverk 
-  //fprintf( outfile, "# %s %d\n", sb_name( &sp->name ), sp->linecount  ); // myrkraverk
-  return 1;
+  copy = xstrdup (path);
+  hash_insert (ctx->files_seen, copy, copy);
+  if (ctx->nfiles_read == ctx->files_read_alloc)
+    {
+      ctx->files_read_alloc = ctx->files_read_alloc * 2 + 8;
+      ctx->files_read = (char **) xrealloc (ctx->files_read,
+					    ctx->files_read_alloc
+					    * sizeof (char *));
+    }
+  ctx->files_read[ctx->nfiles_read++] = copy;
+  return copy;
 }
 
+/* Note where the output is as the file PATH, just pushed, starts, so
+   that what it writes can be kept when it is popped.  */
+
 static void
-do_include (int idx, sb *in)
+start_file_output (masp_context *ctx, const char *path)
 {
-  sb t;
-  sb cat;
-  include_path *includes;
+  ctx->sp->path = path;
+  ctx->sp->out_at = ctx->file_output ? outbuf_tell (&ctx->out) : 0;
+}
 
-  sb_new (&t);
-  sb_new (&cat);
+/* Keep what each file popped since the last line wrote, if it was the
+   first time it was read.  */
 
-  if (! mri)
-    idx = getstring (idx, in, &t);
-  else
+static void
+end_file_output (masp_context *ctx)
+{
+  while (ctx->nended)
     {
-      idx = sb_skip_white (idx, in);
-      while (idx < in->len && ! ISWHITE (in->ptr[idx]))
-	{
-	  sb_add_char (&t, in->ptr[idx]);
-	  ++idx;
-	}
+      const char *path = ctx->ended[--ctx->nended].path;
+      sb *output;
+
+      if (hash_find (ctx->file_output, path))
+	continue;
+      output = (sb *) xmalloc (sizeof (sb));
+      sb_new (output);
+      outbuf_copied (&ctx->out, ctx->ended[ctx->nended].out_at, output);
+      hash_jam (ctx->file_output, path, output);
     }
+}
 
-  for (includes = paths_head; includes; includes = includes->next)
-    {
-      sb_reset (&cat);
-      sb_add_sb (&cat, &includes->path);
-      sb_add_char (&cat, '/');
-      sb_add_sb (&cat, &t);
-      if (new_file (sb_name (&cat)))
-	{
-	  break;
-	}
-    }
-  if (!includes)
-    {
-      if (! new_file (sb_name (&t)))
-	FATAL ((stderr, _("Can't open include file `%s'.\n"), sb_name (&t)));
-    }
-  sb_kill (&cat);
-  sb_kill (&t);
+static void
+free_file_output (const char *path ATTRIBUTE_UNUSED, void *output)
+{
+  sb_kill ((sb *) output);
+  free (output);
 }
 
+/* Stop keeping what each file writes, and forget what was kept.  */
+
 static void
-include_pop (void)
+stop_recording (masp_context *ctx)
 {
-  if (sp != include_stack)
-    {
-      if (sp->handle)
-	fclose (sp->handle);
-      /* Free sb buffers associated with this include frame. */
-      sb_kill (&sp->pushback);
-      sb_kill (&sp->name);
-      sp--;
-    }
+  if (!ctx->file_output)
+    return;
+  outbuf_flush (&ctx->out);
+  ctx->out.copy = NULL;
+  hash_traverse (ctx->file_output, free_file_output);
+  hash_die (ctx->file_output);
+  ctx->file_output = NULL;
+  sb_kill (&ctx->recorded);
 }
 
-/* Get the next character from the include stack.  If there's anything
-   in the pushback buffer, take that first.  If we're at eof, pop from
-   the stack and try again.  Keep the linecount up to date.  */
+void
+masp_record_output (masp_context *ctx)
+{
+  if (ctx->file_output)
+    return;
+  ctx->file_output = hash_new ();
+  sb_new (&ctx->recorded);
+  ctx->out.copy = &ctx->recorded;
+}
 
 static int
-get (void)
+new_file (masp_context *ctx, const char *name)
 {
-  int r;
+  char *path = context_path (ctx, name);
+  FILE *newone = fopen (path, "r");
+  const char *recorded = NULL;
+
+  if (newone)
+    recorded = record_file (ctx, path);
+  if (path != name)
+    free (path);
+  if (!newone)
+    return 0;
 
-  if (sp->pushback.len != sp->pushback_index)
-    {
-      r = (char) (sp->pushback.ptr[sp->pushback_index++]);
-      /* When they've all gone, reset the pointer.  */
-      if (sp->pushback_index == sp->pushback.len)
-	{
-	  sp->pushback.len = 0;
-	  sp->pushback_index = 0;
-	}
-    }
-  else if (sp->handle)
-    {
-      r = getc (sp->handle);
-    }
-  else
-    r = EOF;
+  if (isp == MAX_INCLUDES)
+    FATAL ((ctx->errfile, _("Unreasonable include depth (%ld).\n"), (long) isp));
+
+  if (ctx->trace)
+    trace_span (ctx, TRACE_INCLUDES, "file", NULL, name, strlen (name));
+  ctx->sp++;
+  ctx->sp->handle = newone;
+  ctx->sp->reader = NULL;
+
+  sb_new (&ctx->sp->name);
+  sb_add_string (&ctx->sp->name, name);
+
+  ctx->sp->linecount = 1;
+  ctx->sp->pushback_index = 0;
+  ctx->sp->pieces = NULL;
+  ctx->sp->pieces_tail = &ctx->sp->pieces;
+  ctx->sp->from_piece = 0;
+  ctx->sp->type = include_file;
+  ctx->sp->index = 0;
+  sb_new (&ctx->sp->pushback);
+  start_file_output (ctx, recorded);
+  if ( ctx->line_info )
+    line_marker (ctx, ctx->sp->linecount); // myrkraverk
+  //fprintf( outfile, "# %s %d\n", sb_name( &sp->name ), sp->linecount  ); // myrkraverk
+  return 1;
+}
 
-  if (r == EOF && isp)
-    {
-      include_pop ();
-      if ( line_info )
-	fprintf( outfile, "# %d \"%s\"\n", sp->linecount - 1, sb_name( &sp->name ) ); // myrkraverk 
-      //fprintf( outfile, "# %s %d\n", sb_name( &sp->name ), sp->linecount - 1); // myrkraverk
-      r = get ();
-      while (r == EOF && isp)
-	{
-	  include_pop ();
-	  if ( line_info )
-	    fprintf( outfile, "# %d \"%s\"\n", sp->linecount - 1, sb_name( &sp->name ) ); // myrkraverk 
-	  //fprintf( outfile, "# %s %d\n", sb_name( &sp->name ), sp->linecount - 1); // myrkraverk
-	  r = get ();
-	}
+/* Push the LEN bytes at TEXT onto the include stack as though they
+   were the contents of the file called NAME.  */
+
+static void
+new_buffer (masp_context *ctx, const char *name, const char *text, size_t len)
+{
+  sb t;
+  sb_text *body;
+
+  sb_new (&t);
+  sb_add_string (&t, name);
+  include_buf (ctx, &t, include_file, 0);
+  sb_kill (&t);
+
+  sb_new (&t);
+  sb_add_buffer (&t, text, (int) len);
+  body = sb_text_adopt (&t);
+  include_link (ctx, body);
+  sb_text_unref (body);
+
+  if ( ctx->line_info )
+    line_marker (ctx, ctx->sp->linecount);
+}
+
+/* Read the whole of the file PATH into new text, or return NULL if it
+   can't be opened.  */
+
+static sb_text *
+read_file_text (const char *path)
+{
+  FILE *f = fopen (path, "r");
+  char buf[8192];
+  size_t n;
+  sb t;
+
+  if (!f)
+    return NULL;
+  sb_new (&t);
+  while ((n = fread (buf, 1, sizeof buf, f)) > 0)
+    sb_add_buffer (&t, buf, (int) n);
+  fclose (f);
+  return sb_text_adopt (&t);
+}
+
+/* Whether the file behind a cache entry still looks the same.  */
+
+static int
+shared_entry_current (const shared_entry *e, const struct stat *st)
+{
+  return (e->size == st->st_size
+	  && e->mtime == st->st_mtime
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	  && e->mtime_nsec == st->st_mtim.tv_nsec
+#endif
+	  );
+}
+
+/* Return the contents of the file at PATH from the shared cache, or
+   NULL if it can't be opened.  The file is read on first use, and
+   again whenever it has changed since; the text it replaces may still
+   be in use, so it is retired until shared_leave.  Files are read
+   outside the lock, and should two threads race to read one, the
+   first to finish wins.  *READ is set if the file was read.  */
+
+static sb_text *
+shared_file (masp_shared *shared, const char *path, int *read)
+{
+  struct stat st;
+  shared_entry *e;
+  sb_text *text;
+
+  if (stat (path, &st) != 0)
+    return NULL;
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock (&shared->lock);
+#endif
+  e = (shared_entry *) hash_find (shared->files, path);
+  text = e && shared_entry_current (e, &st) ? e->text : NULL;
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock (&shared->lock);
+#endif
+  *read = 0;
+  if (text)
+    return text;
+
+  text = read_file_text (path);
+  if (!text)
+    return NULL;
+  *read = 1;
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock (&shared->lock);
+#endif
+  e = (shared_entry *) hash_find (shared->files, path);
+  if (e && shared_entry_current (e, &st))
+    {
+      sb_text_unref (text);
+      text = e->text;
+    }
+  else
+    {
+      shared_entry *n = (shared_entry *) xmalloc (sizeof (shared_entry));
+      sb_text_pin (text);
+      n->text = text;
+      n->size = st.st_size;
+      n->mtime = st.st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+      n->mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+      n->retired = NULL;
+      if (e)
+	{
+	  e->retired = shared->retired;
+	  e->epoch = shared->epoch++;
+	  shared->retired = e;
+	}
+      hash_jam (shared->files, path, n);
+    }
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock (&shared->lock);
+#endif
+  return text;
+}
+
+/* Include guards.
+
+   An include file which is all one conditional,
+
+	.AIF	\&NAME EQ 0
+	...
+	.AENDI
+
+   does nothing once NAME is set, just as a C header inside #ifndef, and
+   so needn't be read again.  A false AIF isn't quite silent, though:
+   it still looks up the \& variables on the directives in its body,
+   and puts out the labels of some.  So a file only counts as guarded
+   when leaving it out can't change the output or the diagnostics: no
+   line of its body writes anything or can complain, and NAME and every
+   variable its body names are integers when it is left out.  -s and -l
+   show the lines of a false conditional, so they read the file as
+   usual.  */
+
+typedef struct include_guard {
+  char *name;			/* NAME above.  */
+  char **needs;			/* Variables the body looks up.  */
+  int nneeds;
+  int depth;			/* How deep its AIFs nest.  */
+  char prefix_char;		/* The prefix it was read with.  */
+} include_guard;
+
+/* Marks a file in ctx->include_guards which has no guard.  */
+
+static include_guard no_guard;
+#define NO_GUARD (&no_guard)
+
+/* Copy the line at P, up to END, into LINE as get_line would read it,
+   without its newline or any carriage returns.  Returns where the next
+   line starts.  */
+
+static const char *
+guard_line (const char *p, const char *end, sb *line)
+{
+  sb_reset (line);
+  while (p < end && *p != '\n')
+    {
+      if (*p != '\r')
+	sb_add_char (line, *p);
+      p++;
+    }
+  return p < end ? p + 1 : p;
+}
+
+/* Find the directive on LINE as process_file would, after any label.
+   Sets *LABELLED if there is a label, and *REST to what follows the
+   keyword.  Returns the keyword's code, 0 if there is none, or -1 if
+   the label is one that would be substituted into.  */
+
+static int
+guard_directive (masp_context *ctx, sb *line, int *labelled, int *rest)
+{
+  sb acc;
+  hash_entry *ptr;
+  int code = 0;
+  int l;
+
+  sb_new (&acc);
+  l = grab_label (ctx, line, &acc);
+  *labelled = acc.len != 0;
+  /* process_file substitutes into every label, even in a false AIF,
+     and grab_label takes \ and & anywhere in one.  */
+  if (memchr (acc.ptr, '\\', acc.len) || memchr (acc.ptr, '&', acc.len))
+    code = -1;
+  if (l < line->len && line->ptr[l] == ':')
+    l++;
+  while (l < line->len && ISWHITE (line->ptr[l]))
+    l++;
+  if (code == 0 && l < line->len && line->ptr[l] == ctx->prefix_char)
+    {
+      sb_reset (&acc);
+      l = sb_add_class_run (&acc, l + 1, line, ctx->chartype, FIRSTBIT);
+      ptr = hash_lookup (ctx->keyword_hash_table, &acc);
+      if (ptr)
+	code = ptr->value.i;
+    }
+  sb_kill (&acc);
+  *rest = l;
+  return code;
+}
+
+/* Whether the substitution a false AIF does on the rest of a directive
+   line, from IDX, is sure to be silent.  The \& variables it looks up
+   are added to G; it complains of any not defined.  */
+
+static int
+guard_quiet (masp_context *ctx, sb *line, int idx, include_guard *g)
+{
+  while (idx < line->len && !ISCOMMENTCHAR (line->ptr[idx]))
+    {
+      const char *p = line->ptr + idx;
+      int left = line->len - idx;
+
+      if (*p == '\'')
+	return 0;
+      if (*p == '.'
+	  && ((left > 3 && strncasecmp (p + 1, "LEN", 3) == 0)
+	      || (left > 5 && strncasecmp (p + 1, "INSTR", 5) == 0)
+	      || (left > 6 && strncasecmp (p + 1, "SUBSTR", 6) == 0)))
+	return 0;
+      if (*p == '\\' && left > 1 && p[1] == '&')
+	{
+	  sb name;
+
+	  sb_new (&name);
+	  idx = sb_add_class_run (&name, idx + 2, line, ctx->chartype, NEXTBIT);
+	  if (idx < line->len && line->ptr[idx] == '\'')
+	    idx++;
+	  g->needs = (char **) xrealloc (g->needs,
+					 (g->nneeds + 1) * sizeof (char *));
+	  g->needs[g->nneeds++] = xstrdup (sb_name (&name));
+	  sb_kill (&name);
+	  continue;
+	}
+      if (*p == '\\' && left > 1 && ISFIRSTCHAR (p[1]))
+	{
+	  sb acc;
+	  int known;
+
+	  /* A keyword here may be \EXPR, which evaluates.  */
+	  sb_new (&acc);
+	  idx = sb_add_class_run (&acc, idx + 1, line, ctx->chartype, FIRSTBIT);
+	  known = hash_lookup (ctx->keyword_hash_table, &acc) != NULL;
+	  sb_kill (&acc);
+	  if (known)
+	    return 0;
+	  continue;
+	}
+      idx++;
+    }
+  return 1;
+}
+
+/* Whether the line LINE, from IDX, is "\&NAME EQ 0" and nothing else;
+   if so NAME goes in G.  */
+
+static int
+guard_condition (masp_context *ctx, sb *line, int idx, include_guard *g)
+{
+  sb name;
+
+  while (idx < line->len && ISWHITE (line->ptr[idx]))
+    idx++;
+  if (idx + 2 >= line->len
+      || line->ptr[idx] != '\\' || line->ptr[idx + 1] != '&')
+    return 0;
+  sb_new (&name);
+  idx = sb_add_class_run (&name, idx + 2, line, ctx->chartype, NEXTBIT);
+  if (name.len == 0)
+    {
+      sb_kill (&name);
+      return 0;
+    }
+  g->name = xstrdup (sb_name (&name));
+  sb_kill (&name);
+
+  if (idx >= line->len || !ISWHITE (line->ptr[idx]))
+    return 0;
+  while (idx < line->len && ISWHITE (line->ptr[idx]))
+    idx++;
+  if (idx + 2 >= line->len || strncasecmp (line->ptr + idx, "EQ", 2) != 0
+      || !ISWHITE (line->ptr[idx + 2]))
+    return 0;
+  idx += 2;
+  while (idx < line->len && ISWHITE (line->ptr[idx]))
+    idx++;
+  if (idx >= line->len || line->ptr[idx] != '0')
+    return 0;
+  idx++;
+  while (idx < line->len && ISWHITE (line->ptr[idx]))
+    idx++;
+  return idx == line->len;
+}
+
+static void
+free_guard (include_guard *g)
+{
+  int i;
+
+  if (g == NO_GUARD)
+    return;
+  for (i = 0; i < g->nneeds; i++)
+    free (g->needs[i]);
+  free (g->needs);
+  free (g->name);
+  free (g);
+}
+
+/* Look for an include guard around TEXT.  Returns NO_GUARD if it has
+   none.  */
+
+static include_guard *
+find_guard (masp_context *ctx, const sb_text *text)
+{
+  const char *p = text->ptr;
+  const char *end = text->ptr + text->len;
+  include_guard *g;
+  int labelled, idx, code;
+  int depth = 1;
+  int ok;
+  sb line;
+
+  /* Without a last newline get_line warns at the end.  */
+  if (!ctx->masp_syntax || ctx->mri || ctx->alternate
+      || text->len == 0 || end[-1] != '\n')
+    return NO_GUARD;
+
+  g = (include_guard *) xmalloc (sizeof (include_guard));
+  g->name = NULL;
+  g->needs = NULL;
+  g->nneeds = 0;
+  g->depth = 1;
+  g->prefix_char = ctx->prefix_char;
+
+  sb_new (&line);
+  p = guard_line (p, end, &line);
+  ok = (line.len > 0
+	&& guard_directive (ctx, &line, &labelled, &idx) == K_AIF
+	&& !labelled
+	&& guard_condition (ctx, &line, idx, g));
+
+  while (ok && p < end)
+    {
+      /* Anything after the last AENDI is read whatever NAME is.  */
+      if (depth == 0)
+	{
+	  ok = 0;
+	  break;
+	}
+      p = guard_line (p, end, &line);
+      if (line.len == 0)
+	continue;
+      /* A continued line.  */
+      if (line.ptr[0] == '+')
+	{
+	  ok = 0;
+	  break;
+	}
+      code = guard_directive (ctx, &line, &labelled, &idx);
+      if (code < 0 || (code & LAB))
+	ok = 0;
+      else
+	switch (code)
+	  {
+	  case K_AIF:
+	    if (++depth > g->depth)
+	      g->depth = depth;
+	    break;
+	  case K_AELSE:
+	    if (depth == 1)
+	      ok = 0;
+	    break;
+	  case K_AENDI:
+	    if (--depth == 0 && labelled)
+	      ok = 0;
+	    break;
+	  case K_MASP:
+	  case K_GASP:
+	  case K_IFMODE:
+	  case K_ELSEIFMODE:
+	  case K_ENDIFMODE:
+	    ok = 0;
+	    break;
+	  }
+      if (ok && code > 0 && (code & PROCESS)
+	  && !guard_quiet (ctx, &line, idx, g))
+	ok = 0;
+    }
+  sb_kill (&line);
+
+  if (!ok || depth != 0)
+    {
+      free_guard (g);
+      return NO_GUARD;
+    }
+  return g;
+}
+
+/* Whether the variable NAME is an integer, and if NONZERO also not
+   0.  */
+
+static int
+guard_variable (masp_context *ctx, const char *name, int nonzero)
+{
+  hash_entry *ptr;
+  sb key;
+
+  sb_new (&key);
+  sb_add_string (&key, name);
+  ptr = hash_lookup (&ctx->vars, &key);
+  sb_kill (&key);
+  return (ptr && ptr->type == hash_integer
+	  && (!nonzero || ptr->value.i != 0));
+}
+
+/* Whether the include file at PATH, with TEXT, can be left out because
+   of its include guard.  */
+
+static int
+guard_holds (masp_context *ctx, const char *path, const sb_text *text)
+{
+  include_guard *g;
+  int i;
+
+  if (ctx->copysource || ctx->line_info)
+    return 0;
+  if (!ctx->include_guards)
+    ctx->include_guards = hash_new ();
+  g = (include_guard *) hash_find (ctx->include_guards, path);
+  if (!g)
+    {
+      g = find_guard (ctx, text);
+      hash_insert (ctx->include_guards, path, g);
+    }
+
+  if (g == NO_GUARD
+      || g->prefix_char != ctx->prefix_char
+      || !ctx->masp_syntax
+      || ctx->ifi + g->depth >= IFNESTING
+      || !guard_variable (ctx, g->name, 1))
+    return 0;
+  for (i = 0; i < g->nneeds; i++)
+    if (!guard_variable (ctx, g->needs[i], 0))
+      return 0;
+  return 1;
+}
+
+/* A file the prelude read, as it was then, and what it wrote.  */
+
+typedef struct prelude_file {
+  off_t size;
+  time_t mtime;
+  sb output;
+} prelude_file;
+
+static void
+free_prelude_file (const char *key ATTRIBUTE_UNUSED, void *value)
+{
+  sb_kill (&((prelude_file *) value)->output);
+  free (value);
+}
+
+/* Whether the file at PATH was read by the prelude, and if so what
+   it wrote, in *OUTPUT and *LEN.  */
+
+static int
+prelude_covers (masp_context *ctx, const char *path, const char **output,
+		int *len)
+{
+  prelude_file *f;
+  char *full;
+
+  if (!ctx->prelude_files)
+    return 0;
+  full = canonical_path (path);
+  f = full ? (prelude_file *) hash_find (ctx->prelude_files, full) : NULL;
+  free (full);
+  if (!f)
+    return 0;
+  *output = f->output.ptr;
+  *len = f->output.len;
+  return 1;
+}
+
+/* Push the include file NAME, taking it from the shared cache when the
+   context has one.  Returns 0 if the file can't be opened.  */
+
+static int
+new_include (masp_context *ctx, const char *name)
+{
+  const char *recorded = NULL;
+  const char *output;
+  sb_text *text;
+  char *path;
+  int len;
+  sb t;
+
+  path = context_path (ctx, name);
+  if ((ctx->snapshot && snapshot_covers (ctx->snapshot, path, &output, &len))
+      || prelude_covers (ctx, path, &output, &len))
+    {
+      /* Its macros and values are already in place; all that is left
+	 is what it wrote.  */
+      record_file (ctx, path);
+      if (path != name)
+	free (path);
+      out_add_buffer (&ctx->out, output, len);
+      return 1;
+    }
+  if (!ctx->shared)
+    {
+      if (path != name)
+	free (path);
+      return new_file (ctx, name);
+    }
+
+  if (!ctx->include_text)
+    ctx->include_text = hash_new ();
+  text = (sb_text *) hash_find (ctx->include_text, path);
+  if (text)
+    ctx->text_hits++;
+  else
+    {
+      int read;
+
+      text = shared_file (ctx->shared, path, &read);
+      if (text)
+	{
+	  /* Shared text is kept until the cache is freed.  */
+	  hash_jam (ctx->include_text, path, text);
+	  if (read)
+	    ctx->text_reads++;
+	  else
+	    ctx->text_hits++;
+	}
+    }
+  if (text)
+    {
+      recorded = record_file (ctx, path);
+      if (guard_holds (ctx, path, text))
+	{
+	  /* Reading it again would change nothing.  */
+	  ctx->guard_skips++;
+	  if (path != name)
+	    free (path);
+	  return 1;
+	}
+    }
+  if (path != name)
+    free (path);
+  if (!text)
+    return 0;
+
+  if (isp == MAX_INCLUDES)
+    FATAL ((ctx->errfile, _("Unreasonable include depth (%ld).\n"), (long) isp));
+
+  sb_new (&t);
+  sb_add_string (&t, name);
+  include_buf (ctx, &t, include_file, 0);
+  sb_kill (&t);
+  include_link (ctx, text);
+  start_file_output (ctx, recorded);
+
+  if ( ctx->line_info )
+    line_marker (ctx, ctx->sp->linecount);
+  return 1;
+}
+
+/* Marks a name in ctx->include_found which no file was found for.  */
+
+static char no_file[] = "";
+#define NO_FILE no_file
+
+/* The time of the directory DIR, taken once a run.  */
+
+static const dir_time *
+get_dir_time (masp_context *ctx, const char *dir)
+{
+  dir_time *d;
+  struct stat st;
+
+  if (!ctx->dir_times)
+    ctx->dir_times = hash_new ();
+  d = (dir_time *) hash_find (ctx->dir_times, dir);
+  if (d)
+    return d;
+
+  d = (dir_time *) xmalloc (sizeof (dir_time));
+  d->dir = xstrdup (dir);
+  d->mtime = -1;
+  d->mtime_nsec = 0;
+  if (stat (dir, &st) == 0)
+    {
+      d->mtime = st.st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+      d->mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+    }
+  hash_insert (ctx->dir_times, d->dir, d);
+  ctx->dirs_missed = (const char **) xrealloc (ctx->dirs_missed,
+					       (ctx->ndirs_missed + 1)
+					       * sizeof (char *));
+  ctx->dirs_missed[ctx->ndirs_missed++] = d->dir;
+  return d;
+}
+
+/* Note the time of the directory holding CANDIDATE, a name an include
+   file wasn't found by, and keep it in LOOKUP unless that is NULL.  */
+
+static void
+note_missed (masp_context *ctx, include_lookup *lookup, const char *candidate)
+{
+  char *path = context_path (ctx, candidate);
+  const char *slash = strrchr (path, '/');
+  const dir_time *now;
+  sb dir;
+
+  sb_new (&dir);
+  if (!slash)
+    sb_add_char (&dir, '.');
+  else if (slash == path)
+    sb_add_char (&dir, '/');
+  else
+    sb_add_buffer (&dir, path, (int) (slash - path));
+  now = get_dir_time (ctx, sb_name (&dir));
+  sb_kill (&dir);
+  if (path != candidate)
+    free (path);
+
+  if (!lookup)
+    return;
+  lookup->missed = (dir_time *) xrealloc (lookup->missed,
+					  (lookup->nmissed + 1)
+					  * sizeof (dir_time));
+  lookup->missed[lookup->nmissed].dir = xstrdup (now->dir);
+  lookup->missed[lookup->nmissed].mtime = now->mtime;
+  lookup->missed[lookup->nmissed].mtime_nsec = now->mtime_nsec;
+  lookup->nmissed++;
+}
+
+/* Put into KEY all that looking for the include file NAME depends on:
+   the context's directory, the include path and the name.  */
+
+static void
+lookup_key (masp_context *ctx, const char *name, sb *key)
+{
+  include_path *p;
+
+  if (ctx->directory)
+    sb_add_string (key, ctx->directory);
+  sb_add_char (key, '\n');
+  for (p = ctx->paths_head; p; p = p->next)
+    {
+      sb_add_sb (key, &p->path);
+      sb_add_char (key, '\n');
+    }
+  sb_add_string (key, name);
+}
+
+/* What the shared cache knows of the include file with KEY: NULL if
+   nothing, or nothing still true, NO_FILE if there is no such file,
+   or the name it was opened by, which lasts as long as the cache.
+   The lookup holds while none of the directories it was looked for in
+   without success has changed.  */
+
+static const char *
+shared_lookup (masp_context *ctx, const char *key)
+{
+  include_lookup *l;
+  int i;
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock (&ctx->shared->lock);
+#endif
+  l = (include_lookup *) hash_find (ctx->shared->lookups, key);
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock (&ctx->shared->lock);
+#endif
+  if (!l)
+    return NULL;
+
+  /* A replaced lookup is retired rather than freed, so L stays good
+     outside the lock.  */
+  for (i = 0; i < l->nmissed; i++)
+    {
+      const dir_time *now = get_dir_time (ctx, l->missed[i].dir);
+      if (now->mtime != l->missed[i].mtime
+	  || now->mtime_nsec != l->missed[i].mtime_nsec)
+	return NULL;
+    }
+  return l->found ? l->found : NO_FILE;
+}
+
+static void
+shared_remember (masp_context *ctx, const char *key, include_lookup *lookup)
+{
+  include_lookup *old;
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock (&ctx->shared->lock);
+#endif
+  old = (include_lookup *) hash_find (ctx->shared->lookups, key);
+  if (old)
+    {
+      old->retired = ctx->shared->retired_lookups;
+      old->epoch = ctx->shared->epoch++;
+      ctx->shared->retired_lookups = old;
+    }
+  hash_jam (ctx->shared->lookups, key, lookup);
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock (&ctx->shared->lock);
+#endif
+}
+
+static void
+free_lookup (include_lookup *l)
+{
+  int i;
+
+  for (i = 0; i < l->nmissed; i++)
+    free (l->missed[i].dir);
+  free (l->missed);
+  free (l->found);
+  free (l);
+}
+
+/* Look for the include file NAME in each directory of the include
+   path, then by NAME alone, and push the first found.  Returns the
+   name it was found by, or NO_FILE.  With a shared cache, where it
+   was found and where not is kept there for later runs.  */
+
+static const char *
+find_include (masp_context *ctx, const char *name)
+{
+  include_lookup *lookup = NULL;
+  include_path *includes;
+  const char *found = NO_FILE;
+  sb cat;
+
+  if (ctx->shared)
+    {
+      lookup = (include_lookup *) xmalloc (sizeof (include_lookup));
+      lookup->found = NULL;
+      lookup->missed = NULL;
+      lookup->nmissed = 0;
+      lookup->retired = NULL;
+    }
+
+  sb_new (&cat);
+  for (includes = ctx->paths_head; includes; includes = includes->next)
+    {
+      sb_reset (&cat);
+      sb_add_sb (&cat, &includes->path);
+      sb_add_char (&cat, '/');
+      sb_add_string (&cat, name);
+      if (new_include (ctx, sb_name (&cat)))
+	{
+	  found = xstrdup (sb_name (&cat));
+	  break;
+	}
+      note_missed (ctx, lookup, sb_name (&cat));
+    }
+  if (!includes)
+    {
+      if (new_include (ctx, name))
+	found = xstrdup (name);
+      else
+	note_missed (ctx, lookup, name);
+    }
+
+  if (lookup)
+    {
+      if (found != NO_FILE)
+	lookup->found = xstrdup (found);
+      sb_reset (&cat);
+      lookup_key (ctx, name, &cat);
+      shared_remember (ctx, sb_name (&cat), lookup);
+    }
+  sb_kill (&cat);
+  return found;
+}
+
+static void
+free_found (const char *name ATTRIBUTE_UNUSED, void *found)
+{
+  if (found != NO_FILE)
+    free (found);
+}
+
+/* Drop what the run knows of where its include files are, as it no
+   longer holds once the directory or include path changes.  */
+
+static void
+forget_includes (masp_context *ctx)
+{
+  if (ctx->include_found)
+    {
+      hash_traverse (ctx->include_found, free_found);
+      hash_die (ctx->include_found);
+      ctx->include_found = NULL;
+    }
+}
+
+/* Push the include file NAME.  Where a name was found is remembered
+   for the rest of the run, and with a shared cache for later runs too,
+   so that an include file used again is neither looked for nor, if it
+   is still there, read again.  */
+
+static int
+include_by_name (masp_context *ctx, const char *name)
+{
+  const char *found;
+  char *old;
+
+  if (!ctx->include_found)
+    ctx->include_found = hash_new ();
+  found = (const char *) hash_find (ctx->include_found, name);
+  if (found && (found == NO_FILE || new_include (ctx, found)))
+    {
+      ctx->lookup_hits++;
+      return found != NO_FILE;
+    }
+
+  if (!found && ctx->shared)
+    {
+      sb key;
+
+      sb_new (&key);
+      lookup_key (ctx, name, &key);
+      found = shared_lookup (ctx, sb_name (&key));
+      sb_kill (&key);
+      if (found && (found == NO_FILE || new_include (ctx, found)))
+	{
+	  ctx->lookup_hits++;
+	  hash_jam (ctx->include_found, name,
+		    found == NO_FILE ? NO_FILE : xstrdup (found));
+	  return found != NO_FILE;
+	}
+    }
+
+  ctx->lookup_misses++;
+  found = find_include (ctx, name);
+  /* An earlier answer, now wrong, is replaced.  */
+  old = (char *) hash_find (ctx->include_found, name);
+  if (old)
+    free_found (name, old);
+  hash_jam (ctx->include_found, name, (void *) found);
+  return found != NO_FILE;
+}
+
+static void
+do_include (masp_context *ctx, int idx, sb *in)
+{
+  sb t;
+
+  sb_new (&t);
+
+  if (! ctx->mri)
+    idx = getstring (ctx, idx, in, &t);
+  else
+    {
+      idx = sb_skip_white (idx, in);
+      while (idx < in->len && ! ISWHITE (in->ptr[idx]))
+	{
+	  sb_add_char (&t, in->ptr[idx]);
+	  ++idx;
+	}
+    }
+
+  if (!include_by_name (ctx, sb_name (&t)))
+    FATAL ((ctx->errfile, _("Can't open include file `%s'.\n"), sb_name (&t)));
+  sb_kill (&t);
+}
+
+static void
+include_pop (masp_context *ctx)
+{
+  if (ctx->sp != ctx->include_stack)
+    {
+      if (ctx->sp->path && ctx->file_output)
+	{
+	  if (ctx->nended == MAX_INCLUDES)
+	    end_file_output (ctx);
+	  ctx->ended[ctx->nended].path = ctx->sp->path;
+	  ctx->ended[ctx->nended++].out_at = ctx->sp->out_at;
+	}
+      if (ctx->sp->reader)
+	pipe_reader_close (ctx->sp->reader);
+      if (ctx->sp->handle)
+	fclose (ctx->sp->handle);
+      /* Free sb buffers associated with this include frame. */
+      include_free_pieces (ctx->sp);
+      sb_kill (&ctx->sp->pushback);
+      sb_kill (&ctx->sp->name);
+      ctx->sp--;
+      if (ctx->trace)
+	trace_end (ctx->trace, TRACE_INCLUDES);
+    }
+}
+
+/* Get the next character from the include stack.  If there's anything
+   in the pushback buffer, take that first.  If we're at eof, pop from
+   the stack and try again.  Keep the linecount up to date.  */
+
+static int
+get (masp_context *ctx)
+{
+  int r;
+
+  ctx->sp->from_piece = 0;
+  if (ctx->sp->pushback.len != ctx->sp->pushback_index)
+    {
+      r = (char) (ctx->sp->pushback.ptr[ctx->sp->pushback_index++]);
+      /* When they've all gone, reset the pointer.  */
+      if (ctx->sp->pushback_index == ctx->sp->pushback.len)
+	{
+	  ctx->sp->pushback.len = 0;
+	  ctx->sp->pushback_index = 0;
+	}
+    }
+  else if (ctx->sp->pieces
+	   && (ctx->sp->pieces->pos < ctx->sp->pieces->text->len
+	       || ctx->sp->pieces->next))
+    {
+      /* Drop pieces which have been read to the end.  They are kept
+	 until the next read so that unget can step back into them.  */
+      while (ctx->sp->pieces->pos == ctx->sp->pieces->text->len)
+	{
+	  text_piece *next = ctx->sp->pieces->next;
+	  sb_text_unref (ctx->sp->pieces->text);
+	  free (ctx->sp->pieces);
+	  ctx->sp->pieces = next;
+	}
+      if (ctx->sp->pieces->next == NULL)
+	ctx->sp->pieces_tail = &ctx->sp->pieces->next;
+      /* Read as getc would, so a 0xff is not taken for EOF.  */
+      r = (unsigned char) (ctx->sp->pieces->text->ptr[ctx->sp->pieces->pos++]);
+      ctx->sp->from_piece = 1;
+    }
+  else if (ctx->sp->reader)
+    {
+      r = pipe_reader_getc (ctx->sp->reader);
+    }
+  else if (ctx->sp->handle)
+    {
+      r = getc (ctx->sp->handle);
+    }
+  else
+    r = EOF;
+
+  if (r == EOF && isp)
+    {
+      include_pop (ctx);
+      /* There is nothing to mark on returning to the bottom level,
+	 which has no file behind it.  */
+      if ( ctx->line_info && isp )
+	line_marker (ctx, ctx->sp->linecount - 1); // myrkraverk
+      //fprintf( outfile, "# %s %d\n", sb_name( &sp->name ), sp->linecount - 1); // myrkraverk
+      r = get (ctx);
+      while (r == EOF && isp)
+	{
+	  include_pop (ctx);
+	  if ( ctx->line_info && isp )
+	    line_marker (ctx, ctx->sp->linecount - 1); // myrkraverk
+	  //fprintf( outfile, "# %s %d\n", sb_name( &sp->name ), sp->linecount - 1); // myrkraverk
+	  r = get (ctx);
+	}
       return r;
     }
   if (r == '\n')
     {
-      sp->linecount++;
+      ctx->sp->linecount++;
     }
 
   return r;
 }
 
 static int
-linecount (void)
+linecount (masp_context *ctx)
 {
-  return sp->linecount;
+  return ctx->sp->linecount;
 }
 
 static int
-include_next_index (void)
+include_next_index (masp_context *ctx)
 {
-  static int index;
-  if (!unreasonable
-      && index > MAX_REASONABLE)
-    FATAL ((stderr, _("Unreasonable expansion (-u turns off check).\n")));
-  return ++index;
+  if (!ctx->unreasonable
+      && ctx->include_index > MAX_REASONABLE)
+    FATAL ((ctx->errfile, _("Unreasonable expansion (-u turns off check).\n")));
+  return ++ctx->include_index;
 }
 
 /* Initialize the chartype vector.  */
 
 static void
-chartype_init (void)
+chartype_init (masp_context *ctx)
 {
   int x;
   for (x = 0; x < 256; x++)
     {
       if (ISALPHA (x) || x == '_' || x == '$')
-	chartype[x] |= FIRSTBIT;
+	ctx->chartype[x] |= FIRSTBIT;
 
-      if (mri && x == '.')
-	chartype[x] |= FIRSTBIT;
+      if (ctx->mri && x == '.')
+	ctx->chartype[x] |= FIRSTBIT;
 
       if (ISDIGIT (x) || ISALPHA (x) || x == '_' || x == '$')
-	chartype[x] |= NEXTBIT;
+	ctx->chartype[x] |= NEXTBIT;
 
       if (x == ' ' || x == '\t' || x == ',' || x == '"' || x == ';'
 	  || x == '"' || x == '<' || x == '>' || x == ')' || x == '(')
-	chartype[x] |= SEPBIT;
+	ctx->chartype[x] |= SEPBIT;
 
       if (x == 'b' || x == 'B'
 	  || x == 'a' || x == 'A'	/**/
 	  || x == 'q' || x == 'Q'
 	  || x == 'h' || x == 'H'
 	  || x == 'd' || x == 'D')
-	chartype [x] |= BASEBIT;
+	ctx->chartype [x] |= BASEBIT;
 
       if (x == ' ' || x == '\t')
-	chartype[x] |= WHITEBIT;
+	ctx->chartype[x] |= WHITEBIT;
+
+      if (x == ctx->comment_char)
+	ctx->chartype[x] |= COMMENTBIT;
 
-      if (x == comment_char)
-	chartype[x] |= COMMENTBIT;
+      /* Characters which may continue a label: the name characters
+	 plus the backslash and ampersand of substitutions.  */
+      if ((ctx->chartype[x] & NEXTBIT) || x == '\\' || x == '&')
+	ctx->chartype[x] |= LABELBIT;
     }
 }
 
 
-struct keyword {
-  char *name;
-  int code;
-  int extra;
-};
-
-static struct keyword kinfo[] = {
-  { "EQU", K_EQU, 0 },
-  { "ALTERNATE", K_ALTERNATE, 0 },
-  { "ASSIGN", K_ASSIGN, 0 },
-  { "REG", K_REG, 0 },
-  { "ORG", K_ORG, 0 },
-  { "RADIX", K_RADIX, 0 },
-  { "DATA", K_DATA, 0 },
-  { "DB", K_DB, 0 },
-  { "DW", K_DW, 0 },
-  { "DL", K_DL, 0 },
-  { "DATAB", K_DATAB, 0 },
-  { "SDATA", K_SDATA, 0 },
-  { "SDATAB", K_SDATAB, 0 },
-  { "SDATAZ", K_SDATAZ, 0 },
-  { "SDATAC", K_SDATAC, 0 },
-  { "RES", K_RES, 0 },
-  { "SRES", K_SRES, 0 },
-  { "SRESC", K_SRESC, 0 },
-  { "SRESZ", K_SRESZ, 0 },
-  { "EXPORT", K_EXPORT, 0 },
-  { "GLOBAL", K_GLOBAL, 0 },
-  { "PRINT", K_PRINT, 0 },
-  { "FORM", K_FORM, 0 },
-  { "HEADING", K_HEADING, 0 },
-  { "PAGE", K_PAGE, 0 },
-  { "PROGRAM", K_IGNORED, 0 },
-  { "END", K_END, 0 },
-  { "INCLUDE", K_INCLUDE, 0 },
-  { "ASSIGNA", K_ASSIGNA, 0 },
-  { "ASSIGNC", K_ASSIGNC, 0 },
-  { "AIF", K_AIF, 0 },
-  { "AELSE", K_AELSE, 0 },
-  { "AENDI", K_AENDI, 0 },
-  { "AREPEAT", K_AREPEAT, 0 },
-  { "AENDR", K_AENDR, 0 },
-  { "EXITM", K_EXITM, 0 },
-  { "MACRO", K_MACRO, 0 },
-  { "ENDM", K_ENDM, 0 },
-  { "AWHILE", K_AWHILE, 0 },
-  { "ALIGN", K_ALIGN, 0 },
-  { "AENDW", K_AENDW, 0 },
-  { "ALTERNATE", K_ALTERNATE, 0 },
-  { "LOCAL", K_LOCAL, 0 },
-  // New directives start here
-  { "GASP", K_GASP, 0 },
-  { "MASP", K_MASP, 0 },
-  { "SET", K_SET, 0 },
-  { "IFMODE", K_IFMODE, 0 },
-  { "IFM", K_IFMODE, 0 },
-  { "ELSEIFMODE", K_ELSEIFMODE, 0 },
-  { "ELSEIFM", K_ELSEIFMODE, 0 },
-  { "ENDIFMODE", K_ENDIFMODE, 0 },
-  { "ENDIFM", K_ENDIFMODE, 0 },
-  { "EXPR", K_EXPR, 0 },
-  { NULL, 0, 0 }
-};
-
-/* Although the conditional operators are handled by gas, we need to
-   handle them here as well, in case they are used in a recursive
-   macro to end the recursion.  */
-
-static struct keyword mrikinfo[] = {
-  { "IFEQ", K_IFEQ, 0 },
-  { "IFNE", K_IFNE, 0 },
-  { "IFLT", K_IFLT, 0 },
-  { "IFLE", K_IFLE, 0 },
-  { "IFGE", K_IFGE, 0 },
-  { "IFGT", K_IFGT, 0 },
-  { "IFC", K_IFC, 0 },
-  { "IFNC", K_IFNC, 0 },
-  { "ELSEC", K_AELSE, 0 },
-  { "ENDC", K_AENDI, 0 },
-  { "MEXIT", K_EXITM, 0 },
-  { "REPT", K_AREPEAT, 0 },
-  { "IRP", K_IRP, 0 },
-  { "IRPC", K_IRPC, 0 },
-  { "ENDR", K_AENDR, 0 },
-  { NULL, 0, 0 }
-};
-
 // Change syntax into GASP mode
-static void do_gasp( void )
+static void do_gasp(masp_context *ctx)
 {
-  prefix_char = '.';
-  masp_syntax = 0;
+  ctx->prefix_char = '.';
+  ctx->masp_syntax = 0;
   return;
 }
 
 // Change syntax into MASP mode
-static void do_masp( void )
+static void do_masp(masp_context *ctx)
 {
-  prefix_char = cml_prefix_char;
-  masp_syntax = 1;
+  ctx->prefix_char = ctx->cml_prefix_char;
+  ctx->masp_syntax = 1;
   return;
 }
 
@@ -3662,65 +5231,58 @@ static int do_set( int idx, sb *line )
    its handler.  */
 
 static int
-process_pseudo_op (int idx, sb *line, sb *acc)
+process_pseudo_op (masp_context *ctx, int idx, sb *line, sb *acc)
 {
   int oidx = idx;
 
-  if (line->ptr[idx] == prefix_char || alternate || mri) // myrkraverk '.'
+  if (line->ptr[idx] == ctx->prefix_char || ctx->alternate || ctx->mri) // myrkraverk '.'
     {
       /* Scan forward and find pseudo name.  */
-      char *in;
       hash_entry *ptr;
 
-      char *s;
-      char *e;
-      if (line->ptr[idx] == prefix_char ) // Experiment with different mark (myrkraverk)
+      if (line->ptr[idx] == ctx->prefix_char ) // Experiment with different mark (myrkraverk)
 	idx++;
-      in = line->ptr + idx;
-      s = in;
-      e = s;
       sb_reset (acc);
 
-      while (idx < line->len && *e && ISFIRSTCHAR (*e))
-	{
-	  sb_add_char (acc, *e);
-	  e++;
-	  idx++;
-	}
+      idx = sb_add_class_run (acc, idx, line, ctx->chartype, FIRSTBIT);
 
-      ptr = hash_lookup (&keyword_hash_table, acc);
+      ptr = hash_lookup (ctx->keyword_hash_table, acc);
 
       if (!ptr)
 	{
 #if 0
 	  /* This one causes lots of pain when trying to preprocess
 	     ordinary code.  */
-	  WARNING ((stderr, _("Unrecognised pseudo op `%s'.\n"),
+	  WARNING ((ctx->errfile, _("Unrecognised pseudo op `%s'.\n"),
 		    sb_name (acc)));
 #endif
 	  return 0;
 	}
+      ctx->directive = ptr;
       if (ptr->value.i & LAB)
 	{
 	  /* Output the label.  */
-	  if (label.len)
+	  if (ctx->label.len)
 	    {
-	      fprintf (outfile, "%s:\t", sb_name (&label));
+	      out_add_sb (&ctx->out, &ctx->label);
+	      out_add_char (&ctx->out, ':');
 	    }
-	  else
-	    fprintf (outfile, "\t");
+	  out_add_char (&ctx->out, '\t');
 	}
 
-      if (mri && ptr->value.i == K_END)
+      if (ctx->mri && ptr->value.i == K_END)
 	{
 	  sb t;
 
 	  sb_new (&t);
 	  sb_add_buffer (&t, line->ptr + oidx, idx - oidx);
-	  fprintf (outfile, "\t%s", sb_name (&t));
+	  out_add_char (&ctx->out, '\t');
+	  out_add_sb (&ctx->out, &t);
 	  sb_kill (&t);
 	}
 
+      if (ptr->value.i == K_AIF && do_aif_compiled (ctx, idx, line))
+	return 1;
       if (ptr->value.i & PROCESS)
 	{
 	  /* Polish the rest of the line before handling the pseudo op.  */
@@ -3728,30 +5290,30 @@ process_pseudo_op (int idx, sb *line, sb *acc)
 	  strip_comments (line);
 #endif
 	  sb_reset (acc);
-	  process_assigns (idx, line, acc);
+	  process_assigns (ctx, idx, line, acc);
 	  sb_reset (line);
-	  change_base (0, acc, line);
+	  change_base (ctx, 0, acc, line);
 	  idx = 0;
 	}
-      if (!condass_on ())
+      if (!condass_on (ctx))
 	{
 	  switch (ptr->value.i)
 	    {
 	    case K_AIF:
-	      do_aif (idx, line);
+	      do_aif (ctx, idx, line);
 	      break;
 	    case K_AELSE:
-	      do_aelse ();
+	      do_aelse (ctx);
 	      break;
 	    case K_AENDI:
-	      do_aendi ();
+	      do_aendi (ctx);
 	      break;
 	      // New keywords here (myrkraverk):
 	    case K_ENDIFMODE:
-	      do_endifmode(idx, line);
+	      do_endifmode(ctx, idx, line);
 	      break;
 	    case K_ELSEIFMODE:
-	      do_elseifmode(idx, line);
+	      do_elseifmode(ctx, idx, line);
 	      break;
 	    }
 	  return 1;
@@ -3761,173 +5323,173 @@ process_pseudo_op (int idx, sb *line, sb *acc)
 	  switch (ptr->value.i)
 	    {
 	    case K_ALTERNATE:
-	      alternate = 1;
-	      macro_init (1, mri, 0, exp_get_abs);
+	      ctx->alternate = 1;
+	      macro_init (ctx, 1, ctx->mri, 0, exp_get_abs);
 	      return 1;
 	    case K_AELSE:
-	      do_aelse ();
+	      do_aelse (ctx);
 	      return 1;
 	    case K_AENDI:
-	      do_aendi ();
+	      do_aendi (ctx);
 	      return 1;
 	    case K_ORG:
-	      ERROR ((stderr, _("ORG command not allowed.\n")));
+	      ERROR ((ctx->errfile, _("ORG command not allowed.\n")));
 	      break;
 	    case K_RADIX:
-	      do_radix (line);
+	      do_radix (ctx, line);
 	      return 1;
 	    case K_DB:
-	      do_data (idx, line, 1);
+	      do_data (ctx, idx, line, 1);
 	      return 1;
 	    case K_DW:
-	      do_data (idx, line, 2);
+	      do_data (ctx, idx, line, 2);
 	      return 1;
 	    case K_DL:
-	      do_data (idx, line, 4);
+	      do_data (ctx, idx, line, 4);
 	      return 1;
 	    case K_DATA:
-	      do_data (idx, line, 0);
+	      do_data (ctx, idx, line, 0);
 	      return 1;
 	    case K_DATAB:
-	      do_datab (idx, line);
+	      do_datab (ctx, idx, line);
 	      return 1;
 	    case K_SDATA:
-	      do_sdata (idx, line, 0);
+	      do_sdata (ctx, idx, line, 0);
 	      return 1;
 	    case K_SDATAB:
-	      do_sdatab (idx, line);
+	      do_sdatab (ctx, idx, line);
 	      return 1;
 	    case K_SDATAC:
-	      do_sdata (idx, line, 'c');
+	      do_sdata (ctx, idx, line, 'c');
 	      return 1;
 	    case K_SDATAZ:
-	      do_sdata (idx, line, 'z');
+	      do_sdata (ctx, idx, line, 'z');
 	      return 1;
 	    case K_ASSIGN:
-	      do_assign (0, 0, line);
+	      do_assign (ctx, 0, 0, line);
 	      return 1;
 	    case K_AIF:
-	      do_aif (idx, line);
+	      do_aif (ctx, idx, line);
 	      return 1;
 	    case K_AREPEAT:
-	      do_arepeat (idx, line);
+	      do_arepeat (ctx, idx, line);
 	      return 1;
 	    case K_AENDW:
-	      do_aendw ();
+	      do_aendw (ctx);
 	      return 1;
 	    case K_AWHILE:
-	      do_awhile (idx, line);
+	      do_awhile (ctx, idx, line);
 	      return 1;
 	    case K_AENDR:
-	      do_aendr ();
+	      do_aendr (ctx);
 	      return 1;
 	    case K_EQU:
-	      do_assign (1, idx, line);
+	      do_assign (ctx, 1, idx, line);
 	      return 1;
 	    case K_ALIGN:
-	      do_align (idx, line);
+	      do_align (ctx, idx, line);
 	      return 1;
 	    case K_RES:
-	      do_res (idx, line, 0);
+	      do_res (ctx, idx, line, 0);
 	      return 1;
 	    case K_SRES:
-	      do_res (idx, line, 's');
+	      do_res (ctx, idx, line, 's');
 	      return 1;
 	    case K_INCLUDE:
-	      do_include (idx, line);
+	      do_include (ctx, idx, line);
 	      return 1;
 	    case K_LOCAL:
-	      do_local (idx, line);
+	      do_local (ctx, idx, line);
 	      return 1;
 	    case K_MACRO:
-	      do_macro (idx, line);
+	      do_macro (ctx, idx, line);
 	      return 1;
 	    case K_ENDM:
-	      do_endm ();
+	      do_endm (ctx);
 	      return 1;
 	    case K_SRESC:
-	      do_res (idx, line, 'c');
+	      do_res (ctx, idx, line, 'c');
 	      return 1;
 	    case K_PRINT:
-	      do_print (idx, line);
+	      do_print (ctx, idx, line);
 	      return 1;
 	    case K_FORM:
-	      do_form (idx, line);
+	      do_form (ctx, idx, line);
 	      return 1;
 	    case K_HEADING:
-	      do_heading (idx, line);
+	      do_heading (ctx, idx, line);
 	      return 1;
 	    case K_PAGE:
-	      do_page ();
+	      do_page (ctx);
 	      return 1;
 	    case K_GLOBAL:
 	    case K_EXPORT:
-	      do_export (line);
+	      do_export (ctx, line);
 	      return 1;
 	    case K_IMPORT:
 	      return 1;
 	    case K_SRESZ:
-	      do_res (idx, line, 'z');
+	      do_res (ctx, idx, line, 'z');
 	      return 1;
 	    case K_IGNORED:
 	      return 1;
 	    case K_END:
-	      do_end (line);
+	      do_end (ctx, line);
 	      return 1;
 	    case K_ASSIGNA:
-	      do_assigna (idx, line);
+	      do_assigna (ctx, idx, line);
 	      return 1;
 	    case K_ASSIGNC:
-	      do_assignc (idx, line);
+	      do_assignc (ctx, idx, line);
 	      return 1;
 	    case K_EXITM:
-	      do_exitm ();
+	      do_exitm (ctx);
 	      return 1;
 	    case K_REG:
-	      do_reg (idx, line);
+	      do_reg (ctx, idx, line);
 	      return 1;
 	    case K_IFEQ:
-	      do_if (idx, line, EQ);
+	      do_if (ctx, idx, line, EQ);
 	      return 1;
 	    case K_IFNE:
-	      do_if (idx, line, NE);
+	      do_if (ctx, idx, line, NE);
 	      return 1;
 	    case K_IFLT:
-	      do_if (idx, line, LT);
+	      do_if (ctx, idx, line, LT);
 	      return 1;
 	    case K_IFLE:
-	      do_if (idx, line, LE);
+	      do_if (ctx, idx, line, LE);
 	      return 1;
 	    case K_IFGE:
-	      do_if (idx, line, GE);
+	      do_if (ctx, idx, line, GE);
 	      return 1;
 	    case K_IFGT:
-	      do_if (idx, line, GT);
+	      do_if (ctx, idx, line, GT);
 	      return 1;
 	    case K_IFC:
-	      do_ifc (idx, line, 0);
+	      do_ifc (ctx, idx, line, 0);
 	      return 1;
 	    case K_IFNC:
-	      do_ifc (idx, line, 1);
+	      do_ifc (ctx, idx, line, 1);
 	      return 1;
 	    case K_IRP:
-	      do_irp (idx, line, 0);
+	      do_irp (ctx, idx, line, 0);
 	      return 1;
 	    case K_IRPC:
-	      do_irp (idx, line, 1);
+	      do_irp (ctx, idx, line, 1);
 	      return 1;
 	      // Add new GASP keywords here
 	    case K_MASP:
-	      do_masp();
+	      do_masp(ctx);
 	      return 1;
 	    case K_IFMODE:
-	      do_ifmode(idx, line );
+	      do_ifmode(ctx, idx, line );
 	      return 1;
 	    case K_ELSEIFMODE:
-	      do_elseifmode(idx, line);
+	      do_elseifmode(ctx, idx, line);
 	      return 1;
 	    case K_ENDIFMODE:
-	      do_endifmode(idx, line);
+	      do_endifmode(ctx, idx, line);
 	      return 1;
 	    }
 	}
@@ -3936,86 +5498,79 @@ process_pseudo_op (int idx, sb *line, sb *acc)
 }
 
 static int
-process_pseudo_op2 (int idx, sb *line, sb *acc)
+process_pseudo_op2 (masp_context *ctx, int idx, sb *line, sb *acc)
 {
   int oidx = idx;
 
-  if (line->ptr[idx] == prefix_char || alternate || mri) // myrkraverk '.'
+  if (line->ptr[idx] == ctx->prefix_char || ctx->alternate || ctx->mri) // myrkraverk '.'
     {
       /* Scan forward and find pseudo name.  */
-      char *in;
       hash_entry *ptr;
 
-      char *s;
-      char *e;
-      if (line->ptr[idx] == prefix_char ) // Experiment with different mark (myrkraverk)
+      if (line->ptr[idx] == ctx->prefix_char ) // Experiment with different mark (myrkraverk)
 	idx++;
-      in = line->ptr + idx;
-      s = in;
-      e = s;
       sb_reset (acc);
 
-      while (idx < line->len && *e && ISFIRSTCHAR (*e))
-	{
-	  sb_add_char (acc, *e);
-	  e++;
-	  idx++;
-	}
+      idx = sb_add_class_run (acc, idx, line, ctx->chartype, FIRSTBIT);
 
-      ptr = hash_lookup (&keyword_hash_table, acc);
+      ptr = hash_lookup (ctx->keyword_hash_table, acc);
 
       if (!ptr)
 	{
 	  return 0;
 	}
+      ctx->directive = ptr;
       if (ptr->value.i & LAB)
 	{
 	  /* Output the label.  */
-	  if (label.len)
+	  if (ctx->label.len)
 	    {
-	      fprintf (outfile, "%s:\t", sb_name (&label));
+	      out_add_sb (&ctx->out, &ctx->label);
+	      out_add_char (&ctx->out, ':');
 	    }
-	  else
-	    fprintf (outfile, "\t");
+	  out_add_char (&ctx->out, '\t');
 	}
 
-      if (mri && ptr->value.i == K_END)
+      if (ctx->mri && ptr->value.i == K_END)
 	{
 	  sb t;
 
 	  sb_new (&t);
 	  sb_add_buffer (&t, line->ptr + oidx, idx - oidx);
-	  fprintf (outfile, "\t%s", sb_name (&t));
+	  out_add_char (&ctx->out, '\t');
+	  out_add_sb (&ctx->out, &t);
 	  sb_kill (&t);
 	}
 
+      if (ptr->value.i == K_AIF && do_aif_compiled (ctx, idx, line))
+	return 1;
       if (ptr->value.i & PROCESS)
 	{
 	  /* Polish the rest of the line before handling the pseudo op.  */
 	  sb_reset (acc);
-	  process_assigns (idx, line, acc);
+	  process_assigns (ctx, idx, line, acc);
 	  sb_reset (line);
-	  change_base2 (0, acc, line);
+	  change_base2 (ctx, 0, acc, line);
 	  idx = 0;
 	}
-      if (!condass_on ())
+      if (!condass_on (ctx))
 	{
 	  switch (ptr->value.i)
 	    {
 	    case K_AIF:
-	      do_aif (idx, line);
+	      do_aif (ctx, idx, line);
 	      break;
 	    case K_AELSE:
-	      do_aelse ();
+	      do_aelse (ctx);
 	      break;
 	    case K_AENDI:
-	      do_aendi ();
+	      do_aendi (ctx);
 	      break;
 	    case K_ELSEIFMODE:
-	      do_elseifmode(idx, line);
+	      do_elseifmode(ctx, idx, line);
 	      break;
 	    case K_ENDIFMODE:
-	      do_endifmode(idx,line);
+	      do_endifmode(ctx, idx,line);
 	      break;
 	    }
 	  return 1;
@@ -4025,174 +5580,174 @@ process_pseudo_op2 (int idx, sb *line, sb *acc)
 	  switch (ptr->value.i)
 	    {
 	    case K_ALTERNATE:
-	      alternate = 1;
-	      macro_init (1, mri, 0, exp_get_abs);
+	      ctx->alternate = 1;
+	      macro_init (ctx, 1, ctx->mri, 0, exp_get_abs);
 	      return 1;
 	    case K_AELSE:
-	      do_aelse ();
+	      do_aelse (ctx);
 	      return 1;
 	    case K_AENDI:
-	      do_aendi ();
+	      do_aendi (ctx);
 	      return 1;
 	    case K_ORG:
-	      ERROR ((stderr, _("ORG command not allowed.\n")));
+	      ERROR ((ctx->errfile, _("ORG command not allowed.\n")));
 	      break;
 	    case K_RADIX:
-	      do_radix (line);
+	      do_radix (ctx, line);
 	      return 1;
 	    case K_DB:
-	      do_data (idx, line, 1);
+	      do_data (ctx, idx, line, 1);
 	      return 1;
 	    case K_DW:
-	      do_data (idx, line, 2);
+	      do_data (ctx, idx, line, 2);
 	      return 1;
 	    case K_DL:
-	      do_data (idx, line, 4);
+	      do_data (ctx, idx, line, 4);
 	      return 1;
 	    case K_DATA:
-	      do_data (idx, line, 0);
+	      do_data (ctx, idx, line, 0);
 	      return 1;
 	    case K_DATAB:
-	      do_datab (idx, line);
+	      do_datab (ctx, idx, line);
 	      return 1;
 	    case K_SDATA:
-	      do_sdata (idx, line, 0);
+	      do_sdata (ctx, idx, line, 0);
 	      return 1;
 	    case K_SDATAB:
-	      do_sdatab (idx, line);
+	      do_sdatab (ctx, idx, line);
 	      return 1;
 	    case K_SDATAC:
-	      do_sdata (idx, line, 'c');
+	      do_sdata (ctx, idx, line, 'c');
 	      return 1;
 	    case K_SDATAZ:
-	      do_sdata (idx, line, 'z');
+	      do_sdata (ctx, idx, line, 'z');
 	      return 1;
 	    case K_ASSIGN:
-	      do_assign (0, 0, line);
+	      do_assign (ctx, 0, 0, line);
 	      return 1;
 	    case K_AIF:
-	      do_aif (idx, line);
+	      do_aif (ctx, idx, line);
 	      return 1;
 	    case K_AREPEAT:
-	      do_arepeat (idx, line);
+	      do_arepeat (ctx, idx, line);
 	      return 1;
 	    case K_AENDW:
-	      do_aendw ();
+	      do_aendw (ctx);
 	      return 1;
 	    case K_AWHILE:
-	      do_awhile (idx, line);
+	      do_awhile (ctx, idx, line);
 	      return 1;
 	    case K_AENDR:
-	      do_aendr ();
+	      do_aendr (ctx);
 	      return 1;
 	    case K_EQU:
-	      do_assign (1, idx, line);
+	      do_assign (ctx, 1, idx, line);
 	      return 1;
 	      // This is depricated in the new syntax:
 	      /* 	    case K_ALIGN: */
 	      /* 	      do_align (idx, line); */
 	      /* 	      return 1; */
 	    case K_RES:
-	      do_res (idx, line, 0);
+	      do_res (ctx, idx, line, 0);
 	      return 1;
 	    case K_SRES:
-	      do_res (idx, line, 's');
+	      do_res (ctx, idx, line, 's');
 	      return 1;
 	    case K_INCLUDE:
-	      do_include (idx, line);
+	      do_include (ctx, idx, line);
 	      return 1;
 	    case K_LOCAL:
-	      do_local (idx, line);
+	      do_local (ctx, idx, line);
 	      return 1;
 	    case K_MACRO:
-	      do_macro (idx, line);
+	      do_macro (ctx, idx, line);
 	      return 1;
 	    case K_ENDM:
-	      do_endm ();
+	      do_endm (ctx);
 	      return 1;
 	    case K_SRESC:
-	      do_res (idx, line, 'c');
+	      do_res (ctx, idx, line, 'c');
 	      return 1;
 	    case K_PRINT:
-	      do_print (idx, line);
+	      do_print (ctx, idx, line);
 	      return 1;
 	    case K_FORM:
-	      do_form (idx, line);
+	      do_form (ctx, idx, line);
 	      return 1;
 	    case K_HEADING:
-	      do_heading (idx, line);
+	      do_heading (ctx, idx, line);
 	      return 1;
 	    case K_PAGE:
-	      do_page ();
+	      do_page (ctx);
 	      return 1;
 	    case K_GLOBAL:
 	    case K_EXPORT:
-	      do_export (line);
+	      do_export (ctx, line);
 	      return 1;
 	    case K_IMPORT:
 	      return 1;
 	    case K_SRESZ:
-	      do_res (idx, line, 'z');
+	      do_res (ctx, idx, line, 'z');
 	      return 1;
 	    case K_IGNORED:
 	      return 1;
 	    case K_END:
-	      do_end (line);
+	      do_end (ctx, line);
 	      return 1;
 	    case K_ASSIGNA:
-	      do_assigna (idx, line);
+	      do_assigna (ctx, idx, line);
 	      return 1;
 	    case K_ASSIGNC:
-	      do_assignc (idx, line);
+	      do_assignc (ctx, idx, line);
 	      return 1;
 	    case K_EXITM:
-	      do_exitm ();
+	      do_exitm (ctx);
 	      return 1;
 	    case K_REG:
-	      do_reg (idx, line);
+	      do_reg (ctx, idx, line);
 	      return 1;
 	    case K_IFEQ:
-	      do_if (idx, line, EQ);
+	      do_if (ctx, idx, line, EQ);
 	      return 1;
 	    case K_IFNE:
-	      do_if (idx, line, NE);
+	      do_if (ctx, idx, line, NE);
 	      return 1;
 	    case K_IFLT:
-	      do_if (idx, line, LT);
+	      do_if (ctx, idx, line, LT);
 	      return 1;
 	    case K_IFLE:
-	      do_if (idx, line, LE);
+	      do_if (ctx, idx, line, LE);
 	      return 1;
 	    case K_IFGE:
-	      do_if (idx, line, GE);
+	      do_if (ctx, idx, line, GE);
 	      return 1;
 	    case K_IFGT:
-	      do_if (idx, line, GT);
+	      do_if (ctx, idx, line, GT);
 	      return 1;
 	    case K_IFC:
-	      do_ifc (idx, line, 0);
+	      do_ifc (ctx, idx, line, 0);
 	      return 1;
 	    case K_IFNC:
-	      do_ifc (idx, line, 1);
+	      do_ifc (ctx, idx, line, 1);
 	      return 1;
 	    case K_IRP:
-	      do_irp (idx, line, 0);
+	      do_irp (ctx, idx, line, 0);
 	      return 1;
 	    case K_IRPC:
-	      do_irp (idx, line, 1);
+	      do_irp (ctx, idx, line, 1);
 	      return 1;
 	      // Add new masp keywords here:
 	    case K_IFMODE:
-	      do_ifmode(idx, line);
+	      do_ifmode(ctx, idx, line);
 	      return 1;
 	    case K_ELSEIFMODE:
-	      do_elseifmode(idx, line);
+	      do_elseifmode(ctx, idx, line);
 	      return 1;
 	    case K_ENDIFMODE:
-	      do_endifmode(idx, line);
+	      do_endifmode(ctx, idx, line);
 	      return 1;
 	    case K_GASP:
-	      do_gasp();
+	      do_gasp(ctx);
 	      return 1;
 	    case K_SET:
 	      do_set( idx, line );
@@ -4207,51 +5762,28 @@ process_pseudo_op2 (int idx, sb *line, sb *acc)
 }
 
 
-/* Add a keyword to the hash table.  */
-
-static void
-add_keyword (const char *name, int code)
-{
-  sb label;
-  int j;
-
-  sb_new (&label);
-  sb_add_string (&label, name);
-
-  hash_add_to_int_table (&keyword_hash_table, &label, code);
-
-  sb_reset (&label);
-  for (j = 0; name[j]; j++)
-    sb_add_char (&label, name[j] - 'A' + 'a');
-  hash_add_to_int_table (&keyword_hash_table, &label, code);
-
-  sb_kill (&label);
-}
+/* The keyword tables never change, so mkkeywords builds them from
+   keywords.def when masp is built, and every context shares them.
+   There is one table for each setting of -M, since MRI mode adds
+   keywords of its own.  */
 
-/* Build the keyword hash table - put each keyword in the table twice,
-   once upper and once lower case.  */
+#include "keywords.h"
 
 static void
-process_init (void)
+process_init (masp_context *ctx)
 {
-  int i;
-
-  for (i = 0; kinfo[i].name; i++)
-    add_keyword (kinfo[i].name, kinfo[i].code);
-
-  if (mri)
-    {
-      for (i = 0; mrikinfo[i].name; i++)
-	add_keyword (mrikinfo[i].name, mrikinfo[i].code);
-    }
+  ctx->keyword_hash_table = &keyword_tables[ctx->mri ? 1 : 0];
 }
 
 
-static void
-do_define (const char *string)
+/* Define a variable from the command line.  */
+
+void
+masp_define (masp_context *ctx, const char *string)
 {
+  const char *start = string;
   sb label;
-  int res = 1;
+  long long res = 1;
   hash_entry *ptr;
   sb_new (&label);
 
@@ -4267,7 +5799,7 @@ do_define (const char *string)
 	      sb_add_char (&value, *string);
 	      string++;
 	    }
-	  exp_get_abs (_("Invalid expression on command line.\n"),
+	  exp_get_abs (ctx, _("Invalid expression on command line.\n"),
 		       0, &value, &res);
 	  sb_kill (&value);
 	  break;
@@ -4277,222 +5809,814 @@ do_define (const char *string)
       string++;
     }
 
-  ptr = hash_create (&vars, &label);
+  ptr = hash_create (&ctx->vars, &label);
   free_old_entry (ptr);
   ptr->type = hash_integer;
   ptr->value.i = res;
   sb_kill (&label);
+
+  ctx->defines = (char **) xrealloc (ctx->defines, (ctx->ndefines + 1)
+				     * sizeof (char *));
+  ctx->defines[ctx->ndefines++] = xstrdup (start);
 }
 
-char *program_name;
-
-/* The list of long options.  */
-static struct option long_options[] =
-{
-  { "alternate", no_argument, 0, 'a' },
-  { "include", required_argument, 0, 'I' },
-  { "commentchar", required_argument, 0, 'c' },
-  { "prefixchar", required_argument, 0, 'P' },
-  { "line-numbers", no_argument, 0, 'l' },
-  { "copysource", no_argument, 0, 's' },
-  { "debug", no_argument, 0, 'd' },
-  { "help", no_argument, 0, 'h' },
-  { "mri", no_argument, 0, 'M' },
-  { "output", required_argument, 0, 'o' },
-  { "print", no_argument, 0, 'p' },
-  { "unreasonable", no_argument, 0, 'u' },
-  { "version", no_argument, 0, 'v' },
-  { "define", required_argument, 0, 'd' },
-  { NULL, no_argument, 0, 0 }
-};
+/* The library interface.  See masp.h.  */
+
+void
+masp_options_init (masp_options *opts)
+{
+  memset (opts, 0, sizeof *opts);
+  opts->comment_char = '!';
+  opts->prefix_char = '.';
+}
+
+masp_shared *
+masp_shared_new (void)
+{
+  masp_shared *shared = (masp_shared *) xmalloc (sizeof (masp_shared));
+#ifdef HAVE_PTHREAD
+  pthread_mutex_init (&shared->lock, NULL);
+#endif
+  shared->files = hash_new ();
+  shared->retired = NULL;
+  shared->lookups = hash_new ();
+  shared->retired_lookups = NULL;
+  shared->epoch = 0;
+  shared->users = NULL;
+  return shared;
+}
 
-/* Show a usage message and exit.  */
 static void
-show_usage (FILE *file, int status)
-{
-  // Removed references of alternate and mri mode
-  //   [-a]      [--alternate]         enter alternate macro mode
-  //   [-M]      [--mri]               enter MRI compatibility mode
-   fprintf (file,
-"Usage: %s \n"
-"   [-c char] [--commentchar char]  change the comment character from !\n"
-"   [-d]      [--debug]             print some debugging info\n"
-"   [-h]      [--help]              print this message\n"
-"   [-o out]  [--output out]        set the output file\n"
-"   [-p]      [--print]             print line numbers\n"
-"   [-s]      [--copysource]        copy source through as comments \n"
-"   [-u]      [--unreasonable]      allow unreasonable nesting\n"
-"   [-v]      [--version]           print the program version\n"
-"   [-Dname=value]                  create preprocessor variable called name,\n"
-"                                   with value\n"
-"   [-Ipath]                        add to include path list\n"
-"   [-P char] [--prefixchar char]   use char to prefix MASP directives\n"
-"                                   the default is '.'\n"
-"   [-l]      [--line-numbers]      include line number info in output\n"
-"   [in-file]\n",program_name);
-  if (status == 0)
-    printf (_("Report bugs to %s\n"), REPORT_BUGS_TO);
-  exit (status);
-}
-
-/* Display a help message and exit.  */
+free_shared_entry (shared_entry *e)
+{
+  sb_text_free_pinned (e->text);
+  free (e);
+}
 
 static void
-show_help (void)
+free_shared_file (const char *name ATTRIBUTE_UNUSED, void *e)
 {
-  printf (_("%s: MASP, the Assembly Preprocessor\n"), program_name);
-  show_usage (stdout, 0);
+  free_shared_entry ((shared_entry *) e);
 }
 
-int
-main (int argc, char *argv[])
+static void
+free_shared_lookup (const char *key ATTRIBUTE_UNUSED, void *l)
 {
-  int opt;
-  char *out_name = 0;
-  sp = include_stack;
+  free_lookup ((include_lookup *) l);
+}
 
-  cml_prefix_char = prefix_char = '.'; // The default
-  masp_syntax = 1; // The default
-  line_info = 0; // Default
-  
-  ifstack[0].on = 1;
-  ifi = 0;
+void
+masp_shared_free (masp_shared *shared)
+{
+  if (!shared)
+    return;
+  hash_traverse (shared->files, free_shared_file);
+  hash_die (shared->files);
+  while (shared->retired)
+    {
+      shared_entry *next = shared->retired->retired;
+      free_shared_entry (shared->retired);
+      shared->retired = next;
+    }
+  hash_traverse (shared->lookups, free_shared_lookup);
+  hash_die (shared->lookups);
+  while (shared->retired_lookups)
+    {
+      include_lookup *next = shared->retired_lookups->retired;
+      free_lookup (shared->retired_lookups);
+      shared->retired_lookups = next;
+    }
+#ifdef HAVE_PTHREAD
+  pthread_mutex_destroy (&shared->lock);
+#endif
+  free (shared);
+}
 
-#if defined (HAVE_SETLOCALE) && defined (HAVE_LC_MESSAGES) && defined (LC_MESSAGES)
-  setlocale (LC_MESSAGES, "");
+/* Count CTX among the runs using its shared caches.  */
+
+static void
+shared_join (masp_context *ctx)
+{
+  masp_shared *shared = ctx->shared;
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock (&shared->lock);
 #endif
-#if defined (HAVE_SETLOCALE) && defined (LC_CTYPE)
-  setlocale (LC_CTYPE, "");
+  ctx->shared_epoch = shared->epoch;
+  ctx->next_user = shared->users;
+  shared->users = ctx;
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock (&shared->lock);
 #endif
-  bindtextdomain (PACKAGE, LOCALEDIR);
-  textdomain (PACKAGE);
+}
+
+/* CTX has finished with its shared caches: free what was retired
+   before every run still using them began.  The retired lists run
+   newest first, so that is the tail of each.  */
 
-  program_name = argv[0];
-  xmalloc_set_program_name (program_name);
+static void
+shared_leave (masp_context *ctx)
+{
+  masp_shared *shared = ctx->shared;
+  masp_context **u;
+  unsigned long oldest;
+  shared_entry *entries, **e;
+  include_lookup *lookups, **l;
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock (&shared->lock);
+#endif
+  for (u = &shared->users; *u != ctx; u = &(*u)->next_user)
+    ;
+  *u = ctx->next_user;
+  oldest = shared->epoch;
+  for (u = &shared->users; *u; u = &(*u)->next_user)
+    if ((*u)->shared_epoch < oldest)
+      oldest = (*u)->shared_epoch;
+  for (e = &shared->retired; *e && (*e)->epoch >= oldest; e = &(*e)->retired)
+    ;
+  entries = *e;
+  *e = NULL;
+  for (l = &shared->retired_lookups; *l && (*l)->epoch >= oldest;
+       l = &(*l)->retired)
+    ;
+  lookups = *l;
+  *l = NULL;
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock (&shared->lock);
+#endif
 
-  hash_new_table (101, &keyword_hash_table);
-  hash_new_table (101, &assign_hash_table);
-  hash_new_table (101, &vars);
+  while (entries)
+    {
+      shared_entry *next = entries->retired;
+      free_shared_entry (entries);
+      entries = next;
+    }
+  while (lookups)
+    {
+      include_lookup *next = lookups->retired;
+      free_lookup (lookups);
+      lookups = next;
+    }
+}
 
-  sb_new (&label);
+static void
+free_include_guard (const char *path ATTRIBUTE_UNUSED, void *g)
+{
+  free_guard ((include_guard *) g);
+}
+
+static void
+free_dir_time (const char *dir ATTRIBUTE_UNUSED, void *d)
+{
+  free (((dir_time *) d)->dir);
+  free (d);
+}
+
+masp_context *
+masp_new (const masp_options *opts)
+{
+  return masp_new_shared (opts, NULL);
+}
+
+masp_context *
+masp_new_shared (const masp_options *opts, masp_shared *shared)
+{
+  masp_options defaults;
+  masp_context *ctx;
+
+  if (!opts)
+    {
+      masp_options_init (&defaults);
+      opts = &defaults;
+    }
+
+  mem_stats_reset_peak ();
+  ctx = (masp_context *) xmalloc (sizeof (masp_context));
+  memset (ctx, 0, sizeof *ctx);
+  ctx->mem_start = *mem_stats_get ();
+
+  ctx->alternate = opts->alternate;
+  ctx->mri = opts->mri;
+  ctx->copysource = opts->copysource;
+  ctx->print_line_number = opts->print_line_number;
+  ctx->unreasonable = opts->unreasonable;
+  ctx->stats = opts->stats;
+  ctx->line_info = opts->line_info;
+  ctx->pipeline = opts->pipeline;
+  ctx->prefetch = opts->prefetch;
+  if (opts->profile)
+    ctx->profile = profile_new ();
+  if (opts->trace)
+    ctx->trace = trace_new (TRACE_EVENTS);
+  ctx->comment_char = opts->comment_char;
+  ctx->cml_prefix_char = ctx->prefix_char = opts->prefix_char;
+  ctx->masp_syntax = 1;
+  ctx->radix = 10;
+  ctx->shared = shared;
+  if (shared)
+    shared_join (ctx);
+
+  outbuf_init (&ctx->out, stdout);
+  ctx->errfile = stderr;
+
+  /* The bottom of the include stack is never read from, but has a
+     name so it can be reported like any other level.  */
+  ctx->sp = ctx->include_stack;
+  sb_new (&ctx->sp->name);
+  sb_new (&ctx->sp->pushback);
+  ctx->sp->pieces_tail = &ctx->sp->pieces;
+
+  ctx->ifstack[0].on = 1;
+  ctx->ifi = 0;
+
+  hash_new_table (SYMBOL_TABLE_SIZE, &ctx->assign_hash_table);
+  hash_new_table (SYMBOL_TABLE_SIZE, &ctx->vars);
+  sb_new (&ctx->cond_key);
+
+  sb_new (&ctx->label);
+
+  process_init (ctx);
+  macro_init (ctx, ctx->alternate, ctx->mri, 0, exp_get_abs);
+  chartype_init (ctx);
+
+  return ctx;
+}
+
+void
+masp_free (masp_context *ctx)
+{
+  include_path *p;
+  int i;
+
+  if (!ctx)
+    return;
+
+  while (isp)
+    include_pop (ctx);
+  include_free_pieces (ctx->sp);
+  sb_kill (&ctx->sp->pushback);
+  sb_kill (&ctx->sp->name);
+
+  for (p = ctx->paths_head; p; )
+    {
+      include_path *next = p->next;
+      sb_kill (&p->path);
+      free (p);
+      p = next;
+    }
+
+  hash_free_table (&ctx->assign_hash_table);
+  hash_free_table (&ctx->vars);
+  if (ctx->conds)
+    {
+      hash_traverse (ctx->conds, free_cond);
+      hash_die (ctx->conds);
+    }
+  sb_kill (&ctx->cond_key);
+  sb_kill (&ctx->label);
+
+  macro_cleanup (ctx);
+  stop_recording (ctx);
+  outbuf_free (&ctx->out);
+  for (i = 0; i < ctx->nfiles_read; i++)
+    free (ctx->files_read[i]);
+  free (ctx->files_read);
+  for (i = 0; i < ctx->ndefines; i++)
+    free (ctx->defines[i]);
+  free (ctx->defines);
+  if (ctx->files_seen)
+    hash_die (ctx->files_seen);
+  if (ctx->prelude_files)
+    {
+      hash_traverse (ctx->prelude_files, free_prelude_file);
+      hash_die (ctx->prelude_files);
+    }
+  forget_includes (ctx);
+  if (ctx->include_guards)
+    {
+      hash_traverse (ctx->include_guards, free_include_guard);
+      hash_die (ctx->include_guards);
+    }
+  if (ctx->include_text)
+    hash_die (ctx->include_text);
+  if (ctx->dir_times)
+    {
+      hash_traverse (ctx->dir_times, free_dir_time);
+      hash_die (ctx->dir_times);
+    }
+  free (ctx->dirs_missed);
+  profile_free (ctx->profile);
+  trace_free (ctx->trace);
+  free (ctx->directory);
+  if (ctx->shared)
+    shared_leave (ctx);
+  free (ctx);
+}
+
+void
+masp_set_output (masp_context *ctx, FILE *file)
+{
+  outbuf_set_file (&ctx->out, file);
+}
+
+void
+masp_set_diagnostics (masp_context *ctx, FILE *file)
+{
+  ctx->errfile = file;
+}
+
+void
+masp_set_directory (masp_context *ctx, const char *dir)
+{
+  free (ctx->directory);
+  ctx->directory = dir ? xstrdup (dir) : NULL;
+  forget_includes (ctx);
+}
+
+void
+masp_add_include_path (masp_context *ctx, const char *path)
+{
+  include_path *p = (include_path *) xmalloc (sizeof (include_path));
+  p->next = NULL;
+  sb_new (&p->path);
+  sb_add_string (&p->path, path);
+  if (ctx->paths_tail)
+    ctx->paths_tail->next = p;
+  else
+    ctx->paths_head = p;
+  ctx->paths_tail = p;
+  forget_includes (ctx);
+}
+
+/* Process what has just been pushed onto the include stack.  A fatal
+   error comes back here.  Whatever is left on the stack after a fatal
+   error or an .END is popped, so the next file starts afresh.  */
+
+static void
+process_protected (masp_context *ctx, void (*process) (masp_context *))
+{
+  ctx->had_end = 0;
+  if (setjmp (ctx->fatal_return) == 0)
+    {
+      ctx->fatal_return_set = 1;
+      process (ctx);
+    }
+  ctx->fatal_return_set = 0;
+
+  while (isp)
+    include_pop (ctx);
+  if (ctx->nended)
+    end_file_output (ctx);
+
+  if (!outbuf_flush (&ctx->out))
+    {
+      fprintf (ctx->errfile, _("Error writing output file\n"));
+      ctx->errors++;
+    }
+}
+
+/* The reading a prefetcher does for a context: into its shared
+   cache.  */
+
+static const char *
+prefetch_read (void *shared, const char *path, size_t *len, int *read)
+{
+  sb_text *text = shared_file ((masp_shared *) shared, path, read);
+
+  if (!text)
+    return NULL;
+  *len = text->len;
+  return text->ptr;
+}
+
+/* Start reading the include files the file NAME will want, or return
+   NULL if there is no prefetching.  */
+
+static prefetcher *
+start_prefetch (masp_context *ctx, const char *name)
+{
+  prefetch_setup setup;
+  include_path *p;
+  const char **paths;
+  prefetcher *pf;
+  char *path;
+  int n = 0;
+
+  if (!ctx->prefetch || !ctx->shared)
+    return NULL;
+
+  for (p = ctx->paths_head; p; p = p->next)
+    n++;
+  paths = (const char **) xmalloc ((n + 1) * sizeof (char *));
+  n = 0;
+  for (p = ctx->paths_head; p; p = p->next)
+    paths[n++] = sb_terminate (&p->path);
+
+  setup.nthreads = ctx->prefetch;
+  setup.read = prefetch_read;
+  setup.arg = ctx->shared;
+  setup.directory = ctx->directory;
+  setup.paths = paths;
+  setup.npaths = n;
+  setup.prefix_char = ctx->prefix_char;
+  pf = prefetch_start (&setup);
+  free (paths);
+
+  if (pf)
+    {
+      path = context_path (ctx, name);
+      prefetch_main (pf, path);
+      if (path != name)
+	free (path);
+    }
+  return pf;
+}
+
+/* With --pipeline the file is read and the output written on threads
+   of their own (see pipeline.h).  Either stage falls back to working
+   directly if it can't be started.  With --prefetch its include files
+   are read ahead (see prefetch.h).  */
+
+int
+masp_process_file (masp_context *ctx, const char *name)
+{
+  pipe_writer *writer = NULL;
+  prefetcher *pf;
+
+  if (!new_file (ctx, name))
+    return 0;
+  pf = start_prefetch (ctx, name);
+
+  if (ctx->pipeline)
+    {
+      ctx->sp->reader = pipe_reader_open (ctx->sp->handle);
+      if (ctx->sp->reader)
+	ctx->sp->handle = NULL;
+      writer = pipe_writer_open (ctx->out.file);
+      if (writer)
+	outbuf_set_pipe (&ctx->out, writer);
+    }
 
-  while ((opt = getopt_long (argc, argv, "I:sdhavc:upo:D:MP:l", long_options,
-			     (int *) NULL))
-	 != EOF)
+  process_protected (ctx, process_file);
+
+  if (pf)
+    ctx->prefetched += prefetch_stop (pf);
+  if (writer)
     {
-      switch (opt)
+      outbuf_set_pipe (&ctx->out, NULL);
+      if (!pipe_writer_close (writer))
 	{
-	case 'o':
-	  out_name = optarg;
-	  break;
-	case 'u':
-	  unreasonable = 1;
-	  break;
-	case 'I':
-	  {
-	    include_path *p = (include_path *) xmalloc (sizeof (include_path));
-	    p->next = NULL;
-	    sb_new (&p->path);
-	    sb_add_string (&p->path, optarg);
-	    if (paths_tail)
-	      paths_tail->next = p;
-	    else
-	      paths_head = p;
-	    paths_tail = p;
-	  }
-	  break;
-	case 'p':
-	  print_line_number = 1;
-	  break;
-	case 'c':
-	  comment_char = optarg[0];
-	  break;
-	case 'a':
-	  alternate = 1;
-	  break;
-	case 's':
-	  copysource = 1;
-	  break;
-	case 'l':
-	  line_info = 1;
-	  break;
-	case 'd':
-	  stats = 1;
-	  break;
-	case 'D':
-	  do_define (optarg);
-	  break;
-	case 'M':
-	  mri = 1;
-	  comment_char = ';';
-	  break;
-	case 'h':
-	  show_help ();
-	  break;
-	  /* NOTREACHED  */
-	case 'v':
-	  /* This output is intended to follow the GNU standards document.  */
-	  printf (_("MASP, the Assembly Preprocessor %s\n"), program_version);
-	  printf (_("Copyright 2003 Johann Gunnar Oskarsson"
-		    " <myrkraverk@users.sourcefore.net>\n\n"));
-	  printf (_("\
-This program is free software; you may redistribute it under the terms of\n\
-the GNU General Public License.  This program has absolutely no warranty.\n"));
-	  exit (0);
-	  /* NOTREACHED  */
-	case 'P':
-	  cml_prefix_char = prefix_char = optarg[0];
-	  break;
-	case 0:
-	  break;
-	default:
-	  show_usage (stderr, 1);
-	  /* NOTREACHED  */
+	  fprintf (ctx->errfile, _("Error writing output file\n"));
+	  ctx->errors++;
 	}
     }
+  return 1;
+}
+
+int
+masp_scan_file (masp_context *ctx, const char *name)
+{
+  int copysource = ctx->copysource;
+  int line_info = ctx->line_info;
+
+  /* Nothing is written but the files read.  */
+  ctx->copysource = 0;
+  ctx->line_info = 0;
+  if (new_file (ctx, name))
+    {
+      process_protected (ctx, scan_file);
+      name = NULL;
+    }
+  ctx->copysource = copysource;
+  ctx->line_info = line_info;
+  return name == NULL;
+}
+
+/* Note in *ARG the name of a file the prelude read which has changed
+   since.  */
 
-  process_init ();
+static void
+check_prelude_file (const char *path, void *value, void *arg)
+{
+  prelude_file *f = (prelude_file *) value;
+  struct stat st;
+
+  if (*(const char **) arg)
+    return;
+  if (stat (path, &st) != 0 || st.st_size != f->size
+      || st.st_mtime != f->mtime)
+    *(const char **) arg = path;
+}
+
+/* The prelude leaves its definitions and the names of the files it
+   read; what it learnt of the include path, where it was read from,
+   and what it wrote and counted are dropped for the job's own.  */
+
+int
+masp_process_prelude (masp_context *ctx, const char *name)
+{
+  include_path *p;
+  int i;
 
-  macro_init (alternate, mri, 0, exp_get_abs);
+  masp_record_output (ctx);
+  /* The prelude is only the start of each job's input.  */
+  ctx->reading_prelude = 1;
+  i = masp_process_file (ctx, name);
+  ctx->reading_prelude = 0;
+  if (!i)
+    return 0;
 
-  if (out_name)
+  if (!ctx->prelude_files)
+    ctx->prelude_files = hash_new ();
+  for (i = 0; i < ctx->nfiles_read; i++)
     {
-      outfile = fopen (out_name, "w");
-      if (!outfile)
+      char *full = canonical_path (ctx->files_read[i]);
+      struct stat st;
+
+      if (full && stat (full, &st) == 0)
 	{
-	  fprintf (stderr, _("%s: Can't open output file `%s'.\n"),
-		   program_name, out_name);
-	  exit (1);
+	  prelude_file *f = (prelude_file *) xmalloc (sizeof (prelude_file));
+	  sb *output = (sb *) hash_find (ctx->file_output, ctx->files_read[i]);
+
+	  f->size = st.st_size;
+	  f->mtime = st.st_mtime;
+	  sb_new (&f->output);
+	  if (output)
+	    sb_add_sb (&f->output, output);
+	  hash_jam (ctx->prelude_files, full, f);
 	}
+      free (full);
+      free (ctx->files_read[i]);
     }
-  else
+  stop_recording (ctx);
+  ctx->nfiles_read = 0;
+  if (ctx->files_seen)
+    {
+      hash_die (ctx->files_seen);
+      ctx->files_seen = NULL;
+    }
+
+  for (p = ctx->paths_head; p; )
+    {
+      include_path *next = p->next;
+      sb_kill (&p->path);
+      free (p);
+      p = next;
+    }
+  ctx->paths_head = ctx->paths_tail = NULL;
+  forget_includes (ctx);
+
+  ctx->warnings = 0;
+  ctx->lookup_hits = ctx->lookup_misses = 0;
+  ctx->text_hits = ctx->text_reads = 0;
+  ctx->guard_skips = ctx->prefetched = ctx->cond_hits = 0;
+  return 1;
+}
+
+int
+masp_prelude_options (masp_context *ctx, const masp_options *opts,
+		      const char *const *defines, int ndefines, FILE *err)
+{
+  const char *changed = NULL;
+  int i;
+
+  if (opts->alternate != ctx->alternate
+      || opts->mri != ctx->mri
+      || opts->comment_char != ctx->comment_char
+      || opts->prefix_char != ctx->cml_prefix_char)
+    {
+      fprintf (err, _("The prelude was read with other options; not using it.\n"));
+      return 0;
+    }
+  /* Macros defined under a condition on a -D value would be wrong.  */
+  for (i = 0; i < ndefines && i < ctx->ndefines; i++)
+    if (strcmp (defines[i], ctx->defines[i]) != 0)
+      break;
+  if (i != ndefines || i != ctx->ndefines)
+    {
+      fprintf (err, _("The prelude was read with other -D values; not using it.\n"));
+      return 0;
+    }
+  /* What an include wrote then is written again, which is only right
+     if it doesn't depend on where the file was included.  */
+  if (opts->copysource || opts->line_info)
+    {
+      fprintf (err, _("The prelude can't be used with -s or -l; not using it.\n"));
+      return 0;
+    }
+  if (ctx->prelude_files)
+    hash_traverse_arg (ctx->prelude_files, check_prelude_file, &changed);
+  if (changed)
+    {
+      fprintf (err, _("The prelude is out of date, `%s' has changed; not using it.\n"),
+	       changed);
+      return 0;
+    }
+
+  ctx->copysource = opts->copysource;
+  ctx->print_line_number = opts->print_line_number;
+  ctx->unreasonable = opts->unreasonable;
+  ctx->stats = opts->stats;
+  ctx->line_info = opts->line_info;
+  ctx->pipeline = opts->pipeline;
+  ctx->prefetch = opts->prefetch;
+  if (opts->profile && !ctx->profile)
+    ctx->profile = profile_new ();
+  if (opts->trace && !ctx->trace)
+    ctx->trace = trace_new (TRACE_EVENTS);
+
+  /* -d counts the job's memory, not the prelude's.  */
+  mem_stats_reset_peak ();
+  ctx->mem_start = *mem_stats_get ();
+  return 1;
+}
+
+int
+masp_preprocess_buffer (masp_context *ctx, const char *name,
+			const char *text, size_t len,
+			char **out, size_t *out_len,
+			char **diag, size_t *diag_len)
+{
+  FILE *old_out = ctx->out.file;
+  FILE *old_err = ctx->errfile;
+  mem_stream o;
+  mem_stream e;
+
+  if (!mem_stream_open (&o))
+    return 1;
+  if (diag && !mem_stream_open (&e))
     {
-      outfile = stdout;
+      mem_stream_close (&o, NULL, NULL);
+      return 1;
     }
 
-  chartype_init ();
-  if (!outfile)
-    outfile = stdout;
+  outbuf_set_file (&ctx->out, o.file);
+  if (diag)
+    ctx->errfile = e.file;
+
+  new_buffer (ctx, name, text, len);
+  process_protected (ctx, process_file);
+
+  outbuf_set_file (&ctx->out, old_out);
+  ctx->errfile = old_err;
+  mem_stream_close (&o, out, out_len);
+  if (diag)
+    mem_stream_close (&e, diag, diag_len);
+
+  return (ctx->fatals + ctx->errors) ? 1 : 0;
+}
+
+const char *const *
+masp_files_read (const masp_context *ctx, int *count)
+{
+  *count = ctx->nfiles_read;
+  return (const char *const *) ctx->files_read;
+}
+
+const char *const *
+masp_dirs_missed (const masp_context *ctx, int *count)
+{
+  *count = ctx->ndirs_missed;
+  return ctx->dirs_missed;
+}
+
+int
+masp_fatal_p (const masp_context *ctx)
+{
+  return ctx->fatals != 0;
+}
+
+static const char *const mem_kind_names[MEM_KINDS] = {
+  "other", "sb", "hash", "macro"
+};
+
+/* Report, on FILE, the memory used on this thread since CTX was made:
+   allocations and bytes since then, what is live now and the most
+   that was, for each kind of allocation.  As text for -d, or JSON.  */
 
-  /* Process all the input files.  */
+static void
+memory_report (masp_context *ctx, FILE *file, int json)
+{
+  const mem_stats *now = mem_stats_get ();
+  const mem_stats *start = &ctx->mem_start;
+  int i;
 
-  while (optind < argc)
+  if (json)
+    fprintf (file, "{\"memory\": {");
+  for (i = 0; i <= MEM_KINDS; i++)
     {
-      if (new_file (argv[optind]))
+      /* The total comes last.  */
+      const mem_count *c = i < MEM_KINDS ? &now->kind[i] : &now->total;
+      const mem_count *c0 = i < MEM_KINDS ? &start->kind[i] : &start->total;
+      const char *name = i < MEM_KINDS ? mem_kind_names[i] : "total";
+      long long allocs = c->allocs - c0->allocs;
+      long long bytes = c->bytes - c0->bytes;
+
+      if (json)
 	{
-	  process_file ();
+	  fprintf (file, "%s\n  \"%s\": {\"allocs\": %lld, \"bytes\": %lld",
+		   i ? "," : "", name, allocs, bytes);
+	  if (i != MEM_OTHER)
+	    fprintf (file, ", \"live\": %lld, \"peak\": %lld",
+		     c->live, c->peak);
+	  fprintf (file, "}");
 	}
       else
 	{
-	  fprintf (stderr, _("%s: Can't open input file `%s'.\n"),
-		   program_name, argv[optind]);
-	  exit (1);
+	  fprintf (file, "memory %-9s : %lld allocs, %lld bytes",
+		   name, allocs, bytes);
+	  if (i != MEM_OTHER)
+	    fprintf (file, ", %lld live, %lld peak", c->live, c->peak);
+	  fprintf (file, "\n");
 	}
-      optind++;
     }
+  if (json)
+    {
+      fprintf (file, "},\n \"sb_growth\": {\"copies\": %lld, "
+	       "\"bytes_copied\": %lld},\n \"strings\": [",
+	       now->sb_grows - start->sb_grows,
+	       now->sb_grow_bytes - start->sb_grow_bytes);
+      for (i = 0; i < sb_max_power_two; i++)
+	fprintf (file, "%s%d", i ? ", " : "", string_count[i]);
+      fprintf (file, "]}\n");
+    }
+  else
+    fprintf (file, "sb growth        : %lld copies, %lld bytes copied\n",
+	     now->sb_grows - start->sb_grows,
+	     now->sb_grow_bytes - start->sb_grow_bytes);
+}
 
-  quit ();
-  return 0;
+int
+masp_finish (masp_context *ctx)
+{
+  if (ctx->stats)
+    {
+      int i;
+      for (i = 0; i < sb_max_power_two; i++)
+	{
+	  fprintf (ctx->errfile, "strings size %8d : %d\n",
+		   1 << i, string_count[i]);
+	}
+      fprintf (ctx->errfile, "include lookups  : %d found again, %d searched\n",
+	       ctx->lookup_hits, ctx->lookup_misses);
+      fprintf (ctx->errfile, "include texts    : %d reused, %d read\n",
+	       ctx->text_hits, ctx->text_reads);
+      fprintf (ctx->errfile, "include guards   : %d skipped\n",
+	       ctx->guard_skips);
+      fprintf (ctx->errfile, "include prefetch : %d read ahead\n",
+	       ctx->prefetched);
+      fprintf (ctx->errfile, "conditions       : %d run compiled\n",
+	       ctx->cond_hits);
+      memory_report (ctx, ctx->errfile, 0);
+    }
+  if (ctx->profile)
+    profile_report (ctx->profile, ctx->errfile);
+
+  return (ctx->fatals + ctx->errors) ? 1 : 0;
+}
+
+int
+masp_write_memory (masp_context *ctx, const char *path)
+{
+  FILE *f = fopen (path, "w");
+  int ok = f != NULL;
+
+  if (f)
+    {
+      memory_report (ctx, f, 1);
+      if (ferror (f))
+	ok = 0;
+      if (fclose (f) != 0)
+	ok = 0;
+    }
+  if (!ok)
+    fprintf (ctx->errfile, _("Can't write memory report `%s'.\n"), path);
+  return ok;
+}
+
+int
+masp_write_trace (masp_context *ctx, const char *path)
+{
+  FILE *f;
+  int ok;
+
+  if (!ctx->trace)
+    return 1;
+  f = fopen (path, "w");
+  ok = f != NULL;
+  if (f)
+    {
+      ok = trace_write (ctx->trace, f);
+      if (fclose (f) != 0)
+	ok = 0;
+    }
+  if (!ok)
+    fprintf (ctx->errfile, _("Can't write trace file `%s'.\n"), path);
+  else if (trace_dropped (ctx->trace))
+    fprintf (ctx->errfile, _("Trace buffer full, %ld spans left out.\n"),
+	     trace_dropped (ctx->trace));
+  return ok;
 }
 
 /* This function is used because an abort in some of the other files
@@ -0,0 +1,192 @@
+/* masp.h - interface to the MASP preprocessor library.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#ifndef MASP_H
+
+#define MASP_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Everything one preprocessing run needs lives in a masp_context:
+   the include stack, conditional stack, symbol and macro tables and
+   the output and diagnostic streams.  Contexts share nothing but
+   read-only tables, so several of them may be used at once, one per
+   thread.  */
+
+typedef struct masp_context masp_context;
+
+/* Caches which any number of contexts, in any number of threads, may
+   use together.  At present this is the contents of include files, so
+   a header included by every job of a batch is read from disk once.
+   Each use checks the file's size and time, and reads it again if it
+   has changed, so a masp_shared may live as long as a server does.  */
+
+typedef struct masp_shared masp_shared;
+
+/* Settings which are fixed for the life of a context.  Each one
+   matches the command line option noted beside it.  */
+
+typedef struct masp_options {
+  int alternate;		/* -a: alternate macro syntax.  */
+  int mri;			/* -M: MRI compatibility mode.  */
+  int copysource;		/* -s: copy source through as comments.  */
+  int print_line_number;	/* -p: print line numbers.  */
+  int unreasonable;		/* -u: allow unreasonable nesting.  */
+  int stats;			/* -d: print some debugging info.  */
+  int line_info;		/* -l: line number info in the output.  */
+  int pipeline;			/* --pipeline: read and write on threads.  */
+  int prefetch;			/* --prefetch: threads reading includes.  */
+  int profile;			/* --profile: time directives and macros.  */
+  int trace;			/* --trace: record include and conditional
+				   spans.  */
+  char comment_char;		/* -c: the comment character.  */
+  char prefix_char;		/* -P: the directive prefix.  */
+} masp_options;
+
+/* Fill in the defaults used when no options are given.  */
+extern void masp_options_init(masp_options *);
+
+/* Create a context, NULL options meaning the defaults.  Output goes
+   to stdout and diagnostics to stderr until changed.  */
+extern masp_context *masp_new(const masp_options *);
+extern void masp_free(masp_context *);
+
+extern masp_shared *masp_shared_new(void);
+extern void masp_shared_free(masp_shared *);
+
+/* As masp_new, but include files are read through SHARED, which must
+   outlive the context.  */
+extern masp_context *masp_new_shared(const masp_options *, masp_shared *);
+
+extern void masp_set_output(masp_context *, FILE *);
+extern void masp_set_diagnostics(masp_context *, FILE *);
+
+/* Open relative file names, the input and includes alike, in DIR
+   rather than the current directory.  Messages still give the names
+   as written.  */
+extern void masp_set_directory(masp_context *, const char *dir);
+
+/* Append a directory to the include search list.  */
+extern void masp_add_include_path(masp_context *, const char *);
+
+/* Define a variable from a NAME or NAME=EXPRESSION string, as -D.  */
+extern void masp_define(masp_context *, const char *);
+
+/* Preprocess the named file onto the output stream.  Returns 0 if
+   the file could not be opened, 1 otherwise.  State such as macros
+   and variables carries over from one file to the next.  */
+extern int masp_process_file(masp_context *, const char *name);
+
+/* Read the file NAME only for the files it includes, following each
+   .include and expanding nothing, so that masp_files_read lists what
+   NAME depends on.  Returns 0 if the file could not be opened.  */
+extern int masp_scan_file(masp_context *, const char *name);
+
+/* Preprocess LEN bytes of TEXT, reported as coming from NAME.  The
+   output is returned in a malloced buffer in *OUT, and if DIAG is not
+   NULL the diagnostics in another.  Both buffers are NUL terminated.
+   Returns the exit status the program would give for the run.  */
+extern int masp_preprocess_buffer(masp_context *, const char *name,
+				  const char *text, size_t len,
+				  char **out, size_t *out_len,
+				  char **diag, size_t *diag_len);
+
+/* The files read so far, inputs and includes alike, each once and in
+   the order they were first opened.  The names are those the files
+   were opened by.  */
+extern const char *const *masp_files_read(const masp_context *, int *count);
+
+/* The directories an include file was looked for in without success,
+   each once.  A file put in one of them since could be found
+   instead.  */
+extern const char *const *masp_dirs_missed(const masp_context *, int *count);
+
+/* Write what a context made with the trace option has recorded to
+   the file PATH, in the Chrome trace event format.  Returns 0, after
+   saying why on the diagnostics, if it can't.  */
+extern int masp_write_trace(masp_context *, const char *path);
+
+/* Write the memory the context has used, by subsystem, to the file
+   PATH as JSON: the same figures -d shows.  Returns 0, after saying
+   why on the diagnostics, if it can't.  */
+extern int masp_write_memory(masp_context *, const char *path);
+
+/* Snapshots.  A snapshot keeps the macros, variables and conditional
+   state a context has built up, so that later runs can start from it
+   rather than read the same include files again.  It lists the files
+   read to build it, with what each wrote, and is only used while each
+   of them has the size and time, or failing that the contents, it had
+   then.  */
+
+typedef struct masp_snapshot masp_snapshot;
+
+/* Keep what each file read writes to the output, as masp_save_snapshot
+   needs.  This goes before anything is processed.  */
+extern void masp_record_output(masp_context *);
+
+/* Write the state of the context to the file PATH.  Returns 0, after
+   saying why on the diagnostics, if it can't.  */
+extern int masp_save_snapshot(masp_context *, const char *path);
+
+/* Open the snapshot in the file PATH for contexts made with OPTS and
+   the NDEFINES -D values DEFINES.  Returns NULL, after saying why on
+   ERR, if it can't be read, was made with other options or -D values,
+   or its files have changed since.  */
+extern masp_snapshot *masp_snapshot_open(const char *path,
+					 const masp_options *opts,
+					 const char *const *defines,
+					 int ndefines, FILE *err);
+extern void masp_snapshot_close(masp_snapshot *);
+
+/* Start the context from SNAP, which must outlive it.  This goes
+   before anything is processed; variables defined afterwards take
+   precedence.  From then on an .include of a file the snapshot was
+   built from is skipped, as its definitions are already in place, and
+   what it wrote is written instead.  */
+extern void masp_use_snapshot(masp_context *, const masp_snapshot *);
+
+/* Preludes.  masp --fork-server reads a prelude into a context once
+   and forks a copy of it for each job, rather than saving the state
+   in a snapshot and loading it again.  */
+
+/* Process the file NAME, as masp_process_file does, and from then on
+   skip an .include of any file it read, writing what it wrote, as for
+   a snapshot.  The include path is emptied for the next file's own.
+   Returns 0 if NAME can't be opened.  */
+extern int masp_process_prelude(masp_context *, const char *name);
+
+/* Take over OPTS, those of a job with the NDEFINES -D values DEFINES,
+   in a context which has processed a prelude.  Returns 0, changing
+   nothing, after saying why on ERR, if they differ from the context's
+   in -a, -M, -c, -P or the -D values, which the prelude was read with,
+   if they ask for -s or -l, or if a file it read has changed since.  */
+extern int masp_prelude_options(masp_context *, const masp_options *opts,
+				const char *const *defines, int ndefines,
+				FILE *err);
+
+/* Nonzero once a fatal error has stopped processing.  The strings
+   being worked on when it struck are not freed.  */
+extern int masp_fatal_p(const masp_context *);
+
+/* Print statistics if asked for and return the exit status.  */
+extern int masp_finish(masp_context *);
+
+#endif
@@ -0,0 +1,204 @@
+/* mkkeywords.c - build the keyword hash tables of masp.c.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+/* Every run of masp used to build the keyword hash tables before it
+   read a line.  They never change, so this program, run when masp is
+   built, works out what they hold and writes them out as initialized
+   data, which costs a run nothing until it looks a keyword up:
+
+     mkkeywords keywords.h
+
+   The tables are laid out exactly as masp.c's hash_create would have
+   built them from keywords.def: the same hash, the same number of
+   buckets, and each entry put at the head of its chain.  hash_create
+   compares a new key with the head of the chain only, as far as the
+   new key goes, and gives back the head if that matches; that is
+   copied too, so that lookups find what they always found.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "symhash.h"
+
+#define KEYWORD_TABLE_SIZE 101
+
+typedef struct keyword {
+  const char *name;
+  const char *code;		/* The K_ macro, by name.  */
+} keyword;
+
+static const keyword kinfo[] = {
+#define KEYWORD(name, code) { name, #code },
+#define MRI_KEYWORD(name, code)
+#include "keywords.def"
+#undef KEYWORD
+#undef MRI_KEYWORD
+  { NULL, NULL }
+};
+
+static const keyword mrikinfo[] = {
+#define KEYWORD(name, code)
+#define MRI_KEYWORD(name, code) { name, #code },
+#include "keywords.def"
+#undef KEYWORD
+#undef MRI_KEYWORD
+  { NULL, NULL }
+};
+
+typedef struct entry {
+  char key[32];
+  const char *code;
+  int index;			/* In the order written out.  */
+  struct entry *next;
+} entry;
+
+typedef struct table {
+  entry *buckets[KEYWORD_TABLE_SIZE];
+  entry entries[256];
+  int nentries;
+} table;
+
+static table tables[2];
+
+/* hash_add_to_int_table, by way of hash_create.  */
+
+static void
+add (table *t, const char *key, const char *code)
+{
+  int len = (int) strlen (key);
+  int k = symbol_hash (key, len) % KEYWORD_TABLE_SIZE;
+  entry *e;
+
+  if (t->buckets[k] && strncmp (t->buckets[k]->key, key, len) == 0)
+    e = t->buckets[k];
+  else
+    {
+      if (t->nentries == (int) (sizeof t->entries / sizeof t->entries[0])
+	  || len >= (int) sizeof e->key)
+	{
+	  fprintf (stderr, "mkkeywords: too many keywords, or too long\n");
+	  exit (1);
+	}
+      e = &t->entries[t->nentries++];
+      strcpy (e->key, key);
+      e->next = t->buckets[k];
+      t->buckets[k] = e;
+    }
+  e->code = code;
+}
+
+/* add_keyword: each keyword goes in once upper and once lower case.  */
+
+static void
+add_keyword (table *t, const char *name, const char *code)
+{
+  char lower[32];
+  int j;
+
+  add (t, name, code);
+  for (j = 0; name[j] && j < (int) sizeof lower - 1; j++)
+    lower[j] = name[j] - 'A' + 'a';
+  lower[j] = 0;
+  add (t, lower, code);
+}
+
+static void
+write_table (FILE *f, table *t, int n)
+{
+  int i;
+
+  /* Number the entries bucket by bucket, so that each chain is
+     together in memory.  */
+  {
+    int next = 0;
+    entry *e;
+
+    for (i = 0; i < KEYWORD_TABLE_SIZE; i++)
+      for (e = t->buckets[i]; e; e = e->next)
+	e->index = next++;
+  }
+
+  fprintf (f, "\nstatic hash_entry keyword_entries_%d[%d] = {\n",
+	   n, t->nentries);
+  for (i = 0; i < KEYWORD_TABLE_SIZE; i++)
+    {
+      entry *e;
+
+      for (e = t->buckets[i]; e; e = e->next)
+	{
+	  fprintf (f, "  { .key = { .ptr = (char *) \"%s\", .len = %d },\n"
+		   "    .type = hash_integer, .value = { .i = %s },\n",
+		   e->key, (int) strlen (e->key), e->code);
+	  if (e->next)
+	    fprintf (f, "    .next = &keyword_entries_%d[%d] },\n",
+		     n, e->next->index);
+	  else
+	    fprintf (f, "    .next = NULL },\n");
+	}
+    }
+  fprintf (f, "};\n\nstatic hash_entry *keyword_buckets_%d[%d] = {\n",
+	   n, KEYWORD_TABLE_SIZE);
+  for (i = 0; i < KEYWORD_TABLE_SIZE; i++)
+    {
+      if (t->buckets[i])
+	fprintf (f, "  &keyword_entries_%d[%d],\n", n, t->buckets[i]->index);
+      else
+	fprintf (f, "  NULL,\n");
+    }
+  fprintf (f, "};\n");
+}
+
+int
+main (int argc, char **argv)
+{
+  FILE *f;
+  int i;
+
+  if (argc != 2)
+    {
+      fprintf (stderr, "Usage: mkkeywords keywords.h\n");
+      return 2;
+    }
+
+  for (i = 0; kinfo[i].name; i++)
+    {
+      add_keyword (&tables[0], kinfo[i].name, kinfo[i].code);
+      add_keyword (&tables[1], kinfo[i].name, kinfo[i].code);
+    }
+  for (i = 0; mrikinfo[i].name; i++)
+    add_keyword (&tables[1], mrikinfo[i].name, mrikinfo[i].code);
+
+  f = fopen (argv[1], "w");
+  if (!f)
+    {
+      fprintf (stderr, "mkkeywords: can't write `%s'\n", argv[1]);
+      return 1;
+    }
+  fprintf (f, "/* Made by mkkeywords from keywords.def; do not edit.  */\n");
+  write_table (f, &tables[0], 0);
+  write_table (f, &tables[1], 1);
+  fprintf (f, "\n/* One table for each setting of -M.  */\n\n"
+	   "static hash_table keyword_tables[2] = {\n"
+	   "  { keyword_buckets_0, %d, 0 },\n"
+	   "  { keyword_buckets_1, %d, 0 }\n"
+	   "};\n", KEYWORD_TABLE_SIZE, KEYWORD_TABLE_SIZE);
+  return fclose (f) == 0 ? 0 : 1;
+}
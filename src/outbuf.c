@@ -0,0 +1,251 @@
+/* outbuf.c - block-buffered output.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "compat.h"
+#include "outbuf.h"
+#include "pipeline.h"
+
+void
+outbuf_init (outbuf *out, FILE *file)
+{
+  out->own = out->ptr = (char *) xmalloc (OUTBUF_SIZE);
+  out->len = 0;
+  out->size = OUTBUF_SIZE;
+  out->pipe = NULL;
+  out->error = 0;
+  out->copy = NULL;
+  out->file = NULL;
+  outbuf_set_file (out, file);
+}
+
+void
+outbuf_free (outbuf *out)
+{
+  outbuf_flush (out);
+  free (out->own);
+  out->own = out->ptr = NULL;
+}
+
+void
+outbuf_set_file (outbuf *out, FILE *file)
+{
+  if (out->file)
+    outbuf_flush (out);
+  out->file = file;
+#ifdef HAVE_UNISTD_H
+  out->fd = file ? fileno (file) : -1;
+#else
+  out->fd = -1;
+#endif
+}
+
+void
+outbuf_set_pipe (outbuf *out, struct pipe_writer *pipe)
+{
+  if (pipe)
+    {
+      outbuf_flush (out);
+      out->pipe = pipe;
+      out->ptr = pipe_writer_take (pipe);
+      out->size = PIPE_BLOCK_SIZE;
+    }
+  else if (out->pipe)
+    {
+      if (out->len && out->copy)
+	sb_add_buffer (out->copy, out->ptr, out->len);
+      if (out->len)
+	pipe_writer_send (out->pipe, out->ptr, out->len);
+      out->pipe = NULL;
+      out->ptr = out->own;
+      out->size = OUTBUF_SIZE;
+    }
+  out->len = 0;
+}
+
+/* Write LEN bytes at S to the file.  */
+
+static void
+write_file (outbuf *out, const char *s, int len)
+{
+#ifdef HAVE_UNISTD_H
+  if (out->fd >= 0)
+    {
+      /* Anything the caller printed to the FILE itself comes first.  */
+      if (fflush (out->file) != 0)
+	out->error = 1;
+      while (len > 0)
+	{
+	  ssize_t n = write (out->fd, s, len);
+	  if (n < 0)
+	    {
+	      if (errno == EINTR)
+		continue;
+	      out->error = 1;
+	      return;
+	    }
+	  s += n;
+	  len -= n;
+	}
+      return;
+    }
+#endif
+  if (fwrite (s, 1, len, out->file) != (size_t) len)
+    out->error = 1;
+}
+
+int
+outbuf_flush (outbuf *out)
+{
+  int ok;
+
+  if (out->len)
+    {
+      if (out->copy)
+	sb_add_buffer (out->copy, out->ptr, out->len);
+      if (out->pipe)
+	{
+	  pipe_writer_send (out->pipe, out->ptr, out->len);
+	  out->ptr = pipe_writer_take (out->pipe);
+	}
+      else
+	write_file (out, out->ptr, out->len);
+      out->len = 0;
+    }
+  ok = !out->error;
+  out->error = 0;
+  return ok;
+}
+
+/* Called by out_add_char when the block is full.  */
+
+void
+outbuf_overflow (outbuf *out)
+{
+  int error = out->error;
+
+  outbuf_flush (out);
+  /* Keep a failure for the caller's flush to see.  */
+  out->error |= error;
+}
+
+int
+outbuf_tell (const outbuf *out)
+{
+  return out->copy->len + out->len;
+}
+
+void
+outbuf_copied (const outbuf *out, int from, sb *dst)
+{
+  int written = out->copy->len;
+
+  if (from < written)
+    {
+      sb_add_buffer (dst, out->copy->ptr + from, written - from);
+      from = written;
+    }
+  sb_add_buffer (dst, out->ptr + (from - written), out->len - (from - written));
+}
+
+void
+out_add_buffer (outbuf *out, const char *s, int len)
+{
+  while (len > 0)
+    {
+      int n = out->size - out->len;
+
+      if (n == 0)
+	{
+	  outbuf_overflow (out);
+	  n = out->size;
+	}
+      if (n > len)
+	n = len;
+      memcpy (out->ptr + out->len, s, n);
+      out->len += n;
+      s += n;
+      len -= n;
+    }
+}
+
+void
+out_add_string (outbuf *out, const char *s)
+{
+  out_add_buffer (out, s, strlen (s));
+}
+
+void
+out_add_sb (outbuf *out, const sb *s)
+{
+  out_add_buffer (out, s->ptr, s->len);
+}
+
+void
+out_add_sb_at (outbuf *out, int idx, const sb *s)
+{
+  if (idx < s->len)
+    out_add_buffer (out, s->ptr + idx, s->len - idx);
+}
+
+int
+out_add_int (outbuf *out, long long v, int width)
+{
+  char digits[24];
+  char *p = digits + sizeof digits;
+  unsigned long long u = (v < 0 ? 0ull - (unsigned long long) v
+			  : (unsigned long long) v);
+  int n, pad;
+
+  do
+    {
+      *--p = '0' + u % 10;
+      u /= 10;
+    }
+  while (u);
+  if (v < 0)
+    *--p = '-';
+  n = digits + sizeof digits - p;
+  for (pad = width - n; pad > 0; pad--)
+    out_add_char (out, ' ');
+  out_add_buffer (out, p, n);
+  return n > width ? n : width;
+}
+
+void
+out_add_bytes (outbuf *out, const sb *s)
+{
+  int i;
+
+  for (i = 0; i < s->len; i++)
+    {
+      if (i)
+	out_add_char (out, ',');
+      out_add_int (out, s->ptr[i], 0);
+    }
+}
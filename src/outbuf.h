@@ -0,0 +1,93 @@
+/* outbuf.h - block-buffered output.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#ifndef OUTBUF_H
+
+#define OUTBUF_H
+
+#include <stdio.h>
+
+#include "sb.h"
+
+/* The preprocessed text is gathered into one large block and written
+   out a block at a time, rather than a line or a character at a time
+   through stdio.  The appends below do no formatting beyond decimal
+   numbers, so nothing needs to be null terminated to be printed.
+
+   A full block goes straight to the file descriptor behind the output
+   FILE with write(), or through fwrite where the FILE has none (a
+   memory stream, say).  While a pipeline writer is attached
+   (pipeline.h) the blocks are the writer's own, and a full one is
+   handed to the writer thread as it is.  */
+
+#define OUTBUF_SIZE (64 * 1024)
+
+struct pipe_writer;
+
+typedef struct outbuf
+  {
+    char *ptr;			/* The block being filled.  */
+    int len;			/* How much of it is used.  */
+    int size;			/* How big it is.  */
+    char *own;			/* Our block, while PTR is the writer's.  */
+    FILE *file;			/* Where the blocks go.  */
+    int fd;			/* FILE's descriptor, or -1 for fwrite.  */
+    struct pipe_writer *pipe;	/* Or the writer they go to.  */
+    int error;			/* A write has failed.  */
+    sb *copy;			/* Gets every block written too, or NULL.  */
+  }
+outbuf;
+
+extern void outbuf_init (outbuf *out, FILE *file);
+extern void outbuf_free (outbuf *out);
+/* Write what is buffered and send what follows to FILE.  */
+extern void outbuf_set_file (outbuf *out, FILE *file);
+/* Fill the writer's blocks from now on, or, with NULL, hand it the
+   last one and go back to the file.  */
+extern void outbuf_set_pipe (outbuf *out, struct pipe_writer *pipe);
+/* Write out what is buffered.  Returns 0 if any write has failed
+   since the last call.  */
+extern int outbuf_flush (outbuf *out);
+extern void outbuf_overflow (outbuf *out);
+
+/* How many bytes have been added since COPY was set, and append to
+   DST those from the FROMth on.  Only while COPY is set.  */
+extern int outbuf_tell (const outbuf *out);
+extern void outbuf_copied (const outbuf *out, int from, sb *dst);
+
+extern void out_add_buffer (outbuf *out, const char *s, int len);
+extern void out_add_string (outbuf *out, const char *s);
+extern void out_add_sb (outbuf *out, const sb *s);
+extern void out_add_sb_at (outbuf *out, int idx, const sb *s);
+/* The characters of S as comma separated numbers, as for .byte.  */
+extern void out_add_bytes (outbuf *out, const sb *s);
+/* V in decimal, right justified in at least WIDTH columns.  Returns
+   the number of characters added.  */
+extern int out_add_int (outbuf *out, long long v, int width);
+
+static inline void
+out_add_char (outbuf *out, int c)
+{
+  if (out->len == out->size)
+    outbuf_overflow (out);
+  out->ptr[out->len++] = c;
+}
+
+#endif /* OUTBUF_H */
@@ -0,0 +1,307 @@
+/* pipeline.c - reading and writing on threads of their own.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compat.h"
+#include "ring.h"
+#include "pipeline.h"
+
+#ifdef HAVE_PTHREAD
+
+#include <pthread.h>
+
+#define PIPE_BLOCKS 8			/* Blocks in flight per stage.  */
+
+/* Allocate the blocks of a stage and put them all on FREE.  */
+
+static void
+blocks_init (pipe_block *blocks, spsc_ring *free_ring)
+{
+  int i;
+
+  for (i = 0; i < PIPE_BLOCKS; i++)
+    {
+      blocks[i].buf = (char *) xmalloc (PIPE_BLOCK_SIZE);
+      blocks[i].len = 0;
+      ring_push (free_ring, &blocks[i]);
+    }
+}
+
+static void
+blocks_free (pipe_block *blocks)
+{
+  int i;
+
+  for (i = 0; i < PIPE_BLOCKS; i++)
+    free (blocks[i].buf);
+}
+
+/* The reader thread takes empty blocks off EMPTY, fills them from FILE
+   and puts them on FILLED.  A block of length 0 marks the end, and is
+   the last thing it sends.  */
+
+struct pipe_reader_stages {
+  FILE *file;
+  spsc_ring filled;
+  spsc_ring empty;
+  pipe_block *current;		/* The block being read, or NULL.  */
+  int stop;			/* Asks the reader to finish early.  */
+  int eof;			/* The end marker has arrived.  */
+  pthread_t thread;
+  pipe_block blocks[PIPE_BLOCKS];
+};
+
+static void *
+reader_thread (void *arg)
+{
+  struct pipe_reader_stages *s = (struct pipe_reader_stages *) arg;
+  pipe_block *b;
+
+  do
+    {
+      b = (pipe_block *) ring_pop (&s->empty);
+      if (__atomic_load_n (&s->stop, __ATOMIC_RELAXED))
+	b->len = 0;
+      else
+	b->len = (int) fread (b->buf, 1, PIPE_BLOCK_SIZE, s->file);
+      ring_push (&s->filled, b);
+    }
+  while (b->len > 0);
+  return NULL;
+}
+
+pipe_reader *
+pipe_reader_open (FILE *file)
+{
+  pipe_reader *r = (pipe_reader *) xmalloc (sizeof (pipe_reader));
+  struct pipe_reader_stages *s;
+
+  s = (struct pipe_reader_stages *) xmalloc (sizeof *s);
+  s->file = file;
+  s->current = NULL;
+  s->stop = 0;
+  s->eof = 0;
+  ring_init (&s->filled, PIPE_BLOCKS);
+  ring_init (&s->empty, PIPE_BLOCKS);
+  blocks_init (s->blocks, &s->empty);
+  if (pthread_create (&s->thread, NULL, reader_thread, s) != 0)
+    {
+      blocks_free (s->blocks);
+      ring_destroy (&s->filled);
+      ring_destroy (&s->empty);
+      free (s);
+      free (r);
+      return NULL;
+    }
+
+  r->ptr = NULL;
+  r->pos = 0;
+  r->len = 0;
+  r->stages = s;
+  return r;
+}
+
+/* Move on to the next block, returning its first character, or EOF
+   at the end of the file.  */
+
+int
+pipe_reader_next (pipe_reader *r)
+{
+  struct pipe_reader_stages *s = r->stages;
+
+  if (s->eof)
+    return EOF;
+  if (s->current)
+    ring_push (&s->empty, s->current);
+  s->current = (pipe_block *) ring_pop (&s->filled);
+  r->ptr = s->current->buf;
+  r->pos = 0;
+  r->len = s->current->len;
+  if (r->len == 0)
+    {
+      s->eof = 1;
+      return EOF;
+    }
+  return (unsigned char) r->ptr[r->pos++];
+}
+
+void
+pipe_reader_close (pipe_reader *r)
+{
+  struct pipe_reader_stages *s = r->stages;
+
+  /* Tell the reader to stop, and take what it had already read until
+     the end marker comes.  */
+  __atomic_store_n (&s->stop, 1, __ATOMIC_RELAXED);
+  while (!s->eof)
+    {
+      r->len = 0;
+      pipe_reader_next (r);
+    }
+  pthread_join (s->thread, NULL);
+
+  fclose (s->file);
+  blocks_free (s->blocks);
+  ring_destroy (&s->filled);
+  ring_destroy (&s->empty);
+  free (s);
+  free (r);
+}
+
+/* The writer: the processing thread fills blocks taken off EMPTY (see
+   outbuf.c), and the writer thread writes the full blocks it is sent
+   to OUT.  A block of length 0 marks the end.  */
+
+struct pipe_writer {
+  FILE *out;
+  spsc_ring full;
+  spsc_ring empty;
+  pipe_block *current;		/* The block being filled, or NULL.  */
+  int error;			/* A write to OUT failed.  */
+  pthread_t thread;
+  pipe_block blocks[PIPE_BLOCKS];
+};
+
+static void *
+writer_thread (void *arg)
+{
+  pipe_writer *w = (pipe_writer *) arg;
+
+  for (;;)
+    {
+      pipe_block *b = (pipe_block *) ring_pop (&w->full);
+      if (b->len == 0)
+	break;
+      if (fwrite (b->buf, 1, b->len, w->out) != (size_t) b->len)
+	w->error = 1;
+      b->len = 0;
+      ring_push (&w->empty, b);
+    }
+  return NULL;
+}
+
+pipe_writer *
+pipe_writer_open (FILE *out)
+{
+  pipe_writer *w = (pipe_writer *) xmalloc (sizeof (pipe_writer));
+
+  w->out = out;
+  w->current = NULL;
+  w->error = 0;
+  ring_init (&w->full, PIPE_BLOCKS);
+  ring_init (&w->empty, PIPE_BLOCKS);
+  blocks_init (w->blocks, &w->empty);
+  if (pthread_create (&w->thread, NULL, writer_thread, w) != 0)
+    {
+      blocks_free (w->blocks);
+      ring_destroy (&w->full);
+      ring_destroy (&w->empty);
+      free (w);
+      return NULL;
+    }
+  return w;
+}
+
+char *
+pipe_writer_take (pipe_writer *w)
+{
+  w->current = (pipe_block *) ring_pop (&w->empty);
+  return w->current->buf;
+}
+
+void
+pipe_writer_send (pipe_writer *w, char *buf, int len)
+{
+  if (!w->current || buf != w->current->buf || len <= 0)
+    abort ();
+  w->current->len = len;
+  ring_push (&w->full, w->current);
+  w->current = NULL;
+}
+
+int
+pipe_writer_close (pipe_writer *w)
+{
+  int ok;
+
+  /* The end marker is the block last taken, if it wasn't sent.  */
+  if (!w->current)
+    w->current = (pipe_block *) ring_pop (&w->empty);
+  w->current->len = 0;
+  ring_push (&w->full, w->current);
+  pthread_join (w->thread, NULL);
+
+  ok = !w->error;
+  blocks_free (w->blocks);
+  ring_destroy (&w->full);
+  ring_destroy (&w->empty);
+  free (w);
+  return ok;
+}
+
+
+#else /* ! HAVE_PTHREAD */
+
+pipe_reader *
+pipe_reader_open (FILE *file)
+{
+  return NULL;
+}
+
+int
+pipe_reader_next (pipe_reader *r)
+{
+  return EOF;
+}
+
+void
+pipe_reader_close (pipe_reader *r)
+{
+}
+
+pipe_writer *
+pipe_writer_open (FILE *out)
+{
+  return NULL;
+}
+
+char *
+pipe_writer_take (pipe_writer *w)
+{
+  return NULL;
+}
+
+void
+pipe_writer_send (pipe_writer *w, char *buf, int len)
+{
+}
+
+int
+pipe_writer_close (pipe_writer *w)
+{
+  return 1;
+}
+
+#endif /* HAVE_PTHREAD */
@@ -0,0 +1,84 @@
+/* pipeline.h - reading and writing on threads of their own.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#ifndef PIPELINE_H
+
+#define PIPELINE_H
+
+#include <stdio.h>
+
+/* With --pipeline the input file is read by a reader thread and the
+   output written by a writer thread, so that waiting on the disk
+   overlaps with preprocessing.  Each stage hands blocks of text to the
+   next through a pair of rings (ring.h): one carries full blocks
+   forward and the other brings empty ones back, so the blocks are
+   allocated once.  Where threads are not available, or a stage can't
+   be started, the open functions return NULL and the file is read or
+   written directly as usual.  */
+
+#define PIPE_BLOCK_SIZE (64 * 1024)	/* Bytes in a block.  */
+
+typedef struct pipe_block {
+  char *buf;
+  int len;
+} pipe_block;
+
+/* The reader.  The processing thread reads the current block through
+   pipe_reader_getc, which only calls out of line to change blocks.  */
+
+typedef struct pipe_reader {
+  const char *ptr;		/* The current block.  */
+  int pos;
+  int len;
+  struct pipe_reader_stages *stages;
+} pipe_reader;
+
+/* Start reading FILE, which is then the reader's to close.  */
+extern pipe_reader *pipe_reader_open (FILE *file);
+extern int pipe_reader_next (pipe_reader *);
+/* Stop the reader, even before the end of the file, and free it.  */
+extern void pipe_reader_close (pipe_reader *);
+
+/* The next character, as getc would return it.  */
+
+static inline int
+pipe_reader_getc (pipe_reader *r)
+{
+  if (r->pos < r->len)
+    return (unsigned char) r->ptr[r->pos++];
+  return pipe_reader_next (r);
+}
+
+/* The writer.  The processing thread takes an empty block, fills it
+   and sends it, and the writer thread writes the blocks to OUT in the
+   order they were sent.  The outbuf (outbuf.h) does this for masp.  */
+
+typedef struct pipe_writer pipe_writer;
+
+extern pipe_writer *pipe_writer_open (FILE *out);
+/* An empty block of PIPE_BLOCK_SIZE bytes, waiting for one if need be.  */
+extern char *pipe_writer_take (pipe_writer *);
+/* Send the first LEN bytes of BUF, the block last taken.  */
+extern void pipe_writer_send (pipe_writer *, char *buf, int len);
+/* Finish writing and free the writer.  Returns 0 if a write to OUT
+   failed.  */
+extern int pipe_writer_close (pipe_writer *);
+
+#endif
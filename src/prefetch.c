@@ -0,0 +1,345 @@
+/* prefetch.c - reading include files before they are reached.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "compat.h"
+#include "prefetch.h"
+
+#ifdef HAVE_PTHREAD
+
+#include <pthread.h>
+
+#include "hash.h"
+
+/* A file waiting to be read and scanned.  */
+
+typedef struct prefetch_item {
+  char *path;
+  int main;			/* The main file, which isn't cached.  */
+  struct prefetch_item *next;
+} prefetch_item;
+
+struct prefetcher {
+  prefetch_setup setup;		/* With its strings copied.  */
+  char **paths;
+  char *directory;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  prefetch_item *head;		/* The queue.  */
+  prefetch_item **tail;
+  struct hash_control *seen;	/* Paths ever queued.  */
+  int stop;
+  int nread;
+  int nthreads;
+  pthread_t *threads;
+};
+
+/* Queue PATH, which is taken over, unless it has been seen before.
+   Called with the lock held.  */
+
+static void
+queue_file (prefetcher *p, char *path, int main)
+{
+  prefetch_item *item;
+
+  if (hash_find (p->seen, path))
+    {
+      free (path);
+      return;
+    }
+  hash_insert (p->seen, path, p);
+
+  item = (prefetch_item *) xmalloc (sizeof (prefetch_item));
+  item->path = path;
+  item->main = main;
+  item->next = NULL;
+  *p->tail = item;
+  p->tail = &item->next;
+  pthread_cond_signal (&p->wake);
+}
+
+/* Where the include file NAME would be found, in malloced memory, or
+   NULL if nowhere.  */
+
+static char *
+find_file (prefetcher *p, const char *name)
+{
+  struct stat st;
+  char *path;
+  int i;
+
+  for (i = 0; i <= p->setup.npaths; i++)
+    {
+      if (i < p->setup.npaths)
+	{
+	  char *cand = (char *) xmalloc (strlen (p->paths[i])
+					 + strlen (name) + 2);
+	  sprintf (cand, "%s/%s", p->paths[i], name);
+	  path = resolve_path (p->directory, cand);
+	  free (cand);
+	}
+      else
+	path = resolve_path (p->directory, name);
+      if (stat (path, &st) == 0 && S_ISREG (st.st_mode))
+	return path;
+      free (path);
+    }
+  return NULL;
+}
+
+static int
+is_name_char (int c)
+{
+  return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+	  || (c >= '0' && c <= '9') || c == '_' || c == '$');
+}
+
+/* Queue the files named by the include directives in the LEN bytes at
+   TEXT.  */
+
+static void
+scan_text (prefetcher *p, const char *text, size_t len)
+{
+  const char *end = text + len;
+  const char *s = text;
+
+  while (s < end)
+    {
+      const char *eol = memchr (s, '\n', end - s);
+      const char *name;
+      char *copy;
+      char *path;
+
+      if (!eol)
+	eol = end;
+      while (s < eol && (*s == ' ' || *s == '\t'))
+	s++;
+      if (eol - s > 8 && *s == p->setup.prefix_char
+	  && strncasecmp (s + 1, "include", 7) == 0
+	  && !is_name_char ((unsigned char) s[8]))
+	{
+	  s += 8;
+	  while (s < eol && (*s == ' ' || *s == '\t'))
+	    s++;
+	  if (s < eol && *s == '"')
+	    {
+	      name = ++s;
+	      while (s < eol && *s != '"')
+		s++;
+	    }
+	  else
+	    {
+	      name = s;
+	      while (s < eol && *s != ' ' && *s != '\t' && *s != '\r')
+		s++;
+	    }
+	  if (s > name)
+	    {
+	      copy = (char *) xmalloc (s - name + 1);
+	      memcpy (copy, name, s - name);
+	      copy[s - name] = 0;
+	      path = find_file (p, copy);
+	      free (copy);
+	      if (path)
+		{
+		  pthread_mutex_lock (&p->lock);
+		  queue_file (p, path, 0);
+		  pthread_mutex_unlock (&p->lock);
+		}
+	    }
+	}
+      s = eol + 1;
+    }
+}
+
+/* Read the whole of the main file at PATH and scan it.  */
+
+static void
+scan_main (prefetcher *p, const char *path)
+{
+  FILE *f = fopen (path, "rb");
+  size_t alloc = 8192;
+  size_t len = 0;
+  size_t n;
+  char *buf;
+
+  if (!f)
+    return;
+  buf = (char *) xmalloc (alloc);
+  while ((n = fread (buf + len, 1, alloc - len, f)) > 0)
+    {
+      len += n;
+      if (len == alloc)
+	{
+	  alloc *= 2;
+	  buf = (char *) xrealloc (buf, alloc);
+	}
+    }
+  fclose (f);
+  scan_text (p, buf, len);
+  free (buf);
+}
+
+static void *
+prefetch_thread (void *arg)
+{
+  prefetcher *p = (prefetcher *) arg;
+
+  pthread_mutex_lock (&p->lock);
+  while (1)
+    {
+      prefetch_item *item;
+
+      while (!p->stop && !p->head)
+	pthread_cond_wait (&p->wake, &p->lock);
+      if (p->stop)
+	break;
+      item = p->head;
+      p->head = item->next;
+      if (!p->head)
+	p->tail = &p->head;
+      pthread_mutex_unlock (&p->lock);
+
+      if (item->main)
+	scan_main (p, item->path);
+      else
+	{
+	  const char *text;
+	  size_t len;
+	  int read = 0;
+
+	  text = p->setup.read (p->setup.arg, item->path, &len, &read);
+	  if (text)
+	    scan_text (p, text, len);
+	  if (read)
+	    {
+	      pthread_mutex_lock (&p->lock);
+	      p->nread++;
+	      pthread_mutex_unlock (&p->lock);
+	    }
+	}
+      free (item->path);
+      free (item);
+
+      pthread_mutex_lock (&p->lock);
+    }
+  pthread_mutex_unlock (&p->lock);
+  return NULL;
+}
+
+prefetcher *
+prefetch_start (const prefetch_setup *setup)
+{
+  prefetcher *p = (prefetcher *) xmalloc (sizeof (prefetcher));
+  int i;
+
+  p->setup = *setup;
+  p->paths = (char **) xmalloc ((setup->npaths + 1) * sizeof (char *));
+  for (i = 0; i < setup->npaths; i++)
+    p->paths[i] = xstrdup (setup->paths[i]);
+  p->directory = setup->directory ? xstrdup (setup->directory) : NULL;
+  pthread_mutex_init (&p->lock, NULL);
+  pthread_cond_init (&p->wake, NULL);
+  p->head = NULL;
+  p->tail = &p->head;
+  p->seen = hash_new ();
+  p->stop = 0;
+  p->nread = 0;
+  p->threads = (pthread_t *) xmalloc (setup->nthreads * sizeof (pthread_t));
+  for (p->nthreads = 0; p->nthreads < setup->nthreads; p->nthreads++)
+    if (pthread_create (&p->threads[p->nthreads], NULL,
+			prefetch_thread, p) != 0)
+      break;
+  if (p->nthreads == 0)
+    {
+      prefetch_stop (p);
+      return NULL;
+    }
+  return p;
+}
+
+void
+prefetch_main (prefetcher *p, const char *path)
+{
+  pthread_mutex_lock (&p->lock);
+  queue_file (p, xstrdup (path), 1);
+  pthread_mutex_unlock (&p->lock);
+}
+
+int
+prefetch_stop (prefetcher *p)
+{
+  int nread;
+  int i;
+
+  pthread_mutex_lock (&p->lock);
+  p->stop = 1;
+  pthread_cond_broadcast (&p->wake);
+  pthread_mutex_unlock (&p->lock);
+  for (i = 0; i < p->nthreads; i++)
+    pthread_join (p->threads[i], NULL);
+
+  while (p->head)
+    {
+      prefetch_item *next = p->head->next;
+      free (p->head->path);
+      free (p->head);
+      p->head = next;
+    }
+  hash_die (p->seen);
+  for (i = 0; i < p->setup.npaths; i++)
+    free (p->paths[i]);
+  free (p->paths);
+  free (p->directory);
+  free (p->threads);
+  pthread_cond_destroy (&p->wake);
+  pthread_mutex_destroy (&p->lock);
+  nread = p->nread;
+  free (p);
+  return nread;
+}
+
+#else /* !HAVE_PTHREAD */
+
+prefetcher *
+prefetch_start (const prefetch_setup *setup)
+{
+  return NULL;
+}
+
+void
+prefetch_main (prefetcher *p, const char *path)
+{
+}
+
+int
+prefetch_stop (prefetcher *p)
+{
+  return 0;
+}
+
+#endif /* HAVE_PTHREAD */
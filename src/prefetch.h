@@ -0,0 +1,65 @@
+/* prefetch.h - reading include files before they are reached.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#ifndef PREFETCH_H
+
+#define PREFETCH_H
+
+#include <stddef.h>
+
+/* With --prefetch, the include files a run is going to need are read
+   into the include cache on a few threads of their own, while the run
+   gets on with what it already has.  The main file is scanned for
+   include directives, each one is looked for along the include path
+   as do_include would, and each file found is read and scanned in
+   turn.  The scan is only a guess, knowing nothing of macros or
+   conditionals: a file read for nothing costs only the reading, and
+   one missed is read as usual when the run reaches it.  Where threads
+   are not available prefetch_start returns NULL.  */
+
+typedef struct prefetcher prefetcher;
+
+/* Bring the file at PATH into the cache, returning its text and
+   setting *LEN, or return NULL if it can't be read.  The text must
+   last until the prefetcher is stopped.  *READ is set if the file was
+   read, rather than found in the cache.  */
+typedef const char *(*prefetch_read_fn) (void *arg, const char *path,
+					 size_t *len, int *read);
+
+typedef struct prefetch_setup {
+  int nthreads;
+  prefetch_read_fn read;
+  void *arg;
+  const char *directory;	/* Relative names are in this, if not NULL.  */
+  const char *const *paths;	/* The include path.  */
+  int npaths;
+  char prefix_char;		/* What starts a directive.  */
+} prefetch_setup;
+
+extern prefetcher *prefetch_start (const prefetch_setup *);
+
+/* Scan the main file, at PATH, for the include files to read.  */
+extern void prefetch_main (prefetcher *, const char *path);
+
+/* Stop, dropping whatever is left to do, and free the prefetcher.
+   Returns the number of files it read.  */
+extern int prefetch_stop (prefetcher *);
+
+#endif
@@ -0,0 +1,245 @@
+/* profile.c - where a run spends its time.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include "compat.h"
+#include "hash.h"
+#include "profile.h"
+
+/* Directive codes are a keyword number with flags above it; the
+   number alone picks the counter.  */
+#define PROFILE_CODES 256
+
+typedef struct profile_entry {
+  char *name;			/* NULL until first seen.  */
+  long count;
+  double seconds;
+  double bytes;			/* Made by macro expansions.  */
+} profile_entry;
+
+struct profile {
+  double start;
+  profile_entry directives[PROFILE_CODES];
+  struct hash_control *macro_index; /* Name -> its entry.  */
+  profile_entry **macros;
+  int nmacros;
+  int macros_alloc;
+  profile_entry phases[PROFILE_PHASES];
+  int max_depth;
+};
+
+static const char *const phase_names[PROFILE_PHASES] = {
+  "get_line",
+  "process_assigns",
+  "change_base2"
+};
+
+double
+profile_clock (void)
+{
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+  return (double) clock () / CLOCKS_PER_SEC;
+#endif
+}
+
+profile *
+profile_new (void)
+{
+  profile *p = (profile *) xmalloc (sizeof (profile));
+  int i;
+
+  memset (p, 0, sizeof *p);
+  p->macro_index = hash_new ();
+  for (i = 0; i < PROFILE_PHASES; i++)
+    p->phases[i].name = (char *) phase_names[i];
+  p->start = profile_clock ();
+  return p;
+}
+
+void
+profile_free (profile *p)
+{
+  int i;
+
+  if (!p)
+    return;
+  for (i = 0; i < PROFILE_CODES; i++)
+    free (p->directives[i].name);
+  for (i = 0; i < p->nmacros; i++)
+    {
+      free (p->macros[i]->name);
+      free (p->macros[i]);
+    }
+  free (p->macros);
+  hash_die (p->macro_index);
+  free (p);
+}
+
+static char *
+copy_name (const char *name, int len)
+{
+  char *copy = (char *) xmalloc (len + 1);
+
+  memcpy (copy, name, len);
+  copy[len] = 0;
+  return copy;
+}
+
+void
+profile_directive (profile *p, int code, const char *name, int len,
+		   double start)
+{
+  profile_entry *e = &p->directives[code & (PROFILE_CODES - 1)];
+
+  e->seconds += profile_clock () - start;
+  e->count++;
+  if (!e->name)
+    {
+      char *c;
+
+      /* Keywords are found in either case; report them in one.  */
+      e->name = copy_name (name, len);
+      for (c = e->name; *c; c++)
+	*c = TOUPPER (*c);
+    }
+}
+
+void
+profile_macro (profile *p, const char *name, int len, size_t bytes,
+	       double start)
+{
+  double seconds = profile_clock () - start;
+  char buf[128];
+  char *key = len < (int) sizeof buf ? buf : (char *) xmalloc (len + 1);
+  profile_entry *e;
+
+  memcpy (key, name, len);
+  key[len] = 0;
+  e = (profile_entry *) hash_find (p->macro_index, key);
+  if (!e)
+    {
+      e = (profile_entry *) xmalloc (sizeof (profile_entry));
+      memset (e, 0, sizeof *e);
+      e->name = copy_name (name, len);
+      if (p->nmacros == p->macros_alloc)
+	{
+	  p->macros_alloc = p->macros_alloc ? p->macros_alloc * 2 : 64;
+	  p->macros = (profile_entry **)
+	    xrealloc (p->macros, p->macros_alloc * sizeof (profile_entry *));
+	}
+      p->macros[p->nmacros++] = e;
+      hash_insert (p->macro_index, e->name, e);
+    }
+  if (key != buf)
+    free (key);
+
+  e->seconds += seconds;
+  e->count++;
+  e->bytes += bytes;
+}
+
+void
+profile_phase_done (profile *p, profile_phase phase, double start)
+{
+  p->phases[phase].seconds += profile_clock () - start;
+  p->phases[phase].count++;
+}
+
+void
+profile_depth (profile *p, int depth)
+{
+  if (depth > p->max_depth)
+    p->max_depth = depth;
+}
+
+/* Slowest first, then by name so that the order is the same from one
+   run to the next.  */
+
+static int
+compare_entries (const void *a, const void *b)
+{
+  const profile_entry *x = *(const profile_entry *const *) a;
+  const profile_entry *y = *(const profile_entry *const *) b;
+
+  if (x->seconds != y->seconds)
+    return x->seconds < y->seconds ? 1 : -1;
+  return strcmp (x->name, y->name);
+}
+
+static double
+percent (double seconds, double total)
+{
+  return total > 0 ? 100.0 * seconds / total : 0.0;
+}
+
+void
+profile_report (profile *p, FILE *file)
+{
+  double total = profile_clock () - p->start;
+  profile_entry *sorted[PROFILE_CODES];
+  int n = 0;
+  int i;
+
+  fprintf (file, "profile: %.6f seconds, include depth %d\n",
+	   total, p->max_depth);
+
+  for (i = 0; i < PROFILE_CODES; i++)
+    if (p->directives[i].name)
+      sorted[n++] = &p->directives[i];
+  qsort (sorted, n, sizeof (profile_entry *), compare_entries);
+  fprintf (file, "%-24s %10s %12s %7s\n",
+	   "directive", "count", "seconds", "%");
+  for (i = 0; i < n; i++)
+    fprintf (file, "%-24s %10ld %12.6f %6.1f%%\n", sorted[i]->name,
+	     sorted[i]->count, sorted[i]->seconds,
+	     percent (sorted[i]->seconds, total));
+
+  qsort (p->macros, p->nmacros, sizeof (profile_entry *), compare_entries);
+  fprintf (file, "%-24s %10s %12s %7s %12s %10s\n",
+	   "macro", "count", "seconds", "%", "bytes", "per call");
+  for (i = 0; i < p->nmacros; i++)
+    {
+      profile_entry *e = p->macros[i];
+      fprintf (file, "%-24s %10ld %12.6f %6.1f%% %12.0f %10.1f\n",
+	       e->name, e->count, e->seconds, percent (e->seconds, total),
+	       e->bytes, e->bytes / e->count);
+    }
+
+  fprintf (file, "%-24s %10s %12s %7s\n", "phase", "count", "seconds", "%");
+  for (i = 0; i < PROFILE_PHASES; i++)
+    fprintf (file, "%-24s %10ld %12.6f %6.1f%%\n", p->phases[i].name,
+	     p->phases[i].count, p->phases[i].seconds,
+	     percent (p->phases[i].seconds, total));
+}
@@ -0,0 +1,69 @@
+/* profile.h - where a run spends its time.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#ifndef PROFILE_H
+
+#define PROFILE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* With --profile a run counts and times each directive it handles,
+   by keyword, and each macro it expands, by name, along with the
+   bytes each expansion made.  It also times a few phases every line
+   goes through, and notes the deepest the include stack got.  The
+   phases overlap the directives: reading the body of a .macro is
+   time in get_line as well as in MACRO.  A run without --profile has
+   no profile, and pays only for testing that.  */
+
+typedef struct profile profile;
+
+typedef enum {
+  PROFILE_GET_LINE,		/* Reading lines, get_line.  */
+  PROFILE_ASSIGNS,		/* Substituting variables, process_assigns.  */
+  PROFILE_CHANGE_BASE,		/* Converting numbers, change_base2.  */
+  PROFILE_PHASES
+} profile_phase;
+
+extern profile *profile_new (void);
+extern void profile_free (profile *);
+
+/* The time, in seconds from some fixed point.  Each of the following
+   takes what this said when the thing being timed began.  */
+extern double profile_clock (void);
+
+/* The directive numbered CODE, called NAME of LEN characters, has
+   been handled.  */
+extern void profile_directive (profile *, int code, const char *name,
+			       int len, double start);
+
+/* The macro NAME, of LEN characters, has been expanded into BYTES.  */
+extern void profile_macro (profile *, const char *name, int len,
+			   size_t bytes, double start);
+
+extern void profile_phase_done (profile *, profile_phase, double start);
+
+/* The include stack is DEPTH levels deep.  */
+extern void profile_depth (profile *, int depth);
+
+/* Print the report, slowest first, on FILE.  */
+extern void profile_report (profile *, FILE *file);
+
+#endif
@@ -0,0 +1,140 @@
+/* ring.c - single producer, single consumer queues between threads.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#include "config.h"
+
+#include "compat.h"
+#include "ring.h"
+
+#ifdef HAVE_PTHREAD
+
+/* The indices are read by the other side, so loads and stores of them
+   are atomic, with acquire and release ordering so that a slot's
+   contents are seen no later than the index which publishes it.  The
+   full fences pair a side going to sleep with the other side looking
+   for sleepers, so one of them always sees the other.  */
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LOAD_ACQUIRE(p) __atomic_load_n ((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n ((p), (v), __ATOMIC_RELEASE)
+#define FULL_FENCE() __atomic_thread_fence (__ATOMIC_SEQ_CST)
+#define ADD(p, n) __atomic_add_fetch ((p), (n), __ATOMIC_SEQ_CST)
+#else
+#error "ring.c needs the GCC __atomic builtins"
+#endif
+
+/* How many times to look again before going to sleep.  A ring between
+   two busy stages usually becomes ready again within that.  */
+#define SPINS 200
+
+void
+ring_init (spsc_ring *r, unsigned size)
+{
+  unsigned n = 1;
+
+  while (n < size)
+    n <<= 1;
+  r->slots = (void **) xmalloc (n * sizeof (void *));
+  r->size = n;
+  r->head = 0;
+  r->tail = 0;
+  r->sleepers = 0;
+  pthread_mutex_init (&r->lock, NULL);
+  pthread_cond_init (&r->cond, NULL);
+}
+
+void
+ring_destroy (spsc_ring *r)
+{
+  pthread_cond_destroy (&r->cond);
+  pthread_mutex_destroy (&r->lock);
+  free (r->slots);
+}
+
+static int
+ring_can_push (spsc_ring *r)
+{
+  return r->head - LOAD_ACQUIRE (&r->tail) < r->size;
+}
+
+static int
+ring_can_pop (spsc_ring *r)
+{
+  return LOAD_ACQUIRE (&r->head) != r->tail;
+}
+
+/* Wait until READY says the ring has room or items for this side.  */
+
+static void
+ring_wait (spsc_ring *r, int (*ready) (spsc_ring *))
+{
+  int i;
+
+  for (i = 0; i < SPINS; i++)
+    if (ready (r))
+      return;
+
+  pthread_mutex_lock (&r->lock);
+  ADD (&r->sleepers, 1);
+  FULL_FENCE ();
+  while (!ready (r))
+    pthread_cond_wait (&r->cond, &r->lock);
+  ADD (&r->sleepers, -1);
+  pthread_mutex_unlock (&r->lock);
+}
+
+/* Wake the other side if it is asleep.  */
+
+static void
+ring_wake (spsc_ring *r)
+{
+  FULL_FENCE ();
+  if (LOAD_ACQUIRE (&r->sleepers))
+    {
+      pthread_mutex_lock (&r->lock);
+      pthread_cond_broadcast (&r->cond);
+      pthread_mutex_unlock (&r->lock);
+    }
+}
+
+void
+ring_push (spsc_ring *r, void *item)
+{
+  if (!ring_can_push (r))
+    ring_wait (r, ring_can_push);
+  r->slots[r->head & (r->size - 1)] = item;
+  STORE_RELEASE (&r->head, r->head + 1);
+  ring_wake (r);
+}
+
+void *
+ring_pop (spsc_ring *r)
+{
+  void *item;
+
+  if (!ring_can_pop (r))
+    ring_wait (r, ring_can_pop);
+  item = r->slots[r->tail & (r->size - 1)];
+  STORE_RELEASE (&r->tail, r->tail + 1);
+  ring_wake (r);
+  return item;
+}
+
+#endif /* HAVE_PTHREAD */
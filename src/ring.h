@@ -0,0 +1,58 @@
+/* ring.h - single producer, single consumer queues between threads.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#ifndef RING_H
+
+#define RING_H
+
+#ifdef HAVE_PTHREAD
+
+#include <pthread.h>
+
+/* A ring of pointers passed from exactly one producer thread to
+   exactly one consumer thread.  Each index is written by one side
+   only, so pushing and popping need no lock.  Only a side which finds
+   the ring full (or empty) and has to sleep takes the lock, to wait
+   on the condition; the other side takes it just to wake a sleeper.  */
+
+typedef struct spsc_ring {
+  void **slots;
+  unsigned size;		/* Number of slots, a power of two.  */
+  unsigned head;		/* Next slot to fill; the producer's.  */
+  unsigned tail;		/* Next slot to empty; the consumer's.  */
+  int sleepers;			/* Threads waiting on COND.  */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} spsc_ring;
+
+/* SIZE is rounded up to a power of two.  */
+extern void ring_init (spsc_ring *, unsigned size);
+extern void ring_destroy (spsc_ring *);
+
+/* Add ITEM, waiting while the ring is full.  Producer only.  */
+extern void ring_push (spsc_ring *, void *item);
+
+/* Take the oldest item, waiting while the ring is empty.  Consumer
+   only.  */
+extern void *ring_pop (spsc_ring *);
+
+#endif /* HAVE_PTHREAD */
+
+#endif
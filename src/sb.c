@@ -58,9 +58,10 @@
 
 static void sb_check(sb *ptr, int len);
 
-/* Statistics of sb structures.  */
+/* Statistics of sb structures.  They are counted per thread, so the
+   figures a context reports cover the work done on its own thread.  */
 
-int string_count[sb_max_power_two];
+SB_THREAD_LOCAL int string_count[sb_max_power_two];
 
 /* initializes an sb.  */
 
@@ -83,6 +84,7 @@ sb_build (sb *ptr, int size)
   e->next = NULL;
   e->size = 1 << size;
   string_count[size]++;
+  mem_note_alloc (MEM_SB, total_size);
 
   /* copy into callers world */
   ptr->ptr = e->data;
@@ -110,6 +112,7 @@ sb_kill (sb *ptr)
     abort();
 
   /* Free the memory */
+  mem_note_free (MEM_SB, sizeof (sb_element) + ptr->item->size);
   free(ptr->item);
 
   /* Clear the sb to catch use-after-free */
@@ -156,6 +159,7 @@ sb_check (sb *ptr, int len)
 
       sb_build (&tmp, pot);
       sb_add_sb (&tmp, ptr);
+      mem_note_sb_grow (ptr->len);
 
       /* Kill the old buffer before reassigning */
       sb_kill (ptr);
@@ -215,31 +219,139 @@ sb_add_buffer (sb *ptr, const char *s, int len)
   ptr->len += len;
 }
 
-/* print the sb at ptr to the output file */
+/* Copy characters from in, starting at idx, onto the end of ptr up to
+   but not including the first delim.  Return the index of the delim,
+   or in->len if there was none.  */
 
-void
-sb_print (FILE *outfile, sb *ptr)
+int
+sb_add_until (sb *ptr, int idx, const sb *in, int delim)
 {
-  int i;
-  int nc = 0;
+  const char *start;
+  const char *end;
 
-  for (i = 0; i < ptr->len; i++)
+  if (idx >= in->len)
+    return idx;
+  start = in->ptr + idx;
+  end = (const char *) memchr (start, delim, in->len - idx);
+  if (end == NULL)
+    end = in->ptr + in->len;
+  sb_add_buffer (ptr, start, end - start);
+  return end - in->ptr;
+}
+
+/* Like sb_add_until, but stop at any of the characters in the null
+   terminated string stops.  A null byte in in never stops the run.  */
+
+int
+sb_add_until_any (sb *ptr, int idx, const sb *in, const char *stops)
+{
+  int end = idx;
+
+  while (end < in->len
+	 && (in->ptr[end] == '\0' || strchr (stops, in->ptr[end]) == NULL))
+    end++;
+  if (end > idx)
+    sb_add_buffer (ptr, in->ptr + idx, end - idx);
+  return end;
+}
+
+/* Copy the run of characters starting at idx whose entry in the
+   256-entry classes table has any of the bits in mask set.  Return
+   the index of the first character outside the class.  */
+
+int
+sb_add_class_run (sb *ptr, int idx, const sb *in, const char *classes, int mask)
+{
+  int end = idx;
+
+  while (end < in->len && (classes[(unsigned char) in->ptr[end]] & mask))
+    end++;
+  if (end > idx)
+    sb_add_buffer (ptr, in->ptr + idx, end - idx);
+  return end;
+}
+
+/* Turn the contents of the sb at ptr into shared text with a single
+   reference, without copying them.  The sb gives up its storage and is
+   left killed; sb_new it again before reuse.  */
+
+sb_text *
+sb_text_adopt (sb *ptr)
+{
+  sb_text *text;
+
+  if (ptr->item == NULL)
+    abort();
+  text = (sb_text *) xmalloc_kind (MEM_SB, sizeof (sb_text));
+  text->refs = 1;
+  text->len = ptr->len;
+  text->ptr = ptr->ptr;
+  text->item = ptr->item;
+
+  ptr->ptr = NULL;
+  ptr->len = 0;
+  ptr->item = NULL;
+  return text;
+}
+
+/* Make shared text holding a copy of the null terminated string s.  */
+
+sb_text *
+sb_text_string (const char *s)
+{
+  sb tmp;
+
+  sb_new (&tmp);
+  sb_add_string (&tmp, s);
+  return sb_text_adopt (&tmp);
+}
+
+/* Take another reference to text.  */
+
+sb_text *
+sb_text_ref (sb_text *text)
+{
+  if (text->refs >= 0)
+    text->refs++;
+  return text;
+}
+
+/* Drop a reference to text, freeing it with the last one.  */
+
+void
+sb_text_unref (sb_text *text)
+{
+  if (text->refs < 0)
+    return;
+  if (text->refs == 0)
+    abort();
+  if (--text->refs == 0)
     {
-      if (nc)
-	{
-	  fprintf (outfile, ",");
-	}
-      fprintf (outfile, "%d", ptr->ptr[i]);
-      nc = 1;
+      mem_note_free (MEM_SB, sizeof (sb_element) + text->item->size);
+      free (text->item);
+      xfree_kind (MEM_SB, text, sizeof (sb_text));
     }
 }
 
+/* Pin text, handing it to an owner which outlives all its readers.
+   References to pinned text are not counted, so readers in different
+   threads may take and drop them without touching the text at all.
+   The owner frees it with sb_text_free_pinned.  */
+
+void
+sb_text_pin (sb_text *text)
+{
+  text->refs = -1;
+}
+
 void
-sb_print_at (FILE *outfile, int idx, sb *ptr)
+sb_text_free_pinned (sb_text *text)
 {
-  int i;
-  for (i = idx; i < ptr->len; i++)
-    putc (ptr->ptr[i], outfile);
+  if (text->refs >= 0)
+    abort();
+  mem_note_free (MEM_SB, sizeof (sb_element) + text->item->size);
+  free (text->item);
+  xfree_kind (MEM_SB, text, sizeof (sb_text));
 }
 
 /* put a null at the end of the sb at in and return the start of the
@@ -307,9 +419,17 @@ int sb_eat_literal( int idx, sb *out, const sb *in )
   if ( idx < in->len && ( in->ptr[ idx ] == '"' || in->ptr[ idx ] == '\'' ) )
     {
       char str_type = in->ptr[ idx ];
+      char stops[3];
+
+      stops[ 0 ] = '\\';
+      stops[ 1 ] = str_type;
+      stops[ 2 ] = '\0';
       sb_add_char( out, in->ptr[ idx++ ] );
       while ( idx < in->len )
 	{
+	  idx = sb_add_until_any( out, idx, in, stops );
+	  if ( idx >= in->len )
+	    break;
 	  if ( in->ptr[ idx ] == '\\' && idx < in->len - 1 )
 	    {
 	      sb_add_char( out, in->ptr[ ++idx ]);
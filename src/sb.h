@@ -79,7 +79,30 @@ typedef struct
     sb_element *size[sb_max_power_two];
   } sb_list_vector;
 
-extern int string_count[sb_max_power_two];
+/* Shared text.  An sb_text is an immutable block of characters with a
+   reference count.  It is made by adopting the storage of an sb, so
+   creating one copies nothing, and it lets several readers (the
+   include frames in masp.c) point at the same text at once.  Pinned
+   text has refs of -1 and belongs to whoever pinned it.  */
+typedef struct sb_text
+  {
+    int refs;			/* number of holders.  */
+    int len;			/* length of the text.  */
+    char *ptr;			/* the characters.  */
+    sb_element *item;		/* the storage adopted from the sb.  */
+  }
+sb_text;
+
+/* Thread local storage, where the compiler has it.  */
+#if defined(__GNUC__) || defined(__clang__)
+#define SB_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define SB_THREAD_LOCAL __declspec(thread)
+#else
+#define SB_THREAD_LOCAL
+#endif
+
+extern SB_THREAD_LOCAL int string_count[sb_max_power_two];
 
 extern void sb_build(sb *ptr, int size);
 extern void sb_new(sb *ptr);
@@ -89,13 +112,39 @@ extern void sb_reset(sb *ptr);
 extern void sb_add_char(sb *ptr, int c);
 extern void sb_add_string(sb *ptr, const char *s);
 extern void sb_add_buffer(sb *ptr, const char *s, int len);
-extern void sb_print(FILE *outfile, sb *ptr);
-extern void sb_print_at(FILE *outfile, int idx, sb *ptr);
 extern char *sb_name(sb *in);
 extern char *sb_terminate(sb *in);
 extern int sb_skip_white(int idx, const sb *ptr);
 extern int sb_skip_comma(int idx, const sb *ptr);
 
+/* Span appends.  These copy a run of characters out of IN starting at
+   IDX with a single bounds check, and return the index of the first
+   character not copied.  */
+extern int sb_add_until(sb *ptr, int idx, const sb *in, int delim);
+extern int sb_add_until_any(sb *ptr, int idx, const sb *in, const char *stops);
+extern int sb_add_class_run(sb *ptr, int idx, const sb *in,
+			    const char *classes, int mask);
+
+/* Inline fast path for sb_add_char: store straight into the block
+   while there is room, and only fall back to the checked, growing
+   sb_add_char when the block is full.  */
+
+static inline void
+sb_add_char_fast (sb *ptr, int c)
+{
+  if (ptr->len < (1 << ptr->pot))
+    ptr->ptr[ptr->len++] = c;
+  else
+    sb_add_char (ptr, c);
+}
+
+extern sb_text *sb_text_adopt(sb *ptr);
+extern sb_text *sb_text_string(const char *s);
+extern sb_text *sb_text_ref(sb_text *text);
+extern void sb_text_unref(sb_text *text);
+extern void sb_text_pin(sb_text *text);
+extern void sb_text_free_pinned(sb_text *text);
+
 // new functions, myrkraverk
 extern int sb_eat_literal( int idx, sb *out, const sb *in ); // index, out, in
 
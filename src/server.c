@@ -0,0 +1,533 @@
+/* server.c - a resident masp serving jobs over a Unix domain socket.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+/* masp --server keeps one process, with its keyword tables built and
+   its include cache warm, for a whole build, and masp --client hands
+   it each job.  A connection carries one job.  Everything on it is a
+   frame: a type byte, a four byte big endian length and that many
+   bytes.  The client sends
+
+     'C' cwd, then 'A' for each argument, 'D' for each -D value, 'E'
+
+   and the server answers with any number of 'O' (stdout) and 'R'
+   (stderr) frames, then 'X' with the exit status as its four bytes.  */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include "compat.h"
+#include "masp.h"
+#include "jobs.h"
+#include "server.h"
+#include "asintl.h"
+
+#ifdef HAVE_SYS_UN_H
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#define FRAME_CWD	'C'
+#define FRAME_ARG	'A'
+#define FRAME_DEFINE	'D'
+#define FRAME_END	'E'
+#define FRAME_OUT	'O'
+#define FRAME_ERR	'R'
+#define FRAME_STATUS	'X'
+
+/* No frame is longer than this; output is sent in pieces of it.  */
+#define FRAME_MAX (64 * 1024)
+
+static int
+write_all (int fd, const void *buf, size_t len)
+{
+  const char *p = (const char *) buf;
+
+  while (len > 0)
+    {
+      ssize_t n = write (fd, p, len);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return 0;
+      p += n;
+      len -= n;
+    }
+  return 1;
+}
+
+static int
+read_all (int fd, void *buf, size_t len)
+{
+  char *p = (char *) buf;
+
+  while (len > 0)
+    {
+      ssize_t n = read (fd, p, len);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return 0;
+      p += n;
+      len -= n;
+    }
+  return 1;
+}
+
+static int
+send_frame (int fd, int type, const char *data, size_t len)
+{
+  unsigned char head[5];
+
+  head[0] = type;
+  head[1] = (len >> 24) & 0xff;
+  head[2] = (len >> 16) & 0xff;
+  head[3] = (len >> 8) & 0xff;
+  head[4] = len & 0xff;
+  return write_all (fd, head, 5) && write_all (fd, data, len);
+}
+
+/* Send LEN bytes of DATA in as many frames of TYPE as it takes.  */
+
+static int
+send_frames (int fd, int type, const char *data, size_t len)
+{
+  while (len > 0)
+    {
+      size_t n = len < FRAME_MAX ? len : FRAME_MAX;
+      if (!send_frame (fd, type, data, n))
+	return 0;
+      data += n;
+      len -= n;
+    }
+  return 1;
+}
+
+/* Read a frame into *TYPE and a malloced, NUL terminated *DATA.  */
+
+static int
+recv_frame (int fd, int *type, char **data, size_t *len)
+{
+  unsigned char head[5];
+  size_t n;
+
+  if (!read_all (fd, head, 5))
+    return 0;
+  n = ((size_t) head[1] << 24) | (head[2] << 16) | (head[3] << 8) | head[4];
+  if (n > FRAME_MAX)
+    return 0;
+  *type = head[0];
+  *data = (char *) xmalloc (n + 1);
+  if (!read_all (fd, *data, n))
+    {
+      free (*data);
+      return 0;
+    }
+  (*data)[n] = 0;
+  *len = n;
+  return 1;
+}
+
+static int
+connect_to (const char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen (path) >= sizeof addr.sun_path)
+    return -1;
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+  if (connect (fd, (struct sockaddr *) &addr, sizeof addr) != 0)
+    {
+      close (fd);
+      return -1;
+    }
+  return fd;
+}
+
+/* What a connection thread needs.  */
+
+typedef struct connection {
+  int fd;
+  server_job_fn run;
+  masp_shared *shared;
+} connection;
+
+static void
+free_request (server_request *req)
+{
+  int i;
+
+  for (i = 0; i < req->argc; i++)
+    free (req->argv[i]);
+  for (i = 0; i < req->ndefines; i++)
+    free (req->defines[i]);
+  free (req->argv);
+  free (req->defines);
+  free (req->cwd);
+}
+
+/* Read a request from FD.  Returns 0 if the client broke off.  */
+
+static int
+read_request (int fd, server_request *req)
+{
+  int alloc = 0;
+  int dalloc = 0;
+
+  memset (req, 0, sizeof *req);
+  for (;;)
+    {
+      int type;
+      char *data;
+      size_t len;
+
+      if (!recv_frame (fd, &type, &data, &len))
+	return 0;
+      switch (type)
+	{
+	case FRAME_CWD:
+	  free (req->cwd);
+	  req->cwd = data;
+	  break;
+	case FRAME_ARG:
+	  if (req->argc == alloc)
+	    {
+	      alloc = alloc ? alloc * 2 : 16;
+	      req->argv = (char **) xrealloc (req->argv,
+					      (alloc + 1) * sizeof (char *));
+	    }
+	  req->argv[req->argc++] = data;
+	  req->argv[req->argc] = NULL;
+	  break;
+	case FRAME_DEFINE:
+	  if (req->ndefines == dalloc)
+	    {
+	      dalloc = dalloc ? dalloc * 2 : 8;
+	      req->defines = (char **) xrealloc (req->defines,
+						 dalloc * sizeof (char *));
+	    }
+	  req->defines[req->ndefines++] = data;
+	  break;
+	case FRAME_END:
+	  free (data);
+	  return 1;
+	default:
+	  free (data);
+	  return 0;
+	}
+    }
+}
+
+static void *
+serve_connection (void *arg)
+{
+  connection *conn = (connection *) arg;
+  server_request req;
+
+  if (read_request (conn->fd, &req))
+    {
+      mem_stream out;
+      mem_stream err;
+      char *obuf, *ebuf;
+      size_t olen, elen;
+      unsigned char status[4];
+      int rc = 1;
+
+      if (mem_stream_open (&out))
+	{
+	  if (mem_stream_open (&err))
+	    {
+	      rc = conn->run (&req, out.file, err.file, conn->shared);
+	      mem_stream_close (&err, &ebuf, &elen);
+	    }
+	  else
+	    {
+	      ebuf = xstrdup ("masp: out of memory\n");
+	      elen = strlen (ebuf);
+	    }
+	  mem_stream_close (&out, &obuf, &olen);
+
+	  status[0] = (rc >> 24) & 0xff;
+	  status[1] = (rc >> 16) & 0xff;
+	  status[2] = (rc >> 8) & 0xff;
+	  status[3] = rc & 0xff;
+	  if (send_frames (conn->fd, FRAME_OUT, obuf, olen)
+	      && send_frames (conn->fd, FRAME_ERR, ebuf, elen))
+	    send_frame (conn->fd, FRAME_STATUS, (char *) status, 4);
+	  free (obuf);
+	  free (ebuf);
+	}
+    }
+  free_request (&req);
+  close (conn->fd);
+  free (conn);
+  return NULL;
+}
+
+/* The socket to remove when the server is stopped.  */
+static const char *server_path;
+
+static void
+stop_server (int sig)
+{
+  unlink (server_path);
+  signal (sig, SIG_DFL);
+  raise (sig);
+}
+
+/* Serve one connection in a process of its own, forked from the
+   server, so that the job starts from whatever state the server had
+   and what it changes dies with it.  */
+
+static void
+fork_connection (connection *conn, int listener, const char *program_name)
+{
+  pid_t pid = fork ();
+
+  if (pid == 0)
+    {
+      close (listener);
+      signal (SIGINT, SIG_DFL);
+      signal (SIGTERM, SIG_DFL);
+      signal (SIGHUP, SIG_DFL);
+      signal (SIGCHLD, SIG_DFL);
+      serve_connection (conn);
+      _exit (0);
+    }
+  if (pid < 0)
+    fprintf (stderr, _("%s: Can't fork: %s\n"),
+	     program_name, strerror (errno));
+  close (conn->fd);
+  free (conn);
+}
+
+static int
+serve (const char *path, server_job_fn run, const char *program_name,
+       int forking)
+{
+  struct sockaddr_un addr;
+  masp_shared *shared;
+  int fd;
+
+  if (strlen (path) >= sizeof addr.sun_path)
+    {
+      fprintf (stderr, _("%s: socket name `%s' is too long.\n"),
+	       program_name, path);
+      return 1;
+    }
+
+  /* A socket nobody answers on is left over from a server which was
+     not stopped cleanly.  */
+  fd = connect_to (path);
+  if (fd >= 0)
+    {
+      close (fd);
+      fprintf (stderr, _("%s: a server is already running on `%s'.\n"),
+	       program_name, path);
+      return 1;
+    }
+  unlink (path);
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+  if (fd < 0
+      || bind (fd, (struct sockaddr *) &addr, sizeof addr) != 0
+      || listen (fd, 64) != 0)
+    {
+      fprintf (stderr, _("%s: Can't listen on `%s': %s\n"),
+	       program_name, path, strerror (errno));
+      if (fd >= 0)
+	close (fd);
+      return 1;
+    }
+
+  server_path = path;
+  signal (SIGINT, stop_server);
+  signal (SIGTERM, stop_server);
+  signal (SIGHUP, stop_server);
+  /* A client which goes away mid job must not take the server too.  */
+  signal (SIGPIPE, SIG_IGN);
+  /* Forked jobs are reaped as they finish.  */
+  if (forking)
+    signal (SIGCHLD, SIG_IGN);
+
+  shared = masp_shared_new ();
+  for (;;)
+    {
+      connection *conn;
+      int client = accept (fd, NULL, NULL);
+
+      if (client < 0)
+	{
+	  if (errno == EINTR || errno == ECONNABORTED)
+	    continue;
+	  fprintf (stderr, _("%s: accept failed: %s\n"),
+		   program_name, strerror (errno));
+	  break;
+	}
+      conn = (connection *) xmalloc (sizeof (connection));
+      conn->fd = client;
+      conn->run = run;
+      conn->shared = shared;
+      if (forking)
+	{
+	  fork_connection (conn, fd, program_name);
+	  continue;
+	}
+#ifdef HAVE_PTHREAD
+      {
+	pthread_t thread;
+	pthread_attr_t attr;
+	int started;
+
+	pthread_attr_init (&attr);
+	pthread_attr_setstacksize (&attr, JOB_STACK_SIZE);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	started = pthread_create (&thread, &attr, serve_connection, conn) == 0;
+	pthread_attr_destroy (&attr);
+	if (!started)
+	  serve_connection (conn);
+      }
+#else
+      serve_connection (conn);
+#endif
+    }
+
+  close (fd);
+  unlink (path);
+  return 1;
+}
+
+int
+server_run (const char *path, server_job_fn run, const char *program_name)
+{
+  return serve (path, run, program_name, 0);
+}
+
+int
+fork_server_run (const char *path, server_job_fn run,
+		 const char *program_name)
+{
+  return serve (path, run, program_name, 1);
+}
+
+int
+client_run (const char *path, int argc, char **argv,
+	    char **defines, int ndefines)
+{
+  char cwd[4096];
+  int fd;
+  int i;
+  int ok;
+  int status = -1;
+
+  if (!getcwd (cwd, sizeof cwd))
+    return -1;
+  fd = connect_to (path);
+  if (fd < 0)
+    return -1;
+
+  ok = send_frame (fd, FRAME_CWD, cwd, strlen (cwd));
+  for (i = 0; ok && i < argc; i++)
+    ok = send_frame (fd, FRAME_ARG, argv[i], strlen (argv[i]));
+  for (i = 0; ok && i < ndefines; i++)
+    ok = send_frame (fd, FRAME_DEFINE, defines[i], strlen (defines[i]));
+  ok = ok && send_frame (fd, FRAME_END, "", 0);
+
+  while (ok)
+    {
+      int type;
+      char *data;
+      size_t len;
+
+      if (!recv_frame (fd, &type, &data, &len))
+	break;
+      if (type == FRAME_OUT)
+	fwrite (data, 1, len, stdout);
+      else if (type == FRAME_ERR)
+	fwrite (data, 1, len, stderr);
+      else if (type == FRAME_STATUS && len == 4)
+	{
+	  unsigned char *s = (unsigned char *) data;
+	  status = (s[0] << 24) | (s[1] << 16) | (s[2] << 8) | s[3];
+	  ok = 0;
+	}
+      free (data);
+    }
+  close (fd);
+
+  /* A server which dies mid job leaves its output unfinished.  */
+  if (status < 0)
+    {
+      fprintf (stderr, _("masp: lost the connection to the server.\n"));
+      status = 1;
+    }
+  fflush (stdout);
+  return status;
+}
+
+#else /* ! HAVE_SYS_UN_H */
+
+int
+server_run (const char *path, server_job_fn run, const char *program_name)
+{
+  fprintf (stderr, _("%s: --server is not supported on this system.\n"),
+	   program_name);
+  return 1;
+}
+
+int
+fork_server_run (const char *path, server_job_fn run,
+		 const char *program_name)
+{
+  fprintf (stderr, _("%s: --fork-server is not supported on this system.\n"),
+	   program_name);
+  return 1;
+}
+
+int
+client_run (const char *path, int argc, char **argv,
+	    char **defines, int ndefines)
+{
+  return -1;
+}
+
+#endif /* HAVE_SYS_UN_H */
@@ -0,0 +1,68 @@
+/* server.h - a resident masp serving jobs over a Unix domain socket.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#ifndef SERVER_H
+
+#define SERVER_H
+
+#include <stdio.h>
+
+#include "masp.h"
+
+/* A job as the server receives it: the client's arguments, without
+   the program name, the directory it was run in and the -D values it
+   found in its environment.  */
+
+typedef struct server_request {
+  char **argv;
+  int argc;
+  char **defines;
+  int ndefines;
+  char *cwd;
+} server_request;
+
+/* Run the job REQ, writing what would go to stdout and stderr to OUT
+   and ERR.  SHARED lives as long as the server.  Returns the exit
+   status for the client.  */
+typedef int (*server_job_fn) (const server_request *req, FILE *out,
+			      FILE *err, masp_shared *shared);
+
+/* Serve jobs on the socket at PATH until killed, running each
+   connection on a thread of its own.  Returns only if the socket
+   can't be set up, with the exit status.  */
+extern int server_run (const char *path, server_job_fn run,
+		       const char *program_name);
+
+/* As server_run, but each connection is served in a child process
+   forked from the server, which so starts with a copy of its memory:
+   whatever the caller set up before, such as a context which has read
+   a prelude.  */
+extern int fork_server_run (const char *path, server_job_fn run,
+			    const char *program_name);
+
+/* Send the job made of ARGV (ARGC arguments after the program name),
+   the current directory and the -D values in DEFINES to the server at
+   PATH, copying its output to stdout and stderr.  Returns the job's
+   exit status, or -1 if no server answered, in which case nothing has
+   been written.  */
+extern int client_run (const char *path, int argc, char **argv,
+		       char **defines, int ndefines);
+
+#endif
@@ -0,0 +1,813 @@
+/* snapshot.c - saved preprocessor state.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+/* A snapshot file is a flat run of little endian 32 bit numbers and
+   strings, each string being its length followed by its characters.
+   It holds no pointers and needs no alignment, so it is used where it
+   is mapped, and each context started from it builds its tables
+   straight out of the mapping.  In order it holds:
+
+     "MASPSNAP", the version, and the length of the whole file;
+     the options the state and output depend on: -a, -M, -c, -P, -s,
+     -p and -l;
+     the -D values, in order;
+     the files read, each with its size, time, a hash of its text and
+     what it wrote the first time it was read;
+     the radix, prefix, syntax and macro counters;
+     the conditional stack;
+     the assign table and the variable table, bucket by bucket;
+     the macros, with their formals.
+
+   The tables keep the order of their chains, so lookups find what
+   they would have found in the context the snapshot was made from.  */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "compat.h"
+#include "sb.h"
+#include "hash.h"
+#include "masp.h"
+#include "context.h"
+#include "macro.h"
+#include "snapshot.h"
+#include "asintl.h"
+
+#define SNAPSHOT_MAGIC "MASPSNAP"
+#define SNAPSHOT_VERSION 3
+
+/* A file the snapshot was built from, and what it wrote, in DATA.  */
+
+typedef struct snap_file {
+  char *path;
+  const char *output;
+  int len;
+} snap_file;
+
+struct masp_snapshot {
+  const unsigned char *data;	/* The whole file.  */
+  size_t len;
+  int mapped;			/* DATA is mapped rather than malloced.  */
+  size_t state;			/* Where the state starts in DATA.  */
+  snap_file *files;		/* The files it was built from, sorted.  */
+  int nfiles;
+};
+
+/* Writing.  */
+
+static void
+put_u32 (sb *buf, unsigned long v)
+{
+  char b[4];
+
+  b[0] = v & 0xff;
+  b[1] = (v >> 8) & 0xff;
+  b[2] = (v >> 16) & 0xff;
+  b[3] = (v >> 24) & 0xff;
+  sb_add_buffer (buf, b, 4);
+}
+
+static void
+set_u32 (sb *buf, int at, unsigned long v)
+{
+  buf->ptr[at] = v & 0xff;
+  buf->ptr[at + 1] = (v >> 8) & 0xff;
+  buf->ptr[at + 2] = (v >> 16) & 0xff;
+  buf->ptr[at + 3] = (v >> 24) & 0xff;
+}
+
+static void
+put_u64 (sb *buf, unsigned long long v)
+{
+  put_u32 (buf, (unsigned long) (v & 0xffffffffu));
+  put_u32 (buf, (unsigned long) (v >> 32));
+}
+
+static void
+put_str (sb *buf, const char *s, int len)
+{
+  put_u32 (buf, len);
+  sb_add_buffer (buf, s, len);
+}
+
+/* Reading, with every access checked against the end, so a damaged
+   file is found out rather than trusted.  */
+
+typedef struct snap_reader {
+  const unsigned char *p;
+  const unsigned char *end;
+  int bad;
+} snap_reader;
+
+static unsigned long
+get_u32 (snap_reader *r)
+{
+  unsigned long v;
+
+  if (r->bad || r->end - r->p < 4)
+    {
+      r->bad = 1;
+      return 0;
+    }
+  v = (unsigned long) r->p[0]
+    | ((unsigned long) r->p[1] << 8)
+    | ((unsigned long) r->p[2] << 16)
+    | ((unsigned long) r->p[3] << 24);
+  r->p += 4;
+  return v;
+}
+
+static int
+get_i32 (snap_reader *r)
+{
+  unsigned long v = get_u32 (r);
+
+  if (v & 0x80000000ul)
+    return -(int) (0xfffffffful - v) - 1;
+  return (int) v;
+}
+
+static unsigned long long
+get_u64 (snap_reader *r)
+{
+  unsigned long long lo = get_u32 (r);
+  return lo | ((unsigned long long) get_u32 (r) << 32);
+}
+
+static const char *
+get_str (snap_reader *r, int *len)
+{
+  unsigned long n = get_u32 (r);
+  const char *s = (const char *) r->p;
+
+  if (r->bad || (unsigned long) (r->end - r->p) < n)
+    {
+      r->bad = 1;
+      *len = 0;
+      return "";
+    }
+  r->p += n;
+  *len = (int) n;
+  return s;
+}
+
+/* The files.  */
+
+static long
+mtime_nsec (const struct stat *st)
+{
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+  return st->st_mtim.tv_nsec;
+#else
+  return 0;
+#endif
+}
+
+static void
+save_files (masp_context *ctx, sb *buf)
+{
+  const char *const *files;
+  int count_at = buf->len;
+  int count = 0;
+  int n, i;
+
+  files = masp_files_read (ctx, &n);
+  put_u32 (buf, 0);
+  for (i = 0; i < n; i++)
+    {
+      char *path = canonical_path (files[i]);
+      const sb *output = (const sb *) hash_find (ctx->file_output, files[i]);
+      unsigned long long hash;
+      struct stat st;
+
+      if (!path)
+	continue;
+      if (stat (path, &st) == 0 && file_hash (path, &hash))
+	{
+	  put_str (buf, path, strlen (path));
+	  put_u64 (buf, (unsigned long long) st.st_size);
+	  put_u64 (buf, (unsigned long long) st.st_mtime);
+	  put_u32 (buf, (unsigned long) mtime_nsec (&st));
+	  put_u64 (buf, hash);
+	  if (output)
+	    put_str (buf, output->ptr, output->len);
+	  else
+	    put_str (buf, "", 0);
+	  count++;
+	}
+      free (path);
+    }
+  set_u32 (buf, count_at, count);
+}
+
+/* Whether the file at PATH is as it was.  If its time has changed it
+   may still have the same text, and that is good enough.  */
+
+static int
+file_current (const char *path, unsigned long long size,
+	      unsigned long long mtime, long nsec, unsigned long long hash)
+{
+  unsigned long long now;
+  struct stat st;
+
+  if (stat (path, &st) != 0
+      || (unsigned long long) st.st_size != size)
+    return 0;
+  if ((unsigned long long) st.st_mtime == mtime
+      && mtime_nsec (&st) == nsec)
+    return 1;
+  return file_hash (path, &now) && now == hash;
+}
+
+static int
+compare_files (const void *a, const void *b)
+{
+  return strcmp (((const snap_file *) a)->path, ((const snap_file *) b)->path);
+}
+
+/* Read the list of files into SNAP, checking each.  Returns 0 if one
+   has changed, with its name in *CHANGED.  */
+
+static int
+load_files (masp_snapshot *snap, snap_reader *r, const char **changed)
+{
+  unsigned long n = get_u32 (r);
+  unsigned long i;
+
+  /* Each entry takes 36 bytes at the least.  */
+  if (n > (unsigned long) (r->end - r->p) / 36)
+    {
+      r->bad = 1;
+      return 1;
+    }
+  snap->files = (snap_file *) xmalloc ((n + 1) * sizeof (snap_file));
+  for (i = 0; i < n && !r->bad; i++)
+    {
+      int len;
+      const char *s = get_str (r, &len);
+      unsigned long long size = get_u64 (r);
+      unsigned long long mtime = get_u64 (r);
+      long nsec = (long) get_u32 (r);
+      unsigned long long hash = get_u64 (r);
+      snap_file *f;
+
+      if (r->bad)
+	break;
+      f = &snap->files[snap->nfiles++];
+      f->path = (char *) xmalloc (len + 1);
+      memcpy (f->path, s, len);
+      f->path[len] = 0;
+      f->output = get_str (r, &f->len);
+      if (!r->bad && !file_current (f->path, size, mtime, nsec, hash))
+	{
+	  *changed = f->path;
+	  return 0;
+	}
+    }
+  qsort (snap->files, snap->nfiles, sizeof (snap_file), compare_files);
+  return 1;
+}
+
+/* Whether the -D values saved, NDEFINES of them, are DEFINES.  */
+
+static int
+same_defines (snap_reader *r, const char *const *defines, int ndefines)
+{
+  unsigned long n = get_u32 (r);
+  unsigned long i;
+  int same = n == (unsigned long) ndefines;
+
+  for (i = 0; i < n && !r->bad; i++)
+    {
+      int len;
+      const char *s = get_str (r, &len);
+
+      if (same && ((int) strlen (defines[i]) != len
+		   || memcmp (defines[i], s, len) != 0))
+	same = 0;
+    }
+  return same;
+}
+
+int
+snapshot_covers (const masp_snapshot *snap, const char *path,
+		 const char **output, int *len)
+{
+  snap_file key;
+  const snap_file *f;
+
+  key.path = canonical_path (path);
+  if (!key.path)
+    return 0;
+  f = (const snap_file *) bsearch (&key, snap->files, snap->nfiles,
+				   sizeof (snap_file), compare_files);
+  free (key.path);
+  if (!f)
+    return 0;
+  *output = f->output;
+  *len = f->len;
+  return 1;
+}
+
+/* The tables.  */
+
+static void
+save_table (sb *buf, const hash_table *tab)
+{
+  int i;
+
+  put_u32 (buf, tab->size);
+  for (i = 0; i < tab->size; i++)
+    {
+      hash_entry *p;
+      int n = 0;
+
+      for (p = tab->table[i]; p; p = p->next)
+	n++;
+      put_u32 (buf, n);
+      for (p = tab->table[i]; p; p = p->next)
+	{
+	  put_str (buf, p->key.ptr, p->key.len);
+	  if (p->type == hash_string)
+	    {
+	      put_u32 (buf, hash_string);
+	      put_str (buf, p->value.s.ptr, p->value.s.len);
+	    }
+	  else
+	    {
+	      put_u32 (buf, hash_integer);
+	      put_u64 (buf, (unsigned long long) p->value.i);
+	    }
+	}
+    }
+}
+
+/* Read a table, adding its entries to the ends of the chains of TAB,
+   or just checking it if TAB is NULL.  */
+
+static void
+load_table (snap_reader *r, hash_table *tab)
+{
+  int size = (int) get_u32 (r);
+  int i;
+
+  if (size != SYMBOL_TABLE_SIZE)
+    {
+      r->bad = 1;
+      return;
+    }
+  for (i = 0; i < size && !r->bad; i++)
+    {
+      unsigned long n = get_u32 (r);
+      hash_entry **tail = tab ? &tab->table[i] : NULL;
+
+      while (tail && *tail)
+	tail = &(*tail)->next;
+      for (; n > 0 && !r->bad; n--)
+	{
+	  int klen, vlen = 0;
+	  const char *key = get_str (r, &klen);
+	  unsigned long type = get_u32 (r);
+	  const char *value = NULL;
+	  long long number = 0;
+	  hash_entry *e;
+
+	  if (type == hash_string)
+	    value = get_str (r, &vlen);
+	  else if (type == hash_integer)
+	    number = (long long) get_u64 (r);
+	  else
+	    r->bad = 1;
+	  if (r->bad || !tab)
+	    continue;
+
+	  e = (hash_entry *) xmalloc (sizeof (hash_entry));
+	  sb_new (&e->key);
+	  sb_add_buffer (&e->key, key, klen);
+	  e->type = (hash_type) type;
+	  if (value)
+	    {
+	      sb_new (&e->value.s);
+	      sb_add_buffer (&e->value.s, value, vlen);
+	    }
+	  else
+	    e->value.i = number;
+	  e->next = NULL;
+	  *tail = e;
+	  tail = &e->next;
+	}
+    }
+}
+
+/* The macros.  */
+
+static void
+count_macro (const char *name, void *value, void *arg)
+{
+  ++*(int *) arg;
+}
+
+static void
+save_macro (const char *name, void *value, void *arg)
+{
+  sb *buf = (sb *) arg;
+  macro_entry *m = (macro_entry *) value;
+  formal_entry *f;
+  int n = 0;
+
+  put_str (buf, name, strlen (name));
+  put_str (buf, m->sub.ptr, m->sub.len);
+  put_u32 (buf, m->formal_count);
+  for (f = m->formals; f; f = f->next)
+    n++;
+  put_u32 (buf, n);
+  for (f = m->formals; f; f = f->next)
+    {
+      put_str (buf, f->name.ptr, f->name.len);
+      put_str (buf, f->def.ptr, f->def.len);
+      put_u32 (buf, (unsigned long) f->index);
+    }
+}
+
+/* Read the macros, defining them in CTX unless it is NULL.  A macro
+   CTX already has is left as it is.  */
+
+static void
+load_macros (snap_reader *r, masp_context *ctx)
+{
+  unsigned long n = get_u32 (r);
+  sb name;
+
+  sb_new (&name);
+  for (; n > 0 && !r->bad; n--)
+    {
+      int len, count, nformals;
+      const char *s = get_str (r, &len);
+      const char *sub;
+      int sublen;
+      macro_entry *m = NULL;
+      formal_entry **tail = NULL;
+
+      sb_reset (&name);
+      sb_add_buffer (&name, s, len);
+      sub = get_str (r, &sublen);
+      count = (int) get_u32 (r);
+      nformals = (int) get_u32 (r);
+      if (!r->bad && ctx && !hash_find (ctx->macro_hash, sb_terminate (&name)))
+	{
+	  m = (macro_entry *) xmalloc_kind (MEM_MACRO, sizeof (macro_entry));
+	  sb_new (&m->sub);
+	  sb_add_buffer (&m->sub, sub, sublen);
+	  m->formal_count = count;
+	  m->formals = NULL;
+	  m->formal_hash = hash_new ();
+	  tail = &m->formals;
+	}
+
+      for (; nformals > 0 && !r->bad; nformals--)
+	{
+	  int nlen, dlen;
+	  const char *fname = get_str (r, &nlen);
+	  const char *def = get_str (r, &dlen);
+	  int index = get_i32 (r);
+	  formal_entry *f;
+
+	  if (!m || r->bad)
+	    continue;
+	  f = (formal_entry *) xmalloc_kind (MEM_MACRO, sizeof (formal_entry));
+	  sb_new (&f->name);
+	  sb_new (&f->def);
+	  sb_new (&f->actual);
+	  sb_add_buffer (&f->name, fname, nlen);
+	  sb_add_buffer (&f->def, def, dlen);
+	  f->index = index;
+	  f->next = NULL;
+	  hash_jam (m->formal_hash, sb_terminate (&f->name), f);
+	  *tail = f;
+	  tail = &f->next;
+	}
+
+      if (m)
+	hash_jam (ctx->macro_hash, sb_terminate (&name), m);
+    }
+  sb_kill (&name);
+}
+
+/* The state as a whole.  */
+
+static void
+save_state (masp_context *ctx, sb *buf)
+{
+  int i;
+
+  put_u32 (buf, ctx->radix);
+  put_u32 (buf, (unsigned char) ctx->prefix_char);
+  put_u32 (buf, ctx->masp_syntax);
+  put_u32 (buf, ctx->macro_defined);
+  put_u32 (buf, ctx->macro_number);
+  put_u32 (buf, ctx->macro_loccnt);
+  put_u32 (buf, ctx->ifi);
+  for (i = 0; i <= ctx->ifi; i++)
+    {
+      put_u32 (buf, ctx->ifstack[i].on);
+      put_u32 (buf, ctx->ifstack[i].hadelse);
+    }
+  save_table (buf, &ctx->assign_hash_table);
+  save_table (buf, &ctx->vars);
+  i = 0;
+  hash_traverse_arg (ctx->macro_hash, count_macro, &i);
+  put_u32 (buf, i);
+  hash_traverse_arg (ctx->macro_hash, save_macro, buf);
+}
+
+/* Read the state into CTX, or only check it if CTX is NULL.  */
+
+static void
+load_state (snap_reader *r, masp_context *ctx)
+{
+  int radix = (int) get_u32 (r);
+  int prefix_char = (int) get_u32 (r);
+  int masp_syntax = (int) get_u32 (r);
+  int macro_defined = (int) get_u32 (r);
+  int macro_number = (int) get_u32 (r);
+  int macro_loccnt = (int) get_u32 (r);
+  unsigned long ifi = get_u32 (r);
+  unsigned long i;
+
+  if (ifi >= IFNESTING)
+    r->bad = 1;
+  if (ctx && !r->bad)
+    {
+      ctx->radix = radix;
+      ctx->prefix_char = prefix_char;
+      ctx->masp_syntax = masp_syntax;
+      ctx->macro_defined |= macro_defined;
+      ctx->macro_number = macro_number;
+      ctx->macro_loccnt = macro_loccnt;
+      ctx->ifi = ifi;
+    }
+  for (i = 0; i <= ifi && !r->bad; i++)
+    {
+      int on = (int) get_u32 (r);
+      int hadelse = (int) get_u32 (r);
+      if (ctx)
+	{
+	  ctx->ifstack[i].on = on;
+	  ctx->ifstack[i].hadelse = hadelse;
+	}
+    }
+  load_table (r, ctx ? &ctx->assign_hash_table : NULL);
+  load_table (r, ctx ? &ctx->vars : NULL);
+  load_macros (r, ctx);
+}
+
+int
+masp_save_snapshot (masp_context *ctx, const char *path)
+{
+  char *tmp = (char *) xmalloc (strlen (path) + 32);
+  FILE *f;
+  sb buf;
+  int ok;
+  int i;
+
+  if (!ctx->file_output)
+    {
+      fprintf (ctx->errfile,
+	       _("Can't write snapshot file `%s': the output wasn't recorded.\n"),
+	       path);
+      free (tmp);
+      return 0;
+    }
+
+  sb_new (&buf);
+  sb_add_buffer (&buf, SNAPSHOT_MAGIC, 8);
+  put_u32 (&buf, SNAPSHOT_VERSION);
+  put_u32 (&buf, 0);
+  put_u32 (&buf, ctx->alternate);
+  put_u32 (&buf, ctx->mri);
+  put_u32 (&buf, (unsigned char) ctx->comment_char);
+  put_u32 (&buf, (unsigned char) ctx->cml_prefix_char);
+  put_u32 (&buf, ctx->copysource);
+  put_u32 (&buf, ctx->print_line_number);
+  put_u32 (&buf, ctx->line_info);
+  put_u32 (&buf, ctx->ndefines);
+  for (i = 0; i < ctx->ndefines; i++)
+    put_str (&buf, ctx->defines[i], strlen (ctx->defines[i]));
+  save_files (ctx, &buf);
+  save_state (ctx, &buf);
+  set_u32 (&buf, 12, buf.len);
+
+  /* Write it under another name first, so that no one ever reads half
+     a snapshot.  */
+#ifdef HAVE_UNISTD_H
+  sprintf (tmp, "%s.%ld.tmp", path, (long) getpid ());
+#else
+  sprintf (tmp, "%s.tmp", path);
+#endif
+  f = fopen (tmp, "wb");
+  ok = f != NULL;
+  if (f)
+    {
+      ok = fwrite (buf.ptr, 1, buf.len, f) == (size_t) buf.len;
+      if (fclose (f) != 0)
+	ok = 0;
+      if (ok)
+	ok = rename (tmp, path) == 0;
+      if (!ok)
+	remove (tmp);
+    }
+  if (!ok)
+    fprintf (ctx->errfile, _("Can't write snapshot file `%s'.\n"), path);
+
+  free (tmp);
+  sb_kill (&buf);
+  return ok;
+}
+
+/* Map the file at PATH into SNAP, or failing that read it.  */
+
+static int
+map_file (masp_snapshot *snap, const char *path)
+{
+  FILE *f;
+  long size;
+  unsigned char *data;
+
+#ifdef HAVE_SYS_MMAN_H
+  int fd = open (path, O_RDONLY);
+  struct stat st;
+
+  if (fd < 0)
+    return 0;
+  if (fstat (fd, &st) == 0 && st.st_size > 0)
+    {
+      void *p = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED)
+	{
+	  close (fd);
+	  snap->data = (const unsigned char *) p;
+	  snap->len = st.st_size;
+	  snap->mapped = 1;
+	  return 1;
+	}
+    }
+  close (fd);
+#endif
+
+  f = fopen (path, "rb");
+  if (!f)
+    return 0;
+  fseek (f, 0, SEEK_END);
+  size = ftell (f);
+  rewind (f);
+  if (size < 0)
+    size = 0;
+  data = (unsigned char *) xmalloc (size + 1);
+  snap->len = fread (data, 1, size, f);
+  fclose (f);
+  snap->data = data;
+  return 1;
+}
+
+masp_snapshot *
+masp_snapshot_open (const char *path, const masp_options *opts,
+		    const char *const *defines, int ndefines, FILE *err)
+{
+  masp_snapshot *snap = (masp_snapshot *) xmalloc (sizeof (masp_snapshot));
+  masp_options defaults;
+  const char *changed = NULL;
+  snap_reader r;
+  int same;
+
+  memset (snap, 0, sizeof *snap);
+  if (!map_file (snap, path))
+    {
+      fprintf (err, _("Can't read snapshot file `%s'.\n"), path);
+      free (snap);
+      return NULL;
+    }
+  if (!opts)
+    {
+      masp_options_init (&defaults);
+      opts = &defaults;
+    }
+
+  r.p = snap->data;
+  r.end = snap->data + snap->len;
+  r.bad = snap->len < 16 || memcmp (snap->data, SNAPSHOT_MAGIC, 8) != 0;
+  r.p += 8;
+  if (get_u32 (&r) != SNAPSHOT_VERSION || get_u32 (&r) != snap->len)
+    r.bad = 1;
+
+  /* What an include wrote then is written again, which is only right
+     if it doesn't depend on where the file was included.  */
+  if (opts->copysource || opts->line_info)
+    {
+      fprintf (err, _("Snapshot `%s' can't be used with -s or -l; not using it.\n"),
+	       path);
+      masp_snapshot_close (snap);
+      return NULL;
+    }
+
+  same = ((int) get_u32 (&r) == opts->alternate);
+  same &= ((int) get_u32 (&r) == opts->mri);
+  same &= (get_u32 (&r) == (unsigned char) opts->comment_char);
+  same &= (get_u32 (&r) == (unsigned char) opts->prefix_char);
+  same &= ((int) get_u32 (&r) == opts->copysource);
+  same &= ((int) get_u32 (&r) == opts->print_line_number);
+  same &= ((int) get_u32 (&r) == opts->line_info);
+  if (!r.bad && !same)
+    {
+      fprintf (err, _("Snapshot `%s' was made with other options; not using it.\n"),
+	       path);
+      masp_snapshot_close (snap);
+      return NULL;
+    }
+
+  /* Macros defined under a condition on a -D value would be wrong.  */
+  if (!same_defines (&r, defines, ndefines) && !r.bad)
+    {
+      fprintf (err, _("Snapshot `%s' was made with other -D values; not using it.\n"),
+	       path);
+      masp_snapshot_close (snap);
+      return NULL;
+    }
+
+  if (!r.bad && !load_files (snap, &r, &changed))
+    {
+      fprintf (err, _("Snapshot `%s' is out of date, `%s' has changed; not using it.\n"),
+	       path, changed);
+      masp_snapshot_close (snap);
+      return NULL;
+    }
+
+  /* Check the rest now, so that using it needs no checks.  */
+  snap->state = r.p - snap->data;
+  load_state (&r, NULL);
+  if (r.bad)
+    {
+      fprintf (err, _("`%s' is not a snapshot file.\n"), path);
+      masp_snapshot_close (snap);
+      return NULL;
+    }
+  return snap;
+}
+
+void
+masp_snapshot_close (masp_snapshot *snap)
+{
+  int i;
+
+  if (!snap)
+    return;
+  for (i = 0; i < snap->nfiles; i++)
+    free (snap->files[i].path);
+  free (snap->files);
+#ifdef HAVE_SYS_MMAN_H
+  if (snap->mapped)
+    munmap ((void *) snap->data, snap->len);
+  else
+#endif
+    free ((void *) snap->data);
+  free (snap);
+}
+
+void
+masp_use_snapshot (masp_context *ctx, const masp_snapshot *snap)
+{
+  snap_reader r;
+
+  r.p = snap->data + snap->state;
+  r.end = snap->data + snap->len;
+  r.bad = 0;
+  load_state (&r, ctx);
+  ctx->snapshot = snap;
+}
@@ -0,0 +1,34 @@
+/* snapshot.h - saved preprocessor state.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#ifndef SNAPSHOT_H
+
+#define SNAPSHOT_H
+
+#include "masp.h"
+
+/* The interface is in masp.h; this is what masp.c needs besides.  */
+
+/* Whether the file at PATH is one the snapshot was built from, and
+   if so what it wrote, in *OUTPUT and *LEN.  */
+extern int snapshot_covers (const masp_snapshot *, const char *path,
+			    const char **output, int *len);
+
+#endif
@@ -0,0 +1,40 @@
+/* symhash.h - the hash of masp's symbol tables.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+#ifndef SYMHASH_H
+
+#define SYMHASH_H
+
+/* The hash of the LEN characters at KEY, by which masp.c puts symbols
+   in the buckets of its tables.  mkkeywords lays out the keyword
+   tables with it when masp is built, so both must use this one.  */
+
+static inline int
+symbol_hash (const char *key, int len)
+{
+  unsigned int k = 0x1234u;
+  int i;
+
+  for (i = 0; i < len; i++)
+    k ^= (k << 2) ^ (unsigned char) key[i];
+  return (int) (k & 0xf0fffu);
+}
+
+#endif
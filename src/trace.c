@@ -0,0 +1,223 @@
+/* trace.c - spans of a run for a trace viewer.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include "compat.h"
+#include "profile.h"
+#include "trace.h"
+
+/* Longer names are cut short, and longer file names lose their
+   beginning.  */
+#define TRACE_NAME 48
+#define TRACE_FILE 80
+
+typedef struct trace_event {
+  double time;
+  const char *cat;		/* NULL for the end of a span.  */
+  int line;
+  int lane;
+  char name[TRACE_NAME];
+  char file[TRACE_FILE];	/* Empty if not known.  */
+} trace_event;
+
+struct trace {
+  double start;
+  trace_event *events;
+  size_t nevents;
+  size_t size;
+  /* Spans begun and not ended, all lanes together: each needs room
+     kept for its end.  */
+  size_t open;
+  int depth[TRACE_LANES];	/* Spans open on each lane ... */
+  int recorded[TRACE_LANES];	/* ... and how many of them are kept.  */
+  long dropped;
+};
+
+static const char *const lane_names[TRACE_LANES] = {
+  "include stack",
+  "conditionals"
+};
+
+trace *
+trace_new (size_t events)
+{
+  trace *t = (trace *) xmalloc (sizeof (trace));
+
+  memset (t, 0, sizeof *t);
+  t->size = events < 2 ? 2 : events;
+  t->events = (trace_event *) xmalloc (t->size * sizeof (trace_event));
+  t->start = profile_clock ();
+  return t;
+}
+
+void
+trace_free (trace *t)
+{
+  if (!t)
+    return;
+  free (t->events);
+  free (t);
+}
+
+void
+trace_begin (trace *t, trace_lane lane, const char *cat,
+	     const char *name, int len, const char *file, int line)
+{
+  trace_event *e;
+
+  /* Once a span is left out, so is everything within it.  */
+  if (t->recorded[lane] != t->depth[lane]++
+      || t->nevents + t->open + 2 > t->size)
+    {
+      t->dropped++;
+      return;
+    }
+  t->recorded[lane]++;
+  t->open++;
+
+  e = &t->events[t->nevents++];
+  e->time = profile_clock ();
+  e->cat = cat;
+  e->lane = lane;
+  if (len >= TRACE_NAME)
+    len = TRACE_NAME - 1;
+  memcpy (e->name, name, len);
+  e->name[len] = 0;
+  e->line = line;
+  e->file[0] = 0;
+  if (file)
+    {
+      size_t flen = strlen (file);
+
+      if (flen < TRACE_FILE)
+	memcpy (e->file, file, flen + 1);
+      else
+	{
+	  memcpy (e->file, "...", 3);
+	  memcpy (e->file + 3, file + flen - (TRACE_FILE - 4), TRACE_FILE - 3);
+	}
+    }
+}
+
+void
+trace_end (trace *t, trace_lane lane)
+{
+  trace_event *e;
+
+  if (!t->depth[lane])
+    return;
+  if (t->depth[lane]-- > t->recorded[lane])
+    return;
+  t->recorded[lane]--;
+  t->open--;
+
+  e = &t->events[t->nevents++];
+  e->time = profile_clock ();
+  e->cat = NULL;
+  e->lane = lane;
+}
+
+long
+trace_dropped (const trace *t)
+{
+  return t->dropped;
+}
+
+static void
+write_string (FILE *file, const char *s)
+{
+  putc ('"', file);
+  for (; *s; s++)
+    {
+      unsigned char c = *s;
+
+      if (c == '"' || c == '\\')
+	fprintf (file, "\\%c", c);
+      else if (c < 0x20)
+	fprintf (file, "\\u%04x", c);
+      else
+	putc (c, file);
+    }
+  putc ('"', file);
+}
+
+static void
+write_end (FILE *file, double ts, int lane)
+{
+  fprintf (file, ",\n{\"ph\": \"E\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d}",
+	   ts, lane + 1);
+}
+
+int
+trace_write (trace *t, FILE *file)
+{
+  double now = (profile_clock () - t->start) * 1e6;
+  size_t i;
+  int lane;
+
+  fprintf (file, "{\"traceEvents\": [\n");
+  fprintf (file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+	   "\"args\": {\"name\": \"masp\"}}");
+  for (lane = 0; lane < TRACE_LANES; lane++)
+    fprintf (file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+	     "\"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+	     lane + 1, lane_names[lane]);
+
+  for (i = 0; i < t->nevents; i++)
+    {
+      trace_event *e = &t->events[i];
+      double ts = (e->time - t->start) * 1e6;
+
+      if (!e->cat)
+	{
+	  write_end (file, ts, e->lane);
+	  continue;
+	}
+      fprintf (file, ",\n{\"name\": ");
+      write_string (file, e->name);
+      fprintf (file, ", \"cat\": \"%s\", \"ph\": \"B\", \"ts\": %.3f, "
+	       "\"pid\": 1, \"tid\": %d", e->cat, ts, e->lane + 1);
+      if (e->file[0])
+	{
+	  fprintf (file, ", \"args\": {\"file\": ");
+	  write_string (file, e->file);
+	  fprintf (file, ", \"line\": %d}", e->line);
+	}
+      putc ('}', file);
+    }
+
+  /* A fatal error can leave spans open.  */
+  for (lane = 0; lane < TRACE_LANES; lane++)
+    for (i = 0; i < (size_t) t->recorded[lane]; i++)
+      write_end (file, now, lane);
+
+  fprintf (file, "\n],\n\"displayTimeUnit\": \"ms\",\n"
+	   "\"otherData\": {\"dropped\": %ld}}\n", t->dropped);
+  return !ferror (file);
+}
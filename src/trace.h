@@ -0,0 +1,71 @@
+/* trace.h - spans of a run for a trace viewer.
+   Copyright 2003 Johann Gunnar Oskarsson
+
+   This file is part of MASP, the Assembly Preprocessor.
+
+   MASP is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   MASP is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MASP; see the file COPYING.  If not, write to the Free
+   Software Foundation, 59 Temple Place - Suite 330, Boston, MA
+   02111-1307, USA.  */
+
+
+#ifndef TRACE_H
+
+#define TRACE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* With --trace a run records when each level of the include stack
+   was pushed and popped, be it a file, a macro expansion or an
+   AREPEAT or AWHILE, and when each conditional began and ended.  The
+   spans are written out in the Chrome trace event format, with the
+   include stack and the conditionals as two threads, since a
+   conditional may be closed in another file than it was opened in.
+
+   The events go into a buffer allocated up front, so that recording
+   one is only a few stores.  When it fills up, spans are left out
+   whole, innermost first, and counted.  */
+
+typedef struct trace trace;
+
+typedef enum {
+  TRACE_INCLUDES,		/* Files, macros, AREPEAT and AWHILE.  */
+  TRACE_CONDITIONALS,		/* AIF to AENDI, and the like.  */
+  TRACE_LANES
+} trace_lane;
+
+/* The number of events a trace holds by default.  */
+#define TRACE_EVENTS (1 << 18)
+
+extern trace *trace_new (size_t events);
+extern void trace_free (trace *);
+
+/* Begin a span on LANE called NAME, of LEN characters, in category
+   CAT, which must be a constant string.  It began at line LINE of
+   FILE, if FILE is not NULL.  */
+extern void trace_begin (trace *, trace_lane, const char *cat,
+			 const char *name, int len,
+			 const char *file, int line);
+
+/* End the innermost span on LANE.  With none open, nothing is done.  */
+extern void trace_end (trace *, trace_lane);
+
+/* The number of spans left out so far.  */
+extern long trace_dropped (const trace *);
+
+/* Write the trace as JSON on FILE, ending any spans still open.
+   Returns 0 if it could not be written.  */
+extern int trace_write (trace *, FILE *file);
+
+#endif
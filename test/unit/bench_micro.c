@@ -0,0 +1,494 @@
+/* Microbenchmarks for the pieces masp spends its time in: sb appends
+ * and churn, the hash.c tables, masp.c's own hash_table and exp_parse.
+ *
+ * Each benchmark is run in batches: the batch size is doubled until a
+ * batch takes --target-ms, a few batches are then run and thrown away
+ * to warm up, and --reps more are timed.  The report gives the median,
+ * fastest and mean nanoseconds per operation and the relative
+ * standard deviation over the timed batches, as text or with --json.
+ *
+ * masp.c's hash_table and exp_parse are file-static, so, like
+ * test_masp_cli.c, we include the source file to reach them.
+ *
+ * Usage: bench_micro [--reps n] [--target-ms n] [--json] [filter...]
+ * Only benchmarks whose names contain one of the filters are run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../../src/masp.c"
+
+#define WARMUP_REPS 2
+#define MAX_REPS 100
+
+typedef enum { KEYS_SEQ, KEYS_PREFIX, KEYS_RANDOM, KEY_KINDS } key_kind;
+
+static const char *const key_kind_names[KEY_KINDS] = {
+  "seq", "prefix", "random"
+};
+
+static const int table_sizes[] = { 16, 1024, 65536 };
+#define NSIZES ((int) (sizeof table_sizes / sizeof table_sizes[0]))
+
+/* What the benchmark being run works on.  */
+static char **keys;		/* N keys, in a shuffled order.  */
+static char **misses;		/* N keys which are not in the table.  */
+static sb *sb_keys;		/* The keys again, as sbs.  */
+static sb *sb_misses;
+static int nkeys;
+static struct hash_control *table;
+static hash_table masp_table;
+static masp_context *ctx;
+static sb expr;
+static sb buf;
+static volatile long sink;
+
+static unsigned long rng_state = 12345;
+
+static unsigned long rng(void) {
+  rng_state = rng_state * 6364136223846793005ul + 1442695040888963407ul;
+  return rng_state >> 33;
+}
+
+static char *make_key(key_kind kind, int i, const char *tag) {
+  char name[128];
+  int len, j;
+
+  switch (kind) {
+  case KEYS_SEQ:
+    snprintf(name, sizeof name, "%ssym_%d", tag, i);
+    break;
+  case KEYS_PREFIX:
+    snprintf(name, sizeof name, "%sa_rather_long_common_prefix_for_%d",
+             tag, i);
+    break;
+  default:
+    // Random letters, made unique by the number after them.
+    len = 2 + (int) (rng() % 10);
+    for (j = 0; j < len; j++)
+      name[j] = "abcdefghijklmnopqrstuvwxyz_0123456789"[rng() % 37];
+    snprintf(name + len, sizeof name - len, "%s%x", tag, i);
+    break;
+  }
+  return xstrdup(name);
+}
+
+static void make_keys(int n, key_kind kind) {
+  int i;
+
+  nkeys = n;
+  keys = (char **) xmalloc(n * sizeof (char *));
+  misses = (char **) xmalloc(n * sizeof (char *));
+  sb_keys = (sb *) xmalloc(n * sizeof (sb));
+  sb_misses = (sb *) xmalloc(n * sizeof (sb));
+  for (i = 0; i < n; i++) {
+    keys[i] = make_key(kind, i, "");
+    misses[i] = make_key(kind, i, "no_");
+  }
+  // Look them up in another order than they went in.
+  for (i = n - 1; i > 0; i--) {
+    int j = (int) (rng() % (i + 1));
+    char *t = keys[i];
+    keys[i] = keys[j];
+    keys[j] = t;
+  }
+  for (i = 0; i < n; i++) {
+    sb_new(&sb_keys[i]);
+    sb_add_string(&sb_keys[i], keys[i]);
+    sb_new(&sb_misses[i]);
+    sb_add_string(&sb_misses[i], misses[i]);
+  }
+}
+
+static void free_keys(void) {
+  int i;
+
+  for (i = 0; i < nkeys; i++) {
+    free(keys[i]);
+    free(misses[i]);
+    sb_kill(&sb_keys[i]);
+    sb_kill(&sb_misses[i]);
+  }
+  free(keys);
+  free(misses);
+  free(sb_keys);
+  free(sb_misses);
+  keys = misses = NULL;
+  sb_keys = sb_misses = NULL;
+  nkeys = 0;
+}
+
+static void fill_table(void) {
+  int i;
+
+  table = hash_new();
+  for (i = 0; i < nkeys; i++)
+    hash_insert(table, keys[i], keys[i]);
+}
+
+static void fill_masp_table(void) {
+  int i;
+
+  hash_new_table(SYMBOL_TABLE_SIZE, &masp_table);
+  for (i = 0; i < nkeys; i++)
+    hash_create(&masp_table, &sb_keys[i])->value.i = i;
+}
+
+/* The benchmarks.  Each does ITERS operations.  */
+
+static void body_sb_add_char(long iters) {
+  long i;
+
+  for (i = 0; i < iters; i++) {
+    sb_add_char(&buf, 'x');
+    if (buf.len == 4096)
+      sb_reset(&buf);
+  }
+}
+
+static void body_sb_add_char_fast(long iters) {
+  long i;
+
+  for (i = 0; i < iters; i++) {
+    sb_add_char_fast(&buf, 'x');
+    if (buf.len == 4096)
+      sb_reset(&buf);
+  }
+}
+
+static void add_buffer(long iters, int len) {
+  static const char text[256] =
+    "\tmadd.xyz vf01, vf02, vf03 ; the sort of text masp copies";
+  long i;
+
+  for (i = 0; i < iters; i++) {
+    sb_add_buffer(&buf, text, len);
+    if (buf.len >= 65536)
+      sb_reset(&buf);
+  }
+}
+
+static void body_sb_add_buffer_16(long iters) { add_buffer(iters, 16); }
+static void body_sb_add_buffer_256(long iters) { add_buffer(iters, 256); }
+
+static void body_sb_new_kill(long iters) {
+  long i;
+  sb s;
+
+  for (i = 0; i < iters; i++) {
+    sb_new(&s);
+    sb_kill(&s);
+  }
+}
+
+static void body_sb_build_4k_kill(long iters) {
+  long i;
+  sb s;
+
+  for (i = 0; i < iters; i++) {
+    sb_build(&s, 12);
+    sb_kill(&s);
+  }
+}
+
+static void body_sb_grow_64k(long iters) {
+  static const char text[256] = "";
+  long i;
+  int j;
+  sb s;
+
+  for (i = 0; i < iters; i++) {
+    sb_new(&s);
+    for (j = 0; j < 256; j++)
+      sb_add_buffer(&s, text, 256);
+    sb_kill(&s);
+  }
+}
+
+static void body_hash_find_hit(long iters) {
+  long i;
+  int k = 0;
+
+  for (i = 0; i < iters; i++) {
+    sink += hash_find(table, keys[k]) != NULL;
+    if (++k == nkeys)
+      k = 0;
+  }
+}
+
+static void body_hash_find_miss(long iters) {
+  long i;
+  int k = 0;
+
+  for (i = 0; i < iters; i++) {
+    sink += hash_find(table, misses[k]) != NULL;
+    if (++k == nkeys)
+      k = 0;
+  }
+}
+
+static void body_hash_jam_replace(long iters) {
+  long i;
+  int k = 0;
+
+  for (i = 0; i < iters; i++) {
+    hash_jam(table, keys[k], keys[k]);
+    if (++k == nkeys)
+      k = 0;
+  }
+}
+
+/* Inserting into a table which starts empty each time round, so an
+   operation here includes its share of hash_new and hash_die.  */
+static void body_hash_jam_insert(long iters) {
+  long i;
+  int k = 0;
+  struct hash_control *t = hash_new();
+
+  for (i = 0; i < iters; i++) {
+    hash_jam(t, keys[k], keys[k]);
+    if (++k == nkeys) {
+      hash_die(t);
+      t = hash_new();
+      k = 0;
+    }
+  }
+  hash_die(t);
+}
+
+static void body_hash_lookup_hit(long iters) {
+  long i;
+  int k = 0;
+
+  for (i = 0; i < iters; i++) {
+    sink += hash_lookup(&masp_table, &sb_keys[k]) != NULL;
+    if (++k == nkeys)
+      k = 0;
+  }
+}
+
+static void body_hash_lookup_miss(long iters) {
+  long i;
+  int k = 0;
+
+  for (i = 0; i < iters; i++) {
+    sink += hash_lookup(&masp_table, &sb_misses[k]) != NULL;
+    if (++k == nkeys)
+      k = 0;
+  }
+}
+
+static void body_exp_parse(long iters) {
+  long i;
+  exp_t res;
+
+  for (i = 0; i < iters; i++) {
+    sink += exp_parse(ctx, 0, &expr, &res);
+    sink += (long) res.value;
+  }
+}
+
+/* Running them.  */
+
+typedef struct {
+  double median, min, mean, rsd;
+  long iters;
+  int reps;
+} result;
+
+static int reps = 10;
+static double target = 0.02;
+static int json;
+static int nresults;
+static char **filters;
+static int nfilters;
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static double time_batch(void (*body)(long), long iters) {
+  double start = profile_clock();
+  body(iters);
+  return profile_clock() - start;
+}
+
+static int wanted(const char *name) {
+  int i;
+
+  if (!nfilters)
+    return 1;
+  for (i = 0; i < nfilters; i++)
+    if (strstr(name, filters[i]))
+      return 1;
+  return 0;
+}
+
+static void measure(const char *name, void (*body)(long)) {
+  double ns[MAX_REPS];
+  double sum = 0, sq = 0;
+  result r;
+  int i;
+
+  // Find a batch which takes long enough to time; this warms up too.
+  r.iters = 1;
+  while (time_batch(body, r.iters) < target && r.iters < (1l << 40))
+    r.iters *= 2;
+  for (i = 0; i < WARMUP_REPS; i++)
+    time_batch(body, r.iters);
+  for (i = 0; i < reps; i++) {
+    ns[i] = time_batch(body, r.iters) * 1e9 / r.iters;
+    sum += ns[i];
+  }
+  r.reps = reps;
+  r.mean = sum / reps;
+  for (i = 0; i < reps; i++)
+    sq += (ns[i] - r.mean) * (ns[i] - r.mean);
+  r.rsd = r.mean > 0 ? 100.0 * sqrt(sq / reps) / r.mean : 0;
+  qsort(ns, reps, sizeof (double), compare_doubles);
+  r.min = ns[0];
+  r.median = reps % 2 ? ns[reps / 2] : (ns[reps / 2 - 1] + ns[reps / 2]) / 2;
+
+  if (json)
+    printf("%s\n    {\"name\": \"%s\", \"ns_per_op\": %.3f, \"min\": %.3f, "
+           "\"mean\": %.3f, \"rsd_percent\": %.2f, \"reps\": %d, "
+           "\"iters\": %ld}",
+           nresults ? "," : "", name, r.median, r.min, r.mean, r.rsd,
+           r.reps, r.iters);
+  else
+    printf("%-40s %10.2f %10.2f %10.2f %7.2f%% %12ld\n", name, r.median,
+           r.min, r.mean, r.rsd, r.iters);
+  fflush(stdout);
+  nresults++;
+}
+
+static void run_sb(void) {
+  static const struct {
+    const char *name;
+    void (*body)(long);
+  } sb_benches[] = {
+    { "sb_add_char", body_sb_add_char },
+    { "sb_add_char_fast", body_sb_add_char_fast },
+    { "sb_add_buffer 16 bytes", body_sb_add_buffer_16 },
+    { "sb_add_buffer 256 bytes", body_sb_add_buffer_256 },
+    { "sb_new+sb_kill", body_sb_new_kill },
+    { "sb_build 4 KB+sb_kill", body_sb_build_4k_kill },
+    { "sb_new, grow to 64 KB, sb_kill", body_sb_grow_64k },
+  };
+  int i;
+
+  for (i = 0; i < (int) (sizeof sb_benches / sizeof sb_benches[0]); i++)
+    if (wanted(sb_benches[i].name)) {
+      sb_new(&buf);
+      measure(sb_benches[i].name, sb_benches[i].body);
+      sb_kill(&buf);
+    }
+}
+
+static void run_hash(void) {
+  static const struct {
+    const char *name;
+    void (*body)(long);
+    int masp;			/* Uses masp.c's hash_table.  */
+  } hash_benches[] = {
+    { "hash_find hit", body_hash_find_hit, 0 },
+    { "hash_find miss", body_hash_find_miss, 0 },
+    { "hash_jam replace", body_hash_jam_replace, 0 },
+    { "hash_jam insert", body_hash_jam_insert, 0 },
+    { "hash_lookup hit", body_hash_lookup_hit, 1 },
+    { "hash_lookup miss", body_hash_lookup_miss, 1 },
+  };
+  char name[128];
+  int b, s, k;
+
+  for (b = 0; b < (int) (sizeof hash_benches / sizeof hash_benches[0]); b++)
+    for (s = 0; s < NSIZES; s++)
+      for (k = 0; k < KEY_KINDS; k++) {
+        snprintf(name, sizeof name, "%s %s %d", hash_benches[b].name,
+                 key_kind_names[k], table_sizes[s]);
+        if (!wanted(name))
+          continue;
+        make_keys(table_sizes[s], (key_kind) k);
+        if (hash_benches[b].masp)
+          fill_masp_table();
+        else
+          fill_table();
+        measure(name, hash_benches[b].body);
+        if (hash_benches[b].masp)
+          hash_free_table(&masp_table);
+        else
+          hash_die(table);
+        free_keys();
+      }
+}
+
+static void run_exp_parse(void) {
+  static const char *const exprs[] = {
+    "42",
+    "1+2*3",
+    "(12+34)*56/7-8",
+    "label+4",
+    "1.5*2.0",
+    "4294967296*2",
+  };
+  char name[128];
+  int i;
+
+  ctx = masp_new(NULL);
+  for (i = 0; i < (int) (sizeof exprs / sizeof exprs[0]); i++) {
+    snprintf(name, sizeof name, "exp_parse %s", exprs[i]);
+    if (!wanted(name))
+      continue;
+    sb_new(&expr);
+    sb_add_string(&expr, exprs[i]);
+    measure(name, body_exp_parse);
+    sb_kill(&expr);
+  }
+  masp_free(ctx);
+}
+
+static int usage(void) {
+  fprintf(stderr, "Usage: bench_micro [--reps n] [--target-ms n] [--json] "
+          "[filter...]\n");
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  int i;
+
+  filters = (char **) xmalloc(argc * sizeof (char *));
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+      reps = atoi(argv[++i]);
+      if (reps < 1 || reps > MAX_REPS)
+        return usage();
+    } else if (strcmp(argv[i], "--target-ms") == 0 && i + 1 < argc) {
+      target = atof(argv[++i]) / 1000;
+      if (target <= 0)
+        return usage();
+    } else if (strcmp(argv[i], "--json") == 0)
+      json = 1;
+    else if (argv[i][0] == '-')
+      return usage();
+    else
+      filters[nfilters++] = argv[i];
+  }
+
+  if (json)
+    printf("{\"bench\": \"micro\", \"version\": 1, \"results\": [");
+  else
+    printf("%-40s %10s %10s %10s %8s %12s\n", "ns/op", "median", "min",
+           "mean", "rsd", "batch");
+  run_sb();
+  run_hash();
+  run_exp_parse();
+  if (json)
+    printf("\n]}\n");
+
+  free(filters);
+  return 0;
+}
@@ -63,6 +63,24 @@ static int test_new_returns_empty_table(void) {
   return 0;
 }
 
+/* A table nothing was put in has no slots yet; everything but an
+ * insert must still work on it.  */
+static int test_untouched_table_is_usable(void) {
+  struct hash_control *t = hash_new();
+  int v = 3;
+  CHECK(hash_replace(t, "a", &v) == NULL);
+  CHECK(hash_delete(t, "a") == NULL);
+  CHECK(hash_find(t, "a") == NULL);
+  hash_traverse(t, NULL);  /* No slots, so never called.  */
+  hash_die(t);
+
+  t = hash_new();
+  CHECK(hash_jam(t, "a", &v) == NULL);
+  CHECK_PTR_EQ(hash_find(t, "a"), &v);
+  hash_die(t);
+  return 0;
+}
+
 /* --- insert / find -------------------------------------------------- */
 
 static int test_insert_then_find(void) {
@@ -276,6 +294,7 @@ struct test_case { const char *name; int (*fn)(void); };
 
 static const struct test_case cases[] = {
   { "new_returns_empty_table",            test_new_returns_empty_table },
+  { "untouched_table_is_usable",          test_untouched_table_is_usable },
   { "insert_then_find",                   test_insert_then_find },
   { "insert_duplicate_returns_exists",    test_insert_duplicate_returns_exists },
   { "insert_copies_key",                  test_insert_copies_key },
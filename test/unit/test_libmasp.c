@@ -0,0 +1,194 @@
+/* Unit tests for the libmasp interface in src/masp.h.
+ *
+ * These drive the preprocessor through masp_preprocess_buffer only,
+ * the way an embedding program would: no files, no fork/exec, and
+ * more than one context alive at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "masp.h"
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "  %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      return 1; \
+    } \
+  } while (0)
+
+#define CHECK_EQ_INT(a, b) do { \
+    long _a = (long)(a), _b = (long)(b); \
+    if (_a != _b) { \
+      fprintf(stderr, "  %s:%d: %s == %ld, expected %ld\n", \
+              __FILE__, __LINE__, #a, _a, _b); \
+      return 1; \
+    } \
+  } while (0)
+
+#define CHECK_EQ_STR(a, b) do { \
+    const char *_a = (a), *_b = (b); \
+    if (strcmp(_a, _b) != 0) { \
+      fprintf(stderr, "  %s:%d: %s == \"%s\", expected \"%s\"\n", \
+              __FILE__, __LINE__, #a, _a, _b); \
+      return 1; \
+    } \
+  } while (0)
+
+static const char sample[] =
+  "X\t.ASSIGNA 3\n"
+  "\tmov \\&X,r0\n"
+  "\t.MACRO inc R\n"
+  "\tadd #1,\\R\n"
+  "\t.ENDM\n"
+  "\tinc r2\n"
+  "\t.END\n";
+
+/* Preprocess TEXT in CTX, returning the output (caller frees).  Any
+   diagnostics are dropped.  */
+static char *run(masp_context *ctx, const char *text, int *status) {
+  char *out = NULL, *diag = NULL;
+  *status = masp_preprocess_buffer(ctx, "test.s", text, strlen(text),
+                                   &out, NULL, &diag, NULL);
+  free(diag);
+  return out;
+}
+
+static int test_buffer_to_buffer(void) {
+  masp_context *ctx = masp_new(NULL);
+  size_t len = 0, dlen = 0;
+  char *out = NULL, *diag = NULL;
+  int rc = masp_preprocess_buffer(ctx, "test.s", sample, strlen(sample),
+                                  &out, &len, &diag, &dlen);
+  CHECK_EQ_INT(rc, 0);
+  CHECK_EQ_STR(out, "\tmov 3,r0\n\tadd #1,r2\n");
+  CHECK_EQ_INT(len, strlen(out));
+  CHECK_EQ_INT(dlen, 0);
+  free(out);
+  free(diag);
+  CHECK_EQ_INT(masp_finish(ctx), 0);
+  masp_free(ctx);
+  return 0;
+}
+
+static int test_define_before_run(void) {
+  masp_context *ctx = masp_new(NULL);
+  int rc;
+  masp_define(ctx, "N=5");
+  char *out = run(ctx, "\t.AIF \\&N EQ 5\n\tfive\n\t.AENDI\n\t.END\n", &rc);
+  CHECK_EQ_INT(rc, 0);
+  CHECK_EQ_STR(out, "\tfive\n");
+  free(out);
+  masp_free(ctx);
+  return 0;
+}
+
+static int test_options_apply(void) {
+  masp_options opts;
+  masp_options_init(&opts);
+  opts.comment_char = ';';
+  opts.prefix_char = '#';
+  masp_context *ctx = masp_new(&opts);
+  int rc;
+  char *out = run(ctx, "Y\t#ASSIGNA 7\n\tdb \\&Y ; seven\n\t#END\n", &rc);
+  CHECK_EQ_INT(rc, 0);
+  CHECK(strstr(out, "db 7") != NULL);
+  free(out);
+  masp_free(ctx);
+  return 0;
+}
+
+static int test_contexts_are_independent(void) {
+  masp_context *a = masp_new(NULL);
+  masp_context *b = masp_new(NULL);
+  size_t dlen = 0;
+  char *out = NULL, *diag = NULL;
+  int rc;
+
+  /* Define a variable and a macro in A, then use them from B.  */
+  out = run(a, "V\t.ASSIGNA 1\n\t.MACRO m\n\tin_a\n\t.ENDM\n", &rc);
+  CHECK_EQ_INT(rc, 0);
+  free(out);
+
+  const char *use = "\tm\n\tv \\&V\n\t.END\n";
+  rc = masp_preprocess_buffer(b, "b.s", use, strlen(use),
+                              &out, NULL, &diag, &dlen);
+  CHECK_EQ_INT(rc, 0);
+  CHECK(strstr(out, "in_a") == NULL);
+  CHECK(strstr(diag, "b.s:2 Can't find preprocessor variable V") != NULL);
+  free(out);
+  free(diag);
+
+  /* A still has both.  */
+  out = run(a, use, &rc);
+  CHECK_EQ_INT(rc, 0);
+  CHECK_EQ_STR(out, "\tin_a\n\tv 1\n");
+  free(out);
+
+  masp_free(a);
+  masp_free(b);
+  return 0;
+}
+
+static int test_fatal_returns_to_caller(void) {
+  masp_context *ctx = masp_new(NULL);
+  const char *text = "\tbefore\n\t.INCLUDE \"no/such/file.i\"\n\tafter\n";
+  char *out = NULL, *diag = NULL;
+  size_t dlen = 0;
+  int rc = masp_preprocess_buffer(ctx, "f.s", text, strlen(text),
+                                  &out, NULL, &diag, &dlen);
+  CHECK_EQ_INT(rc, 1);
+  CHECK(masp_fatal_p(ctx));
+  CHECK(strstr(out, "before") != NULL);
+  CHECK(strstr(out, "after") == NULL);
+  CHECK(strstr(diag, "no/such/file.i") != NULL);
+  free(out);
+  free(diag);
+  CHECK_EQ_INT(masp_finish(ctx), 1);
+  masp_free(ctx);
+  return 0;
+}
+
+static int test_end_stops_only_its_own_run(void) {
+  masp_context *ctx = masp_new(NULL);
+  int rc;
+  char *out = run(ctx, "\tone\n\t.END\n\tignored\n", &rc);
+  CHECK_EQ_STR(out, "\tone\n");
+  free(out);
+  out = run(ctx, "\ttwo\n\tthree\n\t.END\n", &rc);
+  CHECK_EQ_INT(rc, 0);
+  CHECK_EQ_STR(out, "\ttwo\n\tthree\n");
+  free(out);
+  masp_free(ctx);
+  return 0;
+}
+
+/* --- driver --------------------------------------------------------- */
+
+struct test_case { const char *name; int (*fn)(void); };
+
+static const struct test_case cases[] = {
+  { "buffer_to_buffer",                 test_buffer_to_buffer },
+  { "define_before_run",                test_define_before_run },
+  { "options_apply",                    test_options_apply },
+  { "contexts_are_independent",         test_contexts_are_independent },
+  { "fatal_returns_to_caller",          test_fatal_returns_to_caller },
+  { "end_stops_only_its_own_run",       test_end_stops_only_its_own_run },
+};
+
+int main(void) {
+  int n = (int)(sizeof cases / sizeof cases[0]);
+  int failed = 0;
+  for (int i = 0; i < n; i++) {
+    int rc = cases[i].fn();
+    if (rc != 0) {
+      fprintf(stderr, "FAIL  %s\n", cases[i].name);
+      failed++;
+    } else {
+      fprintf(stdout, "ok    %s\n", cases[i].name);
+    }
+  }
+  fprintf(stdout, "\n%d/%d tests passed\n", n - failed, n);
+  return failed == 0 ? 0 : 1;
+}
@@ -11,6 +11,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <signal.h>
 #define MKDIR(p) mkdir((p), 0777)
 #endif
 
@@ -24,6 +25,7 @@
 // Avoid symbol clash: rename masp main before including the implementation
 #define main masp_program_main
 #include "../../src/masp.c"
+#include "../../src/main.c"
 #undef main
 
 static int files_equal(const char *a, const char *b) {
@@ -275,6 +277,1142 @@ static int run_vu1Triangle(void) {
   return 0;
 }
 
+// --jobs: the same file preprocessed many times over by a pool of
+// workers must give exactly what a single run does, every time.
+static int run_jobs(void) {
+#if defined(__unix__)
+  enum { NJOBS = 12 };
+  char masp_path[1024];
+  char src_path[1024];
+  char expected_path[1024];
+  char pairs[NJOBS][1100];
+  char out_paths[NJOBS][1024];
+  const char *argvp[8 + NJOBS];
+  int argc = 0, failed = 0;
+
+  snprintf(masp_path, sizeof(masp_path), "%s/src/masp", BUILD_DIR);
+  snprintf(src_path, sizeof(src_path), "%s/test/vu1Triangle.vcl", SRC_DIR);
+  snprintf(expected_path, sizeof(expected_path), "%s/test/vu1Triangle.vcl_masp", SRC_DIR);
+
+  argvp[argc++] = masp_path;
+  argvp[argc++] = "-p";
+  argvp[argc++] = "-s";
+  argvp[argc++] = "-c";
+  argvp[argc++] = ";";
+  argvp[argc++] = "--jobs";
+  argvp[argc++] = "4";
+  for (int i = 0; i < NJOBS; i++) {
+    snprintf(out_paths[i], sizeof(out_paths[i]), "%s/test_outputs/jobs_%d.out", BUILD_DIR, i);
+    remove(out_paths[i]);
+    snprintf(pairs[i], sizeof(pairs[i]), "%s=%s", src_path, out_paths[i]);
+    argvp[argc++] = pairs[i];
+  }
+  argvp[argc] = NULL;
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    execv(masp_path, (char* const*)argvp);
+    _exit(127);
+  } else if (pid < 0) {
+    perror("fork");
+    return 1;
+  }
+  int status = 0;
+  if (waitpid(pid, &status, 0) < 0) { perror("waitpid"); return 1; }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "masp --jobs failed (status %d)\n", status);
+    return 1;
+  }
+  for (int i = 0; i < NJOBS; i++) {
+    if (!files_equal(out_paths[i], expected_path)) {
+      fprintf(stderr, "masp --jobs output %d differs from expected\n", i);
+      print_diff_snippet(out_paths[i], expected_path);
+      failed++;
+    }
+  }
+  return failed ? 1 : 0;
+#else
+  return 0;
+#endif
+}
+
+#if defined(__unix__)
+// Run masp with ARGV to completion, returning its exit status.
+static int spawn_masp_wait(const char *const *argvp) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    execv(argvp[0], (char* const*)argvp);
+    _exit(127);
+  } else if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  int status = 0;
+  if (waitpid(pid, &status, 0) < 0) { perror("waitpid"); return -1; }
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+#endif
+
+// --server / --client: a client's job run by the server must give what
+// a plain run does, and a client with no server must do the job itself.
+static int run_server(void) {
+#if defined(__unix__)
+  char masp_path[1024];
+  char sock_path[1024];
+  char src_path[1024];
+  char expected_path[1024];
+  char out_path[1024];
+  int failed = 0;
+
+  snprintf(masp_path, sizeof(masp_path), "%s/src/masp", BUILD_DIR);
+  snprintf(sock_path, sizeof(sock_path), "/tmp/masp_cli_unit.%ld.sock", (long)getpid());
+  snprintf(src_path, sizeof(src_path), "%s/test/vu1Triangle.vcl", SRC_DIR);
+  snprintf(expected_path, sizeof(expected_path), "%s/test/vu1Triangle.vcl_masp", SRC_DIR);
+  snprintf(out_path, sizeof(out_path), "%s/test_outputs/server.out", BUILD_DIR);
+
+  // No server yet: the client falls back to doing the job itself.
+  {
+    const char *argvp[] = { masp_path, "--client", sock_path, "-p", "-s", "-c", ";",
+                            "-o", out_path, "--", src_path, NULL };
+    remove(out_path);
+    if (spawn_masp_wait(argvp) != 0 || !files_equal(out_path, expected_path)) {
+      fprintf(stderr, "masp --client without a server failed\n");
+      failed++;
+    }
+  }
+
+  pid_t server = fork();
+  if (server == 0) {
+    const char *argvp[] = { masp_path, "--server", sock_path, NULL };
+    execv(masp_path, (char* const*)argvp);
+    _exit(127);
+  } else if (server < 0) {
+    perror("fork");
+    return 1;
+  }
+  struct stat st;
+  for (int i = 0; i < 100 && stat(sock_path, &st) != 0; i++)
+    usleep(20000);
+
+  for (int round = 0; round < 3; round++) {
+    const char *argvp[] = { masp_path, "--client", sock_path, "-p", "-s", "-c", ";",
+                            "-o", out_path, "--", src_path, NULL };
+    remove(out_path);
+    int rc = spawn_masp_wait(argvp);
+    if (rc != 0 || !files_equal(out_path, expected_path)) {
+      fprintf(stderr, "masp --client round %d failed (rc=%d)\n", round, rc);
+      print_diff_snippet(out_path, expected_path);
+      failed++;
+    }
+  }
+  {
+    const char *argvp[] = { masp_path, "--client", sock_path, "--", "no/such/input.vcl", NULL };
+    if (spawn_masp_wait(argvp) != 1) {
+      fprintf(stderr, "masp --client should fail for a missing input\n");
+      failed++;
+    }
+  }
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  if (stat(sock_path, &st) == 0) {
+    fprintf(stderr, "masp --server left its socket behind\n");
+    remove(sock_path);
+    failed++;
+  }
+  return failed ? 1 : 0;
+#else
+  return 0;
+#endif
+}
+
+// --pipeline must not change a byte of the output.
+static int run_pipeline(void) {
+#if defined(__unix__)
+  char masp_path[1024];
+  char src_path[1024];
+  char expected_path[1024];
+  char out_path[1024];
+  snprintf(masp_path, sizeof(masp_path), "%s/src/masp", BUILD_DIR);
+  snprintf(src_path, sizeof(src_path), "%s/test/vu1Triangle.vcl", SRC_DIR);
+  snprintf(expected_path, sizeof(expected_path), "%s/test/vu1Triangle.vcl_masp", SRC_DIR);
+  snprintf(out_path, sizeof(out_path), "%s/test_outputs/pipeline.out", BUILD_DIR);
+  const char *argvp[] = { masp_path, "--pipeline", "-p", "-s", "-c", ";",
+                          "-o", out_path, "--", src_path, NULL };
+  remove(out_path);
+  int rc = spawn_masp_wait(argvp);
+  if (rc != 0 || !files_equal(out_path, expected_path)) {
+    fprintf(stderr, "masp --pipeline failed (rc=%d)\n", rc);
+    print_diff_snippet(out_path, expected_path);
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+// --emit-snapshot / --use-snapshot: macros defined by a snapshot's
+// includes are there without reading them again and what they wrote is
+// written still, and a snapshot made with other -D values or whose
+// include has since changed is left alone.
+static int run_snapshot(void) {
+#if defined(__unix__)
+  char masp_path[1024];
+  char dir_path[1024];
+  char defs_path[1024];
+  char prelude_path[1024];
+  char main_path[1024];
+  char snap_path[1024];
+  char out_path[1024];
+  char plain_path[1024];
+  char *buf = NULL;
+  char *plain = NULL;
+  size_t len = 0;
+  size_t plain_len = 0;
+  int failed = 0;
+
+  snprintf(masp_path, sizeof(masp_path), "%s/src/masp", BUILD_DIR);
+  snprintf(dir_path, sizeof(dir_path), "%s/test_outputs", BUILD_DIR);
+  snprintf(defs_path, sizeof(defs_path), "%s/test_outputs/snap_defs.i", BUILD_DIR);
+  snprintf(prelude_path, sizeof(prelude_path), "%s/test_outputs/snap_prelude.s", BUILD_DIR);
+  snprintf(main_path, sizeof(main_path), "%s/test_outputs/snap_main.s", BUILD_DIR);
+  snprintf(snap_path, sizeof(snap_path), "%s/test_outputs/snap.snap", BUILD_DIR);
+  snprintf(out_path, sizeof(out_path), "%s/test_outputs/snap_main.out", BUILD_DIR);
+  snprintf(plain_path, sizeof(plain_path), "%s/test_outputs/snap_plain.out", BUILD_DIR);
+
+  // The header writes lines, the last one included, and -D picks the
+  // body of its macro.
+  if (write_text_file(defs_path, "defs_first\n\t.AIF \\&LIGHT EQ 1\n"
+                      "\t.macro twice x\n\tadd \\x, \\x\n\t.endm\n\t.AELSE\n"
+                      "\t.macro twice x\n\tsub \\x, \\x\n\t.endm\n\t.AENDI\n"
+                      "defs_marker\n") != 0 ||
+      write_text_file(prelude_path, "\t.include \"snap_defs.i\"\n") != 0 ||
+      write_text_file(main_path, "main_first\n\t.include \"snap_defs.i\"\n\ttwice r1\n") != 0)
+    return 1;
+  remove(snap_path);
+  {
+    const char *argvp[] = { masp_path, "-I", dir_path, "-DLIGHT=1", "--emit-snapshot", snap_path,
+                            "-o", "/dev/null", "--", prelude_path, NULL };
+    struct stat st;
+    if (spawn_masp_wait(argvp) != 0 || stat(snap_path, &st) != 0) {
+      fprintf(stderr, "masp --emit-snapshot failed\n");
+      return 1;
+    }
+  }
+
+  // The include is covered: the output is that of reading it.
+  {
+    const char *argvp[] = { masp_path, "-I", dir_path, "-DLIGHT=1", "--use-snapshot", snap_path,
+                            "-o", out_path, "--", main_path, NULL };
+    const char *plainv[] = { masp_path, "-I", dir_path, "-DLIGHT=1", "-o", plain_path,
+                             "--", main_path, NULL };
+    remove(out_path);
+    if (spawn_masp_wait(argvp) != 0 || read_file_to_buf(out_path, &buf, &len) != 0 ||
+        spawn_masp_wait(plainv) != 0 || read_file_to_buf(plain_path, &plain, &plain_len) != 0 ||
+        !strstr(buf, "add r1, r1") || len != plain_len || memcmp(buf, plain, len) != 0) {
+      fprintf(stderr, "masp --use-snapshot gave the wrong output\n");
+      failed++;
+    }
+    free(buf);
+    free(plain);
+    buf = NULL;
+  }
+
+  // Other -D values would have defined the macro otherwise.
+  {
+    const char *argvp[] = { masp_path, "-I", dir_path, "-DLIGHT=0", "--use-snapshot", snap_path,
+                            "-o", out_path, "--", main_path, NULL };
+    remove(out_path);
+    if (spawn_masp_wait(argvp) != 0 || read_file_to_buf(out_path, &buf, &len) != 0 ||
+        !strstr(buf, "sub r1, r1") || !strstr(buf, "defs_marker")) {
+      fprintf(stderr, "masp --use-snapshot used a snapshot made with other -D values\n");
+      failed++;
+    }
+    free(buf);
+    buf = NULL;
+  }
+
+  // A changed include makes the snapshot stale, and it is read as usual.
+  if (write_text_file(defs_path, "\t.macro twice x\n\tadd \\x, \\x\n\t.endm\ndefs_marker_2\n") != 0)
+    return 1;
+  {
+    const char *argvp[] = { masp_path, "-I", dir_path, "-DLIGHT=1", "--use-snapshot", snap_path,
+                            "-o", out_path, "--", main_path, NULL };
+    remove(out_path);
+    if (spawn_masp_wait(argvp) != 0 || read_file_to_buf(out_path, &buf, &len) != 0 ||
+        !strstr(buf, "add r1, r1") || !strstr(buf, "defs_marker_2")) {
+      fprintf(stderr, "masp --use-snapshot used a stale snapshot\n");
+      failed++;
+    }
+    free(buf);
+  }
+  return failed ? 1 : 0;
+#else
+  return 0;
+#endif
+}
+
+// --fork-server: a job forked from the prelude has its macros, and skips
+// an include the prelude read, writing what it wrote, as with a snapshot;
+// one with other options or -D values is run afresh.  The prelude needs
+// no .END, so starting the server warns of nothing.
+static int run_fork_server(void) {
+#if defined(__unix__)
+  char masp_path[1024];
+  char sock_path[1024];
+  char dir_path[1024];
+  char defs_path[1024];
+  char prelude_path[1024];
+  char main_path[1024];
+  char out_path[1024];
+  char plain_path[1024];
+  char err_path[1024];
+  char *buf = NULL;
+  char *plain = NULL;
+  size_t len = 0;
+  size_t plain_len = 0;
+  int failed = 0;
+
+  snprintf(masp_path, sizeof(masp_path), "%s/src/masp", BUILD_DIR);
+  snprintf(sock_path, sizeof(sock_path), "/tmp/masp_cli_unit.%ld.fork.sock", (long)getpid());
+  snprintf(err_path, sizeof(err_path), "%s/test_outputs/fork_server.err", BUILD_DIR);
+  snprintf(dir_path, sizeof(dir_path), "%s/test_outputs", BUILD_DIR);
+  snprintf(defs_path, sizeof(defs_path), "%s/test_outputs/fork_defs.i", BUILD_DIR);
+  snprintf(prelude_path, sizeof(prelude_path), "%s/test_outputs/fork_prelude.s", BUILD_DIR);
+  snprintf(main_path, sizeof(main_path), "%s/test_outputs/fork_main.s", BUILD_DIR);
+  snprintf(out_path, sizeof(out_path), "%s/test_outputs/fork_main.out", BUILD_DIR);
+  snprintf(plain_path, sizeof(plain_path), "%s/test_outputs/fork_plain.out", BUILD_DIR);
+
+  if (write_text_file(defs_path, "defs_first\n\t.AIF \\&LIGHT EQ 1\n"
+                      "\t.macro twice x\n\tadd \\x, \\x\n\t.endm\n\t.AELSE\n"
+                      "\t.macro twice x\n\tsub \\x, \\x\n\t.endm\n\t.AENDI\n"
+                      "defs_marker\n") != 0 ||
+      write_text_file(prelude_path, "\t.include \"fork_defs.i\"\n") != 0 ||
+      write_text_file(main_path, "main_first\n\t.include \"fork_defs.i\"\n\ttwice r1\n") != 0)
+    return 1;
+
+  {
+    const char *argvp[] = { masp_path, "--fork-server", sock_path, NULL };
+    if (spawn_masp_wait(argvp) != 1) {
+      fprintf(stderr, "masp --fork-server without --prelude should fail\n");
+      failed++;
+    }
+  }
+
+  pid_t server = fork();
+  if (server == 0) {
+    const char *argvp[] = { masp_path, "--fork-server", sock_path, "--prelude", prelude_path,
+                            "-I", dir_path, "-DLIGHT=1", NULL };
+    if (!freopen(err_path, "w", stderr))
+      _exit(127);
+    execv(masp_path, (char* const*)argvp);
+    _exit(127);
+  } else if (server < 0) {
+    perror("fork");
+    return 1;
+  }
+  struct stat st;
+  for (int i = 0; i < 100 && stat(sock_path, &st) != 0; i++)
+    usleep(20000);
+
+  {
+    const char *plainv[] = { masp_path, "-I", dir_path, "-DLIGHT=1", "-o", plain_path,
+                             "--", main_path, NULL };
+    if (spawn_masp_wait(plainv) != 0 || read_file_to_buf(plain_path, &plain, &plain_len) != 0)
+      plain_len = 0;
+  }
+  for (int round = 0; round < 2; round++) {
+    const char *argvp[] = { masp_path, "--client", sock_path, "-I", dir_path, "-DLIGHT=1",
+                            "-o", out_path, "--", main_path, NULL };
+    remove(out_path);
+    if (spawn_masp_wait(argvp) != 0 || read_file_to_buf(out_path, &buf, &len) != 0 ||
+        !strstr(buf, "add r1, r1") || !plain || len != plain_len || memcmp(buf, plain, len) != 0) {
+      fprintf(stderr, "masp --fork-server round %d gave the wrong output\n", round);
+      failed++;
+    }
+    free(buf);
+    buf = NULL;
+  }
+  free(plain);
+  {
+    const char *argvp[] = { masp_path, "--client", sock_path, "-I", dir_path, "-DLIGHT=0",
+                            "-o", out_path, "--", main_path, NULL };
+    remove(out_path);
+    if (spawn_masp_wait(argvp) != 0 || read_file_to_buf(out_path, &buf, &len) != 0 ||
+        !strstr(buf, "sub r1, r1") || !strstr(buf, "defs_marker")) {
+      fprintf(stderr, "masp --fork-server used the prelude with other -D values\n");
+      failed++;
+    }
+    free(buf);
+    buf = NULL;
+  }
+  {
+    const char *argvp[] = { masp_path, "--client", sock_path, "-c", "#", "-I", dir_path,
+                            "-DLIGHT=1", "-o", out_path, "--", main_path, NULL };
+    remove(out_path);
+    if (spawn_masp_wait(argvp) != 0 || read_file_to_buf(out_path, &buf, &len) != 0 ||
+        !strstr(buf, "add r1, r1") || !strstr(buf, "defs_marker")) {
+      fprintf(stderr, "masp --fork-server used the prelude with other options\n");
+      failed++;
+    }
+    free(buf);
+  }
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  if (stat(sock_path, &st) == 0) {
+    fprintf(stderr, "masp --fork-server left its socket behind\n");
+    remove(sock_path);
+    failed++;
+  }
+  if (read_file_to_buf(err_path, &buf, &len) != 0 || len != 0) {
+    fprintf(stderr, "masp --fork-server complained at startup: %.*s\n",
+            buf ? (int)len : 0, buf ? buf : "");
+    failed++;
+  }
+  free(buf);
+  return failed ? 1 : 0;
+#else
+  return 0;
+#endif
+}
+
+// --variant: each variant's output, named after -o, must be what a plain
+// run with its -D values gives.
+static int run_variant(void) {
+#if defined(__unix__)
+  char masp_path[1024];
+  char dir_path[1024];
+  char defs_path[1024];
+  char main_path[1024];
+  char out_path[1024];
+  char lit_path[1024];
+  char dark_path[1024];
+  char expected_path[1024];
+  int failed = 0;
+
+  snprintf(masp_path, sizeof(masp_path), "%s/src/masp", BUILD_DIR);
+  snprintf(dir_path, sizeof(dir_path), "%s/test_outputs", BUILD_DIR);
+  snprintf(defs_path, sizeof(defs_path), "%s/test_outputs/variant_defs.i", BUILD_DIR);
+  snprintf(main_path, sizeof(main_path), "%s/test_outputs/variant_main.s", BUILD_DIR);
+  snprintf(out_path, sizeof(out_path), "%s/test_outputs/variant.out", BUILD_DIR);
+  snprintf(lit_path, sizeof(lit_path), "%s/test_outputs/variant.lit.out", BUILD_DIR);
+  snprintf(dark_path, sizeof(dark_path), "%s/test_outputs/variant.dark.out", BUILD_DIR);
+  snprintf(expected_path, sizeof(expected_path), "%s/test_outputs/variant.expected", BUILD_DIR);
+
+  if (write_text_file(defs_path, "\t.macro twice x\n\tadd \\x, \\x\n\t.endm\n") != 0 ||
+      write_text_file(main_path,
+                      "\t.include \"variant_defs.i\"\n"
+                      "\t.AIF \\&LIGHT EQ 1\n\ttwice r1\n\t.AELSE\n\ttwice r2\n\t.AENDI\n"
+                      "\tmov \\&CLIP\n") != 0)
+    return 1;
+  remove(lit_path);
+  remove(dark_path);
+  {
+    const char *argvp[] = { masp_path, "-I", dir_path, "-DCLIP=5", "--jobs", "2",
+                            "--variant", "lit:-DLIGHT=1,-DCLIP=2", "--variant", "dark:LIGHT=0",
+                            "-o", out_path, "--", main_path, NULL };
+    if (spawn_masp_wait(argvp) != 0) {
+      fprintf(stderr, "masp --variant failed\n");
+      return 1;
+    }
+  }
+  {
+    const char *argvp[] = { masp_path, "-I", dir_path, "-DCLIP=5", "-DLIGHT=1", "-DCLIP=2",
+                            "-o", expected_path, "--", main_path, NULL };
+    if (spawn_masp_wait(argvp) != 0 || !files_equal(lit_path, expected_path)) {
+      fprintf(stderr, "masp --variant lit differs from a plain run\n");
+      print_diff_snippet(lit_path, expected_path);
+      failed++;
+    }
+  }
+  {
+    const char *argvp[] = { masp_path, "-I", dir_path, "-DCLIP=5", "-DLIGHT=0",
+                            "-o", expected_path, "--", main_path, NULL };
+    if (spawn_masp_wait(argvp) != 0 || !files_equal(dark_path, expected_path)) {
+      fprintf(stderr, "masp --variant dark differs from a plain run\n");
+      print_diff_snippet(dark_path, expected_path);
+      failed++;
+    }
+  }
+  {
+    const char *argvp[] = { masp_path, "--variant", "lit:LIGHT=1", "--", main_path, NULL };
+    if (spawn_masp_wait(argvp) != 1) {
+      fprintf(stderr, "masp --variant without -o should fail\n");
+      failed++;
+    }
+  }
+  return failed ? 1 : 0;
+#else
+  return 0;
+#endif
+}
+
+// --cache-dir: a second run takes its output from the cache, and a
+// changed include, or one which a new file earlier on the include path
+// shadows, is noticed.
+static int run_cache_dir(void) {
+#if defined(__unix__)
+  char masp_path[1024];
+  char dir_path[1024];
+  char shadow_dir[1024];
+  char shadow_path[1024];
+  char cache_path[1024];
+  char defs_path[1024];
+  char main_path[1024];
+  char out_path[1024];
+  char *buf = NULL;
+  size_t len = 0;
+  int failed = 0;
+
+  snprintf(masp_path, sizeof(masp_path), "%s/src/masp", BUILD_DIR);
+  snprintf(dir_path, sizeof(dir_path), "%s/test_outputs", BUILD_DIR);
+  snprintf(shadow_dir, sizeof(shadow_dir), "%s/test_outputs/cache_shadow", BUILD_DIR);
+  snprintf(shadow_path, sizeof(shadow_path), "%s/test_outputs/cache_shadow/cache_defs.i", BUILD_DIR);
+  snprintf(cache_path, sizeof(cache_path), "%s/test_outputs/cache", BUILD_DIR);
+  snprintf(defs_path, sizeof(defs_path), "%s/test_outputs/cache_defs.i", BUILD_DIR);
+  snprintf(main_path, sizeof(main_path), "%s/test_outputs/cache_main.s", BUILD_DIR);
+  snprintf(out_path, sizeof(out_path), "%s/test_outputs/cache_main.out", BUILD_DIR);
+
+  if (write_text_file(defs_path, "\t.macro twice x\n\tadd \\x, \\x\n\t.endm\n") != 0 ||
+      write_text_file(main_path, "\t.include \"cache_defs.i\"\n\ttwice r1\n") != 0)
+    return 1;
+  mkdir(shadow_dir, 0777);
+  remove(shadow_path);
+
+  const char *argvp[] = { masp_path, "-I", shadow_dir, "-I", dir_path, "--cache-dir", cache_path,
+                          "-o", out_path, "--", main_path, NULL };
+
+  for (int round = 0; round < 2; round++) {
+    remove(out_path);
+    if (spawn_masp_wait(argvp) != 0 || read_file_to_buf(out_path, &buf, &len) != 0 ||
+        !strstr(buf, "add r1, r1")) {
+      fprintf(stderr, "masp --cache-dir round %d gave the wrong output\n", round);
+      failed++;
+    }
+    free(buf);
+    buf = NULL;
+  }
+
+  if (write_text_file(defs_path, "\t.macro twice x\n\tsub \\x, \\x\n\t.endm\n") != 0)
+    return 1;
+  remove(out_path);
+  if (spawn_masp_wait(argvp) != 0 || read_file_to_buf(out_path, &buf, &len) != 0 ||
+      !strstr(buf, "sub r1, r1")) {
+    fprintf(stderr, "masp --cache-dir missed a changed include\n");
+    failed++;
+  }
+  free(buf);
+  buf = NULL;
+
+  if (write_text_file(shadow_path, "\t.macro twice x\n\tmul \\x, \\x\n\t.endm\n") != 0)
+    return 1;
+  remove(out_path);
+  if (spawn_masp_wait(argvp) != 0 || read_file_to_buf(out_path, &buf, &len) != 0 ||
+      !strstr(buf, "mul r1, r1")) {
+    fprintf(stderr, "masp --cache-dir missed an include shadowing another\n");
+    failed++;
+  }
+  free(buf);
+  remove(shadow_path);
+  return failed ? 1 : 0;
+#else
+  return 0;
+#endif
+}
+
+// Whether DEPS is a rule for deps_main.out on MAIN_PATH and the
+// include, ending with TAIL.
+static int deps_ok(const char *deps, const char *main_path, const char *tail) {
+  size_t n = strlen(deps), t = strlen(tail);
+  return strncmp(deps, "deps_main.out: ", 15) == 0 && strstr(deps, main_path) &&
+         n >= t && strcmp(deps + n - t, tail) == 0;
+}
+
+// -MD and -MM: the dependency file lists the input and its includes,
+// whether the file was preprocessed or only scanned.  Without -o or -MT
+// a .s input would be its own target, which is refused.
+static int run_deps(void) {
+#if defined(__unix__)
+  char masp_path[1024];
+  char dir_path[1024];
+  char defs_path[1024];
+  char main_path[1024];
+  char out_path[1024];
+  char deps_path[1024];
+  char expected[4096];
+  char *buf = NULL;
+  size_t len = 0;
+  int failed = 0;
+
+  snprintf(masp_path, sizeof(masp_path), "%s/src/masp", BUILD_DIR);
+  snprintf(dir_path, sizeof(dir_path), "%s/test_outputs", BUILD_DIR);
+  snprintf(defs_path, sizeof(defs_path), "%s/test_outputs/deps_defs.i", BUILD_DIR);
+  snprintf(main_path, sizeof(main_path), "%s/test_outputs/deps_main.s", BUILD_DIR);
+  snprintf(out_path, sizeof(out_path), "%s/test_outputs/deps_main.out", BUILD_DIR);
+  snprintf(deps_path, sizeof(deps_path), "%s/test_outputs/deps_main.d", BUILD_DIR);
+  // The rule ends with the include, which then gets an empty rule.
+  snprintf(expected, sizeof(expected), "\n\n%s/deps_defs.i:\n", dir_path);
+
+  if (write_text_file(defs_path, "\t.macro twice x\n\tadd \\x, \\x\n\t.endm\n") != 0 ||
+      write_text_file(main_path, "\t.include \"deps_defs.i\"\n\ttwice r1\n") != 0)
+    return 1;
+
+  {
+    const char *argvp[] = { masp_path, "-I", dir_path, "-MD", "-MT", "deps_main.out",
+                            "-o", out_path, "--", main_path, NULL };
+    remove(deps_path);
+    if (spawn_masp_wait(argvp) != 0 || read_file_to_buf(deps_path, &buf, &len) != 0 ||
+        !deps_ok(buf, main_path, expected)) {
+      fprintf(stderr, "masp -MD wrote\n%s\n", buf ? buf : "(nothing)");
+      failed++;
+    }
+    free(buf);
+    buf = NULL;
+  }
+  {
+    const char *argvp[] = { masp_path, "-I", dir_path, "-MM", "-MF", deps_path,
+                            "-MT", "deps_main.out", "--", main_path, NULL };
+    remove(deps_path);
+    if (spawn_masp_wait(argvp) != 0 || read_file_to_buf(deps_path, &buf, &len) != 0 ||
+        !deps_ok(buf, main_path, expected)) {
+      fprintf(stderr, "masp -MM wrote\n%s\n", buf ? buf : "(nothing)");
+      failed++;
+    }
+    free(buf);
+  }
+  {
+    const char *argvp[] = { masp_path, "-I", dir_path, "-MD", "--", main_path, NULL };
+    struct stat st;
+    remove(deps_path);
+    if (spawn_masp_wait(argvp) != 1 || stat(deps_path, &st) == 0) {
+      fprintf(stderr, "masp -MD without -o made %s depend on itself\n", main_path);
+      failed++;
+    }
+  }
+  return failed ? 1 : 0;
+#else
+  return 0;
+#endif
+}
+
+// Include lookups kept in a shared cache: a later run finds an include
+// without looking for it, until a file of that name turns up earlier
+// in the include path.  What that replaces is kept while a run which
+// began before is still going, and no longer.
+static int include_once(masp_shared *shared, const char *first,
+                        const char *second, const char *want, int want_hits) {
+  masp_context *ctx = masp_new_shared(NULL, shared);
+  const char *text = "\t.include \"lookup.i\"\n\t.include \"lookup.i\"\n";
+  char *out = NULL, *diag = NULL;
+  int failed = 0;
+
+  masp_add_include_path(ctx, first);
+  masp_add_include_path(ctx, second);
+  if (masp_preprocess_buffer(ctx, "lookup.s", text, strlen(text),
+                             &out, NULL, &diag, NULL) != 0 ||
+      !strstr(out, want) || ctx->lookup_hits != want_hits) {
+    fprintf(stderr, "include lookup gave\n%s\n%s(%d found again)\n",
+            out ? out : "", diag ? diag : "", ctx->lookup_hits);
+    failed = 1;
+  }
+  free(out);
+  free(diag);
+  masp_free(ctx);
+  return failed;
+}
+
+static int run_include_lookups(void) {
+  char first[1024];
+  char second[1024];
+  char path[1024];
+  int failed = 0;
+
+  snprintf(first, sizeof(first), "%s/test_outputs/lookup_a", BUILD_DIR);
+  snprintf(second, sizeof(second), "%s/test_outputs/lookup_b", BUILD_DIR);
+  MKDIR(first);
+  MKDIR(second);
+  snprintf(path, sizeof(path), "%s/lookup.i", first);
+  remove(path);
+  snprintf(path, sizeof(path), "%s/lookup.i", second);
+  if (write_text_file(path, "\tfrom_b\n") != 0)
+    return 1;
+
+  masp_shared *shared = masp_shared_new();
+  // The second include of a run is found again, and so is the first in
+  // a later run.
+  failed += include_once(shared, first, second, "from_b", 1);
+  failed += include_once(shared, first, second, "from_b", 2);
+  masp_context *held = masp_new_shared(NULL, shared);
+  snprintf(path, sizeof(path), "%s/lookup.i", first);
+  if (write_text_file(path, "\tfrom_a\n") != 0)
+    failed++;
+  else
+    failed += include_once(shared, first, second, "from_a", 1);
+  // A different size, so the file is read again.
+  if (write_text_file(path, "\tfrom_a again\n") != 0)
+    failed++;
+  else
+    failed += include_once(shared, first, second, "from_a again", 2);
+  if (!shared->retired || !shared->retired_lookups) {
+    fprintf(stderr, "shared cache freed what an older run may hold\n");
+    failed++;
+  }
+  masp_free(held);
+  if (shared->retired || shared->retired_lookups) {
+    fprintf(stderr, "shared cache kept what no run holds\n");
+    failed++;
+  }
+  masp_shared_free(shared);
+  return failed ? 1 : 0;
+}
+
+// An include file inside its own guard is left out once the guard is
+// set, with the output just as if it had been read.
+static int run_include_guard(void) {
+  char dir[1024];
+  char path[1024];
+  const char *text =
+    "G_I\t.ASSIGNA 0\n"
+    "\t.include \"guard.i\"\n"
+    "\t.include \"guard.i\"\n"
+    "\ttwice r1\n"
+    "\t.include \"guard.i\"\n";
+  char *out = NULL, *diag = NULL;
+  int failed = 0;
+
+  snprintf(dir, sizeof(dir), "%s/test_outputs", BUILD_DIR);
+  snprintf(path, sizeof(path), "%s/guard.i", dir);
+  if (write_text_file(path,
+                      ".AIF \\&G_I EQ 0\n"
+                      "G_I\t.ASSIGNA 1\n"
+                      "\t.macro twice x\n"
+                      "\tadd \\x, \\x\n"
+                      "\t.endm\n"
+                      "\tguarded\n"
+                      ".AENDI\n") != 0)
+    return 1;
+
+  masp_shared *shared = masp_shared_new();
+  masp_context *ctx = masp_new_shared(NULL, shared);
+  masp_add_include_path(ctx, dir);
+  if (masp_preprocess_buffer(ctx, "guard.s", text, strlen(text),
+                             &out, NULL, &diag, NULL) != 0 ||
+      strcmp(out, "\tguarded\n\tadd r1, r1\n") != 0 ||
+      ctx->guard_skips != 2) {
+    fprintf(stderr, "include guard gave\n%s\n%s(%d skipped)\n",
+            out ? out : "", diag ? diag : "", ctx->guard_skips);
+    failed = 1;
+  }
+  free(out);
+  free(diag);
+  masp_free(ctx);
+
+  // A label substituted into complains each time the file is read,
+  // so the file is read each time.
+  const char *labelled =
+    "G_L\t.ASSIGNA 0\n"
+    "\t.include \"guard_label.i\"\n"
+    "\t.include \"guard_label.i\"\n"
+    "\t.include \"guard_label.i\"\n";
+  snprintf(path, sizeof(path), "%s/guard_label.i", dir);
+  if (write_text_file(path,
+                      ".AIF \\&G_L EQ 0\n"
+                      "G_L\t.ASSIGNA 1\n"
+                      "lab\\&UNDEF:\tnop\n"
+                      ".AENDI\n") != 0)
+    return 1;
+  out = diag = NULL;
+  ctx = masp_new_shared(NULL, shared);
+  masp_add_include_path(ctx, dir);
+  masp_preprocess_buffer(ctx, "guard_label.s", labelled, strlen(labelled),
+                         &out, NULL, &diag, NULL);
+  int complaints = 0;
+  for (const char *p = diag; p && (p = strstr(p, "UNDEF")); p++)
+    complaints++;
+  if (complaints != 3 || ctx->guard_skips != 0) {
+    fprintf(stderr, "include guard around a substituted label gave\n%s(%d skipped)\n",
+            diag ? diag : "", ctx->guard_skips);
+    failed = 1;
+  }
+  free(out);
+  free(diag);
+  masp_free(ctx);
+  masp_shared_free(shared);
+  return failed;
+}
+
+// AIF and AWHILE conditions on variables are run compiled, and give
+// the same output and messages as when they are parsed each time.
+static int run_compiled_conditions(void) {
+  const char *text =
+    "N\t.ASSIGNA 0\n"
+    "\t.AWHILE \\&N LT 4\n"
+    ".AIF (\\&N & 1) EQ 0\n"
+    "\teven \\&N\n"
+    ".AELSE\n"
+    "\todd \\&N\n"
+    ".AENDI\n"
+    ".AIF 6 / (\\&N - 2) GT -4\n"
+    "\tbig \\&N\n"
+    ".AENDI\n"
+    "N\t.ASSIGNA \\&N+1\n"
+    "\t.AENDW\n";
+  const char *want =
+    "\teven 0\n\tbig 0\n\todd 1\n\teven 2\n\tbig 2\n\todd 3\n\tbig 3\n";
+  char *out = NULL, *diag = NULL;
+  int failed = 0;
+
+  masp_context *ctx = masp_new(NULL);
+  // N - 2 is zero once, which is left to istrue to report; the 6
+  // then stands.
+  if (masp_preprocess_buffer(ctx, "cond.s", text, strlen(text),
+                             &out, NULL, &diag, NULL) == 0 ||
+      strcmp(out, want) != 0 || !strstr(diag, "divide by zero") ||
+      ctx->cond_hits < 8) {
+    fprintf(stderr, "compiled conditions gave\n%s\n%s(%d run compiled)\n",
+            out ? out : "", diag ? diag : "", ctx->cond_hits);
+    failed = 1;
+  }
+  free(out);
+  free(diag);
+  masp_free(ctx);
+  return failed;
+}
+
+// Allocations of every kind so far, sbs and plain xmalloc alike.
+static long long count_allocations(void) {
+  const mem_stats *m = mem_stats_get();
+  return m->total.allocs + m->kind[MEM_OTHER].allocs;
+}
+
+// Evaluating numeric and plain string conditions, and floating point
+// expressions, allocates nothing, and integers, variables among them,
+// are 64 bits wide.
+static int run_eval_allocations(void) {
+  const char *conds[] = {
+    "(3 + 4) * 2 EQ 14",
+    "\"ab\"\"c\" EQ \"ab\"\"c\"",
+    "\"abc\" NE \"abd\"",
+    "4294967296 * 2 GT 4294967296",
+  };
+  const char *text =
+    "BIG\t.ASSIGNA 3000000000\n"
+    "\tbig \\&BIG\n"
+    ".AIF \\&BIG GT 2147483647\n"
+    "\tabove\n"
+    ".AENDI\n";
+  masp_context *ctx = masp_new(NULL);
+  long long value = 0;
+  char *out = NULL;
+  exp_t res;
+  sb s;
+  int failed = 0;
+
+  sb_new(&s);
+  for (int i = 0; i < 4; i++) {
+    sb_reset(&s);
+    sb_add_string(&s, conds[i]);
+    long long before = count_allocations();
+    for (int j = 0; j < 1000; j++)
+      if (!istrue(ctx, 0, &s)) {
+        fprintf(stderr, "condition %s is false\n", conds[i]);
+        failed = 1;
+        break;
+      }
+    if (count_allocations() != before) {
+      fprintf(stderr, "condition %s made %lld allocations\n", conds[i],
+              count_allocations() - before);
+      failed = 1;
+    }
+  }
+
+  sb_reset(&s);
+  sb_add_string(&s, "4294967296*2");
+  exp_get_abs(ctx, "not constant", 0, &s, &value);
+  if (value != 8589934592LL) {
+    fprintf(stderr, "4294967296*2 gave %lld\n", value);
+    failed = 1;
+  }
+  sb_reset(&s);
+  sb_add_string(&s, "1.5*2.0");
+  long long before = count_allocations();
+  for (int j = 0; j < 1000; j++)
+    exp_parse(ctx, 0, &s, &res);
+  if (count_allocations() != before || res.type != exp_t_double ||
+      res.d_value != 3.0) {
+    fprintf(stderr, "1.5*2.0 gave %g, making %lld allocations\n", res.d_value,
+            count_allocations() - before);
+    failed = 1;
+  }
+  sb_kill(&s);
+
+  if (masp_preprocess_buffer(ctx, "big.s", text, strlen(text),
+                             &out, NULL, NULL, NULL) != 0 ||
+      strcmp(out, "\tbig 3000000000\n\tabove\n") != 0) {
+    fprintf(stderr, ".ASSIGNA 3000000000 gave\n%s\n", out ? out : "");
+    failed = 1;
+  }
+  free(out);
+  masp_free(ctx);
+  return failed;
+}
+
+// --profile counts each directive and macro, and the output is the
+// same as without it.
+static int run_profile(void) {
+  const char *text =
+    "\t.macro twice x\n"
+    "\tadd \\x, \\x\n"
+    "\t.endm\n"
+    "N\t.ASSIGNA 1\n"
+    "\ttwice r1\n"
+    "\ttwice r2\n"
+    "\t.END\n";
+  masp_options opts;
+  char *out = NULL, *diag = NULL, *report = NULL;
+  size_t len;
+  mem_stream m;
+  int failed = 0;
+
+  masp_options_init(&opts);
+  opts.profile = 1;
+  masp_context *ctx = masp_new(&opts);
+  if (masp_preprocess_buffer(ctx, "profile.s", text, strlen(text),
+                             &out, NULL, &diag, NULL) != 0 ||
+      strcmp(out, "\tadd r1, r1\n\tadd r2, r2\n") != 0 ||
+      !mem_stream_open(&m)) {
+    fprintf(stderr, "profiled run gave\n%s\n%s", out ? out : "",
+            diag ? diag : "");
+    failed = 1;
+  } else {
+    profile_report(ctx->profile, m.file);
+    mem_stream_close(&m, &report, &len);
+    if (!strstr(report, "include depth 2\n") ||
+        !strstr(report, "\nMACRO                             1 ") ||
+        !strstr(report, "\nASSIGNA                           1 ") ||
+        !strstr(report, "\ntwice                             2 ") ||
+        !strstr(report, "          24       12.0\n") ||
+        !strstr(report, "\nget_line                          9 ")) {
+      fprintf(stderr, "profile report was\n%s", report);
+      failed = 1;
+    }
+  }
+  free(report);
+  free(out);
+  free(diag);
+  masp_free(ctx);
+  return failed;
+}
+
+static int count_in(const char *s, const char *what) {
+  int n = 0;
+  while ((s = strstr(s, what)) != NULL) {
+    n++;
+    s += strlen(what);
+  }
+  return n;
+}
+
+// --trace records a span for each file, macro, AREPEAT and conditional,
+// every one of them ended, and a full buffer leaves out whole spans.
+static int run_trace(void) {
+  const char *text =
+    "\t.macro twice x\n"
+    "\tadd \\x, \\x\n"
+    "\t.endm\n"
+    "N\t.ASSIGNA 1\n"
+    "\t.AIF \\&N EQ 1\n"
+    "\ttwice r1\n"
+    "\t.AELSE\n"
+    "\tnop\n"
+    "\t.AENDI\n"
+    "\t.AREPEAT 2\n"
+    "\ttwice r2\n"
+    "\t.AENDR\n"
+    "\t.END\n";
+  masp_options opts;
+  char *out = NULL, *diag = NULL, *json = NULL;
+  size_t len;
+  mem_stream m;
+  trace *t;
+  int failed = 0;
+
+  masp_options_init(&opts);
+  opts.trace = 1;
+  masp_context *ctx = masp_new(&opts);
+  if (masp_preprocess_buffer(ctx, "trace.s", text, strlen(text),
+                             &out, NULL, &diag, NULL) != 0 ||
+      strcmp(out, "\tadd r1, r1\n\tadd r2, r2\n\tadd r2, r2\n") != 0 ||
+      !mem_stream_open(&m)) {
+    fprintf(stderr, "traced run gave\n%s\n%s", out ? out : "",
+            diag ? diag : "");
+    failed = 1;
+  } else {
+    trace_write(ctx->trace, m.file);
+    mem_stream_close(&m, &json, &len);
+    if (count_in(json, "\"ph\": \"B\"") != 8 ||
+        count_in(json, "\"ph\": \"E\"") != 8 ||
+        count_in(json, "\"tid\": 2}") != 2 ||
+        count_in(json, "{\"name\": \"twice\", \"cat\": \"macro\"") != 3 ||
+        !strstr(json, "{\"name\": \"trace.s\", \"cat\": \"file\"") ||
+        !strstr(json, "{\"name\": \"AREPEAT 2\", \"cat\": \"repeat\"") ||
+        !strstr(json, "{\"name\": \"AREPEAT 1\", \"cat\": \"repeat\"") ||
+        !strstr(json, "{\"name\": \"AIF\", \"cat\": \"conditional\", "
+                "\"ph\": \"B\"") ||
+        !strstr(json, "\"args\": {\"file\": \"trace.s\", \"line\": 7}}") ||
+        !strstr(json, "\"otherData\": {\"dropped\": 0}}\n")) {
+      fprintf(stderr, "trace was\n%s", json);
+      failed = 1;
+    }
+  }
+  free(json);
+  free(out);
+  free(diag);
+  masp_free(ctx);
+
+  // Room for two spans and their ends: the third, inside them, is
+  // left out, and its end with it.
+  t = trace_new(4);
+  trace_begin(t, TRACE_INCLUDES, "file", "a", 1, NULL, 0);
+  trace_begin(t, TRACE_INCLUDES, "macro", "b", 1, "a", 2);
+  trace_begin(t, TRACE_INCLUDES, "macro", "c", 1, "a", 3);
+  trace_end(t, TRACE_INCLUDES);
+  trace_end(t, TRACE_INCLUDES);
+  json = NULL;
+  if (!mem_stream_open(&m)) {
+    failed = 1;
+  } else {
+    trace_write(t, m.file);
+    mem_stream_close(&m, &json, &len);
+    if (trace_dropped(t) != 1 ||
+        count_in(json, "\"ph\": \"B\"") != 2 ||
+        count_in(json, "\"ph\": \"E\"") != 2 ||
+        strstr(json, "\"c\"")) {
+      fprintf(stderr, "full trace was\n%s", json);
+      failed = 1;
+    }
+  }
+  free(json);
+  trace_free(t);
+  return failed;
+}
+
+// Memory accounting: a macro's entries and its formals' hash table are
+// counted while they live and given back with the context, and long
+// lines count the copies made growing their sbs.
+static int run_memory(void) {
+  const char *text =
+    "\t.macro pair a, b\n"
+    "\tadd \\a, \\b\n"
+    "\t.endm\n"
+    "\tpair r1, r2\n"
+    "; a comment long enough to outgrow the first block of its sb, and "
+    "then the next one as well\n"
+    "\t.END\n";
+  masp_options opts;
+  mem_stats before = *mem_stats_get();
+  char *out = NULL, *diag = NULL, *json = NULL;
+  size_t len;
+  mem_stream m;
+  int failed = 0;
+
+  masp_options_init(&opts);
+  masp_context *ctx = masp_new(&opts);
+  if (masp_preprocess_buffer(ctx, "memory.s", text, strlen(text),
+                             &out, NULL, &diag, NULL) != 0 ||
+      !mem_stream_open(&m)) {
+    fprintf(stderr, "memory run gave\n%s\n%s", out ? out : "",
+            diag ? diag : "");
+    failed = 1;
+  } else {
+    const mem_stats *now = mem_stats_get();
+    memory_report(ctx, m.file, 1);
+    mem_stream_close(&m, &json, &len);
+    // The macro and its two formals.
+    if (now->kind[MEM_MACRO].live - before.kind[MEM_MACRO].live !=
+            (long long)(sizeof(macro_entry) + 2 * sizeof(formal_entry)) ||
+        now->kind[MEM_HASH].live <= before.kind[MEM_HASH].live ||
+        now->kind[MEM_SB].peak < now->kind[MEM_SB].live ||
+        now->total.live != now->kind[MEM_SB].live +
+            now->kind[MEM_HASH].live + now->kind[MEM_MACRO].live ||
+        now->sb_grows == before.sb_grows ||
+        now->sb_grow_bytes == before.sb_grow_bytes ||
+        !strstr(json, "{\"memory\": {\n  \"other\": {\"allocs\": ") ||
+        !strstr(json, "\n  \"macro\": {\"allocs\": 3, \"bytes\": ") ||
+        !strstr(json, "\n \"sb_growth\": {\"copies\": ")) {
+      fprintf(stderr, "memory report was\n%s", json);
+      failed = 1;
+    }
+  }
+  free(json);
+  free(out);
+  free(diag);
+  masp_free(ctx);
+
+  if (mem_stats_get()->kind[MEM_MACRO].live != before.kind[MEM_MACRO].live ||
+      mem_stats_get()->kind[MEM_HASH].live != before.kind[MEM_HASH].live ||
+      mem_stats_get()->kind[MEM_SB].live != before.kind[MEM_SB].live) {
+    fprintf(stderr, "memory still live after masp_free: %lld %lld %lld\n",
+            mem_stats_get()->kind[MEM_MACRO].live - before.kind[MEM_MACRO].live,
+            mem_stats_get()->kind[MEM_HASH].live - before.kind[MEM_HASH].live,
+            mem_stats_get()->kind[MEM_SB].live - before.kind[MEM_SB].live);
+    failed = 1;
+  }
+  return failed;
+}
+
+// --prefetch: includes nested two deep come out just as they do
+// without it.
+static int run_prefetch(void) {
+#if defined(__unix__)
+  char masp_path[1024];
+  char dir_path[1024];
+  char outer_path[1024];
+  char inner_path[1024];
+  char main_path[1024];
+  char plain_path[1024];
+  char out_path[1024];
+  int failed = 0;
+
+  snprintf(masp_path, sizeof(masp_path), "%s/src/masp", BUILD_DIR);
+  snprintf(dir_path, sizeof(dir_path), "%s/test_outputs", BUILD_DIR);
+  snprintf(outer_path, sizeof(outer_path), "%s/pf_outer.i", dir_path);
+  snprintf(inner_path, sizeof(inner_path), "%s/pf_inner.i", dir_path);
+  snprintf(main_path, sizeof(main_path), "%s/pf_main.s", dir_path);
+  snprintf(plain_path, sizeof(plain_path), "%s/pf_plain.out", dir_path);
+  snprintf(out_path, sizeof(out_path), "%s/pf_main.out", dir_path);
+
+  if (write_text_file(inner_path, "\t.macro twice x\n\tadd \\x, \\x\n\t.endm\n") != 0 ||
+      write_text_file(outer_path, "\t.include \"pf_inner.i\"\n\touter\n") != 0 ||
+      write_text_file(main_path,
+                      "\t.include \"pf_outer.i\"\n\ttwice r1\n"
+                      "\t.include \"pf_inner.i\"\n\ttwice r2\n") != 0)
+    return 1;
+
+  {
+    const char *argvp[] = { masp_path, "-I", dir_path, "-o", plain_path,
+                            "--", main_path, NULL };
+    if (spawn_masp_wait(argvp) != 0) {
+      fprintf(stderr, "masp failed without --prefetch\n");
+      return 1;
+    }
+  }
+  {
+    const char *argvp[] = { masp_path, "--prefetch=2", "-I", dir_path, "-o", out_path,
+                            "--", main_path, NULL };
+    remove(out_path);
+    if (spawn_masp_wait(argvp) != 0 || !files_equal(plain_path, out_path)) {
+      fprintf(stderr, "masp --prefetch output differs\n");
+      print_diff_snippet(plain_path, out_path);
+      failed++;
+    }
+  }
+  return failed ? 1 : 0;
+#else
+  return 0;
+#endif
+}
+
 static int run_basic_suite(void) {
   int failed = 0;
   // Ensure output dir exists
@@ -358,6 +1496,22 @@ int main(void) {
   int failures = 0;
   failures += run_vu1Triangle();
   failures += run_basic_suite();
+  failures += run_jobs();
+  failures += run_server();
+  failures += run_pipeline();
+  failures += run_snapshot();
+  failures += run_fork_server();
+  failures += run_variant();
+  failures += run_cache_dir();
+  failures += run_deps();
+  failures += run_include_lookups();
+  failures += run_include_guard();
+  failures += run_prefetch();
+  failures += run_compiled_conditions();
+  failures += run_eval_allocations();
+  failures += run_profile();
+  failures += run_trace();
+  failures += run_memory();
   if (failures) {
     fprintf(stderr, "Unit tests failed: %d\n", failures);
     return 1;
@@ -15,18 +15,18 @@
  *   - sb_strtol(idx, sb, base, *out) -> end-index, value via out
  *
  * The functions are file-static in src/masp.c, so we include the
- * source file directly (with main renamed) to reach them — same
- * trick the existing test_masp_cli.c uses.
+ * source file directly to reach them — same trick the existing
+ * test_masp_cli.c uses.  They run against one context, made with
+ * the default options in main().
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-/* Avoid colliding with masp's main when masp.c is #included. */
-#define main masp_program_main
 #include "../../src/masp.c"
-#undef main
+
+static masp_context *test_ctx;
 
 #define CHECK(cond) do { \
     if (!(cond)) { \
@@ -96,7 +96,7 @@ static int test_is_base_unknown_returns_zero(void) {
 /* --- sb_strtol ------------------------------------------------------ */
 
 static int test_sb_strtol_decimal(void) {
-  sb s; int val = -1;
+  sb s; long long val = -1;
   make_sb(&s, "12345");
   int end = sb_strtol(0, &s, 10, &val);
   CHECK_EQ_INT(val, 12345);
@@ -106,7 +106,7 @@ static int test_sb_strtol_decimal(void) {
 }
 
 static int test_sb_strtol_binary(void) {
-  sb s; int val = -1;
+  sb s; long long val = -1;
   make_sb(&s, "1010");
   int end = sb_strtol(0, &s, 2, &val);
   CHECK_EQ_INT(val, 10);
@@ -116,7 +116,7 @@ static int test_sb_strtol_binary(void) {
 }
 
 static int test_sb_strtol_octal(void) {
-  sb s; int val = -1;
+  sb s; long long val = -1;
   make_sb(&s, "17");
   int end = sb_strtol(0, &s, 8, &val);
   CHECK_EQ_INT(val, 15);
@@ -126,7 +126,7 @@ static int test_sb_strtol_octal(void) {
 }
 
 static int test_sb_strtol_hex_lower_and_upper(void) {
-  sb s; int val;
+  sb s; long long val;
   make_sb(&s, "ff");
   CHECK_EQ_INT(sb_strtol(0, &s, 16, &val), 2);
   CHECK_EQ_INT(val, 255);
@@ -145,7 +145,7 @@ static int test_sb_strtol_hex_lower_and_upper(void) {
 }
 
 static int test_sb_strtol_stops_at_first_non_digit(void) {
-  sb s; int val;
+  sb s; long long val;
   make_sb(&s, "12xy");
   CHECK_EQ_INT(sb_strtol(0, &s, 10, &val), 2);
   CHECK_EQ_INT(val, 12);
@@ -155,7 +155,7 @@ static int test_sb_strtol_stops_at_first_non_digit(void) {
 
 static int test_sb_strtol_stops_at_digit_outside_base(void) {
   /* '2' is invalid in base 2; strtol should stop there.  */
-  sb s; int val;
+  sb s; long long val;
   make_sb(&s, "112");
   CHECK_EQ_INT(sb_strtol(0, &s, 2, &val), 2);
   CHECK_EQ_INT(val, 3);
@@ -164,7 +164,7 @@ static int test_sb_strtol_stops_at_digit_outside_base(void) {
 }
 
 static int test_sb_strtol_skips_leading_whitespace(void) {
-  sb s; int val;
+  sb s; long long val;
   make_sb(&s, "   42rest");
   CHECK_EQ_INT(sb_strtol(0, &s, 10, &val), 5);
   CHECK_EQ_INT(val, 42);
@@ -173,7 +173,7 @@ static int test_sb_strtol_skips_leading_whitespace(void) {
 }
 
 static int test_sb_strtol_starting_at_offset(void) {
-  sb s; int val;
+  sb s; long long val;
   make_sb(&s, "prefix99tail");
   /* Caller is responsible for moving past non-digit content; here we
      just pretend they did and pass idx=6.  */
@@ -189,7 +189,7 @@ static int run_change_base2(const char *input, const char *expected) {
   sb in, out;
   make_sb(&in, input);
   sb_new(&out);
-  change_base2(0, &in, &out);
+  change_base2(test_ctx, 0, &in, &out);
   /* sb_as_cstr() mutates by NUL-terminating; use a local check. */
   const char *got = sb_terminate(&out);
   int ok = strcmp(got, expected) == 0;
@@ -258,7 +258,7 @@ static int run_change_base(const char *input, const char *expected) {
   sb in, out;
   make_sb(&in, input);
   sb_new(&out);
-  change_base(0, &in, &out);
+  change_base(test_ctx, 0, &in, &out);
   const char *got = sb_terminate(&out);
   int ok = strcmp(got, expected) == 0;
   if (!ok)
@@ -344,6 +344,7 @@ static const struct test_case cases[] = {
 int main(void) {
   int n = (int)(sizeof cases / sizeof cases[0]);
   int failed = 0;
+  test_ctx = masp_new(NULL);
   for (int i = 0; i < n; i++) {
     int rc = cases[i].fn();
     if (rc != 0) {
@@ -354,5 +355,6 @@ int main(void) {
     }
   }
   fprintf(stdout, "\n%d/%d tests passed\n", n - failed, n);
+  masp_free(test_ctx);
   return failed == 0 ? 0 : 1;
 }
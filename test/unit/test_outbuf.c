@@ -0,0 +1,242 @@
+/* Unit tests for src/outbuf.c — the block buffer the preprocessed text
+ * is gathered in before it is written.
+ *
+ * Linkage: outbuf.c + pipeline.c + ring.c + compat.c, so the writer
+ * thread path is covered where there are pthreads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "config.h"
+#include "compat.h"
+#include "outbuf.h"
+#include "pipeline.h"
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      return 1; \
+    } \
+  } while (0)
+
+#define CHECK_EQ_INT(a, b) do { \
+    long _a = (long)(a), _b = (long)(b); \
+    if (_a != _b) { \
+      fprintf(stderr, "  FAIL %s:%d: %s == %s  (got %ld vs %ld)\n", \
+              __FILE__, __LINE__, #a, #b, _a, _b); \
+      return 1; \
+    } \
+  } while (0)
+
+#define CHECK_EQ_STR(a, b) do { \
+    if (strcmp((a), (b)) != 0) { \
+      fprintf(stderr, "  FAIL %s:%d: \"%s\" != \"%s\"\n", \
+              __FILE__, __LINE__, (a), (b)); \
+      return 1; \
+    } \
+  } while (0)
+
+/* Everything written to F so far, NUL terminated.  */
+static char *slurp(FILE *f, long *len) {
+  char *buf;
+  fflush(f);
+  fseek(f, 0, SEEK_END);
+  *len = ftell(f);
+  rewind(f);
+  buf = (char *)malloc(*len + 1);
+  if (fread(buf, 1, *len, f) != (size_t)*len)
+    *len = -1;
+  buf[*len < 0 ? 0 : *len] = 0;
+  return buf;
+}
+
+/* A pattern long enough to fill several blocks.  */
+static void pattern(char *buf, long n) {
+  long i;
+  for (i = 0; i < n; i++)
+    buf[i] = 'a' + (char)(i % 23);
+}
+
+/* --- formatting ----------------------------------------------------- */
+
+static int test_ints(void) {
+  FILE *f = tmpfile();
+  outbuf out;
+  char *got;
+  long len;
+  CHECK(f != NULL);
+  outbuf_init(&out, f);
+  CHECK_EQ_INT(out_add_int(&out, 0, 0), 1);
+  out_add_char(&out, ' ');
+  CHECK_EQ_INT(out_add_int(&out, -42, 0), 3);
+  out_add_char(&out, ' ');
+  out_add_int(&out, INT_MAX, 0);
+  out_add_char(&out, ' ');
+  out_add_int(&out, INT_MIN, 0);
+  out_add_char(&out, '|');
+  CHECK_EQ_INT(out_add_int(&out, 7, 4), 4);
+  out_add_char(&out, '|');
+  CHECK_EQ_INT(out_add_int(&out, 12345, 4), 5);
+  CHECK(outbuf_flush(&out));
+  got = slurp(f, &len);
+  CHECK_EQ_STR(got, "0 -42 2147483647 -2147483648|   7|12345");
+  free(got);
+  outbuf_free(&out);
+  fclose(f);
+  return 0;
+}
+
+static int test_sb_and_bytes(void) {
+  FILE *f = tmpfile();
+  outbuf out;
+  sb s;
+  char *got;
+  long len;
+  CHECK(f != NULL);
+  outbuf_init(&out, f);
+  sb_new(&s);
+  sb_add_string(&s, "AB\tC");
+  out_add_sb(&out, &s);
+  out_add_char(&out, '/');
+  out_add_sb_at(&out, 3, &s);
+  out_add_sb_at(&out, 9, &s);
+  out_add_char(&out, '/');
+  out_add_bytes(&out, &s);
+  outbuf_free(&out);
+  got = slurp(f, &len);
+  CHECK_EQ_STR(got, "AB\tC/C/65,66,9,67");
+  free(got);
+  sb_kill(&s);
+  fclose(f);
+  return 0;
+}
+
+/* --- blocks --------------------------------------------------------- */
+
+static int test_crosses_blocks(void) {
+  long n = 3 * OUTBUF_SIZE + 17;
+  char *want = (char *)malloc(n);
+  FILE *f = tmpfile();
+  outbuf out;
+  char *got;
+  long len, i;
+  CHECK(f != NULL);
+  pattern(want, n);
+  outbuf_init(&out, f);
+  /* A character at a time, then in spans that straddle the blocks.  */
+  for (i = 0; i < OUTBUF_SIZE + 5; i++)
+    out_add_char(&out, want[i]);
+  out_add_buffer(&out, want + i, n - i);
+  CHECK(outbuf_flush(&out));
+  got = slurp(f, &len);
+  CHECK_EQ_INT(len, n);
+  CHECK(memcmp(got, want, n) == 0);
+  free(got);
+  free(want);
+  outbuf_free(&out);
+  fclose(f);
+  return 0;
+}
+
+/* What the caller printed to the FILE itself comes out first.  */
+static int test_file_prints_first(void) {
+  FILE *f = tmpfile();
+  outbuf out;
+  char *got;
+  long len;
+  CHECK(f != NULL);
+  outbuf_init(&out, f);
+  fprintf(f, "head ");
+  out_add_string(&out, "body");
+  CHECK(outbuf_flush(&out));
+  fprintf(f, " tail");
+  got = slurp(f, &len);
+  CHECK_EQ_STR(got, "head body tail");
+  free(got);
+  outbuf_free(&out);
+  fclose(f);
+  return 0;
+}
+
+/* A stream with no descriptor is written with fwrite.  */
+static int test_memory_stream(void) {
+  mem_stream m;
+  outbuf out;
+  char *got;
+  size_t len;
+  CHECK(mem_stream_open(&m));
+  outbuf_init(&out, m.file);
+  out_add_string(&out, "in memory\n");
+  outbuf_set_file(&out, stdout);
+  mem_stream_close(&m, &got, &len);
+  CHECK_EQ_STR(got, "in memory\n");
+  free(got);
+  outbuf_free(&out);
+  return 0;
+}
+
+static int test_pipe_writer(void) {
+#ifdef HAVE_PTHREAD
+  long n = 5 * PIPE_BLOCK_SIZE + 123;
+  char *want = (char *)malloc(n);
+  FILE *f = tmpfile();
+  pipe_writer *w;
+  outbuf out;
+  char *got;
+  long len;
+  CHECK(f != NULL);
+  pattern(want, n);
+  outbuf_init(&out, f);
+  out_add_string(&out, "before ");
+  w = pipe_writer_open(f);
+  CHECK(w != NULL);
+  outbuf_set_pipe(&out, w);
+  out_add_buffer(&out, want, n);
+  outbuf_set_pipe(&out, NULL);
+  CHECK(pipe_writer_close(w));
+  out_add_string(&out, " after");
+  CHECK(outbuf_flush(&out));
+  got = slurp(f, &len);
+  CHECK_EQ_INT(len, n + 13);
+  CHECK(memcmp(got, "before ", 7) == 0);
+  CHECK(memcmp(got + 7, want, n) == 0);
+  CHECK(memcmp(got + 7 + n, " after", 6) == 0);
+  free(got);
+  free(want);
+  outbuf_free(&out);
+  fclose(f);
+#endif
+  return 0;
+}
+
+/* --- driver --------------------------------------------------------- */
+
+struct test_case { const char *name; int (*fn)(void); };
+
+static const struct test_case cases[] = {
+  { "ints",                           test_ints },
+  { "sb_and_bytes",                   test_sb_and_bytes },
+  { "crosses_blocks",                 test_crosses_blocks },
+  { "file_prints_first",              test_file_prints_first },
+  { "memory_stream",                  test_memory_stream },
+  { "pipe_writer",                    test_pipe_writer },
+};
+
+int main(void) {
+  int n = (int)(sizeof cases / sizeof cases[0]);
+  int failed = 0;
+  for (int i = 0; i < n; i++) {
+    int rc = cases[i].fn();
+    if (rc != 0) {
+      fprintf(stderr, "FAIL  %s\n", cases[i].name);
+      failed++;
+    } else {
+      fprintf(stdout, "ok    %s\n", cases[i].name);
+    }
+  }
+  fprintf(stdout, "\n%d/%d tests passed\n", n - failed, n);
+  return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,171 @@
+/* Unit tests for src/ring.c — the single producer, single consumer
+ * queue the --pipeline stages hand blocks through.
+ *
+ * Linkage: ring.c + compat.c (for xmalloc).  Built only where there
+ * are pthreads, as ring.c is.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "ring.h"
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      return 1; \
+    } \
+  } while (0)
+
+#define CHECK_EQ_LONG(a, b) do { \
+    long _a = (long)(a), _b = (long)(b); \
+    if (_a != _b) { \
+      fprintf(stderr, "  FAIL %s:%d: %s == %ld, expected %ld\n", \
+              __FILE__, __LINE__, #a, _a, _b); \
+      return 1; \
+    } \
+  } while (0)
+
+/* --- single thread -------------------------------------------------- */
+
+static int test_size_rounds_up(void) {
+  spsc_ring r;
+  ring_init(&r, 5);
+  CHECK_EQ_LONG(r.size, 8);
+  ring_destroy(&r);
+  ring_init(&r, 8);
+  CHECK_EQ_LONG(r.size, 8);
+  ring_destroy(&r);
+  return 0;
+}
+
+static int test_fifo_order(void) {
+  spsc_ring r;
+  long i;
+  ring_init(&r, 4);
+  /* Go round the ring several times so the indices wrap.  */
+  for (i = 0; i < 20; i++) {
+    ring_push(&r, (void *)(i + 1));
+    ring_push(&r, (void *)(i + 100));
+    CHECK_EQ_LONG(ring_pop(&r), i + 1);
+    CHECK_EQ_LONG(ring_pop(&r), i + 100);
+  }
+  ring_destroy(&r);
+  return 0;
+}
+
+static int test_fills_to_size(void) {
+  spsc_ring r;
+  long i;
+  ring_init(&r, 4);
+  for (i = 0; i < 4; i++)
+    ring_push(&r, (void *)(i + 1));
+  for (i = 0; i < 4; i++)
+    CHECK_EQ_LONG(ring_pop(&r), i + 1);
+  ring_destroy(&r);
+  return 0;
+}
+
+/* --- two threads ---------------------------------------------------- */
+
+#define ITEMS 200000
+
+static void *producer(void *arg) {
+  spsc_ring *r = (spsc_ring *)arg;
+  long i;
+  for (i = 1; i <= ITEMS; i++)
+    ring_push(r, (void *)i);
+  return NULL;
+}
+
+/* A small ring between two threads keeps both sides waiting on each
+ * other; every item must still arrive once and in order.  */
+static int test_threads_keep_order(void) {
+  spsc_ring r;
+  pthread_t t;
+  long i;
+  ring_init(&r, 2);
+  CHECK(pthread_create(&t, NULL, producer, &r) == 0);
+  for (i = 1; i <= ITEMS; i++) {
+    long got = (long)ring_pop(&r);
+    if (got != i) {
+      pthread_join(t, NULL);
+      CHECK_EQ_LONG(got, i);
+    }
+  }
+  pthread_join(t, NULL);
+  ring_destroy(&r);
+  return 0;
+}
+
+/* Blocks passed forward on one ring and back on another, the way the
+ * pipeline stages recycle their buffers.  */
+
+struct relay { spsc_ring forward, back; };
+
+static void *echo(void *arg) {
+  struct relay *rl = (struct relay *)arg;
+  for (;;) {
+    long *p = (long *)ring_pop(&rl->forward);
+    if (!p)
+      break;
+    *p += 1;
+    ring_push(&rl->back, p);
+  }
+  return NULL;
+}
+
+static int test_round_trip(void) {
+  struct relay rl;
+  long cells[3] = { 0, 0, 0 };
+  pthread_t t;
+  int i;
+  ring_init(&rl.forward, 4);
+  ring_init(&rl.back, 4);
+  CHECK(pthread_create(&t, NULL, echo, &rl) == 0);
+  for (i = 0; i < 3; i++)
+    ring_push(&rl.forward, &cells[i]);
+  for (i = 0; i < 3000; i++) {
+    long *p = (long *)ring_pop(&rl.back);
+    ring_push(&rl.forward, p);
+  }
+  for (i = 0; i < 3; i++)
+    ring_pop(&rl.back);
+  ring_push(&rl.forward, NULL);
+  pthread_join(t, NULL);
+  CHECK_EQ_LONG(cells[0] + cells[1] + cells[2], 3003);
+  ring_destroy(&rl.forward);
+  ring_destroy(&rl.back);
+  return 0;
+}
+
+/* --- driver --------------------------------------------------------- */
+
+struct test_case { const char *name; int (*fn)(void); };
+
+static const struct test_case cases[] = {
+  { "size_rounds_up",                 test_size_rounds_up },
+  { "fifo_order",                     test_fifo_order },
+  { "fills_to_size",                  test_fills_to_size },
+  { "threads_keep_order",             test_threads_keep_order },
+  { "round_trip",                     test_round_trip },
+};
+
+int main(void) {
+  int n = (int)(sizeof cases / sizeof cases[0]);
+  int failed = 0;
+  for (int i = 0; i < n; i++) {
+    int rc = cases[i].fn();
+    if (rc != 0) {
+      fprintf(stderr, "FAIL  %s\n", cases[i].name);
+      failed++;
+    } else {
+      fprintf(stdout, "ok    %s\n", cases[i].name);
+    }
+  }
+  fprintf(stdout, "\n%d/%d tests passed\n", n - failed, n);
+  return failed == 0 ? 0 : 1;
+}
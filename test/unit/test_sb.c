@@ -279,6 +279,126 @@ static int test_eat_literal_not_a_string_is_a_noop(void) {
   return 0;
 }
 
+/* --- span appends -------------------------------------------------- */
+
+static int test_add_char_fast_grows_when_full(void) {
+  sb s;
+  sb_new(&s);                 /* capacity 32 */
+  for (int i = 0; i < 100; i++)
+    sb_add_char_fast(&s, (char)('a' + (i % 26)));
+  CHECK_EQ_INT(s.len, 100);
+  CHECK(s.pot >= 7);
+  CHECK_EQ_INT(s.ptr[0],  'a');
+  CHECK_EQ_INT(s.ptr[99], 'a' + (99 % 26));
+  sb_kill(&s);
+  return 0;
+}
+
+static int test_add_until_stops_at_delim(void) {
+  sb in, out;
+  sb_new(&in);
+  sb_new(&out);
+  sb_add_string(&in, "xab)cd");
+  int idx = sb_add_until(&out, 1, &in, ')');
+  CHECK_EQ_INT(idx, 3);
+  CHECK_EQ_INT(out.len, 2);
+  CHECK_EQ_MEM(out.ptr, "ab", 2);
+  sb_kill(&in);
+  sb_kill(&out);
+  return 0;
+}
+
+static int test_add_until_runs_to_end_without_delim(void) {
+  sb in, out;
+  sb_new(&in);
+  sb_new(&out);
+  sb_add_string(&in, "no close paren here, and long enough to grow");
+  int idx = sb_add_until(&out, 0, &in, ')');
+  CHECK_EQ_INT(idx, in.len);
+  CHECK_EQ_INT(out.len, in.len);
+  CHECK_EQ_MEM(out.ptr, in.ptr, in.len);
+  sb_kill(&in);
+  sb_kill(&out);
+  return 0;
+}
+
+static int test_add_until_any_stops_at_first_of_set(void) {
+  sb in, out;
+  const char data[] = { 'a', 0, 'b', '&', 'c', '\\' };
+  sb_new(&in);
+  sb_new(&out);
+  sb_add_buffer(&in, data, sizeof data);
+  /* embedded NUL is copied, never treated as a stop */
+  int idx = sb_add_until_any(&out, 0, &in, "\\&");
+  CHECK_EQ_INT(idx, 3);
+  CHECK_EQ_INT(out.len, 3);
+  CHECK_EQ_MEM(out.ptr, data, 3);
+  /* starting on a stop copies nothing */
+  CHECK_EQ_INT(sb_add_until_any(&out, idx, &in, "\\&"), idx);
+  CHECK_EQ_INT(out.len, 3);
+  sb_kill(&in);
+  sb_kill(&out);
+  return 0;
+}
+
+static int test_add_class_run(void) {
+  sb in, out;
+  char classes[256];
+  memset(classes, 0, sizeof classes);
+  for (int c = '0'; c <= '9'; c++) classes[c] = 1;
+  classes['_'] = 2;
+  sb_new(&in);
+  sb_new(&out);
+  sb_add_string(&in, "12_3x45");
+  CHECK_EQ_INT(sb_add_class_run(&out, 0, &in, classes, 1), 2);
+  CHECK_EQ_MEM(out.ptr, "12", 2);
+  sb_reset(&out);
+  CHECK_EQ_INT(sb_add_class_run(&out, 0, &in, classes, 1 | 2), 4);
+  CHECK_EQ_INT(out.len, 4);
+  CHECK_EQ_MEM(out.ptr, "12_3", 4);
+  sb_kill(&in);
+  sb_kill(&out);
+  return 0;
+}
+
+static int test_text_adopt_takes_storage(void) {
+  sb in;
+  sb_new(&in);
+  sb_add_string(&in, "body\n");
+  char *storage = in.ptr;
+  sb_text *t = sb_text_adopt(&in);
+  CHECK(t->ptr == storage);
+  CHECK_EQ_INT(t->len, 5);
+  CHECK_EQ_INT(t->refs, 1);
+  CHECK(in.ptr == NULL);
+  CHECK(sb_text_ref(t) == t);
+  CHECK_EQ_INT(t->refs, 2);
+  sb_text_unref(t);
+  CHECK_EQ_MEM(t->ptr, "body\n", 5);
+  sb_text_unref(t);
+  return 0;
+}
+
+static int test_text_string(void) {
+  sb_text *t = sb_text_string("\t.AENDR\n");
+  CHECK_EQ_INT(t->len, 8);
+  CHECK_EQ_MEM(t->ptr, "\t.AENDR\n", 8);
+  sb_text_unref(t);
+  return 0;
+}
+
+static int test_text_pinned_is_not_counted(void) {
+  sb_text *t = sb_text_string("shared\n");
+  sb_text_pin(t);
+  CHECK(sb_text_ref(t) == t);
+  CHECK_EQ_INT(t->refs, -1);
+  sb_text_unref(t);
+  sb_text_unref(t);
+  CHECK_EQ_MEM(t->ptr, "shared\n", 7);
+  sb_text_free_pinned(t);
+  return 0;
+}
+
 /* --- driver --------------------------------------------------------- */
 
 struct test_case { const char *name; int (*fn)(void); };
@@ -302,6 +422,14 @@ static const struct test_case cases[] = {
   { "eat_literal_single_quote",                    test_eat_literal_single_quote },
   { "eat_literal_escape_inside_string",            test_eat_literal_escape_inside_string },
   { "eat_literal_not_a_string_is_a_noop",          test_eat_literal_not_a_string_is_a_noop },
+  { "add_char_fast_grows_when_full",               test_add_char_fast_grows_when_full },
+  { "add_until_stops_at_delim",                    test_add_until_stops_at_delim },
+  { "add_until_runs_to_end_without_delim",         test_add_until_runs_to_end_without_delim },
+  { "add_until_any_stops_at_first_of_set",         test_add_until_any_stops_at_first_of_set },
+  { "add_class_run",                               test_add_class_run },
+  { "text_adopt_takes_storage",                    test_text_adopt_takes_storage },
+  { "text_string",                                 test_text_string },
+  { "text_pinned_is_not_counted",                  test_text_pinned_is_not_counted },
 };
 
 int main(void) {
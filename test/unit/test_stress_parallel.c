@@ -5,6 +5,8 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <time.h>
 
 #ifndef SRC_DIR
@@ -16,8 +18,23 @@
 
 // Test masp stability under repeated execution
 // This reproduces the crash observed in ps2gl builds
+//
+// A second phase then runs masp the way a parallel make does: up to
+// --procs processes at once (the core count by default), --rounds
+// times over each ps2gl file.  Every output must match what the
+// sequential phase wrote for that file.  It reports files per second
+// altogether, the wall time of each process at the median and the
+// 99th percentile against the same in the sequential phase, which
+// shows what running side by side costs, and the largest peak RSS of
+// any one process.
 
-static int run_masp_once(const char *masp_path, const char *input, const char *output, const char *include_path) {
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static pid_t spawn_masp(const char *masp_path, const char *input, const char *output, const char *include_path) {
     pid_t pid = fork();
     if (pid == 0) {
         // Child process
@@ -25,30 +42,201 @@ static int run_masp_once(const char *masp_path, const char *input, const char *o
         const char *argv[] = { masp_path, "-p", "-s", "-c", ";", "-I", include_path, "-o", output, "--", input, NULL };
         execv(masp_path, (char* const*)argv);
         _exit(127);
-    } else if (pid > 0) {
+    }
+    if (pid < 0)
+        perror("fork");
+    return pid;
+}
+
+// Turn a wait status into an exit code, 128 + signal for a crash
+static int exit_code(int status, const char *input) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        int sig = WTERMSIG(status);
+        fprintf(stderr, "masp terminated by signal %d (iter with input=%s)\n", sig, input);
+        return 128 + sig;  // Signal death
+    } else {
+        fprintf(stderr, "masp terminated abnormally\n");
+        return -1;
+    }
+}
+
+static int run_masp_once(const char *masp_path, const char *input, const char *output, const char *include_path) {
+    pid_t pid = spawn_masp(masp_path, input, output, include_path);
+    if (pid > 0) {
         // Parent process
         int status = 0;
         if (waitpid(pid, &status, 0) < 0) {
             perror("waitpid");
             return -1;
         }
-        if (WIFEXITED(status)) {
-            return WEXITSTATUS(status);
-        } else if (WIFSIGNALED(status)) {
-            int sig = WTERMSIG(status);
-            fprintf(stderr, "masp terminated by signal %d (iter with input=%s)\n", sig, input);
-            return 128 + sig;  // Signal death
-        } else {
-            fprintf(stderr, "masp terminated abnormally\n");
-            return -1;
+        return exit_code(status, input);
+    }
+    return -1;
+}
+
+static char *read_whole(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    size_t alloc = 65536, n = 0, got;
+    char *buf = malloc(alloc);
+    while (buf && (got = fread(buf + n, 1, alloc - n, f)) > 0) {
+        n += got;
+        if (n == alloc)
+            buf = realloc(buf, alloc *= 2);
+    }
+    fclose(f);
+    *len = n;
+    return buf;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// The P'th fraction of the N sorted TIMES, by nearest rank
+static double percentile(const double *times, int n, double p) {
+    int i = (int)(p * n + 0.999999) - 1;
+    if (i < 0)
+        i = 0;
+    if (i >= n)
+        i = n - 1;
+    return times[i];
+}
+
+#define MAX_PROCS 256
+
+typedef struct {
+    pid_t pid;
+    int file;
+    int job;
+    double start;
+} running_proc;
+
+// Run ROUNDS jobs over each of the NUM_FILES inputs, PROCS at a time,
+// comparing each output with REFS.  Returns the number which failed.
+static int run_concurrent(const char *masp_path, const char *include_path, const char *const *inputs,
+                          const char *const *names, char **refs, const size_t *ref_lens,
+                          int num_files, int procs, int rounds, double seq_p50, double seq_p99) {
+    int total = num_files * rounds;
+    double *times = malloc(total * sizeof(double));
+    running_proc running[MAX_PROCS];
+    int nrunning = 0, started = 0, done = 0;
+    int crashes = 0, failures = 0, mismatches = 0;
+    long peak_rss = 0;
+    double start = now_seconds();
+
+    printf("\nConcurrent: %d processes at a time, %d runs...\n", procs, total);
+    while (done < total) {
+        while (nrunning < procs && started < total) {
+            running_proc *r = &running[nrunning];
+            char output_path[1024];
+            r->file = started % num_files;
+            r->job = started;
+            snprintf(output_path, sizeof(output_path), "%s/test_outputs/concurrent_%d.out",
+                     BUILD_DIR, r->job);
+            r->start = now_seconds();
+            r->pid = spawn_masp(masp_path, inputs[r->file], output_path, include_path);
+            if (r->pid < 0)
+                break;
+            nrunning++;
+            started++;
         }
-    } else {
-        perror("fork");
-        return -1;
+        if (nrunning == 0) {
+            fprintf(stderr, "  could not start masp\n");
+            failures += total - done;
+            break;
+        }
+
+        int status = 0;
+        struct rusage ru;
+        pid_t pid = wait4(-1, &status, 0, &ru);
+        if (pid < 0) {
+            perror("wait4");
+            failures += total - done;
+            break;
+        }
+        int i;
+        for (i = 0; i < nrunning && running[i].pid != pid; i++)
+            ;
+        if (i == nrunning)
+            continue;
+        running_proc r = running[i];
+        running[i] = running[--nrunning];
+        times[done++] = now_seconds() - r.start;
+#ifdef __APPLE__
+        ru.ru_maxrss /= 1024;
+#endif
+        if (ru.ru_maxrss > peak_rss)
+            peak_rss = ru.ru_maxrss;
+
+        char output_path[1024];
+        snprintf(output_path, sizeof(output_path), "%s/test_outputs/concurrent_%d.out",
+                 BUILD_DIR, r.job);
+        int rc = exit_code(status, inputs[r.file]);
+        if (rc >= 128) {
+            crashes++;
+            fprintf(stderr, "  CRASH on %s (signal %d)\n", names[r.file], rc - 128);
+        } else if (rc != 0) {
+            failures++;
+            fprintf(stderr, "  FAILURE on %s (exit code %d)\n", names[r.file], rc);
+        } else if (refs[r.file]) {
+            size_t len = 0;
+            char *out = read_whole(output_path, &len);
+            if (!out || len != ref_lens[r.file] || memcmp(out, refs[r.file], len) != 0) {
+                mismatches++;
+                fprintf(stderr, "  WRONG OUTPUT for %s\n", names[r.file]);
+            }
+            free(out);
+        }
+        unlink(output_path);
     }
+    double seconds = now_seconds() - start;
+
+    qsort(times, done, sizeof(double), compare_doubles);
+    printf("  %d runs in %.3f seconds: %.1f files/sec\n", done, seconds, done / seconds);
+    if (done > 0) {
+        double p50 = percentile(times, done, 0.50), p99 = percentile(times, done, 0.99);
+        printf("  wall time per process: p50 %.2f ms, p99 %.2f ms (sequential p50 %.2f ms, p99 %.2f ms)\n",
+               p50 * 1e3, p99 * 1e3, seq_p50 * 1e3, seq_p99 * 1e3);
+        if (seq_p50 > 0)
+            printf("  contention: p50 %.2fx sequential\n", p50 / seq_p50);
+    }
+    printf("  peak RSS of a process: %ld KB\n", peak_rss);
+    printf("  %d crashes, %d failures, %d wrong outputs\n", crashes, failures, mismatches);
+    free(times);
+    return crashes + failures + mismatches;
+}
+
+static int usage(void) {
+    fprintf(stderr, "Usage: test_stress_parallel [--procs n] [--rounds n]\n");
+    return 2;
 }
 
-int main(void) {
+int main(int argc, char **argv) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int procs = cores > 0 ? (int)cores : 1;
+    int rounds = 20;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--procs") == 0 && i + 1 < argc)
+            procs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc)
+            rounds = atoi(argv[++i]);
+        else
+            return usage();
+    }
+    if (procs < 1 || rounds < 1)
+        return usage();
+    // More processes than cores measures the scheduler, not masp
+    if (cores > 0 && procs > cores)
+        procs = (int)cores;
+    if (procs > MAX_PROCS)
+        procs = MAX_PROCS;
+
     char masp_path[1024];
     char output_path[1024];
     char include_path[1024];
@@ -80,20 +268,30 @@ int main(void) {
         "general_nospec_tri_pp1.vcl"
     };
     int num_test_files = sizeof(test_files) / sizeof(test_files[0]);
+    char input_paths[3][1024];
+    const char *inputs[3];
+    const char *names[3];
+    char *refs[3] = { NULL, NULL, NULL };
+    size_t ref_lens[3] = { 0, 0, 0 };
+    int num_found = 0;
+    double seq_times[3 * 50];
+    int num_seq = 0;
 
     int total_iterations = 0;
     int total_crashes = 0;
     int total_failures = 0;
 
     for (int file_idx = 0; file_idx < num_test_files; file_idx++) {
-        char input_path[1024];
-        snprintf(input_path, sizeof(input_path), "%s/test/%s", SRC_DIR, test_files[file_idx]);
+        char *input_path = input_paths[num_found];
+        snprintf(input_path, 1024, "%s/test/%s", SRC_DIR, test_files[file_idx]);
 
         // Check if file exists
         if (stat(input_path, &st) != 0) {
             printf("Skipping %s (not found)\n", test_files[file_idx]);
             continue;
         }
+        inputs[num_found] = input_path;
+        names[num_found] = test_files[file_idx];
 
         printf("\nTesting with %s (50 iterations)...\n", test_files[file_idx]);
         int failures = 0;
@@ -103,7 +301,9 @@ int main(void) {
             snprintf(output_path, sizeof(output_path), "%s/test_outputs/stress_%s_%d.out",
                      BUILD_DIR, test_files[file_idx], i);
 
+            double start = now_seconds();
             int rc = run_masp_once(masp_path, input_path, output_path, include_path);
+            seq_times[num_seq++] = now_seconds() - start;
 
             if (rc != 0) {
                 if (rc >= 128) {
@@ -115,6 +315,10 @@ int main(void) {
                 }
             }
 
+            // Keep the first good output to check the concurrent runs against
+            if (rc == 0 && !refs[num_found])
+                refs[num_found] = read_whole(output_path, &ref_lens[num_found]);
+
             // Clean up output file
             unlink(output_path);
 
@@ -132,6 +336,7 @@ int main(void) {
 
         total_crashes += crashes;
         total_failures += failures;
+        num_found++;
 
         printf("  File %s: %d crashes, %d failures (%.1f%% success)\n",
                test_files[file_idx], crashes, failures,
@@ -145,6 +350,16 @@ int main(void) {
     printf("Overall success rate: %.1f%%\n",
            100.0 * (total_iterations - total_crashes - total_failures) / total_iterations);
 
+    qsort(seq_times, num_seq, sizeof(double), compare_doubles);
+    int concurrent_failures = 0;
+    if (num_found > 0)
+        concurrent_failures = run_concurrent(masp_path, include_path, inputs, names, refs, ref_lens,
+                                             num_found, procs, rounds,
+                                             percentile(seq_times, num_seq, 0.50),
+                                             percentile(seq_times, num_seq, 0.99));
+    for (int i = 0; i < num_found; i++)
+        free(refs[i]);
+
     if (total_crashes > 0) {
         fprintf(stderr, "\nERROR: Detected %d crashes during stress test\n", total_crashes);
         return 1;
@@ -155,6 +370,12 @@ int main(void) {
         return 1;
     }
 
+    if (concurrent_failures > 0) {
+        fprintf(stderr, "\nERROR: %d concurrent runs crashed, failed or wrote the wrong output\n",
+                concurrent_failures);
+        return 1;
+    }
+
     printf("\nStress test PASSED\n");
     return 0;
 }